@@ -0,0 +1,64 @@
+/* Provides a connection stand-in for benchmarking the codecs
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_BENCH_FIXED_SIZE_CON_H_
+#define ROASTERY_BENCH_FIXED_SIZE_CON_H_
+
+#include <cstdint>
+#include <memory>
+
+#include "jdwp_con.hpp"
+#include "jdwp_packet.hpp"
+
+namespace roastery {
+
+namespace bench {
+
+/**
+ * A connection to a VM that doesn't exist, with every ID \c kIdSize bytes
+ * long. Messages sent on it are dropped. Unlike a mock, its getters cost no
+ * more than a real connection's, so they don't skew what's measured.
+ */
+class FixedSizeCon : public IJdwpCon {
+  public:
+    explicit FixedSizeCon(uint8_t id_size = 8) : id_size(id_size) { }
+  protected:
+    uint8_t GetObjIdSizeImpl() override { return this->id_size; }
+    uint8_t GetMethodIdSizeImpl() override { return this->id_size; }
+    uint8_t GetFieldIdSizeImpl() override { return this->id_size; }
+    uint8_t GetFrameIdSizeImpl() override { return this->id_size; }
+    void RegisterEventHandlerImpl(unique_ptr<Handler> handler,
+        JdwpDispatchMode mode) override {
+      static_cast<void>(handler);
+      static_cast<void>(mode);
+    }
+    void SendMessageImpl(unique_ptr<IJdwpCommandPacket> message,
+        unique_ptr<ReplyHandler> on_reply) override {
+      static_cast<void>(message);
+      static_cast<void>(on_reply);
+    }
+  private:
+    uint8_t id_size;
+};
+
+}  // namespace bench
+
+}  // namespace roastery
+
+#endif  // ROASTERY_BENCH_FIXED_SIZE_CON_H_
@@ -0,0 +1,278 @@
+/* Provides a fake JVM on the loopback interface for end-to-end benchmarks
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_BENCH_LOOPBACK_JVM_H_
+#define ROASTERY_BENCH_LOOPBACK_JVM_H_
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace roastery {
+
+namespace bench {
+
+/**
+ * A fake JVM that accepts a single connection on \c 127.0.0.1, performs the
+ * JDWP handshake, and answers every command with a canned reply. It can also
+ * be told to send a burst of event packets.
+ *
+ * Unlike the fake server used by the tests, it's built to not be the
+ * bottleneck: it reads as much as is available at once, and answers every
+ * command it read with a single write. Everything it does happens on its own
+ * thread, so its CPU time can be told apart from the client's with
+ * \c GetServerCpuNs.
+ */
+class LoopbackJvm {
+  public:
+    using string = std::string;
+
+    LoopbackJvm() : client_fd(-1), pending_events(0) {
+      this->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (this->listen_fd < 0) throw std::runtime_error("socket");
+      int one = 1;
+      setsockopt(this->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+      struct sockaddr_in addr = {};
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      addr.sin_port = 0;
+      if (bind(this->listen_fd, reinterpret_cast<sockaddr*>(&addr),
+            sizeof(addr)) < 0 || listen(this->listen_fd, 1) < 0 ||
+          pipe(this->wake_fds) < 0) {
+        close(this->listen_fd);
+        throw std::runtime_error("bind/listen");
+      }
+      socklen_t len = sizeof(addr);
+      getsockname(this->listen_fd, reinterpret_cast<sockaddr*>(&addr), &len);
+      this->port = ntohs(addr.sin_port);
+
+      // IDSizes, which every connection sends first
+      string id_sizes;
+      for (int i = 0; i < 5; i++) AppendInt(id_sizes, 8);
+      this->SetReply(1, 7, id_sizes);
+
+      this->server_thread = std::thread(&LoopbackJvm::Serve, this);
+    }
+
+    LoopbackJvm(const LoopbackJvm& copy) = delete;
+    LoopbackJvm& operator=(const LoopbackJvm& other) = delete;
+
+    ~LoopbackJvm() {
+      shutdown(this->listen_fd, SHUT_RDWR);
+      close(this->wake_fds[1]);
+      this->server_thread.join();
+      if (this->client_fd >= 0) close(this->client_fd);
+      close(this->wake_fds[0]);
+      close(this->listen_fd);
+    }
+
+    /**
+     * Returns the port the server is listening on, in host byte order.
+     */
+    uint16_t GetPort() const { return this->port; }
+
+    /**
+     * Makes \c body the reply to every command from \c command_set with
+     * \c command. Commands without a reply set are answered with an empty
+     * body.
+     */
+    void SetReply(uint8_t command_set, uint8_t command, const string& body) {
+      std::lock_guard<std::mutex> l(this->lck);
+      this->replies[{ command_set, command }] = body;
+    }
+
+    /**
+     * Sends \c count copies of the event packet \c packet, from the server's
+     * thread, as soon as it gets to them.
+     */
+    void SendEvents(const string& packet, size_t count) {
+      {
+        std::lock_guard<std::mutex> l(this->lck);
+        this->event_packet = packet;
+        this->pending_events += count;
+      }
+      char wake = 0;
+      if (write(this->wake_fds[1], &wake, 1) < 0) {
+        throw std::runtime_error("write");
+      }
+    }
+
+    /**
+     * Returns how much CPU time, in nanoseconds, the server's thread has used.
+     */
+    uint64_t GetServerCpuNs() {
+      clockid_t clock;
+      struct timespec time;
+      if (pthread_getcpuclockid(this->server_thread.native_handle(),
+            &clock) != 0 || clock_gettime(clock, &time) != 0) {
+        return 0;
+      }
+      return time.tv_sec * 1000000000ULL + time.tv_nsec;
+    }
+
+    static void AppendInt(string& out, int32_t val) {
+      uint32_t val_nbo = htonl(val);
+      out.append(reinterpret_cast<char*>(&val_nbo), sizeof(val_nbo));
+    }
+
+  private:
+    static constexpr size_t kHeaderLen = 11;
+    static constexpr size_t kReadSize = 64 * 1024;
+    /**
+     * The most events sent before checking for more commands.
+     */
+    static constexpr size_t kEventBurst = 256;
+
+    int listen_fd;
+    int client_fd;
+    int wake_fds[2];
+    uint16_t port;
+    std::thread server_thread;
+
+    std::mutex lck;
+    std::map<std::pair<uint8_t, uint8_t>, string> replies;
+    string event_packet;
+    size_t pending_events;
+
+    bool WriteAll(const string& data) {
+      size_t written = 0;
+      while (written < data.size()) {
+        ssize_t res = send(this->client_fd, data.data() + written,
+            data.size() - written, MSG_NOSIGNAL);
+        if (res <= 0) return false;
+        written += res;
+      }
+      return true;
+    }
+
+    bool ReadExactly(string& out, size_t len) {
+      out.resize(len);
+      size_t got = 0;
+      while (got < len) {
+        ssize_t res = recv(this->client_fd, &out[got], len - got, 0);
+        if (res <= 0) return false;
+        got += res;
+      }
+      return true;
+    }
+
+    /**
+     * Appends the reply to each complete command at the start of \c in to
+     * \c out, and removes those commands from \c in.
+     */
+    void Answer(string& in, string& out) {
+      size_t offset = 0;
+      std::lock_guard<std::mutex> l(this->lck);
+      while (in.size() - offset >= kHeaderLen) {
+        uint32_t len_nbo;
+        memcpy(&len_nbo, in.data() + offset, sizeof(len_nbo));
+        size_t len = ntohl(len_nbo);
+        if (len < kHeaderLen || in.size() - offset < len) break;
+        auto reply = this->replies.find({
+            static_cast<uint8_t>(in[offset + 9]),
+            static_cast<uint8_t>(in[offset + 10]) });
+        size_t body_len = reply == this->replies.end() ?
+          0 : reply->second.size();
+        AppendInt(out, kHeaderLen + body_len);
+        // Same ID, reply flag, no error
+        out.append(in, offset + 4, 4);
+        out.push_back(static_cast<char>(0x80));
+        out.append(2, '\0');
+        if (body_len) out += reply->second;
+        offset += len;
+      }
+      in.erase(0, offset);
+    }
+
+    void Serve() {
+      int fd = accept(this->listen_fd, nullptr, nullptr);
+      if (fd < 0) return;
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      this->client_fd = fd;
+
+      const string kHandshake = "JDWP-Handshake";
+      string handshake;
+      if (!this->ReadExactly(handshake, kHandshake.size()) ||
+          !this->WriteAll(kHandshake)) {
+        return;
+      }
+
+      string in, out;
+      char buf[kReadSize];
+      struct pollfd fds[2] = {
+        { this->client_fd, POLLIN, 0 },
+        { this->wake_fds[0], POLLIN, 0 },
+      };
+      while (true) {
+        bool sending;
+        {
+          std::lock_guard<std::mutex> l(this->lck);
+          sending = this->pending_events > 0;
+        }
+        // Keep sending events while there are any, only stopping to answer
+        // commands
+        if (poll(fds, 2, sending ? 0 : -1) < 0) return;
+
+        if (fds[1].revents) {
+          ssize_t res = read(this->wake_fds[0], buf, sizeof(buf));
+          if (res <= 0) return;
+        }
+        if (fds[0].revents) {
+          ssize_t res = recv(this->client_fd, buf, sizeof(buf), 0);
+          if (res <= 0) return;
+          in.append(buf, res);
+          this->Answer(in, out);
+        }
+        {
+          std::lock_guard<std::mutex> l(this->lck);
+          for (size_t i = 0; i < kEventBurst && this->pending_events > 0;
+              i++) {
+            out += this->event_packet;
+            this->pending_events--;
+          }
+        }
+        if (!out.empty()) {
+          if (!this->WriteAll(out)) return;
+          out.clear();
+        }
+      }
+    }
+};
+
+}  // namespace bench
+
+}  // namespace roastery
+
+#endif  // ROASTERY_BENCH_LOOPBACK_JVM_H_
@@ -0,0 +1,247 @@
+/* Provides end-to-end benchmarks of `JdwpCon` against a loopback fake JVM
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "jdwp_con.hpp"
+#include "jdwp_packet.hpp"
+#include "loopback_jvm.hpp"
+
+using namespace roastery;
+using namespace roastery::bench;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using command_packets::thread_reference::NameCommand;
+
+constexpr uint8_t kThreadReference =
+  static_cast<uint8_t>(commands::CommandSet::kThreadReference);
+constexpr uint8_t kName =
+  static_cast<uint8_t>(commands::ThreadReference::kName);
+
+uint64_t ProcessCpuNs() {
+  struct timespec time;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+  return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+/**
+ * Measures the CPU time used by everything but the fake JVM, i.e. the client
+ * threads, the connection's I/O thread and any dispatch workers.
+ */
+class ClientCpu {
+  public:
+    explicit ClientCpu(LoopbackJvm& jvm) : jvm(jvm),
+      start(ProcessCpuNs() - jvm.GetServerCpuNs()) { }
+
+    uint64_t Elapsed() {
+      return ProcessCpuNs() - this->jvm.GetServerCpuNs() - this->start;
+    }
+  private:
+    LoopbackJvm& jvm;
+    uint64_t start;
+};
+
+/**
+ * Reports the median, 99th and 99.9th percentiles of \c latencies_ns, in
+ * microseconds.
+ */
+void ReportLatency(benchmark::State& state, vector<uint64_t>& latencies_ns) {
+  if (latencies_ns.empty()) return;
+  auto percentile = [&](double p) {
+    auto nth = latencies_ns.begin() + static_cast<size_t>(
+        p * (latencies_ns.size() - 1));
+    std::nth_element(latencies_ns.begin(), nth, latencies_ns.end());
+    return *nth / 1000.0;
+  };
+  state.counters["p50_us"] = percentile(0.5);
+  state.counters["p99_us"] = percentile(0.99);
+  state.counters["p999_us"] = percentile(0.999);
+}
+
+/**
+ * Keeps \c range(0) \c ThreadReference.Name requests in flight at once: each
+ * iteration sends that many, and waits for all their replies. Reports the
+ * requests/second, the latency of each request, and the client CPU used per
+ * request; a range of 1 is a synchronous round trip.
+ */
+void BM_RoundTrips(benchmark::State& state) {
+  LoopbackJvm jvm;
+  string name;
+  LoopbackJvm::AppendInt(name, 4);
+  name += "main";
+  jvm.SetReply(kThreadReference, kName, name);
+  JdwpCon con("127.0.0.1", jvm.GetPort());
+
+  const size_t window = state.range(0);
+  vector<Clock::time_point> sent(window);
+  vector<uint64_t> latencies_ns;
+  std::mutex lck;
+  std::condition_variable cv;
+  std::atomic<size_t> outstanding(0);
+
+  ClientCpu cpu(jvm);
+  for (auto _ : state) {
+    outstanding = window;
+    for (size_t i = 0; i < window; i++) {
+      auto command = std::make_unique<NameCommand>();
+      std::get<0>(command->GetFields()) << 1;
+      sent[i] = Clock::now();
+      con.SendAsync(std::move(command),
+          [&, i](NameCommand::ReplyFields& reply) {
+            static_cast<void>(reply);
+            // Only the I/O thread writes these, and the waiting thread
+            // only reads them once every reply is in
+            latencies_ns.push_back(std::chrono::duration_cast<
+                std::chrono::nanoseconds>(Clock::now() - sent[i]).count());
+            if (--outstanding == 0) {
+              std::lock_guard<std::mutex> l(lck);
+              cv.notify_one();
+            }
+          });
+    }
+    std::unique_lock<std::mutex> l(lck);
+    cv.wait(l, [&]() { return outstanding == 0; });
+  }
+
+  size_t requests = state.iterations() * window;
+  state.SetItemsProcessed(requests);
+  state.counters["cpu_ns_per_req"] =
+    static_cast<double>(cpu.Elapsed()) / requests;
+  ReportLatency(state, latencies_ns);
+}
+BENCHMARK(BM_RoundTrips)->Arg(1)->Arg(16)->Arg(256)->UseRealTime();
+
+/**
+ * Counts the events it's handed, and wakes a waiter once it's seen as many
+ * as expected.
+ */
+class CountingHandler : public Handler {
+  public:
+    using Handler::Handle;
+
+    void Handle(events::MethodEntry& event) override {
+      static_cast<void>(event);
+      if (++this->seen == this->expected) {
+        std::lock_guard<std::mutex> l(this->lck);
+        this->cv.notify_one();
+      }
+    }
+
+    /**
+     * Makes \c Wait wait for \c count more events.
+     */
+    void Expect(size_t count) { this->expected += count; }
+    /**
+     * Waits until every event expected so far has been seen.
+     */
+    void Wait() {
+      std::unique_lock<std::mutex> l(this->lck);
+      this->cv.wait(l, [this]() { return this->seen >= this->expected; });
+    }
+  private:
+    std::atomic<size_t> seen{0};
+    std::atomic<size_t> expected{0};
+    std::mutex lck;
+    std::condition_variable cv;
+};
+
+void AppendLong(string& out, uint64_t val) {
+  uint64_t val_nbo = htobe64(val);
+  out.append(reinterpret_cast<char*>(&val_nbo), sizeof(val_nbo));
+}
+
+/**
+ * Builds a composite event packet of \c count method entries spread over
+ * eight threads.
+ */
+string MakeMethodEntries(int32_t count) {
+  string body;
+  body.push_back(0);  // suspend policy
+  LoopbackJvm::AppendInt(body, count);
+  for (int32_t i = 0; i < count; i++) {
+    body.push_back(static_cast<char>(JdwpEventKind::kMethodEntry));
+    LoopbackJvm::AppendInt(body, 3);  // request ID
+    AppendLong(body, 0x1000 + i % 8);  // thread
+    body.push_back(static_cast<char>(JdwpTypeTag::kClass));
+    AppendLong(body, 0x2000 + i % 16);
+    AppendLong(body, 0x3000 + i);
+    AppendLong(body, 0);
+  }
+  string res;
+  LoopbackJvm::AppendInt(res, impl::kHeaderLen + body.size());
+  LoopbackJvm::AppendInt(res, 0);
+  res.push_back(0);
+  res.push_back(static_cast<char>(commands::CommandSet::kEvent));
+  res.push_back(static_cast<char>(commands::Event::kComposite));
+  return res + body;
+}
+
+/**
+ * Has the fake JVM send 64 composite packets of \c range(0) method entries
+ * per iteration, and waits for a handler to have seen them all. Handlers are
+ * called inline if \c range(1) is 0, pooled otherwise. Reports events/second
+ * and the client CPU used per event.
+ */
+void BM_Events(benchmark::State& state) {
+  constexpr size_t kPackets = 64;
+  LoopbackJvm jvm;
+  JdwpCon con("127.0.0.1", jvm.GetPort());
+  auto handler = std::make_unique<CountingHandler>();
+  CountingHandler& counter = *handler;
+  con.RegisterEventHandler(std::move(handler), state.range(1) == 0 ?
+      JdwpDispatchMode::kInline : JdwpDispatchMode::kPooled);
+
+  const size_t per_packet = state.range(0);
+  const string packet = MakeMethodEntries(per_packet);
+  ClientCpu cpu(jvm);
+  for (auto _ : state) {
+    counter.Expect(kPackets * per_packet);
+    jvm.SendEvents(packet, kPackets);
+    counter.Wait();
+  }
+
+  size_t events = state.iterations() * kPackets * per_packet;
+  state.SetItemsProcessed(events);
+  state.SetBytesProcessed(state.iterations() * kPackets * packet.size());
+  state.counters["cpu_ns_per_event"] =
+    static_cast<double>(cpu.Elapsed()) / events;
+}
+BENCHMARK(BM_Events)->ArgsProduct({ { 1, 32 }, { 0, 1 } })
+  ->ArgNames({ "per_packet", "pooled" })->UseRealTime();
+
+}  // namespace
@@ -0,0 +1,331 @@
+/* Provides benchmarks for `jdwp_packet.hpp` and `jdwp_packet.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "fixed_size_con.hpp"
+#include "jdwp_packet.hpp"
+#include "jdwp_type.hpp"
+
+using namespace roastery;
+using namespace roastery::bench;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+void AppendInt(string& out, int32_t val) {
+  uint32_t val_nbo = htonl(val);
+  out.append(reinterpret_cast<char*>(&val_nbo), sizeof(val_nbo));
+}
+
+void AppendLong(string& out, uint64_t val) {
+  uint64_t val_nbo = htobe64(val);
+  out.append(reinterpret_cast<char*>(&val_nbo), sizeof(val_nbo));
+}
+
+void AppendString(string& out, const string& str) {
+  AppendInt(out, str.size());
+  out += str;
+}
+
+void AppendLocation(string& out, uint64_t cls, uint64_t method,
+    uint64_t index) {
+  out.push_back(static_cast<char>(JdwpTypeTag::kClass));
+  AppendLong(out, cls);
+  AppendLong(out, method);
+  AppendLong(out, index);
+}
+
+/**
+ * Prepends a JDWP header to \c body.
+ */
+string WithHeader(const string& body, uint32_t id, uint8_t flags,
+    uint16_t third) {
+  string res;
+  AppendInt(res, impl::kHeaderLen + body.size());
+  AppendInt(res, id);
+  res.push_back(static_cast<char>(flags));
+  res.push_back(static_cast<char>(third >> 8));
+  res.push_back(static_cast<char>(third));
+  return res + body;
+}
+
+/**
+ * Builds a composite event packet of \c count method entries on a few
+ * threads, as sent to a tracer under load.
+ */
+string MakeMethodEntries(int32_t count) {
+  string body;
+  body.push_back(0);  // suspend policy
+  AppendInt(body, count);
+  for (int32_t i = 0; i < count; i++) {
+    body.push_back(static_cast<char>(JdwpEventKind::kMethodEntry));
+    AppendInt(body, 3);  // request ID
+    AppendLong(body, 0x1000 + i % 4);  // thread
+    AppendLocation(body, 0x2000 + i % 16, 0x3000 + i, 0);
+  }
+  return WithHeader(body, 0, 0,
+      static_cast<uint8_t>(commands::CommandSet::kEvent) << 8 |
+      static_cast<uint8_t>(commands::Event::kComposite));
+}
+
+/**
+ * Builds a composite event packet holding a single class being prepared, as
+ * sent while an application starts up.
+ */
+string MakeClassPrepare() {
+  string body;
+  body.push_back(0);
+  AppendInt(body, 1);
+  body.push_back(static_cast<char>(JdwpEventKind::kClassPrepare));
+  AppendInt(body, 1);
+  AppendLong(body, 0x1000);
+  body.push_back(static_cast<char>(JdwpTypeTag::kClass));
+  AppendLong(body, 0x2000);
+  AppendString(body, "Lcom/example/service/impl/RequestHandlerFactory;");
+  AppendInt(body, 7);
+  return WithHeader(body, 0, 0,
+      static_cast<uint8_t>(commands::CommandSet::kEvent) << 8 |
+      static_cast<uint8_t>(commands::Event::kComposite));
+}
+
+/**
+ * A packet with an empty body, so serializing it only writes its header.
+ */
+class HeaderOnlyCommand : public IJdwpCommandPacket {
+  protected:
+    void SerializeToImpl(string& out, IJdwpCon& con) const override {
+      static_cast<void>(con);
+      size_t header_offset = BeginHeader(out);
+      FinishHeader(out, header_offset, 1, 1, this->id);
+    }
+};
+
+/**
+ * Serializes \c command into a buffer that's reused between iterations.
+ */
+void SerializeCommand(benchmark::State& state,
+    const IJdwpCommandPacket& command) {
+  FixedSizeCon con;
+  string out;
+  for (auto _ : state) {
+    out.clear();
+    command.SerializeTo(out, con);
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(state.iterations() * out.size());
+}
+
+void BM_Header(benchmark::State& state) {
+  SerializeCommand(state, HeaderOnlyCommand());
+}
+BENCHMARK(BM_Header);
+
+void BM_SerializeFrames(benchmark::State& state) {
+  command_packets::thread_reference::FramesCommand command;
+  std::get<0>(command.GetFields()) << 0x1000;
+  std::get<1>(command.GetFields()) << 0;
+  std::get<2>(command.GetFields()) << 64;
+  SerializeCommand(state, command);
+}
+BENCHMARK(BM_SerializeFrames);
+
+void BM_SerializeClassesBySignature(benchmark::State& state) {
+  command_packets::virtual_machine::ClassesBySignatureCommand command;
+  std::get<0>(command.GetFields()) <<
+    "Lcom/example/service/impl/RequestHandlerFactory;";
+  SerializeCommand(state, command);
+}
+BENCHMARK(BM_SerializeClassesBySignature);
+
+void BM_SerializeEventRequest(benchmark::State& state) {
+  using command_packets::event_request::SetCommand;
+  SetCommand command;
+  auto& fields = command.GetFields();
+  std::get<0>(fields) << static_cast<uint8_t>(JdwpEventKind::kMethodEntry);
+  std::get<1>(fields) << 0;
+  JdwpThreadId thread;
+  thread << 0x1000;
+  JdwpString pattern;
+  pattern << "com.example.*";
+  JdwpString exclude;
+  exclude << "*Test";
+  std::get<2>(fields).emplace_back(std::in_place_index<2>,
+      std::make_tuple(thread));
+  std::get<2>(fields).emplace_back(std::in_place_index<4>,
+      std::make_tuple(pattern));
+  std::get<2>(fields).emplace_back(std::in_place_index<5>,
+      std::make_tuple(exclude));
+  SerializeCommand(state, command);
+}
+BENCHMARK(BM_SerializeEventRequest);
+
+/**
+ * Decodes the reply to a \c Frames command for a stack \c range(0) frames
+ * deep.
+ */
+void BM_DecodeFramesReply(benchmark::State& state) {
+  string body;
+  AppendInt(body, state.range(0));
+  for (int64_t i = 0; i < state.range(0); i++) {
+    AppendLong(body, i);
+    AppendLocation(body, 0x2000 + i, 0x3000 + i, i * 4);
+  }
+  string reply = WithHeader(body, 1, static_cast<uint8_t>(JdwpFlags::kReply),
+      0);
+
+  FixedSizeCon con;
+  command_packets::thread_reference::FramesCommand command;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(command.Deserialize(reply, con));
+  }
+  state.SetBytesProcessed(state.iterations() * reply.size());
+}
+BENCHMARK(BM_DecodeFramesReply)->Arg(8)->Arg(64);
+
+/**
+ * Decodes \c packet into newly allocated events.
+ */
+void DecodeComposite(benchmark::State& state, const string& packet) {
+  FixedSizeCon con;
+  size_t events = 0;
+  for (auto _ : state) {
+    auto decoded = IJdwpEvent::FromComposite(packet, con);
+    events += decoded.size();
+    benchmark::DoNotOptimize(decoded.data());
+  }
+  state.SetItemsProcessed(events);
+  state.SetBytesProcessed(state.iterations() * packet.size());
+}
+
+/**
+ * Decodes \c packet into events recycled from a pool, as a connection does.
+ */
+void DecodeCompositePooled(benchmark::State& state, const string& packet) {
+  FixedSizeCon con;
+  JdwpEventPool pool;
+  vector<JdwpEventPool::Ptr> decoded;
+  size_t events = 0;
+  for (auto _ : state) {
+    IJdwpEvent::FromComposite(packet, con, pool, decoded);
+    events += decoded.size();
+    benchmark::DoNotOptimize(decoded.data());
+    decoded.clear();
+  }
+  state.SetItemsProcessed(events);
+  state.SetBytesProcessed(state.iterations() * packet.size());
+}
+
+/**
+ * Counts the \c MethodEntry events it's handed.
+ */
+class MethodEntryCounter : public Handler {
+  public:
+    using Handler::Handle;
+
+    void Handle(events::MethodEntry& event) override {
+      static_cast<void>(event);
+      this->count++;
+    }
+
+    size_t count = 0;
+};
+
+/**
+ * Decodes \c packet into pooled events, and dispatches each to a
+ * \c Handler, as a connection does for inline handlers.
+ */
+void DecodeCompositeDispatched(benchmark::State& state,
+    const string& packet) {
+  FixedSizeCon con;
+  JdwpEventPool pool;
+  vector<JdwpEventPool::Ptr> decoded;
+  MethodEntryCounter handler;
+  for (auto _ : state) {
+    IJdwpEvent::FromComposite(packet, con, pool, decoded);
+    for (auto& event : decoded) event->Dispatch(handler);
+    decoded.clear();
+  }
+  benchmark::DoNotOptimize(handler.count);
+  state.SetItemsProcessed(handler.count);
+  state.SetBytesProcessed(state.iterations() * packet.size());
+}
+
+/**
+ * Decodes \c packet straight into a visitor, without any virtual calls.
+ */
+void DecodeCompositeStatic(benchmark::State& state, const string& packet) {
+  struct Counter {
+    void operator()(events::MethodEntry& event) {
+      static_cast<void>(event);
+      this->count++;
+    }
+
+    size_t count = 0;
+  };
+  FixedSizeCon con;
+  StaticEventDecoder<Counter> decoder{Counter()};
+  for (auto _ : state) {
+    decoder.Decode(packet, con);
+  }
+  benchmark::DoNotOptimize(decoder.GetVisitor().count);
+  state.SetItemsProcessed(decoder.GetVisitor().count);
+  state.SetBytesProcessed(state.iterations() * packet.size());
+}
+
+void BM_FromCompositeMethodEntries(benchmark::State& state) {
+  DecodeComposite(state, MakeMethodEntries(state.range(0)));
+}
+BENCHMARK(BM_FromCompositeMethodEntries)->Arg(1)->Arg(32);
+
+void BM_FromCompositeMethodEntriesPooled(benchmark::State& state) {
+  DecodeCompositePooled(state, MakeMethodEntries(state.range(0)));
+}
+BENCHMARK(BM_FromCompositeMethodEntriesPooled)->Arg(1)->Arg(32);
+
+void BM_DispatchMethodEntries(benchmark::State& state) {
+  DecodeCompositeDispatched(state, MakeMethodEntries(state.range(0)));
+}
+BENCHMARK(BM_DispatchMethodEntries)->Arg(1)->Arg(32);
+
+void BM_StaticDecodeMethodEntries(benchmark::State& state) {
+  DecodeCompositeStatic(state, MakeMethodEntries(state.range(0)));
+}
+BENCHMARK(BM_StaticDecodeMethodEntries)->Arg(1)->Arg(32);
+
+void BM_FromCompositeClassPrepare(benchmark::State& state) {
+  DecodeComposite(state, MakeClassPrepare());
+}
+BENCHMARK(BM_FromCompositeClassPrepare);
+
+void BM_FromCompositeClassPreparePooled(benchmark::State& state) {
+  DecodeCompositePooled(state, MakeClassPrepare());
+}
+BENCHMARK(BM_FromCompositeClassPreparePooled);
+
+}  // namespace
@@ -0,0 +1,189 @@
+/* Provides benchmarks for `jdwp_type.hpp` and `jdwp_type.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <memory>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "fixed_size_con.hpp"
+#include "jdwp_type.hpp"
+
+using namespace roastery;
+using namespace roastery::bench;
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+/**
+ * Serializes \c field into a buffer that's reused between iterations, so only
+ * the encoding is measured.
+ */
+template<typename Field>
+void EncodeField(benchmark::State& state, const Field& field) {
+  FixedSizeCon con;
+  string out;
+  for (auto _ : state) {
+    out.clear();
+    field.SerializeTo(out, con);
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(state.iterations() * out.size());
+}
+
+/**
+ * Decodes \c encoded into the same \c Field every iteration.
+ */
+template<typename Field>
+void DecodeField(benchmark::State& state, const string& encoded) {
+  FixedSizeCon con;
+  Field field;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(field.FromEncoded(encoded, con));
+  }
+  state.SetBytesProcessed(state.iterations() * encoded.size());
+}
+
+template<typename Field, typename Value>
+Field MakeField(Value value) {
+  Field res;
+  res << value;
+  return res;
+}
+
+template<typename Field>
+string Encoded(const Field& field) {
+  FixedSizeCon con;
+  return field.Serialize(con);
+}
+
+void BM_IntEncode(benchmark::State& state) {
+  EncodeField(state, MakeField<JdwpInt>(0x12345678));
+}
+BENCHMARK(BM_IntEncode);
+
+void BM_IntDecode(benchmark::State& state) {
+  DecodeField<JdwpInt>(state, Encoded(MakeField<JdwpInt>(0x12345678)));
+}
+BENCHMARK(BM_IntDecode);
+
+void BM_LongEncode(benchmark::State& state) {
+  EncodeField(state, MakeField<JdwpLong>(0x123456789ABCDEF0));
+}
+BENCHMARK(BM_LongEncode);
+
+void BM_LongDecode(benchmark::State& state) {
+  DecodeField<JdwpLong>(state,
+      Encoded(MakeField<JdwpLong>(0x123456789ABCDEF0)));
+}
+BENCHMARK(BM_LongDecode);
+
+void BM_ObjIdEncode(benchmark::State& state) {
+  EncodeField(state, MakeField<JdwpObjId>(0xDEADBEEFCAFEF00D));
+}
+BENCHMARK(BM_ObjIdEncode);
+
+void BM_ObjIdDecode(benchmark::State& state) {
+  DecodeField<JdwpObjId>(state,
+      Encoded(MakeField<JdwpObjId>(0xDEADBEEFCAFEF00D)));
+}
+BENCHMARK(BM_ObjIdDecode);
+
+/**
+ * Strings the length of a typical class signature, and of a long one.
+ */
+void BM_StringEncode(benchmark::State& state) {
+  EncodeField(state, MakeField<JdwpString>(string(state.range(0), 'a')));
+}
+BENCHMARK(BM_StringEncode)->Arg(32)->Arg(1024);
+
+void BM_StringDecode(benchmark::State& state) {
+  DecodeField<JdwpString>(state,
+      Encoded(MakeField<JdwpString>(string(state.range(0), 'a'))));
+}
+BENCHMARK(BM_StringDecode)->Arg(32)->Arg(1024);
+
+JdwpValue MakeIntValue() {
+  return JdwpValue(JdwpTag::kInt, JdwpValue::JdwpVal(
+        MakeField<JdwpInt>(0x12345678)));
+}
+
+JdwpValue MakeObjectValue() {
+  return JdwpValue(JdwpTag::kObject, JdwpValue::JdwpVal(
+        MakeField<JdwpObjId>(0xDEADBEEFCAFEF00D)));
+}
+
+void BM_ValueEncode(benchmark::State& state) {
+  EncodeField(state, MakeObjectValue());
+}
+BENCHMARK(BM_ValueEncode);
+
+void BM_ValueDecode(benchmark::State& state) {
+  DecodeField<JdwpValue>(state, Encoded(MakeObjectValue()));
+}
+BENCHMARK(BM_ValueDecode);
+
+/**
+ * Builds an array region of \c length copies of \c value.
+ */
+JdwpArrayRegion MakeRegion(JdwpTag tag, const JdwpValue& value,
+    size_t length) {
+  vector<unique_ptr<JdwpValue>> values;
+  for (size_t i = 0; i < length; i++) {
+    values.push_back(std::make_unique<JdwpValue>(value));
+  }
+  return JdwpArrayRegion(tag, values);
+}
+
+void BM_IntArrayRegionEncode(benchmark::State& state) {
+  EncodeField(state, MakeRegion(JdwpTag::kInt, MakeIntValue(),
+        state.range(0)));
+}
+BENCHMARK(BM_IntArrayRegionEncode)->Arg(16)->Arg(4096);
+
+void BM_IntArrayRegionDecode(benchmark::State& state) {
+  DecodeField<JdwpArrayRegion>(state, Encoded(MakeRegion(JdwpTag::kInt,
+          MakeIntValue(), state.range(0))));
+}
+BENCHMARK(BM_IntArrayRegionDecode)->Arg(16)->Arg(4096);
+
+void BM_PackedIntArrayRegionEncode(benchmark::State& state) {
+  EncodeField(state, JdwpArrayRegion(JdwpTag::kInt, JdwpArrayRegion::Packed(
+          vector<int32_t>(state.range(0), 0x12345678))));
+}
+BENCHMARK(BM_PackedIntArrayRegionEncode)->Arg(16)->Arg(4096);
+
+void BM_ObjectArrayRegionEncode(benchmark::State& state) {
+  EncodeField(state, MakeRegion(JdwpTag::kObject, MakeObjectValue(),
+        state.range(0)));
+}
+BENCHMARK(BM_ObjectArrayRegionEncode)->Arg(16)->Arg(4096);
+
+void BM_ObjectArrayRegionDecode(benchmark::State& state) {
+  DecodeField<JdwpArrayRegion>(state, Encoded(MakeRegion(JdwpTag::kObject,
+          MakeObjectValue(), state.range(0))));
+}
+BENCHMARK(BM_ObjectArrayRegionDecode)->Arg(16)->Arg(4096);
+
+}  // namespace
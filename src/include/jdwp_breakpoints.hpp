@@ -0,0 +1,156 @@
+/* Provides batched installation of breakpoints over JDWP
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_BREAKPOINTS_H_
+#define ROASTERY_JDWP_BREAKPOINTS_H_
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_type.hpp"
+
+namespace roastery {
+
+/**
+ * Identifies a single code location a breakpoint can be installed at.
+ */
+struct JdwpBreakpointLocation {
+  JdwpTypeTag type;
+  uint64_t class_id;
+  uint64_t method_id;
+  /**
+   * The index of the location within the method.
+   */
+  uint64_t index;
+
+  bool operator==(const JdwpBreakpointLocation& other) const {
+    return this->type == other.type && this->class_id == other.class_id &&
+      this->method_id == other.method_id && this->index == other.index;
+  }
+  bool operator!=(const JdwpBreakpointLocation& other) const {
+    return !(*this == other);
+  }
+};
+
+/**
+ * Installs breakpoints in bulk, and keeps track of which locations have one.
+ *
+ * Each batch passed to \c Install is sent as a pipeline of
+ * \c event_request::SetCommand messages, without waiting for any reply
+ * before sending the next, bracketed by \c HoldEventsCommand and
+ * \c ReleaseEventsCommand so that no breakpoint event is reported until the
+ * whole batch is in place. Each location only ever gets one breakpoint:
+ * duplicates within a batch are dropped, and locations that already have a
+ * breakpoint, or are being installed by another batch, aren't sent again.
+ *
+ * Locations name their classes by reference type ID, which is only good for
+ * the connection that handed it out. When the connection is reestablished
+ * with \c JdwpConOptions::reconnect, it sets each breakpoint again with its
+ * class found by signature, and the breakpoint moves to the location naming
+ * the class's new ID, keeping its request ID. Breakpoints whose class can't
+ * be found again are forgotten.
+ *
+ * Every method is safe to call from any thread.
+ */
+class JdwpBreakpointManager {
+  public:
+    /**
+     * Called once for each distinct location of a batch, as soon as its
+     * breakpoint is known. Usually called on the connection's I/O thread, so
+     * it should not block.
+     *
+     * @param location The location the breakpoint is at.
+     * @param request_id The ID of the breakpoint's event request, as reported
+     * in its events. Zero if installing it failed.
+     * @param error \c nullptr if the breakpoint was installed, otherwise the
+     * exception it failed with.
+     */
+    using InstallCallback = std::function<void(
+        const JdwpBreakpointLocation& location, int32_t request_id,
+        std::exception_ptr error)>;
+
+    /**
+     * Creates a manager for breakpoints on \c con, which must outlive
+     * \c this.
+     */
+    explicit JdwpBreakpointManager(IJdwpCon& con);
+
+    // No copies/default constructor
+    JdwpBreakpointManager() = delete;
+    JdwpBreakpointManager(const JdwpBreakpointManager& copy) = delete;
+    JdwpBreakpointManager& operator=(const JdwpBreakpointManager& other) =
+      delete;
+
+    // Not moveable, replies in flight hold on to its state
+    JdwpBreakpointManager(JdwpBreakpointManager&& other) = delete;
+    JdwpBreakpointManager& operator=(JdwpBreakpointManager&& other) = delete;
+
+    ~JdwpBreakpointManager();
+
+    /**
+     * Installs a breakpoint at each of \c locations that doesn't already have
+     * one.
+     *
+     * @param locations The locations to install breakpoints at. May contain
+     * duplicates.
+     * @param on_installed Called with the request ID of each distinct
+     * location, as its reply arrives. May be \c nullptr.
+     * @param suspend_policy The JDWP \c suspendPolicy of new breakpoints.
+     * Defaults to suspending nothing, as suits logpoints.
+     *
+     * @return A future that holds how many of the distinct locations have a
+     * breakpoint, once every reply has arrived. Must not be waited on from the
+     * connection's I/O thread.
+     */
+    std::future<size_t> Install(
+        const std::vector<JdwpBreakpointLocation>& locations,
+        InstallCallback on_installed = nullptr, uint8_t suspend_policy = 0);
+
+    /**
+     * Clears the breakpoint at \c location, if it has been installed.
+     *
+     * @return Whether there was a breakpoint at \c location.
+     */
+    bool Remove(const JdwpBreakpointLocation& location);
+
+    /**
+     * Looks up the request ID of the breakpoint at \c location.
+     *
+     * @return Whether the breakpoint at \c location has been installed.
+     */
+    bool GetRequestId(const JdwpBreakpointLocation& location,
+        int32_t& request_id) const;
+
+    /**
+     * Returns the number of breakpoints that have been installed.
+     */
+    size_t Size() const;
+  private:
+    class Impl;
+    unique_ptr<Impl> pImpl;
+};
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_BREAKPOINTS_H_
@@ -0,0 +1,143 @@
+/* Provides an index of the classes loaded by a VM, by signature
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_CLASS_INDEX_H_
+#define ROASTERY_JDWP_CLASS_INDEX_H_
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_interner.hpp"
+#include "jdwp_type.hpp"
+
+namespace roastery {
+
+/**
+ * Describes a single class loaded by the VM.
+ */
+struct JdwpClassInfo {
+  JdwpTypeTag tag;
+  uint64_t ref_type;
+  /**
+   * The JNI signature, e.g. \c Ljava/lang/String;
+   */
+  string signature;
+  /**
+   * The generic signature, or an empty string if there is none.
+   */
+  string generic_signature;
+  int32_t status;
+};
+
+/**
+ * Indexes every class loaded by the VM by its signature, so that classes can
+ * be found by name, or by a breakpoint's class pattern, without a round trip
+ * per lookup.
+ *
+ * \c Load takes a snapshot of every loaded class with a single
+ * \c AllClassesWithGeneric command. Before doing so, it requests
+ * \c ClassPrepare and \c ClassUnload events (without suspending anything), so
+ * that the index stays current afterwards with no further requests. A
+ * \c ClassUnload only names a signature, so when several class loaders have
+ * loaded classes with the same signature, all of them are dropped.
+ *
+ * When its connection is reestablished with \c JdwpConOptions::reconnect,
+ * the index is emptied, as the IDs of its classes were only good for the
+ * connection that was lost. Once loaded, it then fills itself again from a
+ * fresh snapshot, relying on the connection to set its \c ClassPrepare and
+ * \c ClassUnload requests again. Classes found before the reconnect have to
+ * be looked up again for their new IDs.
+ *
+ * Every method is safe to call from any thread.
+ */
+class JdwpClassIndex {
+  public:
+    /**
+     * Creates an empty index for \c con, and registers an inline handler with
+     * \c con to track classes being prepared and unloaded. \c con must outlive
+     * \c this.
+     *
+     * @param interner Holds the signatures of indexed classes. Pass the one
+     * shared by the other caches of \c con, if any, so that each signature is
+     * only held once between them. If \c nullptr, the index uses its own.
+     */
+    explicit JdwpClassIndex(IJdwpCon& con,
+        std::shared_ptr<JdwpStringInterner> interner = nullptr);
+
+    // No copies/default constructor
+    JdwpClassIndex() = delete;
+    JdwpClassIndex(const JdwpClassIndex& copy) = delete;
+    JdwpClassIndex& operator=(const JdwpClassIndex& other) = delete;
+
+    // Not moveable, the registered handler holds on to its state
+    JdwpClassIndex(JdwpClassIndex&& other) = delete;
+    JdwpClassIndex& operator=(JdwpClassIndex&& other) = delete;
+
+    ~JdwpClassIndex();
+
+    /**
+     * Fills the index with every class currently loaded by the VM. The first
+     * call also asks the VM to report classes being prepared and unloaded
+     * from then on. Can be called again to resynchronize with the VM.
+     *
+     * @return A future that holds the number of classes in the index once the
+     * snapshot has been merged in, or the exception the snapshot failed with.
+     * Must not be waited on from the connection's I/O thread.
+     */
+    std::future<size_t> Load();
+
+    /**
+     * Returns the loaded classes with the JNI signature \c signature.
+     */
+    std::vector<JdwpClassInfo> FindBySignature(const string& signature) const;
+    /**
+     * Returns the loaded classes with the fully qualified name
+     * \c class_name, e.g. \c java.lang.String.
+     */
+    std::vector<JdwpClassInfo> FindByName(const string& class_name) const;
+    /**
+     * Returns the loaded classes whose names match \c pattern, which follows
+     * the rules of a JDWP \c ClassMatch modifier: a fully qualified class
+     * name that may either start or end with \c *, e.g. \c com.example.* or
+     * \c *.Main. Only classes and interfaces are matched, not arrays.
+     */
+    std::vector<JdwpClassInfo> FindByPattern(const string& pattern) const;
+
+    /**
+     * Returns the number of classes in the index.
+     */
+    size_t Size() const;
+
+    /**
+     * Returns the JNI signature of the class with the fully qualified name
+     * \c class_name.
+     */
+    static string NameToSignature(const string& class_name);
+  private:
+    class Impl;
+    unique_ptr<Impl> pImpl;
+};
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_CLASS_INDEX_H_
@@ -20,9 +20,19 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef ROASTERY_JDWP_CON_H_
 #define ROASTERY_JDWP_CON_H_
 
+#include <chrono>
 #include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "jdwp_stats.hpp"
 
 using std::unique_ptr;
 using std::string;
@@ -30,7 +40,476 @@ using std::string;
 namespace roastery {
 
 class IJdwpCommandPacket;
+class IJdwpCon;
 class Handler;
+class JdwpConPool;
+class JdwpRecorder;
+
+namespace command_packets {
+namespace event_request {
+class SetCommand;
+}  // namespace event_request
+}  // namespace command_packets
+
+/**
+ * Called for an event request that was set before the connection was
+ * reestablished, once it's been set again or dropped, with the ID it was
+ * first given and the command it was set again with, or \c nullptr if it was
+ * dropped. \c set names types by their IDs on the new connection.
+ */
+using JdwpReplayHandler = std::function<void(int32_t request_id,
+    const command_packets::event_request::SetCommand* set)>;
+
+/**
+ * Called with each composite event packet, header included, that the
+ * connection could decode. \c packet is only valid until it returns.
+ */
+using JdwpPacketHandler =
+  std::function<void(std::string_view packet, IJdwpCon& con)>;
+
+/**
+ * Tunes how a \c JdwpCon writes to its socket. The defaults favor latency,
+ * since most JDWP traffic is a request waiting on its reply.
+ */
+struct JdwpConOptions {
+  /**
+   * Sets \c TCP_NODELAY, so packets are sent as soon as they're written
+   * instead of being held back by Nagle's algorithm. Packets queued together
+   * are still written together.
+   */
+  bool no_delay = true;
+  /**
+   * Sets \c TCP_CORK while writing each batch of queued packets, so a large
+   * burst (e.g., setting thousands of breakpoints) goes out in as few
+   * full-sized TCP segments as possible. Only has an effect on Linux.
+   */
+  bool cork_batches = false;
+  /**
+   * The most serialized messages that can be waiting to be written at once.
+   * Once the queue is full, \c SendMessage blocks until the connection's I/O
+   * thread catches up, and \c TrySendMessage fails. Rounded up to a power of
+   * two.
+   */
+  size_t send_queue_capacity = 1024;
+  /**
+   * The number of worker threads that deliver events to handlers registered
+   * with \c JdwpDispatchMode::kPooled. If zero, one thread per hardware
+   * thread is used. The workers are only started once such a handler is
+   * registered.
+   */
+  size_t dispatch_threads = 0;
+  /**
+   * Replies at least this many bytes long, headers included, are handed to
+   * a \c StreamingReplyHandler in parts as they're recieved, such as through
+   * \c IJdwpCon::SendStreaming, rather than once they've been buffered
+   * whole. Replies to other handlers are always buffered whole, as are all
+   * replies while the connection is being recorded.
+   */
+  size_t stream_replies_over = 1 << 20;
+  /**
+   * Once the connection is lost, keeps trying to connect to the same address
+   * again instead of staying closed. The VM is assumed to be the same one,
+   * as a JDWP agent listening with \c server=y takes a new debugger once the
+   * old one is gone, so its ID sizes aren't asked for again.
+   *
+   * Object and reference type IDs are only good for the connection that
+   * handed them out, so event requests aren't sent again as they were.
+   * Requests set with an \c event_request::SetCommand are set again from
+   * their fields: those naming no type are sent before anything else, and
+   * those naming types once each type has been found again by its signature,
+   * keeping their method and field IDs. Requests naming a thread or an
+   * object, naming a type that can't be found again, or set some other way,
+   * are dropped. Events and \c Clear commands keep using the IDs requests
+   * were first given, and handlers registered with
+   * \c IJdwpCon::RegisterReplayHandler hear how each request was set again,
+   * or that it was dropped. Handlers registered with
+   * \c IJdwpCon::RegisterReconnectHandler are called once the requests
+   * naming no type have been sent, before any event from the new connection
+   * is handled, and must drop or look up again any ID they got from the old
+   * connection.
+   *
+   * Replies still pending when the connection is lost, and messages sent
+   * while it's being reestablished, fail with a \c JdwpException as they
+   * would on a closed connection.
+   */
+  bool reconnect = false;
+  /**
+   * How long to wait before the first attempt to reconnect. Each attempt
+   * that fails doubles the wait, up to \c max_reconnect_delay.
+   */
+  std::chrono::milliseconds reconnect_delay{100};
+  std::chrono::milliseconds max_reconnect_delay{10000};
+  /**
+   * The most attempts made to reconnect each time the connection is lost,
+   * after which it stays closed. Zero keeps trying until the connection is
+   * destroyed.
+   */
+  size_t reconnect_attempts = 0;
+};
+
+/**
+ * Chooses which thread a registered \c Handler recieves events on.
+ */
+enum class JdwpDispatchMode {
+  /**
+   * Handlers are called on the connection's I/O thread as soon as each event
+   * is decoded. They must not block, and a slow handler delays all reads on
+   * the connection.
+   */
+  kInline,
+  /**
+   * Handlers are called on a pool of worker threads, so they can block, and
+   * can wait on replies. The events of each Java thread are still handled in
+   * order, but different Java threads are handled in parallel.
+   */
+  kPooled,
+  /**
+   * Handlers are called on the connection's I/O thread, before any other
+   * handler, and must copy whatever they need out of each event right away.
+   * Once they have, if every event in the composite was for a request
+   * marked with \c IJdwpCon::FastResume, whatever the events suspended is
+   * resumed, before the events go on to the other handlers. Suits handlers
+   * that only observe, like logpoints, which otherwise keep the VM suspended
+   * for a round trip at least.
+   */
+  kFastResume,
+};
+
+/**
+ * A snapshot of the state of a connection's outgoing message queue.
+ */
+struct JdwpSendQueueStats {
+  /**
+   * The number of messages currently waiting to be written.
+   */
+  size_t depth;
+  /**
+   * The most messages that have been waiting to be written at once.
+   */
+  size_t high_water_mark;
+  /**
+   * The most messages that can be waiting to be written at once.
+   */
+  size_t capacity;
+  /**
+   * The number of calls to \c SendMessage that had to wait for room.
+   */
+  uint64_t blocked_sends;
+  /**
+   * The number of calls to \c TrySendMessage that failed for lack of room.
+   */
+  uint64_t rejected_sends;
+};
+
+/**
+ * A histogram of how long events have kept the VM, or their thread,
+ * suspended: from reading the event to queueing the first resume command
+ * sent for it, whether by the connection itself, for
+ * \c JdwpDispatchMode::kFastResume handlers, or by anyone else. The time the
+ * VM spends sending the event and acting on the resume isn't included.
+ */
+struct JdwpSuspensionHistogram : JdwpDurationHistogram {
+  /**
+   * The number of threads, or the VM, currently suspended by an event and
+   * not yet resumed.
+   */
+  size_t outstanding = 0;
+};
+
+/**
+ * Counts the traffic for one command sent on a connection.
+ */
+struct JdwpCommandStats {
+  uint8_t command_set;
+  uint8_t command;
+  /**
+   * The number of times it has been sent.
+   */
+  uint64_t requests;
+  /**
+   * The size of every request sent, headers included.
+   */
+  uint64_t bytes_sent;
+  /**
+   * The number of replies recieved. Only replies to requests sent with a
+   * \c ReplyHandler, such as through \c IJdwpCon::SendAsync, are counted,
+   * since replies to the rest are dropped unread.
+   */
+  uint64_t replies;
+  /**
+   * The number of \c replies that carried an error code.
+   */
+  uint64_t errors;
+  /**
+   * The size of every reply counted, headers included.
+   */
+  uint64_t bytes_recieved;
+  /**
+   * The time from queueing each request to reading its reply, for every
+   * reply counted.
+   */
+  JdwpDurationHistogram latency;
+};
+
+/**
+ * Counts the events of one kind recieved on a connection.
+ */
+struct JdwpEventStats {
+  /**
+   * The \c JdwpEventKind of the events.
+   */
+  uint8_t kind;
+  uint64_t count;
+};
+
+/**
+ * Everything a \c JdwpCon counts about itself, as of one instant.
+ */
+struct JdwpConStats {
+  /**
+   * One entry for each command sent so far, by command set then command.
+   */
+  std::vector<JdwpCommandStats> commands;
+  /**
+   * One entry for each kind of event recieved so far, by kind.
+   */
+  std::vector<JdwpEventStats> events;
+  /**
+   * The number of composite event packets recieved, and their total size.
+   */
+  uint64_t event_packets;
+  uint64_t event_bytes;
+  JdwpSocketStats socket;
+  JdwpSendQueueStats send_queue;
+  /**
+   * The time each composite event spent in \c JdwpDispatchMode::kInline and
+   * \c JdwpDispatchMode::kFastResume handlers, during which the connection
+   * can't read anything else.
+   */
+  JdwpDurationHistogram inline_handler_time;
+  /**
+   * The time each event spent in \c JdwpDispatchMode::kPooled handlers.
+   */
+  JdwpDurationHistogram pooled_handler_time;
+  JdwpSuspensionHistogram suspensions;
+  /**
+   * The number of times the connection was reestablished after being lost,
+   * with \c JdwpConOptions::reconnect.
+   */
+  uint64_t reconnects;
+  /**
+   * The number of event requests kept to be set again if the connection is
+   * reestablished, including those that will turn out not to be settable on
+   * the new connection. Zero without \c JdwpConOptions::reconnect.
+   */
+  uint64_t event_requests;
+};
+
+/**
+ * Recieves the reply to a command packet sent with \c IJdwpCon::SendMessage.
+ * Exactly one of \c OnReply or \c OnError is called for each message.
+ *
+ * Both methods are normally called on the connection's I/O thread, so they
+ * should not block. In particular, they must not wait on the reply to another
+ * message. \c OnError may instead be called on the sending thread if the
+ * connection was already closed when the message was sent.
+ */
+class ReplyHandler {
+  public:
+    virtual ~ReplyHandler() = 0;
+
+    /**
+     * Called once the reply to \c request has been recieved.
+     *
+     * @param request The message that was replied to.
+     * @param reply The JDWP encoded reply packet, including the JDWP header.
+     * Only valid for the duration of the call.
+     * @param con The connection the reply was recieved on. Used to get
+     * deserialization info.
+     */
+    virtual void OnReply(IJdwpCommandPacket& request, std::string_view reply,
+        IJdwpCon& con) = 0;
+    /**
+     * Called if no reply to \c request will be recieved, e.g. because the
+     * connection was closed.
+     *
+     * @param request The message that won't be replied to.
+     * @param error The exception describing what went wrong.
+     */
+    virtual void OnError(IJdwpCommandPacket& request,
+        std::exception_ptr error) = 0;
+};
+
+/**
+ * A \c ReplyHandler that can take its reply in parts, as they're recieved.
+ * Large replies are only held whole by the connection if their handler
+ * can't.
+ */
+class StreamingReplyHandler : public ReplyHandler {
+  public:
+    /**
+     * Passes the whole of \c reply to \c OnReplyPart, as its only part.
+     */
+    void OnReply(IJdwpCommandPacket& request, std::string_view reply,
+        IJdwpCon& con) final;
+
+    /**
+     * Called with each part of the reply to \c request, in order, as it's
+     * recieved.
+     *
+     * @param request The message that was replied to.
+     * @param part The next bytes of the reply. The first part starts with the
+     * JDWP header. Only valid for the duration of the call.
+     * @param remaining The number of bytes of the reply still to come after
+     * \c part. Zero for the last part.
+     * @param con The connection the reply was recieved on.
+     */
+    virtual void OnReplyPart(IJdwpCommandPacket& request,
+        std::string_view part, size_t remaining, IJdwpCon& con) = 0;
+};
+
+namespace impl {
+
+template<typename RespFields>
+class StreamingReplyDecoder;
+
+/**
+ * A \c ReplyHandler that fulfills a \c std::promise with the deserialized
+ * reply to a \c Command.
+ */
+template<typename Command>
+class PromiseReplyHandler : public ReplyHandler {
+  public:
+    using Fields = typename Command::ReplyFields;
+
+    std::future<Fields> GetFuture() { return this->promise.get_future(); }
+
+    void OnReply(IJdwpCommandPacket& request, std::string_view reply,
+        IJdwpCon& con) override {
+      try {
+        this->promise.set_value(
+            static_cast<Command&>(request).Deserialize(reply, con));
+      } catch (...) {
+        this->promise.set_exception(std::current_exception());
+      }
+    }
+
+    void OnError(IJdwpCommandPacket& request,
+        std::exception_ptr error) override {
+      static_cast<void>(request);
+      this->promise.set_exception(error);
+    }
+  private:
+    std::promise<Fields> promise;
+};
+
+/**
+ * Detects whether \c Command can decode its reply without copying out of the
+ * buffer it's in, through \c DeserializeInPlace.
+ */
+template<typename Command, typename = void>
+struct HasDeserializeInPlace : std::false_type { };
+
+template<typename Command>
+struct HasDeserializeInPlace<Command,
+    std::void_t<decltype(std::declval<const Command&>().DeserializeInPlace(
+          std::declval<std::string_view>(), std::declval<IJdwpCon&>()))>> :
+  std::true_type { };
+
+/**
+ * A \c ReplyHandler that invokes a callback with the deserialized reply to a
+ * \c Command. As the reply's buffer outlives the callback, the reply is
+ * decoded in place where the command supports it.
+ */
+template<typename Command>
+class CallbackReplyHandler : public ReplyHandler {
+  public:
+    using Fields = typename Command::ReplyFields;
+
+    CallbackReplyHandler(std::function<void(Fields&)> on_reply,
+        std::function<void(std::exception_ptr)> on_error) :
+      on_reply(std::move(on_reply)), on_error(std::move(on_error)) { }
+
+    void OnReply(IJdwpCommandPacket& request, std::string_view reply,
+        IJdwpCon& con) override {
+      Fields fields;
+      try {
+        if constexpr (HasDeserializeInPlace<Command>::value) {
+          fields = static_cast<Command&>(request).DeserializeInPlace(reply,
+              con);
+        } else {
+          fields = static_cast<Command&>(request).Deserialize(reply, con);
+        }
+      } catch (...) {
+        this->OnError(request, std::current_exception());
+        return;
+      }
+      this->on_reply(fields);
+    }
+
+    void OnError(IJdwpCommandPacket& request,
+        std::exception_ptr error) override {
+      static_cast<void>(request);
+      if (this->on_error) this->on_error(error);
+    }
+  private:
+    std::function<void(Fields&)> on_reply;
+    std::function<void(std::exception_ptr)> on_error;
+};
+
+/**
+ * A \c StreamingReplyHandler that decodes the reply to a \c Command as it's
+ * recieved, invoking callbacks with each element of the \c vector the reply
+ * ends with, and fulfills a \c std::promise with how many there were.
+ */
+template<typename Command>
+class StreamingCallbackReplyHandler : public StreamingReplyHandler {
+  public:
+    using Decoder = StreamingReplyDecoder<typename Command::ReplyFields>;
+    using Head = typename Decoder::Head;
+    using Element = typename Decoder::Element;
+
+    StreamingCallbackReplyHandler(std::function<void(Head&)> on_head,
+        std::function<void(Element&)> on_element) :
+      decoder(std::move(on_head), std::move(on_element)), finished(false) { }
+
+    std::future<size_t> GetFuture() { return this->promise.get_future(); }
+
+    void OnReplyPart(IJdwpCommandPacket& request, std::string_view part,
+        size_t remaining, IJdwpCon& con) override {
+      static_cast<void>(request);
+      if (this->finished) return;
+      try {
+        this->decoder.Feed(part, remaining == 0, con);
+      } catch (...) {
+        this->finished = true;
+        this->promise.set_exception(std::current_exception());
+        return;
+      }
+      if (remaining == 0) {
+        this->finished = true;
+        this->promise.set_value(this->decoder.GetCount());
+      }
+    }
+
+    void OnError(IJdwpCommandPacket& request,
+        std::exception_ptr error) override {
+      static_cast<void>(request);
+      if (this->finished) return;
+      this->finished = true;
+      this->promise.set_exception(error);
+    }
+  private:
+    Decoder decoder;
+    /**
+     * Set once \c promise has been fulfilled, after which the rest of the
+     * reply is ignored.
+     */
+    bool finished;
+    std::promise<size_t> promise;
+};
+
+}  // namespace impl
 
 /**
  * An interface representing a connection to a JDWP server.
@@ -42,36 +521,209 @@ class IJdwpCon {
      */
     virtual ~IJdwpCon() = 0;
 
-    // Getters for type sizes for proper serialization
+    // Getters for type sizes for proper serialization. Every ID coded asks,
+    // so these only make a virtual call until \c CacheIdSizes has run.
     /**
      * Returns the size of an \c objectID, in bytes.
      */
-    uint8_t GetObjIdSize();
+    uint8_t GetObjIdSize() {
+      return this->obj_id_size ? this->obj_id_size : this->GetObjIdSizeImpl();
+    }
     /**
      * Returns the size of a \c methodID, in bytes.
      */
-    uint8_t GetMethodIdSize();
+    uint8_t GetMethodIdSize() {
+      return this->method_id_size ?
+        this->method_id_size : this->GetMethodIdSizeImpl();
+    }
     /**
      * Returns the size of a \c fieldID, in bytes.
      */
-    uint8_t GetFieldIdSize();
+    uint8_t GetFieldIdSize() {
+      return this->field_id_size ?
+        this->field_id_size : this->GetFieldIdSizeImpl();
+    }
     /**
      * Returns the size of a \c frameID, in bytes.
      */
-    uint8_t GetFrameIdSize();
+    uint8_t GetFrameIdSize() {
+      return this->frame_id_size ?
+        this->frame_id_size : this->GetFrameIdSizeImpl();
+    }
 
     /**
      * Registers the given \c handler, which will have the appropriate \c Handle
-     * function invoked when an event packet is recieved.
+     * function invoked on the connection's I/O thread when an event packet is
+     * recieved.
      */
     void RegisterEventHandler(unique_ptr<Handler> handler);
+    /**
+     * Registers the given \c handler, which will have the appropriate \c Handle
+     * function invoked when an event packet is recieved.
+     *
+     * @param handler The handler to register.
+     * @param mode Which thread \c handler is called on.
+     */
+    void RegisterEventHandler(unique_ptr<Handler> handler,
+        JdwpDispatchMode mode);
+    /**
+     * Registers \c handler to be called each time the connection has been
+     * reestablished after being lost, once the event requests naming no type
+     * have been sent again. Suits state that has to catch up with what
+     * happened while the connection was down. Called before any event from
+     * the new connection is handled, and must not block. Connections that
+     * never reconnect ignore it.
+     */
+    void RegisterReconnectHandler(std::function<void()> handler);
+    /**
+     * Registers \c handler to be called with each composite event packet, on
+     * the connection's I/O thread, right after the inline handlers have seen
+     * its events. Connections that never read packets ignore it.
+     */
+    void RegisterPacketHandler(JdwpPacketHandler handler);
+    /**
+     * Registers a \c StaticEventDecoder for \c visitor, which visits the
+     * events of each composite event packet as \c RegisterPacketHandler
+     * would see it. Packets that it fails to decode, e.g. as they hold an
+     * event not in \c Events, are visited up to the bad event. Defined in
+     * \c jdwp_packet.hpp.
+     *
+     * @tparam Events The \c tuple of event types the VM may send.
+     */
+    template<typename Visitor, typename Events>
+    void RegisterStaticHandler(Visitor visitor);
+    /**
+     * Does the same as \c RegisterStaticHandler, accepting any event the VM
+     * may send.
+     */
+    template<typename Visitor>
+    void RegisterStaticHandler(Visitor visitor);
+    /**
+     * Registers \c handler to be called for each event request that was set
+     * before the connection was reestablished, once it has been set again on
+     * the new connection, or dropped as it can't be. Called on the
+     * connection's I/O thread, and must not block. Connections that never
+     * reconnect ignore it.
+     */
+    void RegisterReplayHandler(JdwpReplayHandler handler);
+    /**
+     * Marks the event request \c request_id, as given in the reply to its
+     * \c Set command, as one that only \c JdwpDispatchMode::kFastResume
+     * handlers need suspended. A composite event made up only of events for
+     * marked requests is resumed as soon as those handlers have seen it. A
+     * \c Clear command for the request drops the mark. Connections that
+     * can't resume anything ignore it.
+     */
+    void FastResume(int32_t request_id);
 
     /**
-     * Queues the given message to be send to the JVM.
+     * Queues the given message to be send to the JVM. Blocks while the
+     * connection's send queue is full.
      *
      * @param message The message to send.
      */
     void SendMessage(unique_ptr<IJdwpCommandPacket> message);
+    /**
+     * Queues the given message to be send to the JVM, and registers
+     * \c on_reply to recieve its reply. Blocks while the connection's send
+     * queue is full.
+     *
+     * @param message The message to send.
+     * @param on_reply The handler for the reply, may be \c nullptr if the
+     * reply should be ignored.
+     */
+    void SendMessage(unique_ptr<IJdwpCommandPacket> message,
+        unique_ptr<ReplyHandler> on_reply);
+    /**
+     * Queues the given message to be send to the JVM if there is room in the
+     * connection's send queue, without blocking.
+     *
+     * @param message The message to send. Only moved from if it was queued.
+     * @param on_reply The handler for the reply, may be \c nullptr if the
+     * reply should be ignored. Only moved from if the message was queued.
+     *
+     * @return Whether the message was queued.
+     */
+    bool TrySendMessage(unique_ptr<IJdwpCommandPacket>& message,
+        unique_ptr<ReplyHandler>& on_reply);
+
+    /**
+     * Queues the given message to be sent to the JVM, and returns a future for
+     * its deserialized reply. Any number of messages can be in flight at once.
+     *
+     * The future must not be waited on from a \c Handler or \c ReplyHandler
+     * running on the connection's I/O thread, as that thread is the one that
+     * will fulfill it.
+     *
+     * @param message The message to send.
+     *
+     * @return A future that holds the fields of the reply, or a
+     * \c JdwpReplyException if the reply carried an error code, or a
+     * \c JdwpException if the connection closed before a reply was recieved.
+     */
+    template<typename Command>
+    std::future<typename Command::ReplyFields> SendAsync(
+        unique_ptr<Command> message) {
+      auto handler = std::make_unique<impl::PromiseReplyHandler<Command>>();
+      auto res = handler->GetFuture();
+      this->SendMessage(std::move(message), std::move(handler));
+      return res;
+    }
+    /**
+     * Queues the given message to be sent to the JVM, and invokes \c on_reply
+     * with its deserialized reply. Both callbacks are invoked on the
+     * connection's I/O thread, so they should not block.
+     *
+     * @param message The message to send.
+     * @param on_reply Called with the fields of the reply.
+     * @param on_error Called instead of \c on_reply with a
+     * \c JdwpReplyException if the reply carried an error code, or a
+     * \c JdwpException if the connection closed before a reply was recieved.
+     * May be \c nullptr, in which case errors are ignored.
+     */
+    template<typename Command>
+    void SendAsync(unique_ptr<Command> message,
+        std::function<void(typename Command::ReplyFields&)> on_reply,
+        std::function<void(std::exception_ptr)> on_error = nullptr) {
+      this->SendMessage(std::move(message),
+          std::make_unique<impl::CallbackReplyHandler<Command>>(
+            std::move(on_reply), std::move(on_error)));
+    }
+    /**
+     * Queues the given message to be sent to the JVM, and decodes its reply
+     * as it's recieved, invoking \c on_element with each element of the
+     * \c vector the reply ends with. Suits replies that can be very large,
+     * like those to \c AllClassesWithGenericCommand or \c BytecodesCommand:
+     * once they're over \c JdwpConOptions::stream_replies_over, they're
+     * never held whole, and handling them overlaps recieving them. Both
+     * callbacks are invoked on the connection's I/O thread, so they should
+     * not block.
+     *
+     * @param message The message to send.
+     * @param on_element Called with each element, which is only valid for
+     * the duration of the call.
+     * @param on_head Called with the fields before the \c vector, before any
+     * element. May be \c nullptr.
+     *
+     * @return A future for the number of elements in the reply. It holds a
+     * \c JdwpReplyException if the reply carried an error code, a
+     * \c JdwpException if it was malformed or the connection closed before
+     * it was all recieved, or whatever a callback threw, in which case the
+     * rest of the reply is skipped.
+     */
+    template<typename Command>
+    std::future<size_t> SendStreaming(unique_ptr<Command> message,
+        std::function<void(typename impl::StreamingCallbackReplyHandler<
+          Command>::Element&)> on_element,
+        std::function<void(typename impl::StreamingCallbackReplyHandler<
+          Command>::Head&)> on_head = nullptr) {
+      auto handler =
+        std::make_unique<impl::StreamingCallbackReplyHandler<Command>>(
+            std::move(on_head), std::move(on_element));
+      auto res = handler->GetFuture();
+      this->SendMessage(std::move(message), std::move(handler));
+      return res;
+    }
   protected:
     /**
      * Returns the size of an \c objectID, in bytes.
@@ -93,15 +745,72 @@ class IJdwpCon {
     /**
      * Registers the given \c handler, which will have the appropriate \c Handle
      * function invoked when an event packet is recieved.
+     *
+     * @param handler The handler to register.
+     * @param mode Which thread \c handler is called on.
      */
-    virtual void RegisterEventHandlerImpl(unique_ptr<Handler> handler) = 0;
+    virtual void RegisterEventHandlerImpl(unique_ptr<Handler> handler,
+        JdwpDispatchMode mode) = 0;
+    /**
+     * Registers \c handler to be called each time the connection is
+     * reestablished. By default, drops it, for connections that never
+     * reconnect.
+     */
+    virtual void RegisterReconnectHandlerImpl(std::function<void()> handler);
+    /**
+     * Registers \c handler to be called with each composite event packet. By
+     * default, drops it, for connections that never read packets.
+     */
+    virtual void RegisterPacketHandlerImpl(JdwpPacketHandler handler);
+    /**
+     * Registers \c handler to be called for each event request set again
+     * after reconnecting. By default, drops it, for connections that never
+     * reconnect.
+     */
+    virtual void RegisterReplayHandlerImpl(JdwpReplayHandler handler);
+    /**
+     * Marks the event request \c request_id as fast-resume. By default, does
+     * nothing, for connections that can't resume anything.
+     */
+    virtual void FastResumeImpl(int32_t request_id);
 
     /**
      * Queues the given message to be send to the JVM.
      *
      * @param message The message to send.
+     * @param on_reply The handler for the reply, may be \c nullptr.
+     */
+    virtual void SendMessageImpl(unique_ptr<IJdwpCommandPacket> message,
+        unique_ptr<ReplyHandler> on_reply) = 0;
+    /**
+     * Queues the given message to be send to the JVM if that can be done
+     * without blocking. By default, hands the message to \c SendMessageImpl
+     * and reports success, for connections that never block.
+     *
+     * @param message The message to send. Only moved from if it was queued.
+     * @param on_reply The handler for the reply, may be \c nullptr. Only moved
+     * from if the message was queued.
+     *
+     * @return Whether the message was queued.
+     */
+    virtual bool TrySendMessageImpl(unique_ptr<IJdwpCommandPacket>& message,
+        unique_ptr<ReplyHandler>& on_reply);
+
+    /**
+     * Records the ID sizes of the VM, so that the getters stop asking the
+     * \c Impl functions. Only call once the sizes are known and won't change,
+     * before any other thread can code IDs with \c this.
+     */
+    void CacheIdSizes(uint8_t field, uint8_t method, uint8_t obj,
+        uint8_t frame);
+  private:
+    /**
+     * The cached ID sizes, or 0 until \c CacheIdSizes has been called.
      */
-    virtual void SendMessageImpl(unique_ptr<IJdwpCommandPacket> message) = 0;
+    uint8_t field_id_size = 0;
+    uint8_t method_id_size = 0;
+    uint8_t obj_id_size = 0;
+    uint8_t frame_id_size = 0;
 };
 
 /**
@@ -114,15 +823,31 @@ class JdwpCon : public IJdwpCon {
      *
      * @throws std::system_error if there is a system error creating a
      * connection to \c port.
+     * @throws JdwpException if the VM doesn't report its ID sizes.
      */
-    explicit JdwpCon(uint16_t port);
+    explicit JdwpCon(uint16_t port,
+        const JdwpConOptions& options = JdwpConOptions());
     /**
      * Create a JDWP connection with \c address on \c port.
      *
      * @throws std::system_error if there is a system error connecting to
      * \c address on \c port.
+     * @throws JdwpException if the VM doesn't report its ID sizes.
+     */
+    explicit JdwpCon(const string& address, uint16_t port,
+        const JdwpConOptions& options = JdwpConOptions());
+    /**
+     * Create a JDWP connection with \c address on \c port, driven by one of
+     * the I/O threads of \c pool rather than a thread of its own. \c pool must
+     * outlive the connection; usually, \c JdwpConPool::Connect should be used
+     * instead, which makes the pool own the connection.
+     *
+     * @throws std::system_error if there is a system error connecting to
+     * \c address on \c port.
+     * @throws JdwpException if the VM doesn't report its ID sizes.
      */
-    explicit JdwpCon(const string& address, uint16_t port);
+    explicit JdwpCon(const string& address, uint16_t port, JdwpConPool& pool,
+        const JdwpConOptions& options = JdwpConOptions());
 
     // No copies/default constructor
     JdwpCon() = delete;
@@ -144,6 +869,29 @@ class JdwpCon : public IJdwpCon {
      */
     virtual ~JdwpCon() override;
 
+    /**
+     * Returns the current state of the outgoing message queue.
+     */
+    JdwpSendQueueStats GetSendQueueStats() const;
+    /**
+     * Returns how long events have kept things suspended so far.
+     */
+    JdwpSuspensionHistogram GetSuspensionHistogram() const;
+    /**
+     * Returns everything counted about the connection so far: the traffic of
+     * each command, its round trip latency, the events recieved and the time
+     * spent handling them, and the state of the socket and send queue. Cheap
+     * enough to call periodically while the connection is busy.
+     */
+    JdwpConStats GetStats() const;
+
+    /**
+     * Starts handing every packet recieved from now on, events and replies
+     * alike, to \c recorder before it's dispatched. Replaces any recorder
+     * already attached; \c nullptr stops recording.
+     */
+    void Record(std::shared_ptr<JdwpRecorder> recorder);
+
   protected:
     // Getters for type sizes for proper serialization
     /**
@@ -166,17 +914,58 @@ class JdwpCon : public IJdwpCon {
     /**
      * Registers the given \c handler, which will have the appropriate \c Handle
      * function invoked when an event packet is recieved.
+     *
+     * @param handler The handler to register.
+     * @param mode Which thread \c handler is called on.
      */
-    void RegisterEventHandlerImpl(unique_ptr<Handler> handler) override;
+    void RegisterEventHandlerImpl(unique_ptr<Handler> handler,
+        JdwpDispatchMode mode) override;
+    /**
+     * Registers \c handler to be called each time the connection is
+     * reestablished, if it was created with \c JdwpConOptions::reconnect.
+     */
+    void RegisterReconnectHandlerImpl(std::function<void()> handler)
+      override;
+    /**
+     * Registers \c handler to be called with each composite event packet.
+     */
+    void RegisterPacketHandlerImpl(JdwpPacketHandler handler) override;
+    /**
+     * Registers \c handler to be called for each event request set again
+     * after reconnecting, if created with \c JdwpConOptions::reconnect.
+     */
+    void RegisterReplayHandlerImpl(JdwpReplayHandler handler) override;
+    /**
+     * Marks the event request \c request_id as fast-resume.
+     */
+    void FastResumeImpl(int32_t request_id) override;
 
     /**
      * Queues the given message to be send to the JVM.
      *
      * @param message The message to send.
+     * @param on_reply The handler for the reply, may be \c nullptr.
      */
-    void SendMessageImpl(unique_ptr<IJdwpCommandPacket> message) override;
+    void SendMessageImpl(unique_ptr<IJdwpCommandPacket> message,
+        unique_ptr<ReplyHandler> on_reply) override;
+    /**
+     * Queues the given message to be send to the JVM, unless the send queue
+     * is full.
+     *
+     * @param message The message to send. Only moved from if it was queued.
+     * @param on_reply The handler for the reply, may be \c nullptr. Only moved
+     * from if the message was queued.
+     *
+     * @return Whether the message was queued.
+     */
+    bool TrySendMessageImpl(unique_ptr<IJdwpCommandPacket>& message,
+        unique_ptr<ReplyHandler>& on_reply) override;
   private:
     class Impl;
+    /**
+     * Caches the ID sizes \c pImpl fetched from the VM on \c this.
+     */
+    void CacheImplIdSizes();
     unique_ptr<Impl> pImpl;
 };
 
@@ -0,0 +1,98 @@
+/* Provides a pool of JDWP connections sharing a fixed set of I/O threads
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_CON_POOL_H_
+#define ROASTERY_JDWP_CON_POOL_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "jdwp_con.hpp"
+#include "jdwp_reactor.hpp"
+
+namespace roastery {
+
+/**
+ * Owns many \c JdwpCon, all driven by a small, fixed set of \c JdwpReactor
+ * threads. Each connection is assigned to a reactor based on the file
+ * descriptor of its socket, so the number of threads doesn't grow with the
+ * number of VMs attached to.
+ */
+class JdwpConPool {
+  public:
+    /**
+     * Creates a \c JdwpConPool with \c num_threads I/O threads. If
+     * \c num_threads is zero, one thread per hardware thread is used.
+     *
+     * @throws std::system_error if a reactor cannot be created.
+     */
+    explicit JdwpConPool(size_t num_threads = 0);
+
+    // No copies
+    JdwpConPool(const JdwpConPool& copy) = delete;
+    JdwpConPool& operator=(const JdwpConPool& other) = delete;
+
+    // Not moveable, connections hold references to the pool's reactors
+    JdwpConPool(JdwpConPool&& other) = delete;
+    JdwpConPool& operator=(JdwpConPool&& other) = delete;
+
+    /**
+     * Closes all connections in the pool, then stops its threads.
+     */
+    ~JdwpConPool();
+
+    /**
+     * Creates a connection to \c address on \c port, owned by this pool. The
+     * returned reference is valid until the connection is passed to
+     * \c Disconnect or the pool is destroyed.
+     *
+     * @throws std::system_error if there is a system error connecting to
+     * \c address on \c port.
+     * @throws JdwpException if the JDWP handshake fails.
+     */
+    JdwpCon& Connect(const std::string& address, uint16_t port,
+        const JdwpConOptions& options = JdwpConOptions());
+    /**
+     * Closes and destroys \c con, which must have been returned by \c Connect
+     * on this pool.
+     */
+    void Disconnect(JdwpCon& con);
+
+    /**
+     * Returns the number of connections currently in the pool.
+     */
+    size_t Size() const;
+    /**
+     * Returns the number of I/O threads used by the pool.
+     */
+    size_t ThreadCount() const;
+
+    /**
+     * Returns the reactor responsible for \c fd.
+     */
+    JdwpReactor& GetReactor(int fd);
+  private:
+    class Impl;
+    std::unique_ptr<Impl> pImpl;
+};
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_CON_POOL_H_
@@ -0,0 +1,136 @@
+/* Provides a worker pool for delivering JDWP events to handlers
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_DISPATCHER_H_
+#define ROASTERY_JDWP_DISPATCHER_H_
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "jdwp_packet.hpp"
+#include "jdwp_stats.hpp"
+
+namespace roastery {
+
+namespace impl {
+
+/**
+ * A copy-on-write list of handlers. Readers never wait on writers: adding a
+ * handler copies the list, so readers holding a \c Snapshot keep seeing the
+ * list as it was, and handlers can safely register more handlers.
+ */
+template<typename Entry>
+class CopyOnWriteList {
+  public:
+    using Snapshot = std::shared_ptr<const std::vector<Entry>>;
+
+    CopyOnWriteList() : entries(std::make_shared<const std::vector<Entry>>()) {
+    }
+
+    /**
+     * Adds \c entry to the end of the list.
+     */
+    void Add(Entry entry) {
+      std::lock_guard<std::mutex> l(this->write_lck);
+      auto updated = std::make_shared<std::vector<Entry>>(
+          *std::atomic_load(&this->entries));
+      updated->push_back(std::move(entry));
+      std::atomic_store(&this->entries, Snapshot(std::move(updated)));
+    }
+    /**
+     * Returns the current contents of the list.
+     */
+    Snapshot Get() const { return std::atomic_load(&this->entries); }
+  private:
+    Snapshot entries;
+    /**
+     * Serializes writers, readers never take it.
+     */
+    std::mutex write_lck;
+};
+
+using HandlerList = CopyOnWriteList<std::shared_ptr<Handler>>;
+
+}  // namespace impl
+
+/**
+ * Delivers events to handlers on a pool of worker threads. Each event is
+ * queued to a worker picked by the thread it happened on, so the events of a
+ * single Java thread are handled in the order they were dispatched, while the
+ * events of different threads are handled in parallel. Events that aren't
+ * tied to a thread are all handled by the same worker.
+ *
+ * Handlers run on the worker threads, so they may block, and may wait on the
+ * replies to messages they send. A slow handler only holds up the events
+ * queued to its worker.
+ */
+class JdwpEventDispatcher {
+  public:
+    /**
+     * Creates a \c JdwpEventDispatcher and starts \c num_workers threads. If
+     * \c num_workers is zero, one thread per hardware thread is used.
+     */
+    explicit JdwpEventDispatcher(size_t num_workers = 0);
+
+    // No copies
+    JdwpEventDispatcher(const JdwpEventDispatcher& copy) = delete;
+    JdwpEventDispatcher& operator=(const JdwpEventDispatcher& other) = delete;
+
+    // Not moveable, the worker threads hold a pointer to its state
+    JdwpEventDispatcher(JdwpEventDispatcher&& other) = delete;
+    JdwpEventDispatcher& operator=(JdwpEventDispatcher&& other) = delete;
+
+    /**
+     * Handles every event that has already been dispatched, then stops the
+     * worker threads.
+     */
+    ~JdwpEventDispatcher();
+
+    /**
+     * Registers \c handler to recieve every event dispatched from now on.
+     */
+    void RegisterHandler(std::unique_ptr<Handler> handler);
+    /**
+     * Queues \c event to be handled by every registered handler. \c event is
+     * released on the worker thread once it has been handled.
+     */
+    void Dispatch(JdwpEventPool::Ptr event);
+    /**
+     * Blocks until every event dispatched before the call has been handled.
+     * Must not be called from a handler.
+     */
+    void Flush();
+
+    /**
+     * Returns the number of worker threads.
+     */
+    size_t WorkerCount() const;
+    /**
+     * Returns how long each event has taken to go through every handler.
+     */
+    JdwpDurationHistogram GetHandlerTime() const;
+  private:
+    class Impl;
+    std::unique_ptr<Impl> pImpl;
+};
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_DISPATCHER_H_
@@ -0,0 +1,161 @@
+/* Provides a builder for filtered JDWP event requests
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_EVENT_FILTER_H_
+#define ROASTERY_JDWP_EVENT_FILTER_H_
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_packet.hpp"
+#include "jdwp_type.hpp"
+
+namespace roastery {
+
+/**
+ * Describes which events of a single kind should be reported, and compiles
+ * that down to event requests whose modifiers make the VM discard every
+ * other event before it's sent. For example, method entries in
+ * \c com.acme.*, but not in test classes, on either of two threads:
+ *
+ *   JdwpEventFilter(JdwpEventKind::kMethodEntry)
+ *       .InClasses("com.acme.*")
+ *       .ExcludingClasses("*Test")
+ *       .OnThread(x)
+ *       .OnThread(y)
+ *       .Compile();
+ *
+ * JDWP only allows a request's modifiers to all apply at once, so alternatives
+ * (several class patterns, threads, locations or instances) are compiled to
+ * one request per combination. Patterns covered by other patterns are dropped
+ * first, as are exclusions that can't match any of the included classes, and
+ * included patterns that are excluded entirely. Modifiers are ordered so the
+ * VM checks the cheapest first, and any count is checked last, so it only
+ * counts events that pass every other filter.
+ *
+ * Which modifiers may be used with which event kinds is up to the VM; see the
+ * JDWP specification of \c EventRequest.Set.
+ */
+class JdwpEventFilter {
+  public:
+    using SetCommand = command_packets::event_request::SetCommand;
+
+    /**
+     * Creates a filter that accepts every event of \c kind.
+     */
+    explicit JdwpEventFilter(JdwpEventKind kind);
+
+    /**
+     * Sets the JDWP \c suspendPolicy of the requests. By default, nothing is
+     * suspended.
+     */
+    JdwpEventFilter& Suspend(uint8_t suspend_policy);
+    /**
+     * Only reports the first \c count matching events of each request.
+     */
+    JdwpEventFilter& Count(int32_t count);
+    /**
+     * Reports events in classes with names matching \c pattern, which may
+     * start or end with \c *. Can be given several times, to report events in
+     * any of the classes.
+     */
+    JdwpEventFilter& InClasses(const string& pattern);
+    /**
+     * Reports events in \c ref_type or its subtypes. Can be given several
+     * times, and combined with \c InClasses, to report events in any of the
+     * classes.
+     */
+    JdwpEventFilter& InClass(uint64_t ref_type);
+    /**
+     * Doesn't report events in classes with names matching \c pattern, which
+     * may start or end with \c *.
+     */
+    JdwpEventFilter& ExcludingClasses(const string& pattern);
+    /**
+     * Reports events on \c thread. Can be given several times, to report
+     * events on any of the threads.
+     */
+    JdwpEventFilter& OnThread(uint64_t thread);
+    /**
+     * Reports events at \c location. Can be given several times.
+     */
+    JdwpEventFilter& AtLocation(const JdwpLocation& location);
+    /**
+     * Reports events where \c this is \c object. Can be given several times.
+     */
+    JdwpEventFilter& OnInstance(uint64_t object);
+    /**
+     * Reports exceptions of type \c ref_type, or any type if it's zero.
+     */
+    JdwpEventFilter& ForException(uint64_t ref_type, bool caught,
+        bool uncaught);
+    /**
+     * Reports accesses or modifications of \c field in \c ref_type.
+     */
+    JdwpEventFilter& ForField(uint64_t ref_type, uint64_t field);
+    /**
+     * Reports steps of \c thread of \c size and \c depth, as defined by the
+     * JDWP \c StepSize and \c StepDepth.
+     */
+    JdwpEventFilter& Step(uint64_t thread, int32_t size, int32_t depth);
+
+    /**
+     * Returns the requests that together report exactly the events accepted
+     * by this filter. Empty if the filter can't accept any event.
+     */
+    std::vector<unique_ptr<SetCommand>> Compile() const;
+    /**
+     * Sends each of the commands from \c Compile to the VM.
+     *
+     * @return A future for each request's reply, which holds its request ID.
+     */
+    std::vector<std::future<SetCommand::ReplyFields>> Send(IJdwpCon& con)
+      const;
+  private:
+    /**
+     * One of the alternative sets of classes events may be in: a pattern, or
+     * a reference type if \c pattern is empty.
+     */
+    struct ClassAlternative {
+      string pattern;
+      uint64_t ref_type;
+    };
+
+    JdwpEventKind kind;
+    uint8_t suspend_policy;
+    std::optional<int32_t> count;
+    std::vector<ClassAlternative> classes;
+    std::vector<string> excludes;
+    std::vector<uint64_t> threads;
+    std::vector<JdwpLocation> locations;
+    std::vector<uint64_t> instances;
+    /**
+     * Modifiers that apply to every request as they are.
+     */
+    std::vector<SetCommand::Modifier> exact;
+};
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_EVENT_FILTER_H_
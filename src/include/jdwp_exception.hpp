@@ -20,11 +20,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef JDWP_EXCEPTION_H_
 #define JDWP_EXCEPTION_H_
 
+#include <cstdint>
 #include <stdexcept>
 #include <string>
 
 namespace roastery {
 
+enum class JdwpError : uint16_t;
+
 /**
  * Represents an exceptional state related to processing a JDWP connection.
  */
@@ -54,6 +57,57 @@ class JdwpException : public std::runtime_error {
     virtual const char* what() const noexcept override;
 };
 
+/**
+ * Represents a packet that ended before a field in it did. Decoders that are
+ * fed a packet in parts take it to mean that the field isn't complete yet,
+ * rather than that the packet is malformed.
+ */
+class JdwpTruncatedException : public JdwpException {
+  public:
+    /**
+     * Constructs a \c JdwpTruncatedException with the given explanatory
+     * message.
+     */
+    JdwpTruncatedException(const char* what_arg);
+
+    /**
+     * Creates a copy of \c other.
+     */
+    JdwpTruncatedException(const JdwpTruncatedException& other);
+    /**
+     * Assigns the contents of \c this to be the contents \c other.
+     */
+    JdwpTruncatedException& operator=(const JdwpTruncatedException& other);
+};
+
+/**
+ * Represents a reply from the JVM that carried a non-zero error code.
+ */
+class JdwpReplyException : public JdwpException {
+  public:
+    /**
+     * Constructs a \c JdwpReplyException for the given error code, using the
+     * error's description from the JDWP spec as the explanatory message.
+     */
+    explicit JdwpReplyException(JdwpError error);
+
+    /**
+     * Creates a copy of \c other.
+     */
+    JdwpReplyException(const JdwpReplyException& other);
+    /**
+     * Assigns the contents of \c this to be the contents \c other.
+     */
+    JdwpReplyException& operator=(const JdwpReplyException& other);
+
+    /**
+     * Returns the error code carried by the reply.
+     */
+    JdwpError GetError() const noexcept;
+  private:
+    JdwpError error;
+};
+
 }  // namespace roastery
 
 #endif  // JDWP_EXCEPTION_H_
@@ -0,0 +1,200 @@
+/* Provides a crawler that snapshots part of a VM's object graph to disk
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_HEAP_CRAWLER_H_
+#define ROASTERY_JDWP_HEAP_CRAWLER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_metadata_cache.hpp"
+
+namespace roastery {
+
+/**
+ * Tunes how a \c JdwpHeapCrawler walks the heap.
+ */
+struct JdwpHeapCrawlOptions {
+  /**
+   * The most objects expanded at once. Every command for a batch of this many
+   * objects is in flight together, and each of them is kept from being
+   * collected until the batch is done.
+   */
+  size_t max_in_flight = 256;
+  /**
+   * The most instances of each root class crawled from.
+   */
+  int32_t max_instances = 100;
+  /**
+   * Also follows the objects referring to each object expanded, through
+   * \c ReferringObjects, which finds who keeps a leaked object alive.
+   */
+  bool follow_referrers = false;
+  /**
+   * The most referring objects followed per object.
+   */
+  int32_t max_referrers = 16;
+  /**
+   * The most elements of each object array followed, from its start.
+   */
+  int32_t max_array_elements = 1024;
+  /**
+   * Stops once this many objects have been expanded, counting those expanded
+   * by the crawl being resumed, if any. 0 for no limit.
+   */
+  uint64_t max_objects = 0;
+  /**
+   * Continues the crawl already written to the output file, if there's one,
+   * rather than replacing it.
+   */
+  bool resume = false;
+};
+
+/**
+ * Walks the object graph of a VM breadth first, from the instances of a few
+ * root classes or from given objects, and streams it to a file as it goes.
+ *
+ * Objects are expanded in batches. For each batch, every object is kept from
+ * being collected and asked for its type, then its reference fields (or the
+ * elements of an object array, or its referrers) are read, all pipelined, so
+ * a batch takes a few round trips however many objects it holds. Each type is
+ * only resolved (its signature, superclasses and fields, through a
+ * \c JdwpMetadataCache) the first time it's seen.
+ *
+ * The file is a text file, flushed after each batch, whose first line is
+ * \c "# roastery heap graph v1", followed by one record per line. Every ID is
+ * in hexadecimal:
+ *
+ * - \c "T type signature" describes a reference type, before anything else
+ *   refers to it.
+ * - \c "C type count" gives the number of instances of a root class, in
+ *   decimal.
+ * - \c "R object" marks an object as a root.
+ * - \c "E from to label" is a reference from \c from to \c to, through the
+ *   field named \c label, the array element \c [index], or through something
+ *   unknown (\c ?) for a referrer.
+ * - \c "N object type" marks \c object, of type \c type, as expanded: every
+ *   reference from it has been written.
+ * - \c "X object error" marks \c object as unexpandable, with the decimal
+ *   \c JdwpError the VM gave, e.g. because it was collected first.
+ *
+ * Only the IDs of the objects seen so far, the objects still to be expanded
+ * and the types seen are held in memory; nodes and edges only live in the
+ * file. Resuming rebuilds that state from the file, so an interrupted crawl
+ * (as long as the objects it found are still alive) carries on where it
+ * stopped. An object interrupted while being expanded is expanded again, so
+ * some of its references may be written twice.
+ *
+ * Must only be used from one thread at a time, and never from the
+ * connection's I/O thread.
+ */
+class JdwpHeapCrawler {
+  public:
+    /**
+     * Creates a crawler writing the graph of the VM on \c con to \c path,
+     * resolving types through \c cache. Both must outlive \c this.
+     *
+     * @throws std::system_error if the file can't be read, created or
+     * written to.
+     * @throws JdwpException if resuming, and the file isn't a heap graph.
+     */
+    JdwpHeapCrawler(IJdwpCon& con, JdwpMetadataCache& cache,
+        const string& path,
+        const JdwpHeapCrawlOptions& options = JdwpHeapCrawlOptions());
+
+    // No copies/default constructor
+    JdwpHeapCrawler() = delete;
+    JdwpHeapCrawler(const JdwpHeapCrawler& copy) = delete;
+    JdwpHeapCrawler& operator=(const JdwpHeapCrawler& other) = delete;
+
+    // Moveable
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpHeapCrawler(JdwpHeapCrawler&& other) noexcept;
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpHeapCrawler& operator=(JdwpHeapCrawler&& other) noexcept;
+
+    /**
+     * Writes out anything not yet written and closes the file.
+     */
+    ~JdwpHeapCrawler();
+
+    /**
+     * Adds up to \c max_instances instances of each of \c ref_types as roots,
+     * and records how many instances each has.
+     *
+     * @return The number of roots added that hadn't been seen yet.
+     *
+     * @throws JdwpException if the VM can't list instances, e.g. because it
+     * lacks the \c canGetInstanceInfo capability or the connection closed.
+     * @throws std::system_error if the file can't be written to.
+     */
+    size_t AddRootClasses(const std::vector<uint64_t>& ref_types);
+    /**
+     * Adds \c obj as a root, unless it's been seen already.
+     *
+     * @throws std::system_error if the file can't be written to.
+     */
+    void AddRoot(uint64_t obj);
+
+    /**
+     * Expands a single batch of objects.
+     *
+     * @return The number of objects expanded, 0 once there's nothing left to
+     * expand or \c max_objects has been reached.
+     *
+     * @throws JdwpException if the connection fails. Whatever the batch found
+     * is then left out of the file, so resuming expands it again.
+     * @throws std::system_error if the file can't be written to.
+     */
+    size_t Step();
+    /**
+     * Expands batches until there's nothing left to expand, or
+     * \c max_objects is reached.
+     *
+     * @return The number of objects expanded in total.
+     *
+     * @throws Whatever \c Step does.
+     */
+    uint64_t Crawl();
+
+    /**
+     * Returns the number of objects expanded so far, counting those expanded
+     * by the crawl being resumed, if any.
+     */
+    uint64_t GetExpandedCount() const;
+    /**
+     * Returns the number of objects seen but not expanded yet.
+     */
+    size_t GetFrontierSize() const;
+  private:
+    class Impl;
+    unique_ptr<Impl> pImpl;
+};
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_HEAP_CRAWLER_H_
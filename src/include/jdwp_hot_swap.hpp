@@ -0,0 +1,185 @@
+/* Provides a pipeline for redefining loaded classes from class files
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_HOT_SWAP_H_
+#define ROASTERY_JDWP_HOT_SWAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "jdwp_class_index.hpp"
+#include "jdwp_con.hpp"
+#include "jdwp_metadata_cache.hpp"
+#include "jdwp_type.hpp"
+
+namespace roastery {
+
+/**
+ * A class file to redefine a class with.
+ */
+struct JdwpClassFile {
+  /**
+   * The JNI signature of the class, e.g. \c Lcom/example/Main;
+   */
+  string signature;
+  /**
+   * The contents of the class file. Points into memory owned by the
+   * \c JdwpClassFiles it came from.
+   */
+  std::string_view bytes;
+};
+
+/**
+ * A set of class files read from disk, to be handed to \c JdwpHotSwapper.
+ * Files are mapped into memory rather than read, so that adding hundreds of
+ * them only costs the pages actually touched when they're sent.
+ *
+ * Each class's signature comes from where its file is, relative to the root
+ * of the directory or jar it was found in, as on a class path:
+ * \c com/example/Main.class holds \c Lcom/example/Main; The \c META-INF
+ * directory and \c module-info.class are skipped.
+ */
+class JdwpClassFiles {
+  public:
+    JdwpClassFiles();
+
+    // No copies
+    JdwpClassFiles(const JdwpClassFiles& copy) = delete;
+    JdwpClassFiles& operator=(const JdwpClassFiles& other) = delete;
+
+    // Moveable
+    JdwpClassFiles(JdwpClassFiles&& other) noexcept;
+    JdwpClassFiles& operator=(JdwpClassFiles&& other) noexcept;
+
+    ~JdwpClassFiles();
+
+    /**
+     * Adds every \c .class file under \c dir, which is the root of a package
+     * hierarchy.
+     *
+     * @throws std::system_error If \c dir, or a file in it, can't be read.
+     * @throws JdwpException If a \c .class file isn't a class file.
+     */
+    void AddDirectory(const string& dir);
+    /**
+     * Adds every \c .class file in the jar at \c path. Only uncompressed
+     * entries can be read, as written by \c jar \c --no-compress or
+     * \c zip \c -0.
+     *
+     * @throws std::system_error If \c path can't be read.
+     * @throws JdwpException If \c path isn't a jar, if a class in it is
+     * compressed, or if one isn't a class file.
+     */
+    void AddJar(const string& path);
+    /**
+     * Adds a file or directory, depending on what \c path is: a jar if it
+     * ends in \c .jar, or a directory otherwise.
+     *
+     * @throws std::system_error, JdwpException As \c AddDirectory and
+     * \c AddJar.
+     */
+    void Add(const string& path);
+
+    /**
+     * Returns the class files added so far, in the order they were added. A
+     * class added more than once is listed more than once.
+     */
+    const std::vector<JdwpClassFile>& GetClasses() const;
+  private:
+    class Impl;
+    unique_ptr<Impl> pImpl;
+};
+
+/**
+ * The outcome of \c JdwpHotSwapper::Swap.
+ */
+struct JdwpHotSwapResult {
+  /**
+   * The signatures of the classes redefined, in the order they were given.
+   */
+  std::vector<string> redefined;
+  /**
+   * The signatures of the classes given that the VM hasn't loaded, which
+   * were left alone.
+   */
+  std::vector<string> not_loaded;
+  /**
+   * The number of reference types redefined. This is more than the size of
+   * \c redefined when several class loaders have loaded the same class.
+   */
+  size_t types = 0;
+};
+
+/**
+ * Redefines loaded classes from class files with a single
+ * \c RedefineClasses command, however many there are.
+ *
+ * Each class is matched to every loaded type with its signature through a
+ * \c JdwpClassIndex, so no lookups are sent per class. Its bytes aren't
+ * copied until they're serialized, straight from its mapped file into the
+ * packet, and the VM is asked whether it can redefine classes at all in the
+ * meantime. The command is sent through a
+ * \c JdwpMetadataCache, so that nothing it cached about the old classes is
+ * served afterwards.
+ */
+class JdwpHotSwapper {
+  public:
+    /**
+     * Creates a swapper that redefines classes on \c con. \c con, \c index
+     * and \c cache must all outlive \c this, and \c index should have been
+     * loaded.
+     */
+    JdwpHotSwapper(IJdwpCon& con, JdwpClassIndex& index,
+        JdwpMetadataCache& cache);
+
+    // No copies/default constructor
+    JdwpHotSwapper() = delete;
+    JdwpHotSwapper(const JdwpHotSwapper& copy) = delete;
+    JdwpHotSwapper& operator=(const JdwpHotSwapper& other) = delete;
+
+    // Moveable
+    JdwpHotSwapper(JdwpHotSwapper&& other) noexcept;
+    JdwpHotSwapper& operator=(JdwpHotSwapper&& other) noexcept;
+
+    ~JdwpHotSwapper();
+
+    /**
+     * Redefines every class in \c classes that the VM has loaded. Nothing is
+     * sent if none of them are. As on a class path, when several class files
+     * have the same signature, only the first is used. Must not be called
+     * from the connection's I/O thread.
+     *
+     * @throws JdwpException If the VM can't redefine classes.
+     * @throws JdwpReplyException If the VM rejects the new classes, e.g.
+     * because they add a method it can't add. The VM may have redefined some
+     * of them before doing so.
+     */
+    JdwpHotSwapResult Swap(const JdwpClassFiles& classes);
+  private:
+    class Impl;
+    unique_ptr<Impl> pImpl;
+};
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_HOT_SWAP_H_
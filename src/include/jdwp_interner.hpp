@@ -0,0 +1,81 @@
+/* Provides a table of interned strings, for metadata that repeats heavily
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_INTERNER_H_
+#define ROASTERY_JDWP_INTERNER_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace roastery {
+
+/**
+ * Hands out a single shared copy of each distinct string interned with it.
+ * Class signatures, method names and method signatures repeat across
+ * replies, and across everything caching them, so sharing one of these
+ * between the caches of a connection keeps each in memory once.
+ *
+ * The table doesn't keep strings alive: once every reference to an interned
+ * string is dropped, it's freed and forgotten. The strings handed out may
+ * outlive the table.
+ *
+ * Safe to use from multiple threads.
+ */
+class JdwpStringInterner {
+  public:
+    /**
+     * Creates an empty table.
+     */
+    JdwpStringInterner();
+
+    // No copies
+    JdwpStringInterner(const JdwpStringInterner& copy) = delete;
+    JdwpStringInterner& operator=(const JdwpStringInterner& other) = delete;
+
+    // Moveable
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpStringInterner(JdwpStringInterner&& other) noexcept;
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpStringInterner& operator=(JdwpStringInterner&& other) noexcept;
+
+    ~JdwpStringInterner();
+
+    /**
+     * Returns the shared copy of \c str, making one if there isn't one yet.
+     */
+    std::shared_ptr<const std::string> Intern(std::string_view str);
+
+    /**
+     * Returns the number of distinct strings currently interned.
+     */
+    size_t Size() const;
+  private:
+    class Impl;
+    std::unique_ptr<Impl> pImpl;
+};
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_INTERNER_H_
@@ -0,0 +1,74 @@
+/* Provides read-only memory mappings of whole files
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_MAPPED_FILE_H_
+#define ROASTERY_JDWP_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace roastery {
+
+namespace impl {
+
+/**
+ * A read-only mapping of a whole file, which stays valid for as long as
+ * \c this does, even once the file is closed or replaced.
+ */
+class MappedFile {
+  public:
+    /**
+     * Maps the file at \c path. An empty file is left unmapped, and reads as
+     * empty.
+     *
+     * @param advice Passed to \c madvise, to say how the mapping will be
+     * read.
+     *
+     * @throws std::system_error if the file can't be opened or mapped.
+     */
+    MappedFile(const std::string& path, int advice);
+
+    // No copies/default constructor
+    MappedFile() = delete;
+    MappedFile(const MappedFile& copy) = delete;
+    MappedFile& operator=(const MappedFile& other) = delete;
+
+    // Not moveable
+    MappedFile(MappedFile&& other) = delete;
+    MappedFile& operator=(MappedFile&& other) = delete;
+
+    ~MappedFile();
+
+    /**
+     * Returns the contents of the file.
+     */
+    std::string_view Get() const {
+      return std::string_view(this->data, this->size);
+    }
+  private:
+    const char* data;
+    size_t size;
+};
+
+}  // namespace impl
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_MAPPED_FILE_H_
@@ -0,0 +1,174 @@
+/* Provides a cache of reference type metadata fetched over JDWP
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_METADATA_CACHE_H_
+#define ROASTERY_JDWP_METADATA_CACHE_H_
+
+#include <cstdint>
+#include <future>
+#include <memory>
+
+#include "jdwp_con.hpp"
+#include "jdwp_interner.hpp"
+#include "jdwp_packet.hpp"
+
+namespace roastery {
+
+/**
+ * Counts how often a \c JdwpMetadataCache could answer a lookup itself.
+ */
+struct JdwpMetadataCacheStats {
+  /**
+   * Lookups answered from the cache, including ones that joined a request
+   * that was already in flight.
+   */
+  uint64_t hits;
+  /**
+   * Lookups that had to send a command to the VM.
+   */
+  uint64_t misses;
+};
+
+/**
+ * Caches the metadata of reference types (their signatures, source files,
+ * fields, methods, line tables and variable tables) for a single connection,
+ * so that repeat lookups are answered without a round trip to the VM.
+ *
+ * A type's metadata is fetched the first time it's looked up, and lookups
+ * made while that request is in flight share its reply. Once its reply has
+ * arrived, it's kept until the type is invalidated: when the VM reports a
+ * \c ClassUnload for it, when it's redefined through \c RedefineClasses, or
+ * explicitly with \c Invalidate. Everything is dropped when the connection
+ * is reestablished with \c JdwpConOptions::reconnect, as reference type IDs
+ * are only good for the connection that handed them out. Failed lookups
+ * aren't cached, so the next lookup tries again.
+ *
+ * Signatures reported by \c ClassPrepare events are recorded as they arrive,
+ * so looking up the signature of a freshly prepared class never needs a
+ * round trip.
+ *
+ * Every method is safe to call from any thread. As with \c IJdwpCon::SendAsync,
+ * the returned futures must not be waited on from the connection's I/O thread.
+ */
+class JdwpMetadataCache {
+  public:
+    using SignatureReply =
+      command_packets::reference_type::SignatureCommand::ReplyFields;
+    using SourceFileReply =
+      command_packets::reference_type::SourceFileCommand::ReplyFields;
+    using FieldsReply =
+      command_packets::reference_type::FieldsWithGenericCommand::ReplyFields;
+    using MethodsReply =
+      command_packets::reference_type::MethodsWithGenericCommand::ReplyFields;
+    using LineTableReply =
+      command_packets::method::LineTableCommand::ReplyFields;
+    using VariableTableReply = command_packets::method::
+      VariableTableWithGenericCommand::ReplyFields;
+    using RedefineReply =
+      command_packets::virtual_machine::RedefineClassesCommand::ReplyFields;
+
+    /**
+     * Creates an empty cache for \c con, and registers an inline handler with
+     * \c con to watch for classes being prepared and unloaded. \c con must
+     * outlive \c this.
+     *
+     * @param interner If set, every string in a cached reply is interned with
+     * it. Method names and signatures repeat across classes, so this saves
+     * memory on large heaps, more so when shared with a \c JdwpClassIndex.
+     */
+    explicit JdwpMetadataCache(IJdwpCon& con,
+        std::shared_ptr<JdwpStringInterner> interner = nullptr);
+
+    // No copies/default constructor
+    JdwpMetadataCache() = delete;
+    JdwpMetadataCache(const JdwpMetadataCache& copy) = delete;
+    JdwpMetadataCache& operator=(const JdwpMetadataCache& other) = delete;
+
+    // Not moveable, the registered handler holds on to its state
+    JdwpMetadataCache(JdwpMetadataCache&& other) = delete;
+    JdwpMetadataCache& operator=(JdwpMetadataCache&& other) = delete;
+
+    ~JdwpMetadataCache();
+
+    /**
+     * Returns the JNI signature of \c ref_type, as sent by \c SignatureCommand.
+     */
+    std::shared_future<SignatureReply> GetSignature(uint64_t ref_type);
+    /**
+     * Returns the source file of \c ref_type, as sent by \c SourceFileCommand.
+     */
+    std::shared_future<SourceFileReply> GetSourceFile(uint64_t ref_type);
+    /**
+     * Returns the fields declared by \c ref_type, as sent by
+     * \c FieldsWithGenericCommand.
+     */
+    std::shared_future<FieldsReply> GetFields(uint64_t ref_type);
+    /**
+     * Returns the methods declared by \c ref_type, as sent by
+     * \c MethodsWithGenericCommand.
+     */
+    std::shared_future<MethodsReply> GetMethods(uint64_t ref_type);
+    /**
+     * Returns the line table of \c method in \c ref_type, as sent by
+     * \c LineTableCommand.
+     */
+    std::shared_future<LineTableReply> GetLineTable(uint64_t ref_type,
+        uint64_t method);
+    /**
+     * Returns the local variables of \c method in \c ref_type, as sent by
+     * \c VariableTableWithGenericCommand.
+     */
+    std::shared_future<VariableTableReply> GetVariableTable(uint64_t ref_type,
+        uint64_t method);
+
+    /**
+     * Sends \c message, after dropping everything cached for the types it
+     * redefines. They're dropped again once the reply arrives, in case they
+     * were looked up in the meantime. Redefining classes through this rather
+     * than sending the command directly keeps the cache from serving stale
+     * metadata.
+     *
+     * @return A future that holds the reply, or the exception the command
+     * failed with.
+     */
+    std::future<RedefineReply> RedefineClasses(
+        unique_ptr<command_packets::virtual_machine::RedefineClassesCommand>
+        message);
+
+    /**
+     * Drops everything cached for \c ref_type.
+     */
+    void Invalidate(uint64_t ref_type);
+    /**
+     * Drops everything cached.
+     */
+    void Clear();
+
+    /**
+     * Returns how many lookups have been answered so far, and how.
+     */
+    JdwpMetadataCacheStats GetStats() const;
+  private:
+    class Impl;
+    unique_ptr<Impl> pImpl;
+};
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_METADATA_CACHE_H_
@@ -21,8 +21,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <arpa/inet.h>
 
+#include <array>
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <sstream>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 
 #include "jdwp_con.hpp"
@@ -51,25 +56,40 @@ class IJdwpCommandPacket {
      * Returns \c this serialized for transmission over JDWP.
      */
     string Serialize(IJdwpCon& con) const;
+    /**
+     * Appends \c this, serialized for transmission over JDWP, to \c out. If
+     * serialization throws, \c out is left as it was.
+     */
+    void SerializeTo(string& out, IJdwpCon& con) const;
     virtual ~IJdwpCommandPacket() = 0;
 
     uint32_t GetId() const;
   protected:
     uint32_t id;
     /**
-     * Provides an implementation of \c Serialize().
+     * Provides an implementation of \c Serialize() and \c SerializeTo(). Should
+     * only append to \c out.
+     */
+    virtual void SerializeToImpl(string& out, IJdwpCon& con) const = 0;
+    /**
+     * Reserves space for a JDWP header at the end of \c out. Everything
+     * appended to \c out afterwards is the packet's body.
+     *
+     * @return The offset of the header, to be passed to \c FinishHeader once
+     * the body has been written.
      */
-    virtual string SerializeImpl(IJdwpCon& con) const = 0;
+    static size_t BeginHeader(string& out);
     /**
-     * Generates a JDWP header for this command.
+     * Fills in the header reserved by \c BeginHeader.
      *
-     * @param body_len The length of the body/data in this JDWP packet. Should
-     * not include the length of a JDWP command header. Should be in host
-     * byte-order.
+     * @param out The buffer passed to \c BeginHeader.
+     * @param header_offset The value returned by \c BeginHeader.
      * @param id The ID to be used in the header. Should be in host byte-order.
+     *
+     * @throws JdwpException if the body is too long.
      */
-    static string ProduceHeader(uint8_t command_set, uint8_t command,
-        size_t body_len, uint32_t id);
+    static void FinishHeader(string& out, size_t header_offset,
+        uint8_t command_set, uint8_t command, uint32_t id);
 };
 
 // Template metaprogramming helpers
@@ -115,6 +135,50 @@ void TupleForEach(Tuple&& tuple, Func&& func) {
     ::Exec(forward<Tuple>(tuple), forward<Func>(func));
 }
 
+/**
+ * Wraps a type, so that it can be passed to a functor as a value.
+ */
+template<typename T>
+struct TypeTag {
+  using type = T;
+};
+
+template<size_t rem>
+struct TupleTypeForEachHelper {
+  template<typename Tuple, typename Func>
+  static constexpr void Exec(Func&& func) {
+    constexpr size_t tuple_siz = tuple_size<Tuple>::value;
+    static_assert(rem <= tuple_siz, "Bad size in TupleTypeForEachHelper");
+    constexpr size_t idx = tuple_siz - rem;
+    func(TypeTag<std::tuple_element_t<idx, Tuple>>());
+    TupleTypeForEachHelper<rem - 1>
+      ::template Exec<Tuple>(forward<Func>(func));
+  }
+};
+
+// template recursion base case: 0 elements remaining
+template<>
+struct TupleTypeForEachHelper<0> {
+  template<typename Tuple, typename Func>
+  static constexpr void Exec(Func&& func) {
+    static_cast<void>(func);
+  }
+};
+
+/**
+ * Runs a functor on the \c TypeTag of each type in a \c std::tuple, without
+ * needing a value of the tuple. Can be used in constant expressions.
+ *
+ * @tparam Tuple The tuple type to iterate over
+ * @param func The functor to execute with each type in \c Tuple.
+ */
+template<typename Tuple, typename Func>
+constexpr void TupleTypeForEach(Func&& func) {
+  TupleTypeForEachHelper
+    <tuple_size<Tuple>::value>
+    ::template Exec<Tuple>(forward<Func>(func));
+}
+
 template <typename...>
 struct ConcatTuple;
 
@@ -134,7 +198,7 @@ struct RepeatedTuple {
 };
 
 template<typename T>
-struct RepeatedTuple<T, 0> {
+struct RepeatedTuple<T, 1> {
   using Type = std::tuple<T>;
 };
 
@@ -160,6 +224,380 @@ class IsVector<vector<T>> {
 uint32_t GetNextId();
 
 const uint32_t kHeaderLen = 11;
+
+// Each overload needs to be able to see the others
+template<typename Field>
+void RecursiveSerialize(string& out, const Field& field, IJdwpCon& con);
+template<typename T>
+void RecursiveSerialize(string& out, const vector<T>& v, IJdwpCon& con);
+template<typename... Ts>
+void RecursiveSerialize(string& out, const std::tuple<Ts...>& bundle,
+    IJdwpCon& con);
+template<typename Field>
+void RecursiveDeserialize(std::string_view encoded, size_t& idx, Field& field,
+    IJdwpCon& con);
+template<typename T>
+void RecursiveDeserialize(std::string_view encoded, size_t& idx, vector<T>& v,
+    IJdwpCon& con);
+template<typename... Ts>
+void RecursiveDeserialize(std::string_view encoded, size_t& idx,
+    std::tuple<Ts...>& bundle, IJdwpCon& con);
+
+/**
+ * Appends the serialization of a single \c IJdwpField to \c out.
+ */
+template<typename Field>
+void RecursiveSerialize(string& out, const Field& field, IJdwpCon& con) {
+  EncodeField(out, field, con);
+}
+
+/**
+ * Appends a \c JdwpInt length, followed by each element of \c v, to \c out.
+ */
+template<typename T>
+void RecursiveSerialize(string& out, const vector<T>& v, IJdwpCon& con) {
+  JdwpInt len;
+  len << v.size();
+  len.Encode(out, con);
+  if constexpr (MaxEncodedSize<T>::bounded) {
+    out.reserve(out.size() + v.size() * MaxEncodedSize<T>::value);
+  }
+  for (const T& elt : v) {
+    RecursiveSerialize(out, elt, con);
+  }
+}
+
+/**
+ * Appends each element of \c bundle, in order, to \c out.
+ */
+template<typename... Ts>
+void RecursiveSerialize(string& out, const std::tuple<Ts...>& bundle,
+    IJdwpCon& con) {
+  TupleForEach(bundle, [&out, &con](const auto& f) {
+    RecursiveSerialize(out, f, con);
+  });
+}
+
+/**
+ * Deserializes a single \c IJdwpField from \c encoded, starting at \c idx,
+ * then advances \c idx past the bytes read.
+ */
+template<typename Field>
+void RecursiveDeserialize(std::string_view encoded, size_t& idx, Field& field,
+    IJdwpCon& con) {
+  if (idx > encoded.size()) throw JdwpTruncatedException("Truncated packet");
+  idx += DecodeField(field, encoded.substr(idx), con);
+}
+
+/**
+ * Deserializes a \c JdwpInt length, followed by that many elements, from
+ * \c encoded, starting at \c idx, then advances \c idx past the bytes read.
+ */
+template<typename T>
+void RecursiveDeserialize(std::string_view encoded, size_t& idx, vector<T>& v,
+    IJdwpCon& con) {
+  JdwpInt len;
+  RecursiveDeserialize(encoded, idx, len, con);
+  // Every element takes at least one byte, so this bounds how much we'll
+  // allocate for a malformed length. The rest of the packet may just not
+  // have been recieved yet, though.
+  if (len.GetValue() < 0) throw JdwpException("Bad length in packet");
+  if (static_cast<size_t>(len.GetValue()) > encoded.size() - idx) {
+    throw JdwpTruncatedException("Bad length in packet");
+  }
+  v.clear();
+  v.resize(len.GetValue());
+  for (T& elt : v) {
+    RecursiveDeserialize(encoded, idx, elt, con);
+  }
+}
+
+/**
+ * Deserializes each element of \c bundle in order from \c encoded, starting at
+ * \c idx, then advances \c idx past the bytes read.
+ */
+template<typename... Ts>
+void RecursiveDeserialize(std::string_view encoded, size_t& idx,
+    std::tuple<Ts...>& bundle, IJdwpCon& con) {
+  TupleForEach(bundle, [&encoded, &idx, &con](auto& f) {
+    RecursiveDeserialize(encoded, idx, f, con);
+  });
+}
+
+// Each overload needs to be able to see the others
+template<typename Field, typename Func>
+void RecursiveForEachField(Field& field, Func& func);
+template<typename T, typename Func>
+void RecursiveForEachField(vector<T>& v, Func& func);
+template<typename... Ts, typename Func>
+void RecursiveForEachField(std::tuple<Ts...>& bundle, Func& func);
+
+/**
+ * Calls \c func with \c field.
+ */
+template<typename Field, typename Func>
+void RecursiveForEachField(Field& field, Func& func) {
+  func(field);
+}
+
+/**
+ * Calls \c func with every field in \c v.
+ */
+template<typename T, typename Func>
+void RecursiveForEachField(vector<T>& v, Func& func) {
+  for (T& elt : v) {
+    RecursiveForEachField(elt, func);
+  }
+}
+
+/**
+ * Calls \c func with every field in \c bundle, in order.
+ */
+template<typename... Ts, typename Func>
+void RecursiveForEachField(std::tuple<Ts...>& bundle, Func& func) {
+  TupleForEach(bundle, [&func](auto& f) {
+    RecursiveForEachField(f, func);
+  });
+}
+
+/**
+ * Materializes every \c JdwpLazyString in \c fields, so that they no longer
+ * point into the buffer they were decoded from.
+ */
+template<typename Fields>
+void MaterializeStrings(Fields& fields) {
+  auto materialize = [](auto& field) {
+    if constexpr (std::is_same_v<std::decay_t<decltype(field)>,
+        JdwpLazyString>) {
+      field.Materialize();
+    }
+  };
+  RecursiveForEachField(fields, materialize);
+}
+
+/**
+ * Interns every \c JdwpString in \c fields with \c interner.
+ */
+template<typename Fields>
+void InternStrings(Fields& fields, JdwpStringInterner& interner) {
+  auto intern = [&interner](auto& field) {
+    if constexpr (std::is_same_v<std::decay_t<decltype(field)>, JdwpString>) {
+      field.Intern(interner);
+    }
+  };
+  RecursiveForEachField(fields, intern);
+}
+
+/**
+ * Checks that \c msg starts with the header of a reply that succeeded.
+ *
+ * @throws JdwpReplyException if the reply carries a non-zero error code.
+ * @throws JdwpException if \c msg is not a reply, or is shorter than a
+ * header.
+ */
+void CheckReplyHeader(std::string_view msg);
+
+/**
+ * Interprets \c msg as a reply packet containing \c RespFields as its data.
+ *
+ * @param msg The JDWP encoded reply, including the JDWP header.
+ * @param con The connection \c msg was recieved from.
+ *
+ * @throws JdwpReplyException if the reply carries a non-zero error code.
+ * @throws JdwpException if \c msg is not a reply, or is malformed.
+ */
+template<typename RespFields>
+RespFields DecodeReply(std::string_view msg, IJdwpCon& con) {
+  CheckReplyHeader(msg);
+
+  RespFields res;
+  size_t idx = kHeaderLen;
+  RecursiveDeserialize(msg, idx, res, con);
+  return res;
+}
+
+template<typename Tuple, typename Indices =
+  std::make_index_sequence<tuple_size<Tuple>::value - 1>>
+struct SplitLastField;
+
+/**
+ * Splits the \c tuple of fields \c Tuple into its last field, \c Last, and
+ * the \c tuple of the fields before it, \c Head.
+ */
+template<typename... Ts, size_t... Is>
+struct SplitLastField<std::tuple<Ts...>, std::index_sequence<Is...>> {
+  using Head = std::tuple<std::tuple_element_t<Is, std::tuple<Ts...>>...>;
+  using Last = std::tuple_element_t<sizeof...(Ts) - 1, std::tuple<Ts...>>;
+};
+
+/**
+ * Decodes a reply whose \c RespFields end in a \c vector incrementally, as
+ * consecutive parts of it are recieved, rather than all at once. The fields
+ * before the \c vector are decoded together, then each element is decoded
+ * and passed on as soon as all of its bytes have been fed in. Only the bytes
+ * of an element that's been cut off by the end of a part are kept until the
+ * next, so the reply is never held whole.
+ */
+template<typename RespFields>
+class StreamingReplyDecoder {
+  public:
+    using Head = typename SplitLastField<RespFields>::Head;
+    using Elements = typename SplitLastField<RespFields>::Last;
+    static_assert(IsVector<Elements>::value,
+        "Only replies that end in a vector can be streamed");
+    using Element = typename Elements::value_type;
+
+    /**
+     * @param on_head Called with the fields before the \c vector once
+     * they've been decoded, before any element. May be \c nullptr.
+     * @param on_element Called with each element of the \c vector, which is
+     * only valid for the duration of the call.
+     */
+    StreamingReplyDecoder(std::function<void(Head&)> on_head,
+        std::function<void(Element&)> on_element) :
+      on_head(std::move(on_head)), on_element(std::move(on_element)),
+      stage(Stage::kHeader), packet_len(0), fed(0), count(0), left(0) { }
+
+    /**
+     * Decodes whatever can be decoded with \c part, which continues where
+     * the last part fed in left off. The first part starts with the JDWP
+     * header.
+     *
+     * @param last Whether \c part ends the reply.
+     *
+     * @throws JdwpReplyException if the reply carries a non-zero error code.
+     * @throws JdwpException if the reply is malformed, or if the last part
+     * is fed in before the reply is complete.
+     */
+    void Feed(std::string_view part, bool last, IJdwpCon& con) {
+      this->fed += part.size();
+      std::string_view data = part;
+      if (!this->carry.empty()) {
+        this->carry.append(part);
+        data = this->carry;
+      }
+
+      size_t idx = 0;
+      bool more = true;
+      while (more && this->stage != Stage::kDone) {
+        switch (this->stage) {
+          case Stage::kHeader:
+            if (data.size() < kHeaderLen) {
+              more = false;
+              break;
+            }
+            CheckReplyHeader(data);
+            uint32_t len_nbo;
+            data.copy(reinterpret_cast<char*>(&len_nbo), sizeof(len_nbo));
+            this->packet_len = ntohl(len_nbo);
+            idx = kHeaderLen;
+            this->stage = Stage::kHead;
+            break;
+          case Stage::kHead: {
+            std::tuple<Head, JdwpInt> head_and_len;
+            if (!this->TryDecode(data, idx, head_and_len, last, con)) {
+              more = false;
+              break;
+            }
+            int32_t len = std::get<1>(head_and_len).GetValue();
+            // Every element takes at least one byte
+            if (len < 0 || static_cast<size_t>(len) >
+                this->packet_len - (this->fed - (data.size() - idx))) {
+              throw JdwpException("Bad length in packet");
+            }
+            this->left = len;
+            if (this->on_head) this->on_head(std::get<0>(head_and_len));
+            this->stage = Stage::kElements;
+            break;
+          }
+          case Stage::kElements:
+            if (this->left == 0) {
+              this->stage = Stage::kDone;
+              break;
+            }
+            if (!this->TryDecode(data, idx, this->element, last, con)) {
+              more = false;
+              break;
+            }
+            this->left--;
+            this->count++;
+            this->on_element(this->element);
+            break;
+          case Stage::kDone:
+            break;
+        }
+      }
+
+      if (last && this->stage != Stage::kDone) {
+        throw JdwpException("Truncated reply packet");
+      }
+      if (data.data() == this->carry.data()) {
+        this->carry.erase(0, idx);
+      } else {
+        this->carry.assign(data.substr(idx));
+      }
+    }
+
+    /**
+     * Returns the number of elements decoded so far.
+     */
+    size_t GetCount() const { return this->count; }
+  private:
+    enum class Stage { kHeader, kHead, kElements, kDone };
+
+    /**
+     * Decodes \c value from \c data at \c idx, advancing \c idx past it.
+     * Only running out of data counts as \c value being incomplete, anything
+     * else it's malformed by is thrown right away.
+     *
+     * @return \c false if \c data ends before \c value does and more is
+     * still to come, in which case \c idx is left alone.
+     */
+    template<typename Value>
+    bool TryDecode(std::string_view data, size_t& idx, Value& value,
+        bool last, IJdwpCon& con) {
+      size_t at = idx;
+      if constexpr (MaxEncodedSize<Value>::bounded) {
+        // Nothing can be cut off, so any error is real
+        if (last || data.size() - idx >= MaxEncodedSize<Value>::value) {
+          RecursiveDeserialize(data, at, value, con);
+          idx = at;
+          return true;
+        }
+      }
+      try {
+        RecursiveDeserialize(data, at, value, con);
+      } catch (const JdwpTruncatedException& e) {
+        if (last) throw;
+        return false;
+      }
+      idx = at;
+      return true;
+    }
+
+    std::function<void(Head&)> on_head;
+    std::function<void(Element&)> on_element;
+    Stage stage;
+    /**
+     * The length of the reply, as given by its header.
+     */
+    size_t packet_len;
+    /**
+     * The number of bytes of the reply fed in so far.
+     */
+    size_t fed;
+    /**
+     * The number of elements decoded so far, and still to come.
+     */
+    size_t count;
+    size_t left;
+    /**
+     * Holds the bytes fed in that haven't been decoded yet.
+     */
+    string carry;
+    Element element;
+};
+
 /**
  * Provides a base for types representing JDWP command packets.
  *
@@ -176,70 +614,67 @@ template<uint8_t command_set, uint8_t command, typename Fields,
   typename RespFields>
 class CommandPacketBase : public roastery::IJdwpCommandPacket {
   public:
+    /**
+     * The fields of the reply to this command.
+     */
+    using ReplyFields = RespFields;
+
     CommandPacketBase() : IJdwpCommandPacket() { }
 
     Fields& GetFields() { return fields; }
     const Fields& GetFields() const { return fields; }
 
-    virtual ~CommandPacketBase() = 0;
-  protected:
     /**
-     * Provides an implementation of \c Serialize(). Can be overriden by derived
-     * classes for customization. By default, calls the \c Serialize() method
-     * of each item in \c Fields and concatenates them. If any field is of type
-     * \c std::vector, first conctenates a \c JdwpInt for the length of the
-     * vector, and then each vector element.
+     * Interprets \c msg as the reply to this command.
+     *
+     * @param msg The JDWP encoded reply, including the JDWP header.
+     * @param con The connection \c msg was recieved from.
+     *
+     * @throws JdwpReplyException if the reply carries a non-zero error code.
+     * @throws JdwpException if \c msg is not a reply, or is malformed.
      */
-    virtual string SerializeImpl(IJdwpCon& con) const {
-      std::stringstream body_acc;
-      TupleForEach(this->fields, [&body_acc, &con](const auto& s) {
-        RecursiveSerialize(body_acc, s, con);
-      });
-      string body = body_acc.str();
-      return ProduceHeader(command_set, command, body.length(), this->id) +
-        body;
+    RespFields Deserialize(std::string_view msg, IJdwpCon& con) const {
+      RespFields res = this->DeserializeImpl(msg, con);
+      MaterializeStrings(res);
+      return res;
     }
-
     /**
-     * Provides a default implementation of \c Deserialize. Interprets the given
-     * message as a reply containing \c RespFields as its data.
+     * Like \c Deserialize, but leaves any \c JdwpLazyString in the reply
+     * pointing into \c msg, so the reply must not outlive \c msg.
      */
-    virtual RespFields DeserializeImpl(const string& msg, IJdwpCon& con) const {
-      JdwpInt len, id;
-      JdwpByte flags;
-      JdwpShort errc;
-      // TODO finishme
-      return RespFields();
+    RespFields DeserializeInPlace(std::string_view msg, IJdwpCon& con) const {
+      return this->DeserializeImpl(msg, con);
     }
-  private:
+
+    virtual ~CommandPacketBase() = 0;
+  protected:
     /**
-     * Recursively serializes \c field. If it's a vector type by prepending a
-     * \c JdwpInt length and then recursively serializing each element.
-     * Otherwise, just serializes the element.
+     * Provides an implementation of \c SerializeTo(). Can be overriden by
+     * derived classes for customization. By default, appends the header, then
+     * each item in \c Fields. If any field is of type \c std::vector, first
+     * appends a \c JdwpInt for the length of the vector, and then each vector
+     * element.
      */
-    template<typename Field>
-    static void RecursiveSerialize(std::stringstream& acc, const Field& field,
-        IJdwpCon& con) {
-      if (IsVector<Field>::value) {
-        RecursiveSerialize(acc, field, con);
-      } else {
-        acc << field.Serialize(con);
+    virtual void SerializeToImpl(string& out, IJdwpCon& con) const override {
+      // When every field has a known maximum size, the whole packet can be
+      // written with at most one allocation.
+      if constexpr (MaxEncodedSize<Fields>::bounded) {
+        out.reserve(out.size() + kHeaderLen + MaxEncodedSize<Fields>::value);
       }
+      size_t header_offset = BeginHeader(out);
+      RecursiveSerialize(out, this->fields, con);
+      FinishHeader(out, header_offset, command_set, command, this->id);
     }
 
-    template<typename FieldBundle>
-    static void RecursiveSerialize(std::stringstream& acc,
-        const vector<FieldBundle>& v, IJdwpCon& con) {
-      JdwpInt len;
-      len << v.size();
-      acc << len.Serialize(con);
-      for (const FieldBundle& bundle : v) {
-        TupleForEach(bundle, [&acc, &con](const auto& s) {
-          RecursiveSerialize(acc, s, con);
-        });
-      }
+    /**
+     * Provides a default implementation of \c Deserialize. Interprets the given
+     * message as a reply containing \c RespFields as its data.
+     */
+    virtual RespFields DeserializeImpl(std::string_view msg,
+        IJdwpCon& con) const {
+      return DecodeReply<RespFields>(msg, con);
     }
-
+  private:
     Fields fields;
 };
 
@@ -283,7 +718,9 @@ class AllClassesCommand :
       kVm,
       static_cast<uint8_t>(VirtualMachine::kAllClasses),
       tuple<>,
-      tuple<vector<tuple<JdwpByte, JdwpReferenceTypeId, JdwpString, JdwpInt>>>
+      tuple<vector<
+        tuple<JdwpByte, JdwpReferenceTypeId, JdwpLazyString, JdwpInt>
+      >>
     > { };
 
 class AllThreadsCommand :
@@ -403,7 +840,7 @@ class RedefineClassesCommand :
     public CommandPacketBase<
       kVm,
       static_cast<uint8_t>(VirtualMachine::kRedefineClassese),
-      tuple<vector<tuple<JdwpReferenceTypeId, vector<JdwpByte>>>>,
+      tuple<vector<tuple<JdwpReferenceTypeId, JdwpBytes>>>,
       tuple<>
     > { };
 
@@ -421,7 +858,8 @@ class AllClassesWithGenericCommand :
       static_cast<uint8_t>(VirtualMachine::kAllClassesWithGeneric),
       tuple<>,
       tuple<vector<
-        tuple<JdwpByte, JdwpReferenceTypeId, JdwpString, JdwpString, JdwpInt>
+        tuple<JdwpByte, JdwpReferenceTypeId, JdwpLazyString, JdwpLazyString,
+          JdwpInt>
       >>
     > { };
 
@@ -611,7 +1049,7 @@ class SetValuesCommand :
   protected:
     // Because the JdwpValues need to be untagged, which isn't the default,
     // override
-    string SerializeImpl(IJdwpCon& con) const override;
+    void SerializeToImpl(string& out, IJdwpCon& con) const override;
 };
 
 class InvokeMethodCommand :
@@ -698,7 +1136,7 @@ class VariableTableWithGenericCommand :
       static_cast<uint8_t>(Method::kVariableTableWithGeneric),
       tuple<JdwpReferenceTypeId, JdwpMethodId>,
       tuple<
-        JdwpLong,
+        JdwpInt,
         vector<
           tuple<JdwpLong, JdwpString, JdwpString, JdwpString, JdwpInt, JdwpInt>
         >
@@ -718,7 +1156,7 @@ namespace object_reference {
 constexpr uint8_t kObjRef = static_cast<uint8_t>(CommandSet::kObjectReference);
 
 class ReferenceTypeCommand :
-    CommandPacketBase<
+    public CommandPacketBase<
       kObjRef,
       static_cast<uint8_t>(ObjectReference::kReferenceType),
       tuple<JdwpObjId>,
@@ -726,7 +1164,7 @@ class ReferenceTypeCommand :
     > { };
 
 class GetValuesCommand :
-    CommandPacketBase<
+    public CommandPacketBase<
       kObjRef,
       static_cast<uint8_t>(ObjectReference::kGetValues),
       tuple<JdwpObjId, vector<tuple<JdwpFieldId>>>,
@@ -734,7 +1172,7 @@ class GetValuesCommand :
     > { };
 
 class SetValuesCommand :
-    CommandPacketBase<
+    public CommandPacketBase<
       kObjRef,
       static_cast<uint8_t>(ObjectReference::kSetValues),
       tuple<JdwpObjId, vector<tuple<JdwpFieldId, JdwpValue>>>,
@@ -743,11 +1181,11 @@ class SetValuesCommand :
   protected:
     // Need to serialize the values as untagged, which isn't the default, so
     // override
-    string SerializeImpl(IJdwpCon &con) const override;
+    void SerializeToImpl(string& out, IJdwpCon& con) const override;
 };
 
 class MonitorInfoCommand :
-    CommandPacketBase<
+    public CommandPacketBase<
       kObjRef,
       static_cast<uint8_t>(ObjectReference::kMonitorInfo),
       tuple<JdwpObjId>,
@@ -755,7 +1193,7 @@ class MonitorInfoCommand :
     > { };
 
 class InvokeMethodCommand :
-    CommandPacketBase<
+    public CommandPacketBase<
       kObjRef,
       static_cast<uint8_t>(ObjectReference::kInvokeMethod),
       tuple<JdwpObjId, JdwpThreadId, JdwpClassId, JdwpMethodId,
@@ -764,7 +1202,7 @@ class InvokeMethodCommand :
     > { };
 
 class DisableCollectionCommand :
-    CommandPacketBase<
+    public CommandPacketBase<
       kObjRef,
       static_cast<uint8_t>(ObjectReference::kDisableCollection),
       tuple<JdwpObjId>,
@@ -772,7 +1210,7 @@ class DisableCollectionCommand :
     > { };
 
 class EnableCollectionCommand :
-    CommandPacketBase<
+    public CommandPacketBase<
       kObjRef,
       static_cast<uint8_t>(ObjectReference::kEnableCollection),
       tuple<JdwpObjId>,
@@ -780,7 +1218,7 @@ class EnableCollectionCommand :
     > { };
 
 class IsCollectedCommand :
-    CommandPacketBase<
+    public CommandPacketBase<
       kObjRef,
       static_cast<uint8_t>(ObjectReference::kIsCollected),
       tuple<JdwpObjId>,
@@ -788,7 +1226,7 @@ class IsCollectedCommand :
     > { };
 
 class ReferringObjectsCommand :
-    CommandPacketBase<
+    public CommandPacketBase<
       kObjRef,
       static_cast<uint8_t>(ObjectReference::kReferringObjects),
       tuple<JdwpObjId, JdwpInt>,
@@ -800,7 +1238,7 @@ class ReferringObjectsCommand :
 namespace string_reference {
 
 class ValueCommand :
-    CommandPacketBase<
+    public CommandPacketBase<
       static_cast<uint8_t>(CommandSet::kStringReference),
       static_cast<uint8_t>(StringReference::kValue),
       tuple<JdwpObjId>,
@@ -987,7 +1425,7 @@ class SetValuesCommand :
     > {
   protected:
     // Need overriden impl to serialize JdwpValues as untagged.
-    string SerializeImpl(IJdwpCon& con) const override;
+    void SerializeToImpl(string& out, IJdwpCon& con) const override;
 };
 
 }  // namespace array_reference
@@ -1028,13 +1466,25 @@ class SetCommand : public IJdwpCommandPacket {
       tuple<JdwpString>
       >;
     using Fields = tuple<JdwpByte, JdwpByte, vector<Modifier>>;
+    /**
+     * The fields of the reply to this command, the ID of the created request.
+     */
+    using ReplyFields = tuple<JdwpInt>;
 
     SetCommand();
 
     Fields& GetFields();
     const Fields& GetFields() const;
+
+    /**
+     * Interprets \c msg as the reply to this command.
+     *
+     * @throws JdwpReplyException if the reply carries a non-zero error code.
+     * @throws JdwpException if \c msg is not a reply, or is malformed.
+     */
+    ReplyFields Deserialize(std::string_view msg, IJdwpCon& con) const;
   protected:
-    string SerializeImpl(IJdwpCon& con) const override;
+    void SerializeToImpl(string& out, IJdwpCon& con) const override;
   private:
     Fields fields;
 };
@@ -1113,9 +1563,78 @@ class ReflectedTypeCommand :
  * Returns \c true when the packet with the given \c header is an event packet,
  * \c false otherwise.
  */
-bool HeaderIsEvent(const string& header);
+bool HeaderIsEvent(std::string_view header);
 
 class Handler;
+class IJdwpEvent;
+
+/**
+ * Recycles decoded \c IJdwpEvent objects, so that decoding a busy stream of
+ * events (e.g., \c MethodEntry tracing) doesn't go through the allocator
+ * for every event. Events acquired from a pool are handed back to it when
+ * their \c Ptr is destroyed, and reused by the next event of the same kind.
+ *
+ * A pool is safe to use from multiple threads, and must outlive every event
+ * acquired from it.
+ */
+class JdwpEventPool {
+  public:
+    /**
+     * Deletes an event by returning it to the pool it came from, or with
+     * \c delete if it didn't come from a pool.
+     */
+    class Recycler {
+      public:
+        Recycler() = default;
+        explicit Recycler(JdwpEventPool* pool) : pool(pool) { }
+        void operator()(IJdwpEvent* event) const;
+      private:
+        JdwpEventPool* pool = nullptr;
+    };
+    /**
+     * Owns an event acquired from a pool.
+     */
+    using Ptr = std::unique_ptr<IJdwpEvent, Recycler>;
+
+    /**
+     * Creates an empty pool.
+     *
+     * @param max_per_kind The most unused events of each kind to keep around.
+     * Events released past that are deleted.
+     */
+    explicit JdwpEventPool(size_t max_per_kind = 256);
+
+    // No copies
+    JdwpEventPool(const JdwpEventPool& copy) = delete;
+    JdwpEventPool& operator=(const JdwpEventPool& other) = delete;
+
+    // Not moveable, events hold a pointer to their pool.
+    JdwpEventPool(JdwpEventPool&& other) = delete;
+    JdwpEventPool& operator=(JdwpEventPool&& other) = delete;
+
+    /**
+     * Deletes every unused event held by \c this.
+     */
+    ~JdwpEventPool();
+
+    /**
+     * Returns an event of the given \c kind, reusing a released one if there
+     * is one. The fields of a reused event hold whatever they were last
+     * decoded to.
+     *
+     * @throws JdwpException if \c kind is not a known event kind.
+     */
+    Ptr Acquire(JdwpEventKind kind);
+
+    /**
+     * Returns the number of events \c this has had to allocate.
+     */
+    size_t GetAllocatedCount() const;
+  private:
+    class Impl;
+    std::unique_ptr<Impl> pImpl;
+};
+
 /**
  * Represents a single event within a JDWP Composite Event.
  */
@@ -1134,13 +1653,60 @@ class IJdwpEvent {
      * @throws JdwpException if \c encoded does not represent a JDWP composite
      * event packet or if the composite event packet is malformed.
      */
-    static vector<unique_ptr<IJdwpEvent>> FromComposite(const string& encoded,
-        IJdwpCon& con);
+    static vector<unique_ptr<IJdwpEvent>> FromComposite(
+        std::string_view encoded, IJdwpCon& con);
+    /**
+     * Parses a JDWP composite event into events recycled from \c pool.
+     *
+     * @param encoded The JDWP encoded composite event, including the JDWP
+     * header.
+     * @param con The JDWP connection \c encoded was recieved from.
+     * @param pool Provides the storage for each event.
+     * @param out Replaced with one event for each entry in \c encoded. Its
+     * storage is reused, so passing the same \c vector for each packet
+     * avoids allocating entirely once the pool is warm.
+     *
+     * @throws JdwpException if \c encoded does not represent a JDWP composite
+     * event packet or if the composite event packet is malformed. \c out is
+     * left empty.
+     */
+    static void FromComposite(std::string_view encoded, IJdwpCon& con,
+        JdwpEventPool& pool, vector<JdwpEventPool::Ptr>& out);
 
     /**
      * Returns the \c JdwpEventKind of this event.
      */
     JdwpEventKind GetKind() const;
+    /**
+     * Returns the ID of the event request that generated this event.
+     */
+    int32_t GetRequestId() const;
+    /**
+     * Sets the ID returned by \c GetRequestId. Done by connections that have
+     * had to set a request again under a new ID, so that handlers only ever
+     * see the one they were first given.
+     */
+    void SetRequestId(int32_t request_id);
+    /**
+     * Gets the ID of the thread this event happened on.
+     *
+     * @param thread_id Set to the \c threadID of the event, if it has one.
+     *
+     * @return \c false if this kind of event isn't tied to a thread (e.g.,
+     * \c VmDeath or \c ClassUnload).
+     */
+    bool GetThreadId(uint64_t& thread_id) const;
+    /**
+     * Returns what the VM suspended when it sent the composite event \c this
+     * was part of. Unless it's \c JdwpSuspendPolicy::kNone, the VM stays
+     * suspended until it's sent a resume command.
+     */
+    JdwpSuspendPolicy GetSuspendPolicy() const;
+    /**
+     * Sets the policy returned by \c GetSuspendPolicy. Done by
+     * \c FromComposite for each event it decodes.
+     */
+    void SetSuspendPolicy(JdwpSuspendPolicy suspend_policy);
     /**
      * Reads \c encoded as a single event, including the \c eventKind byte.
      *
@@ -1149,7 +1715,7 @@ class IJdwpEvent {
      * @throws JdwpException if the \c eventKind byte in \c encoded does not
      * match the kind expected by the run-time type of \c this.
      */
-    size_t FromEncoded(const string& encoded, IJdwpCon& con);
+    size_t FromEncoded(std::string_view encoded, IJdwpCon& con);
     /**
      * Dispatches \c this to the appropriate method of \c handler based on the
      * run-time type of \c this.
@@ -1159,20 +1725,37 @@ class IJdwpEvent {
     virtual ~IJdwpEvent() = 0;
   protected:
     virtual JdwpEventKind GetKindImpl() const = 0;
+    virtual int32_t GetRequestIdImpl() const = 0;
+    virtual void SetRequestIdImpl(int32_t request_id) = 0;
+    virtual bool GetThreadIdImpl(uint64_t& thread_id) const = 0;
     /**
      * Implements \c FromEncoded for a given JDWP event kind.
      *
      * @param encoded The JDWP encoded fields that are are specific to a given
      * event kind (i.e., the message body without the event kind byte).
      */
-    virtual size_t FromEncodedImpl(const string& encoded, IJdwpCon& con) = 0;
+    virtual size_t FromEncodedImpl(std::string_view encoded,
+        IJdwpCon& con) = 0;
     virtual void DispatchImpl(Handler& handler) = 0;
+  private:
+    JdwpSuspendPolicy suspend_policy = JdwpSuspendPolicy::kNone;
 };
 
 namespace impl {
 
 using std::tuple;
 
+/**
+ * Holds whether the \c Fields of an event have a \c threadID right after
+ * the \c requestID, as every event tied to a thread does.
+ */
+template<typename Fields>
+struct HasThreadField : std::false_type { };
+
+template<typename RequestId, typename... Rest>
+struct HasThreadField<tuple<RequestId, JdwpThreadId, Rest...>> :
+  std::true_type { };
+
 /**
  * Provides a base for types representing JDWP event packets.
  *
@@ -1183,23 +1766,51 @@ using std::tuple;
 template<typename Derived, uint8_t kind, typename Fields>
 class EventBase : public IJdwpEvent {
   public:
+    static constexpr JdwpEventKind kKind = static_cast<JdwpEventKind>(kind);
+
     Fields& GetFields() { return this->fields; }
     const Fields& GetFields() const { return this->fields; }
+
+    /**
+     * Reads the fields of \c this from \c encoded, which starts right after
+     * the \c eventKind byte. Does what \c FromEncoded does, less checking the
+     * kind, without any virtual calls.
+     *
+     * @return The number of bytes read.
+     */
+    size_t DecodeFields(std::string_view encoded, IJdwpCon& con) {
+      size_t curr_idx = 0;
+      TupleForEach(this->fields, [&encoded, &con, &curr_idx](auto& f){
+        curr_idx += DecodeField(f, encoded.substr(curr_idx), con);
+      });
+      return curr_idx;
+    }
   protected:
     JdwpEventKind GetKindImpl() const override {
       return static_cast<JdwpEventKind>(kind);
     }
+    int32_t GetRequestIdImpl() const override {
+      return std::get<0>(this->fields).GetValue();
+    }
+    void SetRequestIdImpl(int32_t request_id) override {
+      std::get<0>(this->fields) << request_id;
+    }
+    bool GetThreadIdImpl(uint64_t& thread_id) const override {
+      if constexpr (HasThreadField<Fields>::value) {
+        thread_id = std::get<1>(this->fields).GetValue();
+        return true;
+      } else {
+        static_cast<void>(thread_id);
+        return false;
+      }
+    }
     /**
      * Provides a default implementation of \c FromEncoded. This will only
      * handle \c Fields that are just a tuple of simple \c IJdwpField, \c vector
      * fields won't work.
      */
-    size_t FromEncodedImpl(const string& encoded, IJdwpCon& con) override {
-      size_t curr_idx = 0;
-      TupleForEach(this->fields, [&encoded, &con, &curr_idx](auto& f){
-        curr_idx += f.FromEncoded(encoded.substr(curr_idx), con);
-      });
-      return curr_idx;
+    size_t FromEncodedImpl(std::string_view encoded, IJdwpCon& con) override {
+      return this->DecodeFields(encoded, con);
     }
     void DispatchImpl(Handler& handler) override;
   private:
@@ -1234,6 +1845,11 @@ class GenericHandler<Interface, tuple<NextMsgType, MsgRest...>> :
 template<typename Interface>
 class GenericHandler<Interface, tuple<>> {
   public:
+    /**
+     * Handlers are owned, and destroyed, through pointers to their base.
+     */
+    virtual ~GenericHandler() = default;
+
     /**
      * Provides a default implementation of the generic message handler. By
      * default, simply ignores the message.
@@ -1418,6 +2034,163 @@ void impl::EventBase<Derived, kind, Fields>::DispatchImpl(Handler& handler) {
   handler.Handle(static_cast<Derived&>(*this));
 }
 
+namespace impl {
+
+/**
+ * Builds a table indexed by \c JdwpEventKind, holding \c make(TypeTag<E>())
+ * for each event type \c E in the tuple \c Events, and a value-initialized
+ * \c Entry for every other kind. Can be used in constant expressions.
+ */
+template<typename Entry, typename Events, typename Make>
+constexpr std::array<Entry, 256> MakeEventTable(Make&& make) {
+  std::array<Entry, 256> table{};
+  TupleTypeForEach<Events>([&table, &make](auto tag) {
+    using Event = typename decltype(tag)::type;
+    table[static_cast<uint8_t>(Event::kKind)] = make(tag);
+  });
+  return table;
+}
+
+/**
+ * Returns the number of entries in \c table that aren't value-initialized.
+ * Used to check that no two event types in a table share a kind.
+ */
+template<typename Entry>
+constexpr size_t CountEventTableEntries(const std::array<Entry, 256>& table) {
+  size_t res = 0;
+  for (const Entry& entry : table) {
+    if (entry != Entry()) res++;
+  }
+  return res;
+}
+
+/**
+ * Reads the header of a composite event, up to its first event.
+ *
+ * @param policy Set to the suspend policy of the composite event.
+ * @param event_cnt Set to the number of events in the composite event.
+ *
+ * @return The index of the first event in \c encoded.
+ *
+ * @throws JdwpException if \c encoded isn't an event packet, or is too short
+ * to hold the header.
+ */
+size_t DecodeCompositeHeader(std::string_view encoded, IJdwpCon& con,
+    JdwpSuspendPolicy& policy, int32_t& event_cnt);
+
+}  // namespace impl
+
+/**
+ * Decodes composite events straight into \c visitor, a functor with an
+ * overload for each event type it handles, e.g.
+ * \code
+ *   struct {
+ *     void operator()(events::Breakpoint& ev) { ... }
+ *     void operator()(events::ThreadStart& ev) { ... }
+ *   }
+ * \endcode
+ * Each event is decoded into storage of its concrete type, kept and reused
+ * by \c this, and handed to the matching overload directly, so decoding and
+ * handling it can be inlined together: there's no allocation, and no virtual
+ * call, per event. Events \c visitor has no overload for are decoded and
+ * skipped. Each event is only valid until the visitor returns.
+ *
+ * Unlike a \c Handler, this is fed the raw packets by whoever reads them;
+ * \c IJdwpCon::RegisterStaticHandler has a connection feed it its own.
+ *
+ * @tparam Events The \c tuple of event types the VM may send. Decoding a
+ * kind not in it fails, as its length can't be known.
+ */
+template<typename Visitor, typename Events = events::AllEvents>
+class StaticEventDecoder {
+  public:
+    explicit StaticEventDecoder(Visitor visitor) :
+      visitor(std::move(visitor)) { }
+
+    // No copies, the visitor may hold references to the scratch events.
+    StaticEventDecoder(const StaticEventDecoder& copy) = delete;
+    StaticEventDecoder& operator=(const StaticEventDecoder& other) = delete;
+
+    Visitor& GetVisitor() { return this->visitor; }
+
+    /**
+     * Decodes the JDWP composite event \c encoded, including its header,
+     * visiting each event as soon as it's been decoded.
+     *
+     * @throws JdwpException if \c encoded does not represent a JDWP
+     * composite event packet, if it's malformed, or if it holds an event kind
+     * not in \c Events. The events before the bad one have been visited.
+     */
+    void Decode(std::string_view encoded, IJdwpCon& con) {
+      static constexpr std::array<Entry, 256> table =
+        impl::MakeEventTable<Entry, Events>([](auto tag) {
+          return &StaticEventDecoder::DecodeOne<typename decltype(tag)::type>;
+        });
+      static_assert(impl::CountEventTableEntries(table) ==
+          std::tuple_size<Events>::value, "Two event types share a kind");
+
+      JdwpSuspendPolicy policy;
+      int32_t event_cnt;
+      size_t idx = impl::DecodeCompositeHeader(encoded, con, policy,
+          event_cnt);
+      for (int32_t i = 0; i < event_cnt; i++) {
+        if (idx >= encoded.size()) {
+          throw JdwpException("Composite event ended early");
+        }
+        Entry decode = table[static_cast<uint8_t>(encoded[idx])];
+        if (decode == nullptr) {
+          throw JdwpException("Illegal eventKind in composite event");
+        }
+        idx += 1 + decode(*this, encoded.substr(idx + 1), con, policy);
+      }
+    }
+  private:
+    using Entry = size_t (*)(StaticEventDecoder& decoder,
+        std::string_view encoded, IJdwpCon& con, JdwpSuspendPolicy policy);
+
+    /**
+     * Decodes an \c Event from \c encoded, which starts right after its
+     * \c eventKind byte, and visits it if \c visitor takes one.
+     *
+     * @return The number of bytes read.
+     */
+    template<typename Event>
+    static size_t DecodeOne(StaticEventDecoder& decoder,
+        std::string_view encoded, IJdwpCon& con, JdwpSuspendPolicy policy) {
+      Event& event = std::get<Event>(decoder.scratch);
+      size_t len = event.DecodeFields(encoded, con);
+      event.SetSuspendPolicy(policy);
+      if constexpr (std::is_invocable_v<Visitor&, Event&>) {
+        decoder.visitor(event);
+      }
+      return len;
+    }
+
+    Visitor visitor;
+    Events scratch;
+};
+
+template<typename Visitor, typename Events>
+void IJdwpCon::RegisterStaticHandler(Visitor visitor) {
+  // The decoder can't be copied, and JdwpPacketHandler must be
+  auto decoder = std::make_shared<StaticEventDecoder<Visitor, Events>>(
+      std::move(visitor));
+  this->RegisterPacketHandler(
+      [decoder](std::string_view packet, IJdwpCon& con) {
+        try {
+          decoder->Decode(packet, con);
+        } catch (const JdwpException& e) {
+          // The connection already decoded the whole packet, so all that can
+          // fail is an event missing from Events.
+        }
+      });
+}
+
+template<typename Visitor>
+void IJdwpCon::RegisterStaticHandler(Visitor visitor) {
+  this->RegisterStaticHandler<Visitor, events::AllEvents>(std::move(visitor));
+}
+
 }  // namespace roastery
 
 #endif  // ROASTERY_JDWP_PACKET_H_
@@ -0,0 +1,199 @@
+/* Provides a bounded, lock-free queue for handing work to a single consumer
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_QUEUE_H_
+#define ROASTERY_JDWP_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+namespace roastery {
+
+namespace impl {
+
+/**
+ * A fixed-capacity queue that any number of threads can push to, and a single
+ * thread pops from, without taking any locks. Based on Dmitry Vyukov's bounded
+ * queue: each slot carries a sequence number saying whether it is free to
+ * write or ready to read, so producers only contend on a single
+ * compare-and-swap and never wait on each other.
+ *
+ * Values are assigned into and swapped out of preallocated slots, so a \c T
+ * that owns storage (e.g., a \c std::string) keeps reusing it rather than
+ * allocating for every element.
+ */
+template<typename T>
+class BoundedMpscQueue {
+  public:
+    /**
+     * Creates an empty queue holding up to \c capacity elements, rounded up
+     * to a power of two.
+     *
+     * @throws std::invalid_argument if \c capacity is zero.
+     */
+    explicit BoundedMpscQueue(size_t capacity) :
+        capacity(RoundUpCapacity(capacity)), mask(this->capacity - 1),
+        cells(new Cell[this->capacity]), enqueue_pos(0), dequeue_pos(0),
+        high_water_mark(0) {
+      for (size_t i = 0; i < this->capacity; i++) {
+        this->cells[i].sequence.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    // No copies/default constructor
+    BoundedMpscQueue() = delete;
+    BoundedMpscQueue(const BoundedMpscQueue& copy) = delete;
+    BoundedMpscQueue& operator=(const BoundedMpscQueue& other) = delete;
+
+    // Not moveable
+    BoundedMpscQueue(BoundedMpscQueue&& other) = delete;
+    BoundedMpscQueue& operator=(BoundedMpscQueue&& other) = delete;
+
+    /**
+     * Assigns \c value to the back of the queue, if there is room. Safe to
+     * call from any number of threads at once. \c value is left untouched if
+     * the queue is full.
+     *
+     * @return Whether \c value was queued.
+     */
+    template<typename U>
+    bool TryPush(U&& value) {
+      Cell* cell;
+      size_t pos = this->enqueue_pos.load(std::memory_order_relaxed);
+      while (true) {
+        cell = &this->cells[pos & this->mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) -
+            static_cast<intptr_t>(pos);
+        if (diff == 0) {
+          // The slot is free, try to claim it
+          if (this->enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                std::memory_order_relaxed)) {
+            break;
+          }
+        } else if (diff < 0) {
+          // The slot still holds an element from a lap ago, we're full
+          return false;
+        } else {
+          // Another producer claimed the slot first
+          pos = this->enqueue_pos.load(std::memory_order_relaxed);
+        }
+      }
+
+      cell->value = std::forward<U>(value);
+      cell->sequence.store(pos + 1, std::memory_order_release);
+      this->RecordDepth(pos + 1);
+      return true;
+    }
+
+    /**
+     * Swaps the element at the front of the queue into \c out, if there is
+     * one. Must only be called from one thread at a time.
+     *
+     * @return Whether an element was popped.
+     */
+    bool TryPop(T& out) {
+      size_t pos = this->dequeue_pos.load(std::memory_order_relaxed);
+      Cell* cell = &this->cells[pos & this->mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1) < 0) {
+        return false;
+      }
+
+      using std::swap;
+      swap(out, cell->value);
+      this->dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+      // Hand the slot back to producers for the next lap
+      cell->sequence.store(pos + this->capacity, std::memory_order_release);
+      return true;
+    }
+
+    /**
+     * Returns the number of elements in the queue. Only approximate while
+     * other threads are pushing or popping.
+     */
+    size_t Size() const {
+      size_t tail = this->dequeue_pos.load(std::memory_order_relaxed);
+      size_t head = this->enqueue_pos.load(std::memory_order_relaxed);
+      return head > tail ? head - tail : 0;
+    }
+
+    /**
+     * Returns whether the queue appears to be empty.
+     */
+    bool Empty() const { return this->Size() == 0; }
+
+    /**
+     * Returns the most elements the queue can hold.
+     */
+    size_t Capacity() const { return this->capacity; }
+
+    /**
+     * Returns the most elements the queue has held at once.
+     */
+    size_t HighWaterMark() const {
+      return this->high_water_mark.load(std::memory_order_relaxed);
+    }
+  private:
+    struct Cell {
+      std::atomic<size_t> sequence;
+      T value;
+    };
+
+    static size_t RoundUpCapacity(size_t capacity) {
+      if (capacity == 0) {
+        throw std::invalid_argument("Queue capacity must be positive");
+      }
+      size_t res = 2;
+      while (res < capacity) res <<= 1;
+      return res;
+    }
+
+    /**
+     * Raises \c high_water_mark to the depth of the queue after the element at
+     * \c pos - 1 was pushed.
+     */
+    void RecordDepth(size_t pos) {
+      size_t tail = this->dequeue_pos.load(std::memory_order_relaxed);
+      size_t depth = pos > tail ? pos - tail : 0;
+      size_t seen = this->high_water_mark.load(std::memory_order_relaxed);
+      while (depth > seen && !this->high_water_mark.compare_exchange_weak(
+            seen, depth, std::memory_order_relaxed)) { }
+    }
+
+    const size_t capacity;
+    const size_t mask;
+    std::unique_ptr<Cell[]> cells;
+
+    // Producers and the consumer each hammer on their own position, so keep
+    // them on separate cache lines.
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) std::atomic<size_t> dequeue_pos;
+    alignas(64) std::atomic<size_t> high_water_mark;
+};
+
+}  // namespace impl
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_QUEUE_H_
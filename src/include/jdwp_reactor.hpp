@@ -0,0 +1,111 @@
+/* Provides an event loop for driving JDWP connections
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_REACTOR_H_
+#define ROASTERY_JDWP_REACTOR_H_
+
+#include <functional>
+#include <memory>
+
+namespace roastery {
+
+/**
+ * An event loop running on a single dedicated thread. File descriptors can be
+ * watched for readability, and for writability once, and arbitrary tasks can
+ * be posted to run on the loop's thread. The thread sleeps in \c epoll_wait
+ * when there is nothing to do, and is woken through an \c eventfd when a task
+ * is posted.
+ *
+ * Callbacks and tasks all run on the reactor's thread, so they should not
+ * block for long periods of time, and must not throw.
+ */
+class JdwpReactor {
+  public:
+    /**
+     * A function run on the reactor's thread.
+     */
+    using Callback = std::function<void()>;
+
+    /**
+     * Creates a \c JdwpReactor and starts its thread.
+     *
+     * @throws std::system_error if the underlying \c epoll or \c eventfd
+     * instances cannot be created.
+     */
+    JdwpReactor();
+
+    // No copies
+    JdwpReactor(const JdwpReactor& copy) = delete;
+    JdwpReactor& operator=(const JdwpReactor& other) = delete;
+
+    // Not moveable, the reactor's thread holds a pointer to its state.
+    JdwpReactor(JdwpReactor&& other) = delete;
+    JdwpReactor& operator=(JdwpReactor&& other) = delete;
+
+    /**
+     * Stops the reactor's thread, running any tasks that are still pending.
+     */
+    ~JdwpReactor();
+
+    /**
+     * Invokes \c on_readable on the reactor's thread every time \c fd has data
+     * available to be read, or has hung up. \c fd must stay open until it has
+     * been passed to \c Unwatch.
+     *
+     * If the reactor can no longer wait on file descriptors at all, every one
+     * is dropped and its \c on_failed, if any, invoked once on the reactor's
+     * thread instead. Tasks are still run after that.
+     *
+     * @throws std::system_error if \c fd cannot be added to the \c epoll
+     * instance, or the reactor can no longer wait on file descriptors.
+     */
+    void Watch(int fd, Callback on_readable, Callback on_failed = nullptr);
+    /**
+     * Invokes \c on_writable once on the reactor's thread, the next time
+     * \c fd, which must be watched, can be written to or has hung up. Replaces
+     * any \c on_writable still waiting for \c fd, and is dropped without
+     * being invoked if \c fd is unwatched first. Has no effect if \c fd isn't
+     * being watched.
+     *
+     * @throws std::system_error if the \c epoll instance cannot be updated.
+     */
+    void WatchWritable(int fd, Callback on_writable);
+    /**
+     * Stops watching \c fd. Once this returns, the callback registered for
+     * \c fd is not running and will not be invoked again. Unwatching a file
+     * descriptor that isn't being watched has no effect.
+     */
+    void Unwatch(int fd);
+    /**
+     * Queues \c task to be run on the reactor's thread, waking the reactor if
+     * it is sleeping. Tasks are run in the order they are posted.
+     */
+    void Post(Callback task);
+    /**
+     * Returns whether or not the caller is running on the reactor's thread.
+     */
+    bool InReactorThread() const;
+  private:
+    class Impl;
+    std::unique_ptr<Impl> pImpl;
+};
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_REACTOR_H_
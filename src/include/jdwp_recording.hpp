@@ -0,0 +1,240 @@
+/* Provides recording and replay of the packets recieved from a JDWP server
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_RECORDING_H_
+#define ROASTERY_JDWP_RECORDING_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "jdwp_con.hpp"
+
+namespace roastery {
+
+/**
+ * Appends every packet handed to it to a recording file, along with the time
+ * it was recieved. Attach one to a connection with \c JdwpCon::Record.
+ *
+ * A recording starts with a 16 byte header: the magic \c "RSTREC", a two byte
+ * format version, then the field, method, object and frame ID sizes of the
+ * VM, one byte each, then four reserved bytes. Each record that follows is the
+ * time the packet was recieved, as an eight byte count of nanoseconds since
+ * the Unix epoch, then the packet itself, starting with its JDWP header (and
+ * so its length). Like JDWP, every number is big-endian. Records aren't
+ * padded, so a mapped recording must be read without assuming alignment.
+ *
+ * Safe to use from multiple threads, e.g. when shared by connections on
+ * different I/O threads of a \c JdwpConPool.
+ */
+class JdwpRecorder {
+  public:
+    /**
+     * Creates a new recording at \c path, replacing any file already there,
+     * for packets recieved from the VM on \c con.
+     *
+     * @throws std::system_error if the file can't be created or written to.
+     */
+    JdwpRecorder(const string& path, IJdwpCon& con);
+
+    // No copies/default constructor
+    JdwpRecorder() = delete;
+    JdwpRecorder(const JdwpRecorder& copy) = delete;
+    JdwpRecorder& operator=(const JdwpRecorder& other) = delete;
+
+    // Moveable
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpRecorder(JdwpRecorder&& other) noexcept;
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpRecorder& operator=(JdwpRecorder&& other) noexcept;
+
+    /**
+     * Writes out any buffered records and closes the file.
+     */
+    ~JdwpRecorder();
+
+    /**
+     * Records \c packet, which includes its JDWP header, as recieved now.
+     * Records are buffered, and written out in batches. Never throws, so it
+     * can be called from a connection's I/O thread; if writing fails, every
+     * later record is dropped, and \c Flush reports the error.
+     */
+    void Append(std::string_view packet);
+    /**
+     * Writes out any buffered records.
+     *
+     * @throws std::system_error if writing any record has failed.
+     */
+    void Flush();
+
+    /**
+     * Returns the number of packets recorded so far.
+     */
+    uint64_t GetRecordCount() const;
+  private:
+    class Impl;
+    unique_ptr<Impl> pImpl;
+};
+
+/**
+ * A single packet in a recording.
+ */
+struct JdwpRecord {
+  /**
+   * When the packet was recieved, in nanoseconds since the Unix epoch.
+   */
+  uint64_t timestamp_ns;
+  /**
+   * The packet, including its JDWP header. Only valid while the
+   * \c JdwpRecording it came from is.
+   */
+  std::string_view packet;
+};
+
+/**
+ * A recording made by a \c JdwpRecorder, mapped into memory so its records
+ * can be read without copying them.
+ */
+class JdwpRecording {
+  public:
+    /**
+     * Maps the recording at \c path.
+     *
+     * @throws std::system_error if the file can't be opened or mapped.
+     * @throws JdwpException if the file isn't a recording.
+     */
+    explicit JdwpRecording(const string& path);
+
+    // No copies/default constructor
+    JdwpRecording() = delete;
+    JdwpRecording(const JdwpRecording& copy) = delete;
+    JdwpRecording& operator=(const JdwpRecording& other) = delete;
+
+    // Moveable
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpRecording(JdwpRecording&& other) noexcept;
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpRecording& operator=(JdwpRecording&& other) noexcept;
+
+    /**
+     * Unmaps the recording.
+     */
+    ~JdwpRecording();
+
+    /**
+     * Reads the next record into \c out.
+     *
+     * @return \c false once there are no more records. A record cut short, as
+     * left by a recorder that didn't close cleanly, counts as the end.
+     */
+    bool Next(JdwpRecord& out);
+    /**
+     * Goes back to the first record.
+     */
+    void Rewind();
+
+    // ID sizes of the recorded VM
+    uint8_t GetFieldIdSize() const;
+    uint8_t GetMethodIdSize() const;
+    uint8_t GetObjIdSize() const;
+    uint8_t GetFrameIdSize() const;
+  private:
+    class Impl;
+    unique_ptr<Impl> pImpl;
+};
+
+/**
+ * A connection that plays a recording back, rather than talking to a VM. The
+ * events in it are decoded and handed to registered handlers as fast as they
+ * can take them, so handlers can be benchmarked, or an incident reproduced,
+ * without a live VM. Replies in the recording are skipped.
+ *
+ * Nothing can be sent; every message sent is failed with a \c JdwpException.
+ */
+class JdwpReplayCon : public IJdwpCon {
+  public:
+    /**
+     * Opens the recording at \c path to be replayed.
+     *
+     * @throws std::system_error if the file can't be opened or mapped.
+     * @throws JdwpException if the file isn't a recording.
+     */
+    explicit JdwpReplayCon(const string& path);
+
+    // No copies/default constructor
+    JdwpReplayCon() = delete;
+    JdwpReplayCon(const JdwpReplayCon& copy) = delete;
+    JdwpReplayCon& operator=(const JdwpReplayCon& other) = delete;
+
+    // Moveable
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpReplayCon(JdwpReplayCon&& other) noexcept;
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpReplayCon& operator=(JdwpReplayCon&& other) noexcept;
+
+    ~JdwpReplayCon() override;
+
+    /**
+     * Hands every event in the recording to the registered handlers, from the
+     * start of the recording. \c JdwpDispatchMode::kInline and
+     * \c JdwpDispatchMode::kFastResume handlers, and packet handlers, are
+     * called on the calling thread, and the events for
+     * \c JdwpDispatchMode::kPooled handlers have all been handled by the
+     * time this returns. Malformed event packets are
+     * skipped, as they would be by a \c JdwpCon.
+     *
+     * @return The number of events replayed.
+     */
+    size_t Replay();
+  protected:
+    uint8_t GetObjIdSizeImpl() override;
+    uint8_t GetMethodIdSizeImpl() override;
+    uint8_t GetFieldIdSizeImpl() override;
+    uint8_t GetFrameIdSizeImpl() override;
+
+    void RegisterEventHandlerImpl(unique_ptr<Handler> handler,
+        JdwpDispatchMode mode) override;
+    void RegisterPacketHandlerImpl(JdwpPacketHandler handler) override;
+
+    /**
+     * Fails \c on_reply, since there's no VM to send \c message to.
+     */
+    void SendMessageImpl(unique_ptr<IJdwpCommandPacket> message,
+        unique_ptr<ReplyHandler> on_reply) override;
+  private:
+    class Impl;
+    unique_ptr<Impl> pImpl;
+};
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_RECORDING_H_
@@ -0,0 +1,122 @@
+/* Provides a wall-clock sampling profiler built on JDWP
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_SAMPLER_H_
+#define ROASTERY_JDWP_SAMPLER_H_
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+
+#include "jdwp_con.hpp"
+#include "jdwp_metadata_cache.hpp"
+
+namespace roastery {
+
+/**
+ * Tunes how a \c JdwpSampler samples threads.
+ */
+struct JdwpSamplerOptions {
+  /**
+   * The most frames recorded per thread, counting from the top of the stack.
+   */
+  int32_t max_depth = 64;
+  /**
+   * Tries to read each thread's frames without suspending it first. VMs that
+   * require suspension reject that, in which case the thread is suspended for
+   * every later sample.
+   */
+  bool suspend_free = false;
+  /**
+   * Includes the line number of each frame, from its method's line table.
+   */
+  bool resolve_lines = true;
+};
+
+/**
+ * Samples the stacks of every thread in the VM, and aggregates them into
+ * folded stacks (one line per distinct stack, as used by flame graph tools).
+ *
+ * Each sample lists the VM's threads, then sends every command for every
+ * thread (suspending it, reading its frames, resuming it and, for threads not
+ * seen before, fetching its name) at once, so a sample takes two round trips
+ * however many threads there are. Stacks are recorded as raw locations, and
+ * only resolved to class, method and line names, through a
+ * \c JdwpMetadataCache, when they're written out.
+ *
+ * Must only be used from one thread at a time, and never from the
+ * connection's I/O thread.
+ */
+class JdwpSampler {
+  public:
+    /**
+     * Creates a sampler for the VM on \c con, resolving names through
+     * \c cache. Both must outlive \c this.
+     */
+    JdwpSampler(IJdwpCon& con, JdwpMetadataCache& cache,
+        const JdwpSamplerOptions& options = JdwpSamplerOptions());
+
+    // No copies/default constructor
+    JdwpSampler() = delete;
+    JdwpSampler(const JdwpSampler& copy) = delete;
+    JdwpSampler& operator=(const JdwpSampler& other) = delete;
+
+    // Moveable
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpSampler(JdwpSampler&& other) noexcept;
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpSampler& operator=(JdwpSampler&& other) noexcept;
+
+    ~JdwpSampler();
+
+    /**
+     * Takes a single sample of every thread. Threads that die before they're
+     * sampled are left out.
+     *
+     * @return The number of threads sampled.
+     *
+     * @throws JdwpException if the VM's threads can't be listed, e.g. because
+     * the connection closed.
+     */
+    size_t Sample();
+
+    /**
+     * Writes every stack sampled so far to \c out as folded stacks: one line
+     * per distinct stack, of the thread name and each frame from the bottom
+     * of the stack up, separated by \c ;, then a space and the number of
+     * times it was sampled.
+     */
+    void WriteFolded(std::ostream& out);
+
+    /**
+     * Returns the number of samples taken so far.
+     */
+    uint64_t GetSampleCount() const;
+  private:
+    class Impl;
+    unique_ptr<Impl> pImpl;
+};
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_SAMPLER_H_
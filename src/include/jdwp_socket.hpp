@@ -22,6 +22,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include "jdwp_stats.hpp"
 
 namespace roastery {
 
@@ -80,7 +84,50 @@ class JdwpSocket {
      * other than a closed connection.
      * @throws std::logic_error if this socket is not currently connected.
      */
-    void Write(const std::string& data);
+    void Write(std::string_view data);
+    /**
+     * Writes each of \c segments, in order, to the connected server. Many
+     * segments are handed to the kernel with a single \c sendmsg, so this
+     * takes far fewer syscalls than writing them one at a time.
+     *
+     * @param segments The data to write.
+     *
+     * @throws roastery::JdwpException if the connection is closed.
+     * @throws std::system_error if there is an error writing to the server,
+     * other than a closed connection.
+     * @throws std::logic_error if this socket is not currently connected.
+     */
+    void Write(const std::vector<std::string_view>& segments);
+    /**
+     * Writes as much of \c segments, in order, as the socket will take without
+     * blocking. Like \c Write, many segments are handed to the kernel at once.
+     *
+     * @param segments The data to write.
+     *
+     * @return The number of bytes written, which may end part of the way
+     * through a segment, and is zero if the socket wouldn't take any.
+     *
+     * @throws roastery::JdwpException if the connection is closed.
+     * @throws std::system_error if there is an error writing to the server,
+     * other than a closed connection.
+     * @throws std::logic_error if this socket is not currently connected.
+     */
+    size_t TryWrite(const std::vector<std::string_view>& segments);
+    /**
+     * Enables or disables \c TCP_NODELAY. When enabled, small writes are sent
+     * immediately rather than held back by Nagle's algorithm.
+     *
+     * @throws std::system_error if the option cannot be set.
+     */
+    void SetNoDelay(bool enabled);
+    /**
+     * Enables or disables \c TCP_CORK. While corked, only full-sized segments
+     * are sent; uncorking sends whatever is left. Does nothing on platforms
+     * without \c TCP_CORK.
+     *
+     * @throws std::system_error if the option cannot be set.
+     */
+    void SetCork(bool enabled);
     /**
      * Returns whether or not there is data available to be read on this socket.
      *
@@ -90,7 +137,8 @@ class JdwpSocket {
      */
     bool CanRead();
     /**
-     * Reads \c len bytes from the server and returns it as a string.
+     * Reads \c len bytes from the server and returns it as a string. Any bytes
+     * already read ahead by \c ReadAvailable are returned first.
      *
      * @returns The data read.
      *
@@ -99,6 +147,80 @@ class JdwpSocket {
      * @throws std::logic_error if the socket is not currently connected.
      */
     std::string Read(size_t len);
+    /**
+     * Reads whatever data the server has already sent, without blocking, into
+     * an internal read-ahead buffer. A single call may pull in several
+     * packets, which can then be taken with \c NextPacket.
+     *
+     * Invalidates any view previously returned by \c NextPacket.
+     *
+     * @return The number of bytes read, which is zero if no data was
+     * available.
+     *
+     * @throws roastery::JdwpException if the connection is closed.
+     * @throws std::system_error if there is an error reading from the socket.
+     * @throws std::logic_error if the socket is not currently connected.
+     */
+    size_t ReadAvailable();
+    /**
+     * Takes the next complete JDWP packet from the read-ahead buffer, if there
+     * is one. Never reads from the socket itself.
+     *
+     * @param packet Set to a view of the packet, including its header. The
+     * view is only valid until the next call to \c ReadAvailable or \c Read.
+     *
+     * @return \c true if a packet was available.
+     *
+     * @throws roastery::JdwpException if the buffered data doesn't start with
+     * a valid JDWP header.
+     */
+    bool NextPacket(std::string_view& packet);
+    /**
+     * Returns the header of the next packet in the read-ahead buffer, if all
+     * of it has been recieved, even if the rest of the packet hasn't been.
+     * Never reads from the socket itself.
+     *
+     * @param header Set to a view of the header. The view is only valid
+     * until the next call to \c ReadAvailable, \c Read, \c NextPacket or
+     * \c NextPacketPart.
+     *
+     * @return \c false if the header hasn't all been recieved, or if part of
+     * the packet has already been taken with \c NextPacketPart.
+     */
+    bool PeekHeader(std::string_view& header);
+    /**
+     * Takes whatever of the next packet is in the read-ahead buffer, even if
+     * the rest of it hasn't been recieved yet, so that a large packet can be
+     * handled as it arrives rather than held whole. Never reads from the
+     * socket itself. Once part of a packet has been taken, the rest of it
+     * must be taken this way too: \c NextPacket returns \c false until it
+     * has been.
+     *
+     * @param part Set to a view of the next bytes of the packet. The first
+     * part of a packet starts with its header. The view is only valid until
+     * the next call to \c ReadAvailable or \c Read.
+     * @param remaining Set to the number of bytes of the packet still to come
+     * after \c part.
+     *
+     * @return \c true if part of a packet was available. The first part
+     * isn't until all of the header has been recieved.
+     *
+     * @throws roastery::JdwpException if the buffered data doesn't start with
+     * a valid JDWP header.
+     */
+    bool NextPacketPart(std::string_view& part, size_t& remaining);
+    /**
+     * Returns the file descriptor of the underlying socket, so that it can be
+     * watched for readability (e.g., by a \c JdwpReactor). The descriptor is
+     * non-blocking, and stays valid for the lifetime of \c this, even once
+     * the connection has been closed.
+     */
+    int GetFd() const;
+    /**
+     * Returns how much has been written to and read from the socket so far,
+     * including the handshake.
+     */
+    JdwpSocketStats GetStats() const;
   private:
     class Impl;
     std::unique_ptr<Impl> pImpl;
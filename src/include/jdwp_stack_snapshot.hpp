@@ -0,0 +1,164 @@
+/* Provides snapshots of every thread's stack and locals, taken in one pass
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_STACK_SNAPSHOT_H_
+#define ROASTERY_JDWP_STACK_SNAPSHOT_H_
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_metadata_cache.hpp"
+#include "jdwp_type.hpp"
+
+namespace roastery {
+
+/**
+ * A local variable live in a frame, and its value when the snapshot was
+ * taken.
+ */
+struct JdwpLocalSnapshot {
+  string name;
+  /**
+   * The JNI signature of the variable's type, e.g. \c I or
+   * \c Ljava/lang/String;
+   */
+  string signature;
+  JdwpValue value;
+};
+
+/**
+ * A single frame of a thread's stack.
+ */
+struct JdwpFrameSnapshot {
+  uint64_t frame_id;
+  JdwpLocation location;
+  /**
+   * The locals live at \c location, in slot order. Empty if locals weren't
+   * asked for, or the method has no variable information (e.g. it's native,
+   * or its class was compiled without \c -g).
+   */
+  std::vector<JdwpLocalSnapshot> locals;
+};
+
+/**
+ * A thread, and its stack from the top down.
+ */
+struct JdwpThreadSnapshot {
+  uint64_t thread;
+  string name;
+  std::vector<JdwpFrameSnapshot> frames;
+  /**
+   * Why the thread's frames couldn't be read, e.g. because it died, or
+   * \c JdwpError::kNone.
+   */
+  JdwpError error;
+  /**
+   * How long the thread was kept suspended, from sending the
+   * command suspending it to sending the one resuming it.
+   */
+  std::chrono::nanoseconds suspended;
+};
+
+/**
+ * Tunes how a \c JdwpStackSnapshotter takes snapshots.
+ */
+struct JdwpStackSnapshotOptions {
+  /**
+   * The most frames read per thread, counting from the top of the stack, or
+   * -1 for all of them.
+   */
+  int32_t max_depth = -1;
+  /**
+   * Reads the live locals of each frame.
+   */
+  bool include_locals = true;
+  /**
+   * Suspends the whole VM for the snapshot, so that every thread is seen at
+   * the same instant. Otherwise each thread is only suspended while its own
+   * stack is read, which keeps every thread running for longer.
+   */
+  bool suspend_all = false;
+};
+
+/**
+ * Takes snapshots of every thread's stack, and optionally the locals of each
+ * frame, like a thread dump.
+ *
+ * Naively, that's a chain of dependent round trips per thread: listing the
+ * threads, then the frames of each, then the variable table of each
+ * method, then the values of each frame. Instead, every command at one
+ * step is sent for every thread at once, and each thread moves on as soon as
+ * what it depends on is in: a thread whose methods' variable tables are all
+ * cached (through a \c JdwpMetadataCache, so they're kept across
+ * snapshots) has its locals requested, and is resumed, as soon as its
+ * frames arrive, without waiting on any other thread's tables. The VM
+ * handles commands in order, so each thread is resumed right after the last
+ * command that needs it suspended is sent, rather than once its replies are
+ * in. A snapshot of any number of threads takes two to four round trips.
+ *
+ * Must only be used from one thread at a time, and never from the
+ * connection's I/O thread.
+ */
+class JdwpStackSnapshotter {
+  public:
+    /**
+     * Creates a snapshotter for the VM on \c con, finding locals through
+     * \c cache. Both must outlive \c this.
+     */
+    JdwpStackSnapshotter(IJdwpCon& con, JdwpMetadataCache& cache,
+        const JdwpStackSnapshotOptions& options = JdwpStackSnapshotOptions());
+
+    // No copies/default constructor
+    JdwpStackSnapshotter() = delete;
+    JdwpStackSnapshotter(const JdwpStackSnapshotter& copy) = delete;
+    JdwpStackSnapshotter& operator=(const JdwpStackSnapshotter& other) =
+      delete;
+
+    // Moveable
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpStackSnapshotter(JdwpStackSnapshotter&& other) noexcept;
+    /**
+     * Move \c other to \c this.
+     */
+    JdwpStackSnapshotter& operator=(JdwpStackSnapshotter&& other) noexcept;
+
+    ~JdwpStackSnapshotter();
+
+    /**
+     * Takes a snapshot of every thread in the VM. Every thread suspended for
+     * it has been resumed by the time it returns.
+     *
+     * @throws JdwpException if the VM's threads can't be listed, or the
+     * connection fails.
+     */
+    std::vector<JdwpThreadSnapshot> Take();
+  private:
+    class Impl;
+    unique_ptr<Impl> pImpl;
+};
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_STACK_SNAPSHOT_H_
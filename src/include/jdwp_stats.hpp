@@ -0,0 +1,118 @@
+/* Provides the counters JDWP connections report about themselves
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_JDWP_STATS_H_
+#define ROASTERY_JDWP_STATS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace roastery {
+
+/**
+ * A histogram of durations, e.g. round trip latencies.
+ */
+struct JdwpDurationHistogram {
+  static constexpr size_t kBuckets = 24;
+  /**
+   * The number of durations by how long they were. The first bucket counts
+   * those under 1us, and each bucket after that those under twice the limit
+   * of the one before it, so that bucket \c i counts those under \c 2^i
+   * microseconds. The last bucket also counts everything over its limit.
+   */
+  std::array<uint64_t, kBuckets> counts{};
+  /**
+   * The number of durations counted.
+   */
+  uint64_t total = 0;
+  std::chrono::nanoseconds sum{0};
+  std::chrono::nanoseconds max{0};
+
+  /**
+   * Returns the bucket \c duration is counted in.
+   */
+  static size_t BucketFor(std::chrono::nanoseconds duration);
+
+  /**
+   * Counts \c duration.
+   */
+  void Add(std::chrono::nanoseconds duration);
+  /**
+   * Returns an upper bound on the given percentile, as a \c fraction from 0
+   * to 1: the limit of the bucket it falls in, or \c max for the last
+   * bucket. Zero if nothing has been counted.
+   */
+  std::chrono::microseconds Percentile(double fraction) const;
+};
+
+/**
+ * Counts the traffic on a \c JdwpSocket.
+ */
+struct JdwpSocketStats {
+  uint64_t bytes_written;
+  uint64_t bytes_read;
+  /**
+   * The number of \c sendmsg calls that wrote something.
+   */
+  uint64_t writes;
+  /**
+   * The number of \c recv and \c read calls that read something.
+   */
+  uint64_t reads;
+};
+
+namespace impl {
+
+/**
+ * A \c JdwpDurationHistogram that can be added to from several threads at
+ * once, and read from any thread while it is. Every operation is lock-free.
+ */
+class AtomicDurationHistogram {
+  public:
+    AtomicDurationHistogram();
+
+    // No copies
+    AtomicDurationHistogram(const AtomicDurationHistogram& copy) = delete;
+    AtomicDurationHistogram& operator=(
+        const AtomicDurationHistogram& other) = delete;
+
+    /**
+     * Counts \c duration.
+     */
+    void Add(std::chrono::nanoseconds duration);
+    /**
+     * Returns everything counted so far. As additions aren't synchronized
+     * with each other, one made at the same time may be partly missing.
+     */
+    JdwpDurationHistogram Get() const;
+  private:
+    std::array<std::atomic<uint64_t>, JdwpDurationHistogram::kBuckets> counts;
+    std::atomic<uint64_t> total;
+    std::atomic<int64_t> sum_ns;
+    std::atomic<int64_t> max_ns;
+};
+
+}  // namespace impl
+
+}  // namespace roastery
+
+#endif  // ROASTERY_JDWP_STATS_H_
@@ -17,15 +17,22 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <endian.h>
+
 #include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <memory>
 #include <sstream>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
 #include <variant>
 #include <vector>
 
 #include "jdwp_con.hpp"
 #include "jdwp_exception.hpp"
+#include "jdwp_interner.hpp"
 
 #ifndef ROASTERY_JDWP_TYPE_H_
 #define ROASTERY_JDWP_TYPE_H_
@@ -382,6 +389,19 @@ enum class JdwpEventKind : uint8_t {
   kVmDeath = 99,
 };
 
+/**
+ * What the VM suspended when it sent a composite event, as requested by the
+ * \c suspendPolicy of the event requests involved.
+ */
+enum class JdwpSuspendPolicy : uint8_t {
+  kNone = 0,
+  /**
+   * Only the thread the events happened on is suspended.
+   */
+  kEventThread = 1,
+  kAll = 2,
+};
+
 /**
  * An interface for holding JDWP fields.
  */
@@ -389,94 +409,190 @@ struct IJdwpField {
   public:
     /**
      * Populates the data of \c this with the data encoded in \c encoded.
+     * \c encoded may go past the end of this field, as long as it starts at
+     * its first byte.
      *
      * @return The number of bytes read from \c encoded.
+     *
+     * @throws JdwpException if \c encoded is too short to hold this field.
      */
-    size_t FromEncoded(const string& encoded, IJdwpCon& con);
+    size_t FromEncoded(std::string_view encoded, IJdwpCon& con);
     /**
      * Serializes \c this.
      */
     string Serialize(IJdwpCon& con) const;
+    /**
+     * Appends the serialization of \c this to \c out.
+     */
+    void SerializeTo(string& out, IJdwpCon& con) const;
     virtual ~IJdwpField() = 0;
   protected:
     /**
-     * Provides the implementation for \c Serialize.
+     * Provides the implementation for \c Serialize and \c SerializeTo. Should
+     * only append to \c out.
      */
-    virtual string SerializeImpl(IJdwpCon& con) const = 0;
-    virtual size_t FromEncodedImpl(const string& encoded, IJdwpCon& con) = 0;
+    virtual void SerializeToImpl(string& out, IJdwpCon& con) const = 0;
+    virtual size_t FromEncodedImpl(std::string_view encoded, IJdwpCon& con) = 0;
 };
 
 namespace impl {
 
+/**
+ * Throws a \c JdwpTruncatedException if \c encoded is shorter than \c len
+ * bytes.
+ */
+inline void RequireBytes(std::string_view encoded, size_t len) {
+  if (encoded.size() < len) throw JdwpTruncatedException("Truncated packet");
+}
+
+/**
+ * Computes an upper bound for the encoded size of \c Field at compile time.
+ * \c bounded is \c false for fields whose size depends on their value, like
+ * strings and vectors. Fields opt in by defining \c max_encoded_size.
+ */
+template<typename Field, typename = void>
+struct MaxEncodedSize {
+  static constexpr bool bounded = false;
+  static constexpr size_t value = 0;
+};
+
+template<typename Field>
+struct MaxEncodedSize<Field, std::void_t<decltype(Field::max_encoded_size)>> {
+  static constexpr bool bounded = true;
+  static constexpr size_t value = Field::max_encoded_size;
+};
+
+template<typename... Fields>
+struct MaxEncodedSize<std::tuple<Fields...>, void> {
+  static constexpr bool bounded = (MaxEncodedSize<Fields>::bounded && ...);
+  static constexpr size_t value = (MaxEncodedSize<Fields>::value + ... + 0);
+};
+
+/**
+ * Converts a 2, 4 or 8 byte unsigned integer between big-endian and host
+ * byte order.
+ */
+inline uint16_t SwapBigEndian(uint16_t v) { return be16toh(v); }
+inline uint32_t SwapBigEndian(uint32_t v) { return be32toh(v); }
+inline uint64_t SwapBigEndian(uint64_t v) { return be64toh(v); }
+
+/**
+ * Encodes and decodes trivially copyable values of type \c T as big-endian
+ * bytes, with no virtual calls and no branches on the size.
+ */
+template<typename T>
+struct FixedCodec {
+  static_assert(std::is_trivially_copyable_v<T>,
+      "FixedCodec only handles plain values");
+  static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 ||
+      sizeof(T) == 8, "FixedCodec only handles 1, 2, 4 and 8 byte values");
+
+  static constexpr size_t size = sizeof(T);
+
+  /**
+   * Reads a \c T from the \c size bytes at \c data.
+   */
+  static T Decode(const char* data) {
+    T value;
+    if constexpr (size == 1) {
+      std::memcpy(&value, data, size);
+    } else {
+      Bits bits;
+      std::memcpy(&bits, data, size);
+      bits = SwapBigEndian(bits);
+      std::memcpy(&value, &bits, size);
+    }
+    return value;
+  }
+  /**
+   * Writes \c value to the \c size bytes at \c out.
+   */
+  static void Encode(T value, char* out) {
+    if constexpr (size == 1) {
+      std::memcpy(out, &value, size);
+    } else {
+      Bits bits;
+      std::memcpy(&bits, &value, size);
+      bits = SwapBigEndian(bits);
+      std::memcpy(out, &bits, size);
+    }
+  }
+  private:
+    using Bits = std::conditional_t<size == 2, uint16_t,
+          std::conditional_t<size == 4, uint32_t, uint64_t>>;
+};
+
+/**
+ * Provides a base for fixed-width numeric fields.
+ *
+ * Besides the virtual \c IJdwpField interface, these provide \c Decode and
+ * \c Encode, which do the same but are resolved at compile time, so that the
+ * packet codecs can read and write them without a virtual call per field.
+ * Derived types that change how the value is encoded must hide both.
+ */
 template<typename Derived, typename UnderlyingType>
 class JdwpFieldBase : public IJdwpField {
   public:
     static constexpr size_t value_size = sizeof(UnderlyingType);
+    static constexpr size_t max_encoded_size = sizeof(UnderlyingType);
+    /**
+     * Marks this field as having \c Decode and \c Encode.
+     */
+    static constexpr bool static_codec = true;
 
     /**
      * Sets the value of \c this to \c v
      */
     Derived& operator<<(UnderlyingType v) {
       this->value = v;
-      return dynamic_cast<Derived&>(*this);
+      return static_cast<Derived&>(*this);
     }
 
     /**
      * Returns the underlying value
      */
     UnderlyingType GetValue() { return this->value; }
+    /**
+     * Returns the underlying value
+     */
+    UnderlyingType GetValue() const { return this->value; }
 
-    virtual ~JdwpFieldBase() = 0;
-  protected:
     /**
-     * Returns a serialization of \c value. Assumes \c value is numeric and
-     * therefore does a byte-order conversion. This method can be overriden to
-     * provide custom behavior.
+     * Does the same as \c FromEncoded, without a virtual call.
      */
-    virtual string SerializeImpl(IJdwpCon& con) const override {
+    size_t Decode(std::string_view encoded, IJdwpCon& con) {
       // Ignore con, we're assuming a numeric type which is of a fixed width.
       static_cast<void>(con);
+      RequireBytes(encoded, value_size);
+      this->value = FixedCodec<UnderlyingType>::Decode(encoded.data());
+      return value_size;
+    }
+    /**
+     * Does the same as \c SerializeTo, without a virtual call.
+     */
+    void Encode(string& out, IJdwpCon& con) const {
+      static_cast<void>(con);
+      size_t start = out.size();
+      out.resize(start + value_size);
+      FixedCodec<UnderlyingType>::Encode(this->value, &out[start]);
+    }
 
-      std::ostringstream res;
-      const unsigned char *val_bytes =
-        reinterpret_cast<const unsigned char*>(&value);
-
-#ifdef __BIG_ENDIAN__
-      for (const unsigned char* i = val_bytes;
-          i < val_bytes + value_size;
-          i++) {
-        res << *i;
-      }
-#else
-      // Loop backwards through the bytes of value to change byte order.
-      for (const unsigned char* i = val_bytes + value_size - 1;
-          i >= val_bytes;
-          i--) {
-        res << *i;
-      }
-#endif
-
-      return res.str();
+    virtual ~JdwpFieldBase() = 0;
+  protected:
+    /**
+     * Appends a serialization of \c value to \c out. Assumes \c value is
+     * numeric and therefore does a byte-order conversion.
+     */
+    virtual void SerializeToImpl(string& out, IJdwpCon& con) const override {
+      this->Encode(out, con);
     }
 
     /**
      * Attemps to read a numeric value from encoded into \c value.
      */
-    virtual size_t FromEncodedImpl(const string& encoded, IJdwpCon& con)
+    virtual size_t FromEncodedImpl(std::string_view encoded, IJdwpCon& con)
         override {
-      static_cast<void>(con); // Assuming numeric type, which is fixed-width
-
-      unsigned char* value_bytes = reinterpret_cast<unsigned char*>(&value);
-#ifdef __BIG_ENDIAN__
-      for (size_t i = 0; i < value_size; i++) {
-        value_byes[i] = encoded[i];
-      }
-#else
-      for (size_t i = 0; i < value_size; i++) {
-        value_bytes[i] = encoded[value_size - 1 - i];
-      }
-#endif
-      return value_size;
+      return this->Decode(encoded, con);
     }
 
     UnderlyingType value;
@@ -486,53 +602,161 @@ class JdwpFieldBase : public IJdwpField {
 template<typename Derived, typename UnderlyingType>
 JdwpFieldBase<Derived, UnderlyingType>::~JdwpFieldBase() { }
 
+/**
+ * Encodes and decodes big-endian IDs of a size known at compile time.
+ */
+template<uint8_t kSize>
+struct FixedIdCodec {
+  static uint64_t Decode(const char* data) {
+    uint64_t value = 0;
+    for (uint8_t i = 0; i < kSize; i++) {
+      value = (value << 8) | static_cast<unsigned char>(data[i]);
+    }
+    return value;
+  }
+  static void Encode(string& out, uint64_t value) {
+    for (uint8_t i = kSize; i > 0; i--) {
+      out.push_back(static_cast<char>(value >> (8 * (i - 1))));
+    }
+  }
+};
+
+/**
+ * HotSpot uses 8-byte IDs for everything, so those get to skip the loop and
+ * compile to a single byte swap.
+ */
+template<>
+struct FixedIdCodec<sizeof(uint64_t)> {
+  static uint64_t Decode(const char* data) {
+    uint64_t value_be;
+    std::memcpy(&value_be, data, sizeof(value_be));
+    return be64toh(value_be);
+  }
+  static void Encode(string& out, uint64_t value) {
+    uint64_t value_be = htobe64(value);
+    out.append(reinterpret_cast<const char*>(&value_be), sizeof(value_be));
+  }
+};
+
+/**
+ * Calls \c fn with the \c FixedIdCodec for \c size, which must be at most
+ * eight bytes.
+ */
+template<typename Fn>
+inline auto WithIdCodec(uint8_t size, Fn&& fn) {
+  // Checked ahead of the switch, so the common case is a single compare
+  // rather than a jump through a table.
+  if (size == sizeof(uint64_t)) return fn(FixedIdCodec<sizeof(uint64_t)>());
+  switch (size) {
+    case 4: return fn(FixedIdCodec<4>());
+    case 7: return fn(FixedIdCodec<7>());
+    case 6: return fn(FixedIdCodec<6>());
+    case 5: return fn(FixedIdCodec<5>());
+    case 3: return fn(FixedIdCodec<3>());
+    case 2: return fn(FixedIdCodec<2>());
+    case 1: return fn(FixedIdCodec<1>());
+    default: return fn(FixedIdCodec<0>());
+  }
+}
+
+/**
+ * Reads a big-endian ID of \c size bytes from \c data.
+ */
+inline uint64_t DecodeId(const char* data, uint8_t size) {
+  return WithIdCodec(size, [data](auto codec) { return codec.Decode(data); });
+}
+
+/**
+ * Appends \c value to \c out as a big-endian ID of \c size bytes.
+ */
+inline void EncodeId(string& out, uint64_t value, uint8_t size) {
+  WithIdCodec(size, [&out, value](auto codec) { codec.Encode(out, value); });
+}
+
+/**
+ * Provides a base for IDs whose size depends on the VM. \c Derived must
+ * provide a static \c GetSize(IJdwpCon&) returning its size on a given
+ * connection.
+ */
 template <typename Derived, typename UnderlyingType>
 class JdwpVariableSizeFieldBase :
     public JdwpFieldBase<Derived, UnderlyingType> {
-  protected:
-    size_t FromEncodedImpl(const string& encoded, IJdwpCon& con) override {
-      uint8_t bytes_to_read = this->GetSize(con);
-      vector<unsigned char> bytes;
-      for (int i = 0; i < bytes_to_read; i++) {
-        bytes.push_back(encoded[i]);
-      }
-      std::reverse(bytes.begin(), bytes.end());
-      unsigned char* value_bytes =
-        reinterpret_cast<unsigned char*>(&this->value);
-      for (size_t i = 0; i < bytes.size(); i++) {
-        value_bytes[i] = bytes[i];
+  public:
+    /**
+     * Does the same as \c FromEncoded, without a virtual call.
+     */
+    size_t Decode(std::string_view encoded, IJdwpCon& con) {
+      uint8_t bytes_to_read = Derived::GetSize(con);
+      if (bytes_to_read > sizeof(UnderlyingType)) {
+        throw JdwpException("ID size too large");
       }
+      RequireBytes(encoded, bytes_to_read);
 
+      // IDs are big-endian on the wire
+      this->value = static_cast<UnderlyingType>(
+          DecodeId(encoded.data(), bytes_to_read));
       return bytes_to_read;
     }
-
-    string SerializeImpl(IJdwpCon& con) const override {
-      uint8_t bytes_to_send = this->GetSize(con);
+    /**
+     * Does the same as \c SerializeTo, without a virtual call.
+     */
+    void Encode(string& out, IJdwpCon& con) const {
+      uint8_t bytes_to_send = Derived::GetSize(con);
       if (bytes_to_send > sizeof(UnderlyingType)) {
         throw JdwpException("ID size too large");
       }
-      string res;
-#if __BIG_ENDIAN__
-      res.append(reinterpret_cast<const char*>(&this->value), bytes_to_send);
-#else
-      const char* value_bytes =
-        reinterpret_cast<const char*>(&this->value);
-      for (const char* i = value_bytes + bytes_to_send - 1;
-          i >= value_bytes;
-          i--) {
-        res.append(i, 1);
-      }
-#endif
 
-      return res;
+      // IDs are big-endian on the wire
+      EncodeId(out, static_cast<uint64_t>(this->value), bytes_to_send);
+    }
+  protected:
+    size_t FromEncodedImpl(std::string_view encoded, IJdwpCon& con) override {
+      return this->Decode(encoded, con);
     }
 
-    /**
-     * Returns the size of this field on the given connection.
-     */
-    virtual uint8_t GetSize(IJdwpCon& con) const = 0;
+    void SerializeToImpl(string& out, IJdwpCon& con) const override {
+      this->Encode(out, con);
+    }
 };
 
+/**
+ * Detects whether \c Field provides the statically dispatched \c Decode and
+ * \c Encode.
+ */
+template<typename Field, typename = void>
+struct HasStaticCodec : std::false_type { };
+
+template<typename Field>
+struct HasStaticCodec<Field, std::void_t<decltype(Field::static_codec)>> :
+  std::true_type { };
+
+/**
+ * Reads \c field from \c encoded, without a virtual call if \c Field allows
+ * it.
+ *
+ * @return The number of bytes read from \c encoded.
+ */
+template<typename Field>
+size_t DecodeField(Field& field, std::string_view encoded, IJdwpCon& con) {
+  if constexpr (HasStaticCodec<Field>::value) {
+    return field.Decode(encoded, con);
+  } else {
+    return field.FromEncoded(encoded, con);
+  }
+}
+
+/**
+ * Appends \c field to \c out, without a virtual call if \c Field allows it.
+ */
+template<typename Field>
+void EncodeField(string& out, const Field& field, IJdwpCon& con) {
+  if constexpr (HasStaticCodec<Field>::value) {
+    field.Encode(out, con);
+  } else {
+    field.SerializeTo(out, con);
+  }
+}
+
 }  // namespace impl
 
 struct JdwpByte : impl::JdwpFieldBase<JdwpByte, uint8_t> { };
@@ -546,101 +770,59 @@ struct JdwpLong : impl::JdwpFieldBase<JdwpLong, int64_t> { };
 struct JdwpShort : impl::JdwpFieldBase<JdwpShort, int16_t> { };
 
 struct JdwpObjId : impl::JdwpVariableSizeFieldBase<JdwpObjId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetObjIdSize();
-    }
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetObjIdSize(); }
 };
 struct JdwpThreadId : impl::JdwpVariableSizeFieldBase<JdwpThreadId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetObjIdSize();
-    }
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetObjIdSize(); }
 };
 struct JdwpThreadGroupId :
     impl::JdwpVariableSizeFieldBase<JdwpThreadGroupId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetObjIdSize();
-    }
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetObjIdSize(); }
 };
 struct JdwpStringId :
     impl::JdwpVariableSizeFieldBase<JdwpStringId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetObjIdSize();
-    }
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetObjIdSize(); }
 };
 struct JdwpClassLoaderId :
     impl::JdwpVariableSizeFieldBase<JdwpClassLoaderId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetObjIdSize();
-    }
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetObjIdSize(); }
 };
 struct JdwpClassObjectId :
     impl::JdwpVariableSizeFieldBase<JdwpClassObjectId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetObjIdSize();
-    }
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetObjIdSize(); }
 };
 struct JdwpArrayId :
     impl::JdwpVariableSizeFieldBase<JdwpArrayId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetObjIdSize();
-    }
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetObjIdSize(); }
 };
 struct JdwpReferenceTypeId :
     impl::JdwpVariableSizeFieldBase<JdwpReferenceTypeId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetObjIdSize();
-    }
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetObjIdSize(); }
 };
 struct JdwpClassId :
     impl::JdwpVariableSizeFieldBase<JdwpClassId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetObjIdSize();
-    }
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetObjIdSize(); }
 };
 struct JdwpInterfaceId :
     impl::JdwpVariableSizeFieldBase<JdwpInterfaceId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetObjIdSize();
-    }
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetObjIdSize(); }
 };
 struct JdwpArrayTypeId :
     impl::JdwpVariableSizeFieldBase<JdwpArrayTypeId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetObjIdSize();
-    }
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetObjIdSize(); }
 };
 
 struct JdwpMethodId :
     impl::JdwpVariableSizeFieldBase<JdwpMethodId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetMethodIdSize();
-    }
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetMethodIdSize(); }
 };
 struct JdwpFieldId :
     impl::JdwpVariableSizeFieldBase<JdwpFieldId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetFieldIdSize();
-    }
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetFieldIdSize(); }
 };
 struct JdwpFrameId :
-    impl::JdwpVariableSizeFieldBase<JdwpFieldId, uint64_t> {
-  protected:
-    virtual uint8_t GetSize(IJdwpCon& con) const override {
-      return con.GetFrameIdSize();
-    }
+    impl::JdwpVariableSizeFieldBase<JdwpFrameId, uint64_t> {
+    static uint8_t GetSize(IJdwpCon& con) { return con.GetFrameIdSize(); }
 };
 
 /**
@@ -656,6 +838,13 @@ struct JdwpTaggedObjectId : public IJdwpField {
    */
   JdwpObjId obj_id;
 
+  static constexpr size_t max_encoded_size =
+    sizeof(JdwpTag) + JdwpObjId::max_encoded_size;
+  /**
+   * Marks this field as having \c Decode and \c Encode.
+   */
+  static constexpr bool static_codec = true;
+
   /**
    * Constructs an uninitialized \c JdwpTaggedObjectId.
    */
@@ -666,10 +855,19 @@ struct JdwpTaggedObjectId : public IJdwpField {
    * simultaneously.
    */
   explicit JdwpTaggedObjectId(JdwpTag tag, JdwpObjId obj_id);
+
+  /**
+   * Does the same as \c FromEncoded, without a virtual call.
+   */
+  size_t Decode(std::string_view encoded, IJdwpCon& con);
+  /**
+   * Does the same as \c SerializeTo, without a virtual call.
+   */
+  void Encode(string& out, IJdwpCon& con) const;
   protected:
-    virtual size_t FromEncodedImpl(const string &encoded,
+    virtual size_t FromEncodedImpl(std::string_view encoded,
         IJdwpCon &con) override;
-    virtual string SerializeImpl(IJdwpCon &con) const override;
+    virtual void SerializeToImpl(string& out, IJdwpCon &con) const override;
 };
 
 /**
@@ -708,6 +906,14 @@ struct JdwpLocation : public IJdwpField {
      */
     uint64_t index;
 
+    static constexpr size_t max_encoded_size = sizeof(JdwpTypeTag) +
+      JdwpClassId::max_encoded_size + JdwpMethodId::max_encoded_size +
+      sizeof(uint64_t);
+    /**
+     * Marks this field as having \c Decode and \c Encode.
+     */
+    static constexpr bool static_codec = true;
+
     /**
      * Constructs an uninitialized \c JdwpLocation.
      */
@@ -720,15 +926,24 @@ struct JdwpLocation : public IJdwpField {
     explicit JdwpLocation(JdwpTypeTag type, JdwpClassId class_id,
         JdwpMethodId method_id, uint64_t index);
 
+    /**
+     * Does the same as \c FromEncoded, without a virtual call.
+     */
+    size_t Decode(std::string_view encoded, IJdwpCon& con);
+    /**
+     * Does the same as \c SerializeTo, without a virtual call.
+     */
+    void Encode(string& out, IJdwpCon& con) const;
+
   protected:
     /**
-     * Returns a \c string version of this \c JdwpLocation encoded for JDWP.
+     * Appends this \c JdwpLocation encoded for JDWP to \c out.
      *
      * @param con The connection the data will be sent over. Used to get
      * appropriate serialization information.
      */
-    virtual string SerializeImpl(IJdwpCon& con) const override;
-    virtual size_t FromEncodedImpl(const string& encoded,
+    virtual void SerializeToImpl(string& out, IJdwpCon& con) const override;
+    virtual size_t FromEncodedImpl(std::string_view encoded,
         IJdwpCon& con) override;
 };
 
@@ -742,17 +957,122 @@ struct JdwpString : IJdwpField {
      */
     JdwpString();
     JdwpString& operator<<(const string& s);
+    /**
+     * Returns the value of \c this for modification. If it's interned, it's
+     * copied out of the interner first.
+     */
     string& GetValue();
     const string& GetValue() const;
+
+    /**
+     * Replaces the value of \c this with the copy of it held by \c interner,
+     * so that every \c JdwpString interned with it shares a single copy.
+     */
+    void Intern(JdwpStringInterner& interner);
   protected:
-    virtual size_t FromEncodedImpl(const string &encoded,
+    virtual size_t FromEncodedImpl(std::string_view encoded,
         IJdwpCon& con) override;
-    virtual string SerializeImpl(IJdwpCon& con) const override;
+    virtual void SerializeToImpl(string& out, IJdwpCon& con) const override;
   private:
     string data;
+    /**
+     * The interned value of \c this, used over \c data when set.
+     */
+    std::shared_ptr<const string> interned;
     JdwpString(const string& data);
 };
 
+/**
+ * This struct represents a JDWP String \em value that isn't copied out of the
+ * buffer it was decoded from until it's needed. Used in replies, like
+ * \c AllClassesWithGeneric, that can carry tens of thousands of strings that
+ * most callers only look at once.
+ *
+ * Until it's materialized, it points into the buffer it was decoded from, and
+ * so must not outlive it. \c Deserialize materializes every lazy string in
+ * the reply it returns; only the callbacks passed to \c IJdwpCon::SendAsync
+ * see lazy strings that haven't been, and only until they return.
+ */
+struct JdwpLazyString : IJdwpField {
+  public:
+    /**
+     * Constructs an empty \c JdwpLazyString.
+     */
+    JdwpLazyString();
+    JdwpLazyString& operator<<(const string& s);
+
+    /**
+     * Returns the value of \c this without copying it.
+     */
+    std::string_view GetView() const;
+    /**
+     * Returns the value of \c this, materializing it first if need be.
+     */
+    const string& GetValue();
+
+    /**
+     * Copies the value of \c this out of the buffer it was decoded from, if
+     * it hasn't been already, so that it no longer depends on it.
+     */
+    void Materialize();
+    /**
+     * Returns whether \c this owns its value.
+     */
+    bool IsMaterialized() const;
+  protected:
+    virtual size_t FromEncodedImpl(std::string_view encoded,
+        IJdwpCon& con) override;
+    virtual void SerializeToImpl(string& out, IJdwpCon& con) const override;
+  private:
+    string data;
+    /**
+     * While \c this hasn't been materialized, the start of its value in the
+     * buffer it was decoded from. \c nullptr once it has.
+     */
+    const char* lazy_data;
+    size_t lazy_len;
+};
+
+/**
+ * This struct represents a JDWP array of bytes, like the class file in a
+ * \c RedefineClasses command, held as a single block rather than as a
+ * \c JdwpByte per byte.
+ *
+ * It can refer to bytes it doesn't own, such as a mapped file, which then
+ * must outlive it. Decoding always copies.
+ */
+struct JdwpBytes : IJdwpField {
+  public:
+    /**
+     * Constructs an empty \c JdwpBytes.
+     */
+    JdwpBytes();
+    /**
+     * Sets the value of \c this to a copy of \c s.
+     */
+    JdwpBytes& operator<<(const string& s);
+    /**
+     * Sets the value of \c this to \c bytes, without copying them.
+     */
+    void Refer(std::string_view bytes);
+
+    /**
+     * Returns the value of \c this without copying it.
+     */
+    std::string_view GetView() const;
+  protected:
+    virtual size_t FromEncodedImpl(std::string_view encoded,
+        IJdwpCon& con) override;
+    virtual void SerializeToImpl(string& out, IJdwpCon& con) const override;
+  private:
+    string data;
+    /**
+     * The bytes \c this refers to, used over \c data when set.
+     */
+    const char* referred;
+    size_t referred_len;
+};
+
 /**
  * This struct represents a tagged or untagged JDWP value.
  */
@@ -763,7 +1083,7 @@ struct JdwpValue : IJdwpField {
      */
     struct VoidValue {
       static constexpr size_t value_size = 0;
-      size_t FromEncoded(const string& encoded, IJdwpCon& con) {
+      size_t FromEncoded(std::string_view encoded, IJdwpCon& con) {
         static_cast<void>(encoded);
         static_cast<void>(con);
         throw std::logic_error("Trying to read a void value");
@@ -772,6 +1092,10 @@ struct JdwpValue : IJdwpField {
         static_cast<void>(con);
         return "";
       }
+      void SerializeTo(string& out, IJdwpCon& con) const {
+        static_cast<void>(out);
+        static_cast<void>(con);
+      }
     };
     using JdwpVal = std::variant<
       VoidValue,
@@ -814,7 +1138,7 @@ struct JdwpValue : IJdwpField {
      * @param t The type of the encoded value.
      * @param encoded The encoded data.
      */
-    size_t FromEncodedAsUntagged(JdwpTag t, const string& encoded,
+    size_t FromEncodedAsUntagged(JdwpTag t, std::string_view encoded,
         IJdwpCon& con);
 
     /**
@@ -825,24 +1149,58 @@ struct JdwpValue : IJdwpField {
      * get needed serialization info.
      */
     string SerializeAsUntagged(IJdwpCon& con) const;
+    /**
+     * Appends this \c JdwpValue as a JDWP untagged value to \c out.
+     *
+     * @param con The connection the serialized value will be sent over. Used to
+     * get needed serialization info.
+     */
+    void SerializeAsUntaggedTo(string& out, IJdwpCon& con) const;
   protected:
-    string SerializeImpl(IJdwpCon& con) const override;
-    size_t FromEncodedImpl(const string& encoded, IJdwpCon& con) override;
+    void SerializeToImpl(string& out, IJdwpCon& con) const override;
+    size_t FromEncodedImpl(std::string_view encoded, IJdwpCon& con) override;
 };
 
 /**
  * This struct represents a JDWP array region.
+ *
+ * Array regions of objects are held as a vector of tagged values in
+ * \c values. Array regions of primitives can be large, so when decoded they
+ * are instead held contiguously in \c packed, with no allocation per value.
  */
 struct JdwpArrayRegion : IJdwpField {
   public:
+    /**
+     * Holds the values of a primitive array region in host byte order. Each
+     * element has the same type as the \c JdwpValue it would otherwise be
+     * held in: \c uint8_t for booleans and bytes, \c int16_t for chars and
+     * shorts, \c int32_t for ints, \c int64_t for longs, and the raw bits of
+     * floats (\c uint32_t) and doubles (\c uint64_t).
+     */
+    using Packed = std::variant<
+      std::monostate,
+      vector<uint8_t>,
+      vector<int16_t>,
+      vector<int32_t>,
+      vector<uint32_t>,
+      vector<int64_t>,
+      vector<uint64_t>
+      >;
     /**
      * Holds the tag representing the type of values in this array region.
      */
     JdwpTag tag;
     /**
-     * The underlying values in this array region.
+     * The underlying values in this array region. When this is set, it's used
+     * over \c packed. Array regions of primitives decoded from the wire leave
+     * this as \c nullptr.
      */
     unique_ptr<vector<unique_ptr<JdwpValue>>> values;
+    /**
+     * The underlying values of this array region, if it holds primitives and
+     * \c values isn't set.
+     */
+    Packed packed;
 
     /**
      * Constructs a \c JdwpArrayRegion with uninitialized values.
@@ -854,9 +1212,21 @@ struct JdwpArrayRegion : IJdwpField {
      * simultaneously.
      */
     JdwpArrayRegion(JdwpTag tag, const vector<unique_ptr<JdwpValue>>& values);
+    /**
+     * Constructs a primitive \c JdwpArrayRegion from packed values.
+     *
+     * @throws JdwpException if \c packed doesn't hold the type \c tag is
+     * stored as.
+     */
+    JdwpArrayRegion(JdwpTag tag, Packed packed);
+
+    /**
+     * Returns the number of values in this array region.
+     */
+    size_t Size() const;
   protected:
-    string SerializeImpl(IJdwpCon& con) const override;
-    size_t FromEncodedImpl(const string& encoded, IJdwpCon& con) override;
+    void SerializeToImpl(string& out, IJdwpCon& con) const override;
+    size_t FromEncodedImpl(std::string_view encoded, IJdwpCon& con) override;
 };
 
 }  // namespace roastery
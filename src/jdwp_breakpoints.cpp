@@ -0,0 +1,419 @@
+/* Provides batched installation of breakpoints over JDWP
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_breakpoints.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_packet.hpp"
+
+using std::lock_guard;
+using std::mutex;
+
+namespace roastery {
+
+namespace {
+
+using command_packets::event_request::ClearCommand;
+using command_packets::event_request::SetCommand;
+using command_packets::virtual_machine::HoldEventsCommand;
+using command_packets::virtual_machine::ReleaseEventsCommand;
+
+/**
+ * The index of the \c LocationOnly modifier in \c SetCommand::Modifier.
+ */
+constexpr size_t kLocationOnly = 6;
+
+struct LocationHash {
+  size_t operator()(const JdwpBreakpointLocation& location) const {
+    uint64_t res = static_cast<uint64_t>(location.type);
+    for (uint64_t part : { location.class_id, location.method_id,
+        location.index }) {
+      res = (res ^ part) * 0x9E3779B97F4A7C15ull;
+      res ^= res >> 32;
+    }
+    return static_cast<size_t>(res);
+  }
+};
+
+/**
+ * Tracks a single call to \c Install until each of its locations has been
+ * reported.
+ */
+class Batch {
+  public:
+    explicit Batch(JdwpBreakpointManager::InstallCallback on_installed) :
+      on_installed(std::move(on_installed)), remaining(1), installed(0) { }
+
+    std::future<size_t> GetFuture() { return this->done.get_future(); }
+
+    /**
+     * Adds a location that will be reported later.
+     */
+    void Expect() { this->remaining++; }
+
+    /**
+     * Reports the outcome of one of the locations passed to \c Expect.
+     */
+    void Report(const JdwpBreakpointLocation& location, int32_t request_id,
+        std::exception_ptr error) {
+      if (this->on_installed) this->on_installed(location, request_id, error);
+      if (!error) this->installed++;
+      this->Finish();
+    }
+
+    /**
+     * Called once every location has been passed to \c Expect. Until then,
+     * the batch can't complete, even if every location so far has been
+     * reported.
+     */
+    void Finish() {
+      if (--this->remaining == 0) this->done.set_value(this->installed);
+    }
+  private:
+    JdwpBreakpointManager::InstallCallback on_installed;
+    std::atomic<size_t> remaining;
+    std::atomic<size_t> installed;
+    std::promise<size_t> done;
+};
+
+/**
+ * The state of the breakpoint at a single location.
+ */
+struct Entry {
+  int32_t request_id = 0;
+  bool installed = false;
+  /**
+   * The batches waiting to hear about this breakpoint, while it's being
+   * installed.
+   */
+  std::vector<std::shared_ptr<Batch>> waiters;
+};
+
+/**
+ * Every known breakpoint, shared with the replies in flight so that they
+ * don't depend on the manager outliving them.
+ */
+class BreakpointState {
+  public:
+    mutable mutex lck;
+    std::unordered_map<JdwpBreakpointLocation, Entry, LocationHash> entries;
+
+    /**
+     * Records that the breakpoint at \c location was installed, and tells
+     * everyone waiting on it.
+     */
+    void Installed(const JdwpBreakpointLocation& location,
+        int32_t request_id) {
+      std::vector<std::shared_ptr<Batch>> waiters;
+      {
+        lock_guard<mutex> l(this->lck);
+        auto it = this->entries.find(location);
+        if (it == this->entries.end()) return;
+        it->second.installed = true;
+        it->second.request_id = request_id;
+        this->locations[request_id] = location;
+        waiters.swap(it->second.waiters);
+      }
+      for (auto& batch : waiters) batch->Report(location, request_id, nullptr);
+    }
+
+    /**
+     * Forgets the breakpoint at \c location, which couldn't be installed, and
+     * tells everyone waiting on it.
+     */
+    void Failed(const JdwpBreakpointLocation& location,
+        std::exception_ptr error) {
+      std::vector<std::shared_ptr<Batch>> waiters;
+      {
+        lock_guard<mutex> l(this->lck);
+        auto it = this->entries.find(location);
+        if (it == this->entries.end()) return;
+        waiters.swap(it->second.waiters);
+        this->entries.erase(it);
+      }
+      for (auto& batch : waiters) batch->Report(location, 0, error);
+    }
+
+    /**
+     * Moves the breakpoint request \c request_id to \c location, where the
+     * connection set it again after reconnecting, or forgets it if
+     * \c location is \c nullptr as it couldn't be set again.
+     *
+     * @return Whether another breakpoint is already at \c location, in which
+     * case this one is forgotten and should be cleared.
+     */
+    bool Replayed(int32_t request_id, const JdwpBreakpointLocation* location) {
+      lock_guard<mutex> l(this->lck);
+      auto found = this->locations.find(request_id);
+      if (found == this->locations.end()) return false;
+      auto it = this->entries.find(found->second);
+      if (location == nullptr || this->entries.count(*location)) {
+        this->entries.erase(it);
+        this->locations.erase(found);
+        return location != nullptr;
+      }
+      if (*location == found->second) return false;
+      this->entries.emplace(*location, std::move(it->second));
+      this->entries.erase(it);
+      found->second = *location;
+      return false;
+    }
+
+    /**
+     * Forgets the installed breakpoint at \c location.
+     *
+     * @return Its request ID, or zero if there's no such breakpoint.
+     */
+    int32_t Remove(const JdwpBreakpointLocation& location) {
+      lock_guard<mutex> l(this->lck);
+      auto it = this->entries.find(location);
+      if (it == this->entries.end() || !it->second.installed) return 0;
+      int32_t request_id = it->second.request_id;
+      this->locations.erase(request_id);
+      this->entries.erase(it);
+      return request_id;
+    }
+
+    /**
+     * The location of each breakpoint installed, by its request ID.
+     */
+    std::unordered_map<int32_t, JdwpBreakpointLocation> locations;
+};
+
+}  // namespace
+
+/**
+ * Implementation of \c JdwpBreakpointManager.
+ */
+class JdwpBreakpointManager::Impl {
+  public:
+    explicit Impl(IJdwpCon& con) :
+        con(con), state(std::make_shared<BreakpointState>()), holds(0) {
+      this->con.RegisterReplayHandler(
+          [state = std::weak_ptr<BreakpointState>(this->state), &con](
+            int32_t request_id, const SetCommand* set) {
+            if (auto held = state.lock()) {
+              Replayed(*held, con, request_id, set);
+            }
+          });
+    }
+
+    // No copies/default constructor
+    Impl() = delete;
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    std::future<size_t> Install(
+        const std::vector<JdwpBreakpointLocation>& locations,
+        InstallCallback on_installed, uint8_t suspend_policy) {
+      auto batch = std::make_shared<Batch>(std::move(on_installed));
+      std::future<size_t> res = batch->GetFuture();
+
+      std::vector<JdwpBreakpointLocation> to_send;
+      std::vector<std::pair<JdwpBreakpointLocation, int32_t>> known;
+      {
+        std::unordered_set<JdwpBreakpointLocation, LocationHash> seen;
+        lock_guard<mutex> l(this->state->lck);
+        for (const JdwpBreakpointLocation& location : locations) {
+          if (!seen.insert(location).second) continue;
+          batch->Expect();
+          auto inserted = this->state->entries.try_emplace(location);
+          Entry& entry = inserted.first->second;
+          if (inserted.second) {
+            entry.waiters.push_back(batch);
+            to_send.push_back(location);
+          } else if (entry.installed) {
+            known.emplace_back(location, entry.request_id);
+          } else {
+            // Another batch is installing it, so hear about it from there
+            entry.waiters.push_back(batch);
+          }
+        }
+      }
+
+      for (auto& location : known) {
+        batch->Report(location.first, location.second, nullptr);
+      }
+      if (!to_send.empty()) {
+        this->BeginHold();
+        for (const JdwpBreakpointLocation& location : to_send) {
+          this->SendSet(location, suspend_policy);
+        }
+        this->EndHold();
+      }
+      batch->Finish();
+      return res;
+    }
+
+    bool Remove(const JdwpBreakpointLocation& location) {
+      int32_t request_id = this->state->Remove(location);
+      if (request_id == 0) return false;
+      SendClear(this->con, request_id);
+      return true;
+    }
+
+    bool GetRequestId(const JdwpBreakpointLocation& location,
+        int32_t& request_id) const {
+      lock_guard<mutex> l(this->state->lck);
+      auto it = this->state->entries.find(location);
+      if (it == this->state->entries.end() || !it->second.installed) {
+        return false;
+      }
+      request_id = it->second.request_id;
+      return true;
+    }
+
+    size_t Size() const {
+      lock_guard<mutex> l(this->state->lck);
+      size_t res = 0;
+      for (auto& entry : this->state->entries) {
+        if (entry.second.installed) res++;
+      }
+      return res;
+    }
+  private:
+    IJdwpCon& con;
+    std::shared_ptr<BreakpointState> state;
+
+    /**
+     * The number of batches being sent, so that overlapping batches only hold
+     * events once, and only release them once the last of them is sent.
+     */
+    mutex hold_lck;
+    size_t holds;
+
+    /**
+     * Moves the breakpoint request \c request_id to the location the
+     * connection set it again at after reconnecting, which names its class
+     * by the ID on the new connection, or forgets it if \c set is
+     * \c nullptr. Called on \c con's I/O thread.
+     */
+    static void Replayed(BreakpointState& state, IJdwpCon& con,
+        int32_t request_id, const SetCommand* set) {
+      JdwpBreakpointLocation location;
+      bool found = false;
+      if (set != nullptr) {
+        for (auto& modifier : std::get<2>(set->GetFields())) {
+          if (modifier.index() != kLocationOnly) continue;
+          const JdwpLocation& at =
+            std::get<0>(std::get<kLocationOnly>(modifier));
+          location = { at.type, at.class_id.GetValue(),
+            at.method_id.GetValue(), at.index };
+          found = true;
+        }
+      }
+      if (state.Replayed(request_id, found ? &location : nullptr)) {
+        SendClear(con, request_id);
+      }
+    }
+
+    /**
+     * Clears the breakpoint request \c request_id.
+     */
+    static void SendClear(IJdwpCon& con, int32_t request_id) {
+      auto command = std::make_unique<ClearCommand>();
+      std::get<0>(command->GetFields()) <<
+        static_cast<uint8_t>(JdwpEventKind::kBreakpoint);
+      std::get<1>(command->GetFields()) << request_id;
+      con.SendMessage(move(command));
+    }
+
+    void BeginHold() {
+      lock_guard<mutex> l(this->hold_lck);
+      if (this->holds++ == 0) {
+        this->con.SendMessage(std::make_unique<HoldEventsCommand>());
+      }
+    }
+
+    void EndHold() {
+      lock_guard<mutex> l(this->hold_lck);
+      if (--this->holds == 0) {
+        this->con.SendMessage(std::make_unique<ReleaseEventsCommand>());
+      }
+    }
+
+    /**
+     * Sends the request for the breakpoint at \c location, without waiting
+     * for its reply.
+     */
+    void SendSet(const JdwpBreakpointLocation& location,
+        uint8_t suspend_policy) {
+      auto command = std::make_unique<SetCommand>();
+      auto& fields = command->GetFields();
+      std::get<0>(fields) << static_cast<uint8_t>(JdwpEventKind::kBreakpoint);
+      std::get<1>(fields) << suspend_policy;
+      JdwpLocation where;
+      where.type = location.type;
+      where.class_id << location.class_id;
+      where.method_id << location.method_id;
+      where.index = location.index;
+      std::get<2>(fields).emplace_back(
+          std::in_place_index<kLocationOnly>, std::make_tuple(where));
+
+      std::shared_ptr<BreakpointState> state = this->state;
+      try {
+        this->con.SendAsync(move(command),
+            [state, location](SetCommand::ReplyFields& reply) {
+              state->Installed(location, std::get<0>(reply).GetValue());
+            },
+            [state, location](std::exception_ptr error) {
+              state->Failed(location, error);
+            });
+      } catch (...) {
+        state->Failed(location, std::current_exception());
+      }
+    }
+};
+
+JdwpBreakpointManager::JdwpBreakpointManager(IJdwpCon& con) :
+  pImpl(new JdwpBreakpointManager::Impl(con)) { }
+
+JdwpBreakpointManager::~JdwpBreakpointManager() = default;
+
+std::future<size_t> JdwpBreakpointManager::Install(
+    const std::vector<JdwpBreakpointLocation>& locations,
+    InstallCallback on_installed, uint8_t suspend_policy) {
+  return this->pImpl->Install(locations, std::move(on_installed),
+      suspend_policy);
+}
+bool JdwpBreakpointManager::Remove(const JdwpBreakpointLocation& location) {
+  return this->pImpl->Remove(location);
+}
+bool JdwpBreakpointManager::GetRequestId(
+    const JdwpBreakpointLocation& location, int32_t& request_id) const {
+  return this->pImpl->GetRequestId(location, request_id);
+}
+size_t JdwpBreakpointManager::Size() const { return this->pImpl->Size(); }
+
+}  // namespace roastery
@@ -0,0 +1,408 @@
+/* Provides an index of the classes loaded by a VM, by signature
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_class_index.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_interner.hpp"
+#include "jdwp_packet.hpp"
+
+using std::lock_guard;
+using std::mutex;
+
+namespace roastery {
+
+namespace {
+
+using command_packets::event_request::SetCommand;
+using command_packets::virtual_machine::AllClassesWithGenericCommand;
+
+/**
+ * The \c suspendPolicy of event requests that don't suspend anything.
+ */
+constexpr uint8_t kSuspendNone = 0;
+
+/**
+ * Returns whether \c str starts with \c prefix.
+ */
+bool StartsWith(std::string_view str, std::string_view prefix) {
+  return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+/**
+ * Returns whether \c str ends with \c suffix.
+ */
+bool EndsWith(std::string_view str, std::string_view suffix) {
+  return str.size() >= suffix.size() &&
+    str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/**
+ * A class as held by the index. Its signatures are interned, so that the
+ * index's lookup tables can refer to them rather than keep copies.
+ */
+struct StoredClass {
+  JdwpTypeTag tag;
+  std::shared_ptr<const string> signature;
+  /**
+   * \c nullptr if there's no generic signature.
+   */
+  std::shared_ptr<const string> generic_signature;
+  int32_t status;
+};
+
+/**
+ * The index itself, shared with the event handler and the reply callback of
+ * \c Load so that neither depends on the index outliving them.
+ */
+class IndexState {
+  public:
+    explicit IndexState(std::shared_ptr<JdwpStringInterner> interner) :
+      interner(std::move(interner)) { }
+
+    mutable mutex lck;
+    std::shared_ptr<JdwpStringInterner> interner;
+    /**
+     * Set once \c Load has been called, after which the index is rebuilt
+     * each time the connection is reestablished.
+     */
+    std::atomic_bool loaded{false};
+    std::unordered_map<uint64_t, StoredClass> by_id;
+    /**
+     * Maps each signature to the classes that have it. Usually a single
+     * class, but classes loaded by different class loaders share signatures.
+     * Each key views the interned signature of the classes it maps to.
+     */
+    std::unordered_map<std::string_view, vector<uint64_t>> by_signature;
+    /**
+     * The keys of \c by_signature in order, so that every signature with a
+     * given prefix can be found without looking at the rest.
+     */
+    std::set<std::string_view> sorted_signatures;
+
+    /**
+     * Adds a class to the index, or updates its status if it's already
+     * there. \c lck must be held.
+     */
+    void AddLocked(JdwpTypeTag tag, uint64_t ref_type,
+        std::string_view signature, std::string_view generic_signature,
+        int32_t status) {
+      auto it = this->by_id.find(ref_type);
+      if (it != this->by_id.end()) {
+        it->second.status = status;
+        return;
+      }
+      StoredClass cls;
+      cls.tag = tag;
+      cls.signature = this->interner->Intern(signature);
+      if (!generic_signature.empty()) {
+        cls.generic_signature = this->interner->Intern(generic_signature);
+      }
+      cls.status = status;
+      // Interning hands out a single copy of each signature, so every class
+      // with this signature shares the string the key views
+      std::string_view key = *cls.signature;
+      vector<uint64_t>& ids = this->by_signature[key];
+      if (ids.empty()) this->sorted_signatures.insert(key);
+      ids.push_back(ref_type);
+      this->by_id.emplace(ref_type, std::move(cls));
+    }
+
+    /**
+     * Merges in \c reply, a snapshot of every loaded class. \c lck must be
+     * held.
+     */
+    void MergeLocked(AllClassesWithGenericCommand::ReplyFields& reply) {
+      // The signatures are interned straight out of the reply's buffer,
+      // without a copy in between
+      for (auto& cls : std::get<0>(reply)) {
+        this->AddLocked(static_cast<JdwpTypeTag>(std::get<0>(cls).GetValue()),
+            std::get<1>(cls).GetValue(), std::get<2>(cls).GetView(),
+            std::get<3>(cls).GetView(), std::get<4>(cls).GetValue());
+      }
+    }
+
+    /**
+     * Drops every class. \c lck must be held.
+     */
+    void ClearLocked() {
+      // The keys view strings owned by the classes, so the classes go last
+      this->sorted_signatures.clear();
+      this->by_signature.clear();
+      this->by_id.clear();
+    }
+
+    /**
+     * Drops every class with \c signature.
+     */
+    void Remove(const string& signature) {
+      lock_guard<mutex> l(this->lck);
+      auto it = this->by_signature.find(signature);
+      if (it == this->by_signature.end()) return;
+      // The keys view strings owned by the classes, so the classes go last
+      vector<uint64_t> ref_types = std::move(it->second);
+      this->sorted_signatures.erase(signature);
+      this->by_signature.erase(it);
+      for (uint64_t ref_type : ref_types) this->by_id.erase(ref_type);
+    }
+
+    /**
+     * Appends the classes with \c signature to \c out. \c lck must be held.
+     */
+    void AppendLocked(std::string_view signature,
+        vector<JdwpClassInfo>& out) const {
+      auto it = this->by_signature.find(signature);
+      if (it == this->by_signature.end()) return;
+      for (uint64_t ref_type : it->second) {
+        const StoredClass& cls = this->by_id.at(ref_type);
+        JdwpClassInfo info;
+        info.tag = cls.tag;
+        info.ref_type = ref_type;
+        info.signature = *cls.signature;
+        if (cls.generic_signature) {
+          info.generic_signature = *cls.generic_signature;
+        }
+        info.status = cls.status;
+        out.push_back(std::move(info));
+      }
+    }
+};
+
+/**
+ * Keeps an \c IndexState up to date with the classes being prepared and
+ * unloaded on the VM. Runs on the connection's I/O thread.
+ */
+class IndexHandler : public Handler {
+  public:
+    using Handler::Handle;
+
+    explicit IndexHandler(std::weak_ptr<IndexState> state) :
+      state(std::move(state)) { }
+
+    void Handle(events::ClassPrepare& event) override {
+      auto state = this->state.lock();
+      if (!state) return;
+      auto& fields = event.GetFields();
+      lock_guard<mutex> l(state->lck);
+      state->AddLocked(static_cast<JdwpTypeTag>(std::get<2>(fields).GetValue()),
+          std::get<3>(fields).GetValue(), std::get<4>(fields).GetValue(), "",
+          std::get<5>(fields).GetValue());
+    }
+
+    void Handle(events::ClassUnload& event) override {
+      if (auto state = this->state.lock()) {
+        state->Remove(std::get<1>(event.GetFields()).GetValue());
+      }
+    }
+  private:
+    std::weak_ptr<IndexState> state;
+};
+
+}  // namespace
+
+/**
+ * Implementation of \c JdwpClassIndex.
+ */
+class JdwpClassIndex::Impl {
+  public:
+    Impl(IJdwpCon& con, std::shared_ptr<JdwpStringInterner> interner) :
+        con(con), state(std::make_shared<IndexState>(interner ?
+              std::move(interner) : std::make_shared<JdwpStringInterner>())),
+        tracking(false) {
+      this->con.RegisterEventHandler(
+          std::make_unique<IndexHandler>(this->state));
+      this->con.RegisterReconnectHandler(
+          [state = std::weak_ptr<IndexState>(this->state), &con]() {
+            Resync(state, con);
+          });
+    }
+
+    // No copies/default constructor
+    Impl() = delete;
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    std::future<size_t> Load() {
+      // The VM handles commands in order, so with the event requests sent
+      // first, every class is either in the snapshot or reported afterwards.
+      if (!this->tracking.exchange(true)) {
+        this->RequestEvents(JdwpEventKind::kClassPrepare);
+        this->RequestEvents(JdwpEventKind::kClassUnload);
+      }
+      this->state->loaded = true;
+
+      auto promise = std::make_shared<std::promise<size_t>>();
+      std::future<size_t> res = promise->get_future();
+      std::shared_ptr<IndexState> state = this->state;
+      this->con.SendAsync(std::make_unique<AllClassesWithGenericCommand>(),
+          [state, promise](
+              AllClassesWithGenericCommand::ReplyFields& reply) mutable {
+            size_t size;
+            {
+              // Let go of the state before the result is handed out, so the
+              // index is freed as soon as its owner lets go of it too
+              std::shared_ptr<IndexState> held = std::move(state);
+              lock_guard<mutex> l(held->lck);
+              held->MergeLocked(reply);
+              size = held->by_id.size();
+            }
+            promise->set_value(size);
+          },
+          [promise](std::exception_ptr error) {
+            promise->set_exception(error);
+          });
+      return res;
+    }
+
+    vector<JdwpClassInfo> FindBySignature(const string& signature) const {
+      vector<JdwpClassInfo> res;
+      lock_guard<mutex> l(this->state->lck);
+      this->state->AppendLocked(signature, res);
+      return res;
+    }
+
+    vector<JdwpClassInfo> FindByPattern(const string& pattern) const {
+      vector<JdwpClassInfo> res;
+      lock_guard<mutex> l(this->state->lck);
+      if (pattern.empty() || pattern == "*") {
+        for (std::string_view signature : this->state->sorted_signatures) {
+          if (signature[0] == 'L') this->state->AppendLocked(signature, res);
+        }
+      } else if (pattern.back() == '*') {
+        // Every match shares a prefix, so they're all next to each other
+        string prefix = NameToSignature(
+            pattern.substr(0, pattern.size() - 1));
+        prefix.pop_back();  // the trailing ';'
+        for (auto it = this->state->sorted_signatures.lower_bound(prefix);
+            it != this->state->sorted_signatures.end() &&
+            StartsWith(*it, prefix); ++it) {
+          this->state->AppendLocked(*it, res);
+        }
+      } else if (pattern.front() == '*') {
+        string suffix = NameToSignature(pattern.substr(1)).substr(1);
+        for (std::string_view signature : this->state->sorted_signatures) {
+          if (signature[0] == 'L' && EndsWith(signature, suffix)) {
+            this->state->AppendLocked(signature, res);
+          }
+        }
+      } else {
+        this->state->AppendLocked(NameToSignature(pattern), res);
+      }
+      return res;
+    }
+
+    size_t Size() const {
+      lock_guard<mutex> l(this->state->lck);
+      return this->state->by_id.size();
+    }
+  private:
+    IJdwpCon& con;
+    std::shared_ptr<IndexState> state;
+    /**
+     * Set once \c ClassPrepare and \c ClassUnload events have been requested.
+     */
+    std::atomic_bool tracking;
+
+    /**
+     * Rebuilds the index once \c con has been reestablished. The classes'
+     * IDs were only good for the connection that was lost, so they're all
+     * dropped straight away, before any event from the new connection is
+     * handled, and replaced with a fresh snapshot. The connection sets the
+     * \c ClassPrepare and \c ClassUnload requests again first, so nothing
+     * loaded after the snapshot is missed. Runs on the connection's I/O
+     * thread, so doesn't wait for the snapshot.
+     */
+    static void Resync(const std::weak_ptr<IndexState>& weak_state,
+        IJdwpCon& con) {
+      std::shared_ptr<IndexState> state = weak_state.lock();
+      if (!state) return;
+      {
+        lock_guard<mutex> l(state->lck);
+        state->ClearLocked();
+      }
+      if (!state->loaded) return;
+      std::weak_ptr<IndexState> held = weak_state;
+      con.SendAsync(std::make_unique<AllClassesWithGenericCommand>(),
+          [held](AllClassesWithGenericCommand::ReplyFields& reply) {
+            if (auto state = held.lock()) {
+              lock_guard<mutex> l(state->lck);
+              state->MergeLocked(reply);
+            }
+          },
+          [](std::exception_ptr error) { static_cast<void>(error); });
+    }
+
+    /**
+     * Asks the VM to report every event of \c kind, without suspending.
+     */
+    void RequestEvents(JdwpEventKind kind) {
+      auto command = std::make_unique<SetCommand>();
+      std::get<0>(command->GetFields()) << static_cast<uint8_t>(kind);
+      std::get<1>(command->GetFields()) << kSuspendNone;
+      this->con.SendMessage(std::move(command));
+    }
+};
+
+JdwpClassIndex::JdwpClassIndex(IJdwpCon& con,
+    std::shared_ptr<JdwpStringInterner> interner) :
+  pImpl(new JdwpClassIndex::Impl(con, std::move(interner))) { }
+
+JdwpClassIndex::~JdwpClassIndex() = default;
+
+std::future<size_t> JdwpClassIndex::Load() { return this->pImpl->Load(); }
+vector<JdwpClassInfo> JdwpClassIndex::FindBySignature(
+    const string& signature) const {
+  return this->pImpl->FindBySignature(signature);
+}
+vector<JdwpClassInfo> JdwpClassIndex::FindByName(
+    const string& class_name) const {
+  return this->pImpl->FindBySignature(NameToSignature(class_name));
+}
+vector<JdwpClassInfo> JdwpClassIndex::FindByPattern(
+    const string& pattern) const {
+  return this->pImpl->FindByPattern(pattern);
+}
+size_t JdwpClassIndex::Size() const { return this->pImpl->Size(); }
+
+string JdwpClassIndex::NameToSignature(const string& class_name) {
+  string res;
+  res.reserve(class_name.size() + 2);
+  res.push_back('L');
+  for (char c : class_name) res.push_back(c == '.' ? '/' : c);
+  res.push_back(';');
+  return res;
+}
+
+}  // namespace roastery
@@ -19,217 +19,2496 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "jdwp_con.hpp"
 
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <future>
 #include <map>
 #include <memory>
 #include <mutex>
-#include <queue>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <system_error>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "jdwp_con_pool.hpp"
+#include "jdwp_dispatcher.hpp"
+#include "jdwp_exception.hpp"
 #include "jdwp_packet.hpp"
+#include "jdwp_queue.hpp"
+#include "jdwp_reactor.hpp"
+#include "jdwp_recording.hpp"
 #include "jdwp_socket.hpp"
 
 using std::lock_guard;
-using std::map;
 using std::mutex;
-using std::queue;
-using std::shared_ptr;
-using std::thread;
 
 namespace roastery {
 
 // IJdwpCon Housekeeping
 IJdwpCon::~IJdwpCon() = default;
 
+// ReplyHandler Housekeeping
+ReplyHandler::~ReplyHandler() = default;
+
+void StreamingReplyHandler::OnReply(IJdwpCommandPacket& request,
+    std::string_view reply, IJdwpCon& con) {
+  this->OnReplyPart(request, reply, 0, con);
+}
+
+namespace {
+
+/**
+ * Counts the traffic for one command, for \c JdwpCommandStats. Requests are
+ * counted on the sending threads, replies on the reactor's.
+ */
+struct CommandCounters {
+  std::atomic<uint64_t> requests{0};
+  std::atomic<uint64_t> bytes_sent{0};
+  std::atomic<uint64_t> replies{0};
+  std::atomic<uint64_t> errors{0};
+  std::atomic<uint64_t> bytes_recieved{0};
+  impl::AtomicDurationHistogram latency;
+};
+
+/**
+ * Holds the \c CommandCounters of each command sent, created the first time
+ * each is sent. Lookups are lock-free.
+ */
+class CommandStatsTable {
+  public:
+    CommandStatsTable() {
+      for (auto& slot : this->slots) slot = nullptr;
+    }
+
+    // No copies
+    CommandStatsTable(const CommandStatsTable& copy) = delete;
+    CommandStatsTable& operator=(const CommandStatsTable& other) = delete;
+
+    ~CommandStatsTable() {
+      for (auto& slot : this->slots) delete slot.load();
+    }
+
+    /**
+     * Returns the counters for the command serialized in \c packet, or
+     * \c nullptr for a command set or command past those JDWP defines.
+     */
+    CommandCounters* For(std::string_view packet) {
+      if (packet.size() < impl::kHeaderLen) return nullptr;
+      auto command_set = static_cast<uint8_t>(packet[9]);
+      auto command = static_cast<uint8_t>(packet[10]);
+      if (command_set >= kLimit || command >= kLimit) return nullptr;
+
+      std::atomic<CommandCounters*>& slot =
+        this->slots[command_set * kLimit + command];
+      CommandCounters* res = slot.load(std::memory_order_acquire);
+      if (res) return res;
+      auto created = std::make_unique<CommandCounters>();
+      if (slot.compare_exchange_strong(res, created.get(),
+            std::memory_order_acq_rel)) {
+        res = created.release();
+      }
+      return res;
+    }
+
+    /**
+     * Appends the stats of every command sent so far to \c out.
+     */
+    void Get(vector<JdwpCommandStats>& out) const {
+      for (size_t i = 0; i < this->slots.size(); i++) {
+        CommandCounters* counters =
+          this->slots[i].load(std::memory_order_acquire);
+        if (!counters) continue;
+        JdwpCommandStats stats;
+        stats.command_set = static_cast<uint8_t>(i / kLimit);
+        stats.command = static_cast<uint8_t>(i % kLimit);
+        stats.requests = counters->requests.load(std::memory_order_relaxed);
+        stats.bytes_sent = counters->bytes_sent.load(std::memory_order_relaxed);
+        stats.replies = counters->replies.load(std::memory_order_relaxed);
+        stats.errors = counters->errors.load(std::memory_order_relaxed);
+        stats.bytes_recieved =
+          counters->bytes_recieved.load(std::memory_order_relaxed);
+        stats.latency = counters->latency.Get();
+        out.push_back(stats);
+      }
+    }
+  private:
+    /**
+     * Every command set and command JDWP defines is under this.
+     */
+    static constexpr size_t kLimit = 32;
+
+    std::array<std::atomic<CommandCounters*>, kLimit * kLimit> slots;
+};
+
+/**
+ * Returns whether the reply \c header carries an error code, in its last two
+ * bytes.
+ */
+bool ReplyHasError(std::string_view header) {
+  return header[9] != 0 || header[10] != 0;
+}
+
+/**
+ * Returns the big-endian \c int at the start of \c data.
+ */
+int32_t ReadInt(const char* data) {
+  uint32_t val_nbo;
+  memcpy(&val_nbo, data, sizeof(val_nbo));
+  return static_cast<int32_t>(ntohl(val_nbo));
+}
+
+/**
+ * Returns whether \c packet holds the given \c EventRequest command.
+ */
+bool IsEventRequest(std::string_view packet, commands::EventRequest command) {
+  return packet.size() >= impl::kHeaderLen &&
+    packet[9] == static_cast<char>(commands::CommandSet::kEventRequest) &&
+    packet[10] == static_cast<char>(command);
+}
+
+/**
+ * The event requests marked with \c IJdwpCon::FastResume, by the ID handlers
+ * know them by. Safe to use from any thread.
+ */
+class FastResumeRequests {
+  public:
+    FastResumeRequests() : any(false) { }
+
+    /**
+     * Whether any request is marked, checked without locking.
+     */
+    bool Any() const { return this->any; }
+
+    void Mark(int32_t request_id) {
+      lock_guard<mutex> l(this->lck);
+      this->request_ids.insert(request_id);
+      this->any = true;
+    }
+
+    /**
+     * Returns the marked request the \c Clear command in \c packet clears,
+     * or 0 if it doesn't clear one.
+     */
+    int32_t Clears(std::string_view packet) const {
+      if (!this->any || !IsEventRequest(packet, commands::EventRequest::kClear)
+          || packet.size() < impl::kHeaderLen + 1 + sizeof(int32_t)) {
+        return 0;
+      }
+      int32_t request_id = ReadInt(&packet[impl::kHeaderLen + 1]);
+      lock_guard<mutex> l(this->lck);
+      return this->request_ids.count(request_id) ? request_id : 0;
+    }
+
+    /**
+     * Unmarks \c request_id, once the command clearing it has been handed
+     * off. Does nothing for 0.
+     */
+    void Forget(int32_t request_id) {
+      if (request_id == 0) return;
+      lock_guard<mutex> l(this->lck);
+      this->request_ids.erase(request_id);
+      this->any = !this->request_ids.empty();
+    }
+
+    /**
+     * Returns whether every one of \c events is for a marked request.
+     */
+    bool All(const vector<JdwpEventPool::Ptr>& events) const {
+      if (!this->any || events.empty()) return false;
+      lock_guard<mutex> l(this->lck);
+      for (auto& event : events) {
+        if (!this->request_ids.count(event->GetRequestId())) return false;
+      }
+      return true;
+    }
+  private:
+    mutable mutex lck;
+    std::unordered_set<int32_t> request_ids;
+    std::atomic_bool any;
+};
+
+using command_packets::event_request::SetCommand;
+
+/**
+ * The indexes of the modifiers in \c SetCommand::Modifier that an event
+ * request has to be told apart by when it's set again: those naming a
+ * reference type, and those naming a thread or an object.
+ */
+constexpr size_t kCount = 0;
+constexpr size_t kThreadOnly = 2;
+constexpr size_t kClassOnly = 3;
+constexpr size_t kLocationOnly = 6;
+constexpr size_t kExceptionOnly = 7;
+constexpr size_t kFieldOnly = 8;
+constexpr size_t kStep = 9;
+constexpr size_t kInstanceOnly = 10;
+
+/**
+ * Calls \c visit with each reference type ID named by the modifiers in
+ * \c fields, other than null ones, which it may change.
+ *
+ * @return \c false if a modifier names a thread or an object, which can't be
+ * found again once the connection they were named on is gone.
+ */
+template<typename Visit>
+bool VisitTypeIds(SetCommand::Fields& fields, Visit visit) {
+  auto visit_id = [&visit](auto& id) {
+    uint64_t value = id.GetValue();
+    if (value == 0) return;
+    visit(value);
+    id << value;
+  };
+  for (auto& modifier : std::get<2>(fields)) {
+    switch (modifier.index()) {
+      case kThreadOnly:
+      case kStep:
+      case kInstanceOnly:
+        return false;
+      case kClassOnly:
+        visit_id(std::get<0>(std::get<kClassOnly>(modifier)));
+        break;
+      case kLocationOnly:
+        visit_id(std::get<0>(std::get<kLocationOnly>(modifier)).class_id);
+        break;
+      case kExceptionOnly:
+        visit_id(std::get<0>(std::get<kExceptionOnly>(modifier)));
+        break;
+      case kFieldOnly:
+        visit_id(std::get<0>(std::get<kFieldOnly>(modifier)));
+        break;
+      default:
+        break;
+    }
+  }
+  return true;
+}
+
+/**
+ * Remembers the event requests set on a connection, so that they can be set
+ * again once it reconnects, and translates between the IDs the VM gives
+ * them then and the IDs they were first given, which is all handlers ever
+ * see. Safe to use from any thread.
+ *
+ * Reference type IDs are only good for the connection that handed them out,
+ * so each request is remembered along with the signature of every type it
+ * names, and setting it again means finding those types again. Method and
+ * field IDs are relative to their type, so are kept as they are.
+ */
+class EventRequestTracker {
+  public:
+    /**
+     * What's kept of a \c Set command until its reply arrives.
+     */
+    struct Sent {
+      /**
+       * The command's fields, if it was a \c SetCommand. Requests set any
+       * other way can't be told apart from their bytes alone, so aren't set
+       * again.
+       */
+      std::optional<SetCommand::Fields> fields;
+      uint8_t kind;
+      /**
+       * Whether the request has a \c Count modifier, so that it won't be
+       * reported again once it's been reported once.
+       */
+      bool expires;
+    };
+
+    /**
+     * A request to set again, and the ID it was first given.
+     */
+    struct Replay {
+      int32_t request_id;
+      /**
+       * The request's fields, naming types by their IDs on the connection
+       * that was lost.
+       */
+      SetCommand::Fields fields;
+      /**
+       * The signature of each type \c fields names, by those IDs.
+       */
+      std::unordered_map<uint64_t, string> signatures;
+    };
+
+    EventRequestTracker() : active(false) { }
+
+    /**
+     * Whether \c OnEvent has anything to do, checked without locking.
+     */
+    bool Active() const { return this->active; }
+
+    /**
+     * What \c OnSend found in a command, acted on by \c Apply once the
+     * command has been handed off, so that one that's rejected changes
+     * nothing.
+     */
+    struct Sending {
+      /**
+       * What to keep of a \c Set command until its reply arrives.
+       */
+      unique_ptr<Sent> set;
+      /**
+       * Whether this is a \c Clear command, for the request first given
+       * \c cleared, or a \c ClearAllBreakpoints command.
+       */
+      bool clears = false;
+      int32_t cleared = 0;
+      bool clears_breakpoints = false;
+    };
+
+    /**
+     * Looks at \c packet, the serialization of \c message, before it's sent.
+     * A \c Clear command for a request is rewritten to use the ID the VM
+     * currently knows it by.
+     */
+    Sending OnSend(const IJdwpCommandPacket& message, string& packet) {
+      Sending res;
+      if (IsEventRequest(packet, commands::EventRequest::kSet) &&
+          packet.size() > impl::kHeaderLen) {
+        res.set = std::make_unique<Sent>();
+        res.set->kind = static_cast<uint8_t>(packet[impl::kHeaderLen]);
+        res.set->expires = false;
+        if (auto* set = dynamic_cast<const SetCommand*>(&message)) {
+          res.set->fields = set->GetFields();
+          for (auto& modifier : std::get<2>(set->GetFields())) {
+            if (modifier.index() == kCount) res.set->expires = true;
+          }
+        }
+      } else if (IsEventRequest(packet, commands::EventRequest::kClear) &&
+          packet.size() >= impl::kHeaderLen + 1 + sizeof(int32_t)) {
+        lock_guard<mutex> l(this->lck);
+        int32_t request_id = ReadInt(&packet[impl::kHeaderLen + 1]);
+        auto it = this->requests.find(request_id);
+        if (it == this->requests.end()) return res;
+        res.clears = true;
+        res.cleared = request_id;
+        // While it's being set again, the VM hasn't said what it knows it by
+        // yet, so it's cleared once it has
+        if (it->second.replaying) return res;
+        uint32_t vm_id_nbo = htonl(it->second.vm_id);
+        memcpy(&packet[impl::kHeaderLen + 1], &vm_id_nbo, sizeof(vm_id_nbo));
+      } else if (IsEventRequest(packet,
+            commands::EventRequest::kClearAllBreakpoints)) {
+        res.clears_breakpoints = true;
+      }
+      return res;
+    }
+
+    /**
+     * Forgets what the command \c sending was found in clears, now that it's
+     * been queued, or failed as the connection closed.
+     */
+    void Apply(const Sending& sending) {
+      if (sending.clears) {
+        lock_guard<mutex> l(this->lck);
+        auto it = this->requests.find(sending.cleared);
+        if (it == this->requests.end()) return;
+        if (it->second.replaying) {
+          it->second.cleared = true;
+        } else {
+          this->EraseLocked(it);
+        }
+      } else if (sending.clears_breakpoints) {
+        lock_guard<mutex> l(this->lck);
+        for (auto it = this->requests.begin(); it != this->requests.end();) {
+          if (it->second.kind !=
+              static_cast<uint8_t>(JdwpEventKind::kBreakpoint)) {
+            ++it;
+          } else if (it->second.replaying) {
+            (it++)->second.cleared = true;
+          } else {
+            this->EraseLocked(it++);
+          }
+        }
+      }
+    }
+
+    /**
+     * Records that the VM set the request in \c sent, and knows it by
+     * \c vm_id.
+     *
+     * @param unnamed Set to the types the request names whose signatures
+     * haven't been asked for yet, to pass to \c Named once they're known.
+     *
+     * @return The ID handlers know the request by. The same as \c vm_id,
+     * unless a request from before the connection was reestablished
+     * already goes by that.
+     */
+    int32_t Set(Sent sent, int32_t vm_id, vector<uint64_t>& unnamed) {
+      lock_guard<mutex> l(this->lck);
+      int32_t request_id = vm_id;
+      if (this->requests.count(request_id)) {
+        request_id = this->highest + 1;
+      }
+      this->highest = std::max(this->highest, std::max(request_id, vm_id));
+      if (request_id != vm_id) this->to_request_id[vm_id] = request_id;
+      Entry& entry = this->requests[request_id];
+      entry.fields = std::move(sent.fields);
+      entry.kind = sent.kind;
+      entry.expires = sent.expires;
+      if (entry.fields) {
+        VisitTypeIds(*entry.fields, [this, &unnamed](uint64_t& type) {
+          if (!this->signatures.count(type) &&
+              this->naming.insert(type).second) {
+            unnamed.push_back(type);
+          }
+        });
+      }
+      entry.vm_id = vm_id;
+      if (entry.expires) this->expiring++;
+      this->UpdateActiveLocked();
+      return request_id;
+    }
+
+    /**
+     * Gives \c event the ID handlers know its request by, and forgets the
+     * request if it won't be reported again.
+     */
+    void OnEvent(IJdwpEvent& event) {
+      lock_guard<mutex> l(this->lck);
+      int32_t vm_id = event.GetRequestId();
+      auto translated = this->to_request_id.find(vm_id);
+      int32_t request_id = translated == this->to_request_id.end() ?
+        vm_id : translated->second;
+      if (request_id != vm_id) event.SetRequestId(request_id);
+      auto it = this->requests.find(request_id);
+      if (it != this->requests.end() && it->second.expires &&
+          !it->second.replaying && it->second.vm_id == vm_id) {
+        this->EraseLocked(it);
+      }
+    }
+
+    /**
+     * Records that the type \c type, as the VM knows it on the current
+     * connection, has the signature \c signature.
+     */
+    void Named(uint64_t type, string signature) {
+      lock_guard<mutex> l(this->lck);
+      this->naming.erase(type);
+      this->signatures[type] = std::move(signature);
+    }
+
+    /**
+     * Records that the signature of \c type couldn't be found, so the
+     * requests naming it can't be set again.
+     */
+    void NameFailed(uint64_t type) {
+      lock_guard<mutex> l(this->lck);
+      this->naming.erase(type);
+    }
+
+    /**
+     * Forgets every ID the VM gave, as the connection it gave them on is
+     * gone. Requests that name a thread or an object, or a type whose
+     * signature isn't known, are forgotten too, as there's no telling what
+     * they'd name on the new connection.
+     *
+     * @param dropped Set to the IDs of the requests forgotten that hadn't
+     * been cleared.
+     *
+     * @return Every request to set again, in the order they were first set.
+     */
+    vector<Replay> Reset(vector<int32_t>& dropped) {
+      lock_guard<mutex> l(this->lck);
+      this->to_request_id.clear();
+      vector<Replay> res;
+      for (auto it = this->requests.begin(); it != this->requests.end();) {
+        Entry& entry = it->second;
+        Replay replay;
+        replay.request_id = it->first;
+        // A request that was still being set again names types by the IDs
+        // they had on the connection before
+        const std::unordered_map<uint64_t, string>& known =
+          entry.replaying ? entry.signatures : this->signatures;
+        bool named = entry.fields && !entry.cleared;
+        if (named && !VisitTypeIds(*entry.fields, [&](uint64_t& type) {
+              auto signature = known.find(type);
+              if (signature == known.end()) {
+                named = false;
+              } else {
+                replay.signatures[type] = signature->second;
+              }
+            })) {
+          named = false;
+        }
+        if (!named) {
+          if (!entry.cleared) dropped.push_back(it->first);
+          this->EraseLocked(it++);
+          continue;
+        }
+        entry.replaying = true;
+        entry.vm_id = 0;
+        entry.signatures = replay.signatures;
+        replay.fields = *entry.fields;
+        res.push_back(std::move(replay));
+        ++it;
+      }
+      this->signatures.clear();
+      this->naming.clear();
+      this->UpdateActiveLocked();
+      return res;
+    }
+
+    /**
+     * Records that the request first given \c request_id has been set again,
+     * as \c fields, and that the VM now knows it by \c vm_id.
+     *
+     * @param kind Set to the request's \c JdwpEventKind.
+     *
+     * @return \c false if the request was cleared in the meantime, and so has
+     * to be cleared again under \c vm_id.
+     */
+    bool Replayed(int32_t request_id, int32_t vm_id,
+        const SetCommand::Fields& fields, uint8_t& kind) {
+      lock_guard<mutex> l(this->lck);
+      auto it = this->requests.find(request_id);
+      if (it == this->requests.end()) return true;
+      kind = it->second.kind;
+      if (it->second.cleared) {
+        this->EraseLocked(it);
+        return false;
+      }
+      it->second.fields = fields;
+      it->second.signatures.clear();
+      it->second.replaying = false;
+      it->second.vm_id = vm_id;
+      this->highest = std::max(this->highest, vm_id);
+      if (vm_id != request_id) this->to_request_id[vm_id] = request_id;
+      this->UpdateActiveLocked();
+      return true;
+    }
+
+    /**
+     * Forgets the request first given \c request_id, as the VM wouldn't set
+     * it again.
+     */
+    void ReplayFailed(int32_t request_id) {
+      lock_guard<mutex> l(this->lck);
+      auto it = this->requests.find(request_id);
+      if (it != this->requests.end()) this->EraseLocked(it);
+    }
+
+    size_t Size() const {
+      lock_guard<mutex> l(this->lck);
+      return this->requests.size();
+    }
+  private:
+    struct Entry {
+      std::optional<SetCommand::Fields> fields;
+      uint8_t kind = 0;
+      bool expires = false;
+      /**
+       * The ID the VM knows the request by on the current connection, unless
+       * \c replaying.
+       */
+      int32_t vm_id = 0;
+      /**
+       * Set while the request is being set again, and if it's cleared in the
+       * meantime.
+       */
+      bool replaying = false;
+      bool cleared = false;
+      /**
+       * While \c replaying, the signature of each type \c fields names.
+       */
+      std::unordered_map<uint64_t, string> signatures;
+    };
+
+    mutable mutex lck;
+    /**
+     * Every request set, by the ID handlers know it by.
+     */
+    std::map<int32_t, Entry> requests;
+    /**
+     * Maps the ID the VM knows a request by to the one handlers do, where
+     * they differ.
+     */
+    std::unordered_map<int32_t, int32_t> to_request_id;
+    /**
+     * The highest ID seen, so that a request given one that's taken gets one
+     * nothing has.
+     */
+    int32_t highest = 0;
+    /**
+     * The number of \c requests that expire.
+     */
+    size_t expiring = 0;
+    /**
+     * The signatures of the types named by \c requests, by the IDs the VM
+     * knows them by on the current connection, and the types whose
+     * signatures have been asked for.
+     */
+    std::unordered_map<uint64_t, string> signatures;
+    std::unordered_set<uint64_t> naming;
+    std::atomic_bool active;
+
+    void EraseLocked(std::map<int32_t, Entry>::iterator it) {
+      if (!it->second.replaying) this->to_request_id.erase(it->second.vm_id);
+      if (it->second.expires) this->expiring--;
+      this->requests.erase(it);
+      this->UpdateActiveLocked();
+    }
+
+    void UpdateActiveLocked() {
+      this->active = !this->to_request_id.empty() || this->expiring != 0;
+    }
+};
+
+/**
+ * Drops a reply, for messages whose replies the connection needs to see
+ * itself, but whose senders didn't ask for them.
+ */
+class IgnoredReplyHandler : public ReplyHandler {
+  public:
+    void OnReply(IJdwpCommandPacket& request, std::string_view reply,
+        IJdwpCon& con) override {
+      static_cast<void>(request);
+      static_cast<void>(reply);
+      static_cast<void>(con);
+    }
+    void OnError(IJdwpCommandPacket& request,
+        std::exception_ptr error) override {
+      static_cast<void>(request);
+      static_cast<void>(error);
+    }
+};
+
+/**
+ * Records what the VM knows a request set again after reconnecting by.
+ */
+class ReplayReplyHandler : public ReplyHandler {
+  public:
+    /**
+     * @param request_id The ID the request was first given.
+     * @param clear Clears the request under the ID the VM gave it now, if it
+     * was cleared before the VM replied.
+     * @param replayed Told the command the request was set again with, or
+     * \c nullptr if the VM wouldn't set it, unless it was cleared.
+     */
+    ReplayReplyHandler(EventRequestTracker& requests, int32_t request_id,
+        std::function<void(uint8_t kind, int32_t vm_id)> clear,
+        std::function<void(const SetCommand* set)> replayed) :
+      requests(requests), request_id(request_id), clear(move(clear)),
+      replayed(move(replayed)) { }
+
+    void OnReply(IJdwpCommandPacket& request, std::string_view reply,
+        IJdwpCon& con) override {
+      static_cast<void>(request);
+      static_cast<void>(con);
+      if (ReplyHasError(reply) ||
+          reply.size() < impl::kHeaderLen + sizeof(int32_t)) {
+        this->requests.ReplayFailed(this->request_id);
+        this->replayed(nullptr);
+        return;
+      }
+      int32_t vm_id = ReadInt(&reply[impl::kHeaderLen]);
+      uint8_t kind;
+      auto& set = static_cast<SetCommand&>(request);
+      if (!this->requests.Replayed(this->request_id, vm_id, set.GetFields(),
+            kind)) {
+        this->clear(kind, vm_id);
+      } else {
+        this->replayed(&set);
+      }
+    }
+    /**
+     * Leaves the request to be set again on the next connection, as only
+     * losing this one fails a reply.
+     */
+    void OnError(IJdwpCommandPacket& request,
+        std::exception_ptr error) override {
+      static_cast<void>(request);
+      static_cast<void>(error);
+    }
+  private:
+    EventRequestTracker& requests;
+    int32_t request_id;
+    std::function<void(uint8_t kind, int32_t vm_id)> clear;
+    std::function<void(const SetCommand* set)> replayed;
+};
+
+/**
+ * The event requests being set again on a new connection that name types,
+ * while those types are found again by signature. Only touched on the
+ * reactor's thread.
+ */
+struct TypeLookups {
+  vector<EventRequestTracker::Replay> replays;
+  /**
+   * The ID each signature goes by on the new connection, for those that
+   * were found to name a single type.
+   */
+  std::unordered_map<string, uint64_t> found;
+  size_t remaining = 0;
+};
+
+/**
+ * Adds the counts in \c other to \c stats.
+ */
+void AddSocketStats(JdwpSocketStats& stats, const JdwpSocketStats& other) {
+  stats.bytes_written += other.bytes_written;
+  stats.bytes_read += other.bytes_read;
+  stats.writes += other.writes;
+  stats.reads += other.reads;
+}
+
+/**
+ * Holds the messages that have been sent but not yet replied to, keyed by
+ * packet ID. Split into shards so that threads sending on the same connection
+ * don't all contend with each other and the reactor on a single lock.
+ */
+class PendingReplyTable {
+  public:
+    struct Pending {
+      unique_ptr<IJdwpCommandPacket> request;
+      unique_ptr<ReplyHandler> handler;
+      /**
+       * Where the reply is counted, if anywhere, and when the request was
+       * queued.
+       */
+      CommandCounters* counters = nullptr;
+      std::chrono::steady_clock::time_point sent_at;
+      /**
+       * Whether \c handler is a \c StreamingReplyHandler.
+       */
+      bool streams = false;
+      /**
+       * What's kept of \c request until its reply arrives, if it's an event
+       * request to set again after reconnecting.
+       */
+      unique_ptr<EventRequestTracker::Sent> event_request;
+    };
+
+    void Insert(uint32_t id, Pending pending) {
+      Shard& shard = this->ShardFor(id);
+      lock_guard<mutex> l(shard.lck);
+      shard.pending[id] = std::move(pending);
+    }
+
+    /**
+     * Removes the entry for \c id, storing it in \c out.
+     *
+     * @return Whether there was an entry for \c id.
+     */
+    bool Take(uint32_t id, Pending& out) {
+      Shard& shard = this->ShardFor(id);
+      lock_guard<mutex> l(shard.lck);
+      auto it = shard.pending.find(id);
+      if (it == shard.pending.end()) return false;
+      out = std::move(it->second);
+      shard.pending.erase(it);
+      return true;
+    }
+
+    /**
+     * Removes the entry for \c id, storing it in \c out, but only if its
+     * handler can take its reply in parts.
+     *
+     * @return Whether there was such an entry for \c id.
+     */
+    bool TakeStreaming(uint32_t id, Pending& out) {
+      Shard& shard = this->ShardFor(id);
+      lock_guard<mutex> l(shard.lck);
+      auto it = shard.pending.find(id);
+      if (it == shard.pending.end() || !it->second.streams) return false;
+      out = std::move(it->second);
+      shard.pending.erase(it);
+      return true;
+    }
+
+    /**
+     * Removes and returns every entry.
+     */
+    vector<Pending> TakeAll() {
+      vector<Pending> res;
+      for (Shard& shard : this->shards) {
+        lock_guard<mutex> l(shard.lck);
+        for (auto& entry : shard.pending) {
+          res.push_back(std::move(entry.second));
+        }
+        shard.pending.clear();
+      }
+      return res;
+    }
+  private:
+    static constexpr size_t kShards = 16;
+
+    struct Shard {
+      mutex lck;
+      std::unordered_map<uint32_t, Pending> pending;
+    };
+    std::array<Shard, kShards> shards;
+
+    Shard& ShardFor(uint32_t id) { return this->shards[id % kShards]; }
+};
+
+/**
+ * Scratch space for serializing outgoing messages, reused by every message
+ * sent from a given thread. \c serialize_buffer_in_use is set while a send is
+ * using it.
+ */
+thread_local string serialize_buffer;
+thread_local bool serialize_buffer_in_use = false;
+
+/**
+ * The buffer a send serializes its message into. A send can fail a handler,
+ * whose \c OnError may send again before the first has queued its message, so
+ * only the outermost send on a thread gets \c serialize_buffer. Nested ones
+ * get a buffer of their own.
+ */
+class SerializeScratch {
+  public:
+    SerializeScratch() : nested(serialize_buffer_in_use) {
+      serialize_buffer_in_use = true;
+      this->Get().clear();
+    }
+    ~SerializeScratch() {
+      if (!this->nested) serialize_buffer_in_use = false;
+    }
+
+    // No copies
+    SerializeScratch(const SerializeScratch& copy) = delete;
+    SerializeScratch& operator=(const SerializeScratch& other) = delete;
+
+    string& Get() { return this->nested ? this->own : serialize_buffer; }
+  private:
+    bool nested;
+    string own;
+};
+
+/**
+ * The largest buffer kept around for reuse once it's been written.
+ */
+constexpr size_t kMaxRetainedBuffer = 1 << 20;
+
+/**
+ * Messages at least this large are moved through the send queue and written
+ * as their own segment, rather than being copied in with their neighbors.
+ */
+constexpr size_t kLargeMessage = 16 * 1024;
+
+/**
+ * The most emptied segments a connection keeps around for reuse.
+ */
+constexpr size_t kMaxSpareSegments = 4;
+
+/**
+ * How long to wait for the VM to report its ID sizes when connecting.
+ */
+constexpr std::chrono::seconds kIdSizesTimeout(10);
+
+/**
+ * How long a sender blocked on a full send queue sleeps before checking for
+ * room again, in case it misses being woken.
+ */
+constexpr std::chrono::milliseconds kSendQueueRetry(10);
+
+/**
+ * Tells \c pending that it will never recieve a reply.
+ */
+void FailPending(PendingReplyTable::Pending& pending) {
+  pending.handler->OnError(*pending.request,
+      std::make_exception_ptr(JdwpException("Connection closed")));
+}
+
+/**
+ * Counts a reply of \c size bytes to \c pending, which carried an error code
+ * if \c error, if there are counters for it.
+ */
+void CountReply(const PendingReplyTable::Pending& pending, bool error,
+    size_t size) {
+  CommandCounters* counters = pending.counters;
+  if (!counters) return;
+  counters->latency.Add(std::chrono::steady_clock::now() - pending.sent_at);
+  counters->replies.fetch_add(1, std::memory_order_relaxed);
+  counters->bytes_recieved.fetch_add(size, std::memory_order_relaxed);
+  if (error) counters->errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Counts \c packet as a request sent, if there are \c counters for it.
+ */
+void CountRequest(CommandCounters* counters, std::string_view packet) {
+  if (!counters) return;
+  counters->requests.fetch_add(1, std::memory_order_relaxed);
+  counters->bytes_sent.fetch_add(packet.size(), std::memory_order_relaxed);
+}
+
+/**
+ * Keeps track of what events have left suspended, and how long it stays
+ * suspended until a resume command for it is sent. Safe to use from any
+ * thread.
+ */
+class SuspensionTracker {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    SuspensionTracker() : outstanding(0) { }
+
+    /**
+     * Returns whether anything is currently suspended, without locking, so
+     * that senders can skip looking for resume commands otherwise.
+     */
+    bool Any() const { return this->outstanding != 0; }
+
+    /**
+     * Starts timing whatever the composite event made up of \c events
+     * suspended. Whatever is already suspended keeps the time it was first
+     * suspended at.
+     */
+    void Suspended(const vector<JdwpEventPool::Ptr>& events) {
+      if (events.empty()) return;
+      JdwpSuspendPolicy policy = events.front()->GetSuspendPolicy();
+      if (policy == JdwpSuspendPolicy::kNone) return;
+
+      Clock::time_point at = Clock::now();
+      lock_guard<mutex> l(this->lck);
+      if (policy == JdwpSuspendPolicy::kAll) {
+        if (!this->vm_suspended) {
+          this->vm_suspended = true;
+          this->vm_since = at;
+        }
+      } else {
+        for (auto& event : events) {
+          uint64_t thread;
+          if (event->GetThreadId(thread)) this->threads.emplace(thread, at);
+        }
+      }
+      this->outstanding = this->threads.size() + (this->vm_suspended ? 1 : 0);
+    }
+
+    /**
+     * Stops timing everything, as the VM is being resumed.
+     */
+    void ResumedVm() {
+      Clock::time_point at = Clock::now();
+      lock_guard<mutex> l(this->lck);
+      if (this->vm_suspended) this->Record(at - this->vm_since);
+      this->vm_suspended = false;
+      for (auto& entry : this->threads) this->Record(at - entry.second);
+      this->threads.clear();
+      this->outstanding = 0;
+    }
+
+    /**
+     * Stops timing \c thread, as it's being resumed.
+     */
+    void ResumedThread(uint64_t thread) {
+      Clock::time_point at = Clock::now();
+      lock_guard<mutex> l(this->lck);
+      auto it = this->threads.find(thread);
+      if (it == this->threads.end()) return;
+      this->Record(at - it->second);
+      this->threads.erase(it);
+      this->outstanding = this->threads.size() + (this->vm_suspended ? 1 : 0);
+    }
+
+    JdwpSuspensionHistogram Get() const {
+      lock_guard<mutex> l(this->lck);
+      JdwpSuspensionHistogram res = this->histogram;
+      res.outstanding = this->outstanding;
+      return res;
+    }
+  private:
+    mutable mutex lck;
+    std::atomic<size_t> outstanding;
+    bool vm_suspended = false;
+    Clock::time_point vm_since;
+    std::unordered_map<uint64_t, Clock::time_point> threads;
+    JdwpSuspensionHistogram histogram;
+
+    void Record(Clock::duration duration) {
+      this->histogram.Add(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(duration));
+    }
+};
+
+}  // namespace
+
 /**
  * Implementation of \c JdwpCon.
  */
 class JdwpCon::Impl : public IJdwpCon {
   public:
     /**
-     * Creates a new \c JdwpCon::Impl, connected to \c localhost.
-     *
-     * @param port The port to connect on. Should be in host byte order.
-     *
-     * @throws std::system_error if there is a system error
-     * creating/reading/writing to the socket created.
+     * Creates a new \c JdwpCon::Impl, connected to \c localhost.
+     *
+     * @param port The port to connect on. Should be in host byte order.
+     * @param options Controls how the socket is written to.
+     *
+     * @throws std::system_error if there is a system error
+     * creating/reading/writing to the socket created.
+     */
+    explicit Impl(uint16_t port, const JdwpConOptions& options) :
+      Impl("localhost", port, options) { }
+    /**
+     * Creates a new \c JdwpCon::Impl, connected to \c address.
+     *
+     * @param address The address to connect to. Should just be a host name,
+     * not a URI.
+     * @param port The port to connect on. Should be in host byte order.
+     * @param options Controls how the socket is written to.
+     *
+     * @throws std::system_error if there is a system error
+     * creating/reading/writing to the socket created.
+     * @throws JdwpException if the VM doesn't report its ID sizes.
+     */
+    explicit Impl(const string& address, uint16_t port,
+        const JdwpConOptions& options) :
+        address(address),
+        port(port),
+        socket(new JdwpSocket(address, port)),
+        owned_reactor(new JdwpReactor()),
+        reactor(owned_reactor.get()),
+        options(options),
+        flush_scheduled(false),
+        flush_guard(new FlushGuard{ {}, this }),
+        closed(false),
+        id_sizes_known(false),
+        obj_id_size(0),
+        method_id_size(0),
+        field_id_size(0),
+        frame_id_size(0),
+        outgoing(options.send_queue_capacity),
+        space_waiters(0),
+        blocked_sends(0),
+        rejected_sends(0),
+        dispatcher(nullptr) {
+      this->Start();
+    }
+    /**
+     * Creates a new \c JdwpCon::Impl, connected to \c address and driven by
+     * one of the reactors in \c pool.
+     *
+     * @param address The address to connect to. Should just be a host name,
+     * not a URI.
+     * @param port The port to connect on. Should be in host byte order.
+     * @param pool The pool providing the reactor for this connection. Must
+     * outlive \c this.
+     * @param options Controls how the socket is written to.
+     *
+     * @throws std::system_error if there is a system error
+     * creating/reading/writing to the socket created.
+     * @throws JdwpException if the VM doesn't report its ID sizes.
+     */
+    explicit Impl(const string& address, uint16_t port, JdwpConPool& pool,
+        const JdwpConOptions& options) :
+        address(address),
+        port(port),
+        socket(new JdwpSocket(address, port)),
+        reactor(&pool.GetReactor(this->socket->GetFd())),
+        options(options),
+        flush_scheduled(false),
+        flush_guard(new FlushGuard{ {}, this }),
+        closed(false),
+        id_sizes_known(false),
+        obj_id_size(0),
+        method_id_size(0),
+        field_id_size(0),
+        frame_id_size(0),
+        outgoing(options.send_queue_capacity),
+        space_waiters(0),
+        blocked_sends(0),
+        rejected_sends(0),
+        dispatcher(nullptr) {
+      this->Start();
+    }
+
+    // No copies/default constructor
+    Impl() = delete;
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    ~Impl() override {
+      if (this->reconnect_thread.joinable()) {
+        {
+          lock_guard<mutex> l(this->reconnect_lck);
+          this->stopping = true;
+        }
+        this->reconnect_cv.notify_all();
+        this->reconnect_thread.join();
+      }
+      // Flushes stop posting more of themselves first. Unwatching then waits
+      // out any callback or flush that's running or already posted, which
+      // writes what was sent before this, and retiring the flushes makes any
+      // posted after that do nothing. So it's safe to tear down the rest of
+      // this object afterwards.
+      this->retiring = true;
+      this->reactor->Unwatch(this->socket->GetFd());
+      this->RetireFlushes();
+      this->closed = true;
+      this->WakeBlockedSenders();
+      this->FailStreamed();
+      for (auto& pending : this->pending_replies.TakeAll()) {
+        FailPending(pending);
+      }
+    }
+
+    /**
+     * Attaches \c recorder, which the reactor picks up on its next read.
+     */
+    void Record(std::shared_ptr<JdwpRecorder> recorder) {
+      this->recording = recorder != nullptr;
+      std::atomic_store(&this->recorder, move(recorder));
+    }
+
+    /**
+     * Returns the current state of \c outgoing.
+     */
+    JdwpSendQueueStats GetSendQueueStats() const {
+      JdwpSendQueueStats res;
+      res.depth = this->outgoing.Size();
+      res.high_water_mark = this->outgoing.HighWaterMark();
+      res.capacity = this->outgoing.Capacity();
+      res.blocked_sends = this->blocked_sends;
+      res.rejected_sends = this->rejected_sends;
+      return res;
+    }
+
+    JdwpSuspensionHistogram GetSuspensionHistogram() const {
+      return this->suspensions.Get();
+    }
+
+    JdwpConStats GetStats() const {
+      JdwpConStats res;
+      this->command_stats.Get(res.commands);
+      for (size_t i = 0; i < this->event_counts.size(); i++) {
+        uint64_t count = this->event_counts[i].load(std::memory_order_relaxed);
+        if (count == 0) continue;
+        res.events.push_back({ static_cast<uint8_t>(i), count });
+      }
+      res.event_packets = this->event_packets.load(std::memory_order_relaxed);
+      res.event_bytes = this->event_bytes.load(std::memory_order_relaxed);
+      {
+        lock_guard<mutex> l(this->socket_lck);
+        res.socket = this->socket->GetStats();
+        AddSocketStats(res.socket, this->retired_socket_stats);
+      }
+      res.reconnects = this->reconnects;
+      res.event_requests = this->event_requests.Size();
+      res.send_queue = this->GetSendQueueStats();
+      res.inline_handler_time = this->inline_handler_time.Get();
+      {
+        lock_guard<mutex> l(this->dispatcher_lck);
+        if (this->owned_dispatcher) {
+          res.pooled_handler_time = this->owned_dispatcher->GetHandlerTime();
+        }
+      }
+      res.suspensions = this->suspensions.Get();
+      return res;
+    }
+
+    /**
+     * Adds \c handler to those called once the connection has been
+     * reestablished.
+     */
+    void AddReconnectHandler(std::function<void()> handler) {
+      lock_guard<mutex> l(this->reconnect_lck);
+      this->reconnect_handlers.push_back(move(handler));
+    }
+
+    /**
+     * Adds \c handler to those called with each composite event packet.
+     */
+    void AddPacketHandler(JdwpPacketHandler handler) {
+      this->packet_handlers.Add(move(handler));
+    }
+
+    /**
+     * Adds \c handler to those told how each event request was set again
+     * after reconnecting.
+     */
+    void AddReplayHandler(JdwpReplayHandler handler) {
+      lock_guard<mutex> l(this->reconnect_lck);
+      this->replay_handlers.push_back(move(handler));
+    }
+
+  protected:
+    /**
+     * Returns the size of an \c objectID on the connected VM, in bytes.
+     */
+    uint8_t GetObjIdSizeImpl() override { return this->obj_id_size; }
+    /**
+     * Returns the size of a \c methodID on the connected VM, in bytes.
+     */
+    uint8_t GetMethodIdSizeImpl() override { return this->method_id_size; }
+    /**
+     * Returns the size of a \c fieldID on the connected VM, in bytes.
+     */
+    uint8_t GetFieldIdSizeImpl() override { return this->field_id_size; }
+    /**
+     * Returns the size of a \c frameID on the connected VM, in bytes.
+     */
+    uint8_t GetFrameIdSizeImpl() override { return this->frame_id_size; }
+
+    /**
+     * Registers the given \c handler, which will have the appropriate \c Handle
+     * function invoked when an event packet is recieved. Starts the dispatch
+     * workers when the first pooled handler is registered.
+     */
+    void RegisterEventHandlerImpl(unique_ptr<Handler> handler,
+        JdwpDispatchMode mode) override {
+      if (mode == JdwpDispatchMode::kInline) {
+        this->inline_handlers.Add(move(handler));
+        return;
+      }
+      if (mode == JdwpDispatchMode::kFastResume) {
+        this->fast_resume_handlers.Add(move(handler));
+        this->fast_resume = true;
+        return;
+      }
+
+      lock_guard<mutex> l(this->dispatcher_lck);
+      if (!this->owned_dispatcher) {
+        this->owned_dispatcher.reset(
+            new JdwpEventDispatcher(this->options.dispatch_threads));
+        this->dispatcher = this->owned_dispatcher.get();
+      }
+      this->owned_dispatcher->RegisterHandler(move(handler));
+    }
+
+    /**
+     * Marks the event request handlers know as \c request_id as one whose
+     * events are resumed as soon as they've been to the fast-resume handlers.
+     */
+    void FastResumeImpl(int32_t request_id) override {
+      this->fast_resume_requests.Mark(request_id);
+    }
+
+    void SendMessageImpl(unique_ptr<IJdwpCommandPacket> message,
+        unique_ptr<ReplyHandler> on_reply) override {
+      this->Send(move(message), move(on_reply), this->options.reconnect);
+    }
+
+    /**
+     * Serializes the given message and queues it to be send to the JVM, unless
+     * \c outgoing is full.
+     *
+     * @param message The message to send. Only moved from if it was queued.
+     * @param on_reply The handler for the reply, may be \c nullptr. Only moved
+     * from if the message was queued.
+     *
+     * @return Whether the message was queued.
+     */
+    bool TrySendMessageImpl(unique_ptr<IJdwpCommandPacket>& message,
+        unique_ptr<ReplyHandler>& on_reply) override {
+      uint32_t id = message->GetId();
+      SerializeScratch scratch;
+      string& buffer = scratch.Get();
+      message->SerializeTo(buffer, *this);
+      CommandCounters* counters = this->command_stats.For(buffer);
+      size_t size = buffer.size();
+      // A handler given to an untracked Set command is the connection's own,
+      // and isn't handed back if the message is rejected.
+      bool had_reply = static_cast<bool>(on_reply);
+      int32_t cleared = this->fast_resume_requests.Clears(buffer);
+      EventRequestTracker::Sending sending;
+      if (this->options.reconnect) {
+        sending = this->TrackEventRequest(*message, buffer, on_reply);
+      }
+      bool has_reply = static_cast<bool>(on_reply);
+      if (has_reply && !this->RegisterPending(id, message, on_reply, counters,
+            move(sending.set))) {
+        // Already failed as closed, which counts as handing it off
+        this->event_requests.Apply(sending);
+        this->fast_resume_requests.Forget(cleared);
+        return true;
+      }
+
+      if (!this->TryQueueSerialized(buffer)) {
+        this->rejected_sends++;
+        if (!has_reply) return false;
+        PendingReplyTable::Pending pending;
+        if (this->pending_replies.Take(id, pending)) {
+          message = move(pending.request);
+          if (had_reply) on_reply = move(pending.handler);
+          return false;
+        }
+        // The connection closed and failed the message in the meantime, which
+        // also counts as handing it off.
+        this->event_requests.Apply(sending);
+        this->fast_resume_requests.Forget(cleared);
+        return true;
+      }
+      this->event_requests.Apply(sending);
+      this->fast_resume_requests.Forget(cleared);
+      CountRequest(counters, std::string_view(buffer.data(), size));
+      this->NoteIfResume(buffer);
+      this->ScheduleFlush();
+      return true;
+    }
+  private:
+    /**
+     * Where the VM was connected to, to connect to it again.
+     */
+    const string address;
+    const uint16_t port;
+
+    unique_ptr<JdwpSocket> socket;
+    /**
+     * Held while \c socket is replaced, and while threads other than the
+     * reactor's read it. \c retired_socket_stats totals the sockets replaced.
+     */
+    mutable mutex socket_lck;
+    JdwpSocketStats retired_socket_stats{};
+
+    /**
+     * The reactor driving this connection, if this connection owns it.
+     * Connections created through a \c JdwpConPool borrow one of the pool's
+     * reactors instead.
+     */
+    unique_ptr<JdwpReactor> owned_reactor;
+    JdwpReactor* reactor;
+
+    const JdwpConOptions options;
+
+    std::atomic_bool flush_scheduled;
+    /**
+     * Shared with every flush posted to the reactor, which only runs while
+     * \c con is set. Flushes hold \c lck while they run, so once it's been
+     * cleared none is running either.
+     */
+    struct FlushGuard {
+      mutex lck;
+      Impl* con;
+    };
+    std::shared_ptr<FlushGuard> flush_guard;
+    /**
+     * Set as this is torn down, after which a flush doesn't post another for
+     * what it left queued.
+     */
+    std::atomic_bool retiring{false};
+    /**
+     * Set once the connection has been closed, only written on the reactor's
+     * thread. Cleared again once it's reestablished.
+     */
+    std::atomic_bool closed;
+
+    /**
+     * Reestablishes the connection once it's lost, if
+     * \c JdwpConOptions::reconnect. Woken through \c reconnect_cv when
+     * \c reconnect_needed or \c stopping is set, under \c reconnect_lck,
+     * which also guards \c reconnect_handlers and \c replay_handlers.
+     */
+    std::thread reconnect_thread;
+    mutex reconnect_lck;
+    std::condition_variable reconnect_cv;
+    bool reconnect_needed = false;
+    bool stopping = false;
+    vector<std::function<void()>> reconnect_handlers;
+    vector<JdwpReplayHandler> replay_handlers;
+    std::atomic<uint64_t> reconnects{0};
+
+    /**
+     * The event requests to set again after reconnecting, if
+     * \c JdwpConOptions::reconnect, and a reply whose request ID had to be
+     * changed. \c translated_reply is only accessed on the reactor's thread.
+     */
+    EventRequestTracker event_requests;
+    string translated_reply;
+
+    /**
+     * The ID sizes reported by the VM, fetched once when first connecting,
+     * and kept when reconnecting as the VM is the same one. Set before
+     * \c id_sizes_known.
+     */
+    std::atomic_bool id_sizes_known;
+    std::atomic<uint8_t> obj_id_size;
+    std::atomic<uint8_t> method_id_size;
+    std::atomic<uint8_t> field_id_size;
+    std::atomic<uint8_t> frame_id_size;
+
+    /**
+     * Serialized messages waiting to be written, pushed by any thread and
+     * popped by the reactor's.
+     */
+    impl::BoundedMpscQueue<string> outgoing;
+    /**
+     * Lets senders sleep while \c outgoing is full.
+     */
+    mutex space_lck;
+    std::condition_variable space_cv;
+    std::atomic<size_t> space_waiters;
+    std::atomic<uint64_t> blocked_sends;
+    std::atomic<uint64_t> rejected_sends;
+
+    /**
+     * The rest of this group is only accessed on the reactor's thread.
+     *
+     * The messages popped from \c outgoing in one flush, ready to be written.
+     * Small messages are packed back to back into shared segments, large ones
+     * get a segment of their own so they're never copied. The first
+     * \c write_offset bytes of the first segment have already been written.
+     */
+    vector<string> write_segments;
+    size_t write_offset = 0;
+    vector<std::string_view> write_views;
+    /**
+     * Written segments kept around so their storage can be reused.
+     */
+    vector<string> spare_segments;
+    /**
+     * Recieves each message popped from \c outgoing.
+     */
+    string popped;
+
+    /**
+     * Keeps \c segment, once written, as a spare if there's room for it.
+     */
+    void RecycleSegment(string&& segment) {
+      if (this->spare_segments.size() >= kMaxSpareSegments ||
+          segment.capacity() > kMaxRetainedBuffer) {
+        return;
+      }
+      segment.clear();
+      this->spare_segments.push_back(move(segment));
+    }
+
+    /**
+     * Returns an empty segment, reusing a spare one if possible.
+     */
+    string TakeSpareSegment() {
+      if (this->spare_segments.empty()) return string();
+      string res = move(this->spare_segments.back());
+      this->spare_segments.pop_back();
+      return res;
+    }
+
+    /**
+     * Messages which are waiting on a reply.
+     */
+    PendingReplyTable pending_replies;
+
+    /**
+     * Hols all currently registered \c JdwpDispatchMode::kInline handlers
      */
-    explicit Impl(uint16_t port) : Impl("localhost", port) { }
+    impl::HandlerList inline_handlers;
     /**
-     * Creates a new \c JdwpCon::Impl, connected to \c address.
-     *
-     * @param address The address to connect to. Should just be a host name,
-     * not a URI.
-     * @param port The port to connect on. Should be in host byte order.
+     * Holds all currently registered \c JdwpDispatchMode::kFastResume
+     * handlers. \c fast_resume is set once there are any.
+     */
+    impl::HandlerList fast_resume_handlers;
+    std::atomic_bool fast_resume{false};
+    /**
+     * Holds all currently registered packet handlers.
+     */
+    impl::CopyOnWriteList<JdwpPacketHandler> packet_handlers;
+    /**
+     * The requests whose events are resumed once those handlers have seen
+     * them.
+     */
+    FastResumeRequests fast_resume_requests;
+
+    /**
+     * Times what events leave suspended.
+     */
+    SuspensionTracker suspensions;
+
+    /**
+     * Counts the traffic for \c GetStats. The event counters are only
+     * written on the reactor's thread.
+     */
+    CommandStatsTable command_stats;
+    std::array<std::atomic<uint64_t>, 256> event_counts{};
+    std::atomic<uint64_t> event_packets{0};
+    std::atomic<uint64_t> event_bytes{0};
+    impl::AtomicDurationHistogram inline_handler_time;
+
+    /**
+     * Recycles decoded events, so steady event traffic doesn't allocate.
+     * \c decoded_events is only accessed on the reactor's thread.
+     */
+    JdwpEventPool event_pool;
+    vector<JdwpEventPool::Ptr> decoded_events;
+
+    /**
+     * Delivers events to \c JdwpDispatchMode::kPooled handlers, once one has
+     * been registered. Declared after \c event_pool, so that it's stopped
+     * before the pool its events return to is destroyed.
+     */
+    unique_ptr<JdwpEventDispatcher> owned_dispatcher;
+    std::atomic<JdwpEventDispatcher*> dispatcher;
+    mutable mutex dispatcher_lck;
+
+    /**
+     * Recieves every packet before it's dispatched, if attached. \c recording
+     * is checked first, so reads don't touch \c recorder when there isn't
+     * one.
+     */
+    std::shared_ptr<JdwpRecorder> recorder;
+    std::atomic<bool> recording{false};
+
+    /**
+     * The reply being handed to its handler in parts as it's recieved, if
+     * \c streamed, whether it carried an error code, and how much of it has
+     * been recieved. Only accessed on the reactor's thread.
+     */
+    PendingReplyTable::Pending streamed_reply;
+    bool streamed = false;
+    bool streamed_error = false;
+    size_t streamed_bytes = 0;
+
+    /**
+     * Resumes whatever the composite event made up of \c events suspended.
+     */
+    void ResumeAfter(const vector<JdwpEventPool::Ptr>& events) {
+      using command_packets::thread_reference::ResumeCommand;
+      using VmResumeCommand = command_packets::virtual_machine::ResumeCommand;
+      if (events.empty()) return;
+      JdwpSuspendPolicy policy = events.front()->GetSuspendPolicy();
+      if (policy == JdwpSuspendPolicy::kAll) {
+        this->SendMessageImpl(std::make_unique<VmResumeCommand>(), nullptr);
+      } else if (policy == JdwpSuspendPolicy::kEventThread) {
+        // Every event in a composite happened on the same thread, if any
+        for (auto& event : events) {
+          uint64_t thread;
+          if (!event->GetThreadId(thread)) continue;
+          auto resume = std::make_unique<ResumeCommand>();
+          std::get<0>(resume->GetFields()) << thread;
+          this->SendMessageImpl(move(resume), nullptr);
+          break;
+        }
+      }
+    }
+
+    /**
+     * Stops timing whatever \c packet resumes, if it's a resume command. Only
+     * looks at \c packet while something is suspended.
+     */
+    void NoteIfResume(std::string_view packet) {
+      if (!this->suspensions.Any() || packet.size() < impl::kHeaderLen) {
+        return;
+      }
+      auto command_set = static_cast<commands::CommandSet>(packet[9]);
+      uint8_t command = packet[10];
+      if (command_set == commands::CommandSet::kVirtualMachine &&
+          command == static_cast<uint8_t>(commands::VirtualMachine::kResume)) {
+        this->suspensions.ResumedVm();
+      } else if (command_set == commands::CommandSet::kThreadReference &&
+          command == static_cast<uint8_t>(commands::ThreadReference::kResume) &&
+          packet.size() >= impl::kHeaderLen + this->obj_id_size) {
+        uint64_t thread = 0;
+        for (size_t i = 0; i < this->obj_id_size; i++) {
+          thread = (thread << 8) |
+            static_cast<uint8_t>(packet[impl::kHeaderLen + i]);
+        }
+        this->suspensions.ResumedThread(thread);
+      }
+    }
+
+    /**
+     * Stops watching the socket once the connection has been closed, drops
+     * what was still to be written to it, and fails every message still
+     * waiting on a reply. Wakes \c reconnect_thread, if there is one. Only
+     * called on the reactor's thread.
+     */
+    void HandleClosed() {
+      this->closed = true;
+      this->WakeBlockedSenders();
+      this->reactor->Unwatch(this->socket->GetFd());
+      this->DropUnwritten();
+      this->FailStreamed();
+      for (auto& pending : this->pending_replies.TakeAll()) {
+        FailPending(pending);
+      }
+      if (this->options.reconnect) {
+        // The VM resumes everything once its debugger is gone
+        this->suspensions.ResumedVm();
+        {
+          lock_guard<mutex> l(this->reconnect_lck);
+          this->reconnect_needed = true;
+        }
+        this->reconnect_cv.notify_all();
+      }
+    }
+
+    /**
+     * Runs on \c reconnect_thread, connecting again each time the connection
+     * is lost, until \c stopping.
+     */
+    void ReconnectLoop() {
+      std::unique_lock<mutex> l(this->reconnect_lck);
+      while (true) {
+        this->reconnect_cv.wait(l, [this]() {
+          return this->stopping || this->reconnect_needed;
+        });
+        if (this->stopping) return;
+        this->reconnect_needed = false;
+        std::chrono::milliseconds delay = this->options.reconnect_delay;
+        for (size_t attempt = 0; this->options.reconnect_attempts == 0 ||
+            attempt < this->options.reconnect_attempts; attempt++) {
+          if (this->reconnect_cv.wait_for(l, delay,
+                [this]() { return this->stopping; })) {
+            return;
+          }
+          l.unlock();
+          bool connected = this->TryReconnect();
+          l.lock();
+          if (connected) break;
+          delay = std::min(delay * 2, this->options.max_reconnect_delay);
+        }
+      }
+    }
+
+    /**
+     * Connects to the VM again, and has the reactor switch to the new
+     * connection.
      *
-     * @throws std::system_error if there is a system error
-     * creating/reading/writing to the socket created.
+     * @return Whether the VM could be connected to.
      */
-    explicit Impl(const string& address, uint16_t port) :
-        socket(new JdwpSocket(address, port)),
-        should_cancel(false),
-        write_thread(&Impl::OutgoingMessageQueueHandler, this),
-        read_thread(&Impl::IncomingMessageQueueHandler, this) { }
+    bool TryReconnect() {
+      unique_ptr<JdwpSocket> socket;
+      try {
+        socket.reset(new JdwpSocket(this->address, this->port));
+        socket->SetNoDelay(this->options.no_delay);
+      } catch (const JdwpException& e) {
+        return false;
+      } catch (const std::system_error& e) {
+        return false;
+      }
+      // The reactor's callbacks use the old socket until they return, so it's
+      // only replaced on the reactor's thread. That's waited for, so nothing
+      // posted outlives \c this.
+      std::promise<void> switched;
+      this->reactor->Post([this, &socket, &switched]() {
+        this->Reconnected(move(socket));
+        switched.set_value();
+      });
+      switched.get_future().wait();
+      return true;
+    }
 
-    // No copies/default constructor
-    Impl() = delete;
-    Impl(const Impl& copy) = delete;
-    Impl& operator=(const Impl& other) = delete;
+    /**
+     * Switches to \c socket, a new connection to the VM, sets again every
+     * event request set on the old one, and calls the reconnect handlers,
+     * before reading anything from it. Runs on the reactor's thread.
+     */
+    void Reconnected(unique_ptr<JdwpSocket> socket) {
+      {
+        lock_guard<mutex> l(this->socket_lck);
+        AddSocketStats(this->retired_socket_stats, this->socket->GetStats());
+        this->socket = move(socket);
+      }
+      this->closed = false;
+      this->reconnects++;
+      vector<int32_t> dropped;
+      this->Replay(this->event_requests.Reset(dropped));
+      for (int32_t request_id : dropped) {
+        this->NotifyReplayed(request_id, nullptr);
+      }
 
-    // Not moveable
-    Impl(Impl&& other) = delete;
-    Impl& operator=(Impl&& other) = delete;
+      vector<std::function<void()>> handlers;
+      {
+        lock_guard<mutex> l(this->reconnect_lck);
+        handlers = this->reconnect_handlers;
+      }
+      for (auto& handler : handlers) handler();
 
-    ~Impl() override {
-      this->should_cancel = true;
-      if (write_thread.joinable()) {
-        write_thread.join();
+      try {
+        this->reactor->Watch(this->socket->GetFd(),
+            [this]() { this->OnReadable(); },
+            [this]() { this->HandleClosed(); });
+      } catch (const std::system_error& e) {
+        this->HandleClosed();
+      }
+    }
+
+    /**
+     * Sets again each of \c replays, as the first thing sent on a new
+     * connection. Those that name types are only set once every type they
+     * name has been found again by its signature, as the IDs they had on the
+     * old connection mean nothing on this one. Runs on the reactor's thread.
+     */
+    void Replay(vector<EventRequestTracker::Replay> replays) {
+      using command_packets::virtual_machine::ClassesBySignatureCommand;
+      auto lookups = std::make_shared<TypeLookups>();
+      std::unordered_set<string> signatures;
+      for (auto& replay : replays) {
+        if (replay.signatures.empty()) {
+          this->SendReplay(replay.request_id, std::move(replay.fields));
+          continue;
+        }
+        for (auto& named : replay.signatures) {
+          signatures.insert(named.second);
+        }
+        lookups->replays.push_back(std::move(replay));
       }
-      if (read_thread.joinable()) {
-        read_thread.join();
+      lookups->remaining = signatures.size();
+      for (const string& signature : signatures) {
+        auto command = std::make_unique<ClassesBySignatureCommand>();
+        std::get<0>(command->GetFields()) << signature;
+        this->Send(move(command), std::make_unique<
+            impl::CallbackReplyHandler<ClassesBySignatureCommand>>(
+              [this, lookups, signature](
+                  ClassesBySignatureCommand::ReplyFields& reply) {
+                // With several class loaders' classes to choose from, there's
+                // no telling which one the request meant
+                auto& classes = std::get<0>(reply);
+                if (classes.size() == 1) {
+                  lookups->found[signature] =
+                    std::get<1>(classes[0]).GetValue();
+                }
+                if (--lookups->remaining == 0) this->LookedUp(*lookups);
+              },
+              [this, lookups](std::exception_ptr error) {
+                static_cast<void>(error);
+                if (--lookups->remaining == 0) this->LookedUp(*lookups);
+              }), false);
       }
     }
 
-  protected:
-#warning Fix Get(type)IdSize to use messages once implemented
     /**
-     * Returns the size of an \c objectID on the connected VM, in bytes.
+     * Sets again the requests in \c lookups, now that the types they name
+     * have been looked up. Those naming a type that wasn't found are
+     * forgotten. If the connection was lost in the meantime, they're all
+     * left to be set again on the next one.
      */
-    uint8_t GetObjIdSizeImpl() override { return 0; }
+    void LookedUp(TypeLookups& lookups) {
+      if (this->closed) return;
+      for (auto& [signature, type] : lookups.found) {
+        this->event_requests.Named(type, signature);
+      }
+      for (auto& replay : lookups.replays) {
+        bool found = true;
+        VisitTypeIds(replay.fields, [&](uint64_t& type) {
+          auto it = lookups.found.find(replay.signatures[type]);
+          if (it == lookups.found.end()) {
+            found = false;
+          } else {
+            type = it->second;
+          }
+        });
+        if (!found) {
+          this->event_requests.ReplayFailed(replay.request_id);
+          this->NotifyReplayed(replay.request_id, nullptr);
+          continue;
+        }
+        this->SendReplay(replay.request_id, std::move(replay.fields));
+      }
+    }
+
     /**
-     * Returns the size of a \c methodID on the connected VM, in bytes.
+     * Sets again, as \c fields, the request first given \c request_id.
      */
-    uint8_t GetMethodIdSizeImpl() override { return 0; }
+    void SendReplay(int32_t request_id, SetCommand::Fields fields) {
+      auto command = std::make_unique<SetCommand>();
+      command->GetFields() = std::move(fields);
+      this->Send(move(command), std::make_unique<ReplayReplyHandler>(
+            this->event_requests, request_id,
+            [this](uint8_t kind, int32_t vm_id) {
+              using command_packets::event_request::ClearCommand;
+              auto clear = std::make_unique<ClearCommand>();
+              std::get<0>(clear->GetFields()) << kind;
+              std::get<1>(clear->GetFields()) << vm_id;
+              this->Send(move(clear), nullptr, false);
+            },
+            [this, request_id](const SetCommand* set) {
+              this->NotifyReplayed(request_id, set);
+            }), false);
+    }
+
     /**
-     * Returns the size of a \c fieldID on the connected VM, in bytes.
+     * Tells the replay handlers how the request first given \c request_id
+     * was set again, or that it was dropped if \c set is \c nullptr. Runs
+     * on the reactor's thread.
      */
-    uint8_t GetFieldIdSizeImpl() override { return 0; }
+    void NotifyReplayed(int32_t request_id, const SetCommand* set) {
+      vector<JdwpReplayHandler> handlers;
+      {
+        lock_guard<mutex> l(this->reconnect_lck);
+        handlers = this->replay_handlers;
+      }
+      for (auto& handler : handlers) handler(request_id, set);
+    }
+
     /**
-     * Returns the size of a \c frameID on the connected VM, in bytes.
+     * Starts reading from \c socket, fetches the ID sizes of the VM, and
+     * starts \c reconnect_thread if needed. Called once by each constructor.
+     *
+     * @throws JdwpException if the VM doesn't report usable ID sizes.
      */
-    uint8_t GetFrameIdSizeImpl() override { return 0; }
+    void Start() {
+      this->socket->SetNoDelay(this->options.no_delay);
+      this->reactor->Watch(this->socket->GetFd(),
+          [this]() { this->OnReadable(); },
+          [this]() { this->HandleClosed(); });
+      try {
+        this->FetchIdSizes();
+      } catch (...) {
+        // The destructor won't run, so make sure the reactor is done with
+        // this before it goes away.
+        this->retiring = true;
+        this->reactor->Unwatch(this->socket->GetFd());
+        this->RetireFlushes();
+        this->closed = true;
+        for (auto& pending : this->pending_replies.TakeAll()) {
+          FailPending(pending);
+        }
+        throw;
+      }
+      if (this->options.reconnect) {
+        this->reconnect_thread = std::thread([this]() {
+          this->ReconnectLoop();
+        });
+      }
+    }
 
     /**
-     * Registers the given \c handler, which will have the appropriate \c Handle
-     * function invoked when an event packet is recieved.
+     * Asks the VM for its ID sizes and caches them, so that encoding an ID
+     * never has to.
+     *
+     * @throws JdwpException if the VM doesn't report usable ID sizes.
      */
-    void RegisterEventHandlerImpl(unique_ptr<Handler> handler) override {
-      lock_guard<mutex> l(this->event_handlers_lck);
-      this->event_handlers.push_back(move(handler));
+    void FetchIdSizes() {
+      using command_packets::virtual_machine::IDSizesCommand;
+      auto reply = this->SendAsync(std::make_unique<IDSizesCommand>());
+      if (reply.wait_for(kIdSizesTimeout) != std::future_status::ready) {
+        throw JdwpException("Timed out waiting for ID sizes");
+      }
+      IDSizesCommand::ReplyFields sizes = reply.get();
+
+      auto checked = [](JdwpInt& size) {
+        if (size.GetValue() <= 0 ||
+            size.GetValue() > static_cast<int32_t>(sizeof(uint64_t))) {
+          throw JdwpException("Unsupported ID size");
+        }
+        return static_cast<uint8_t>(size.GetValue());
+      };
+      // The reply holds the fieldID, methodID, objectID, referenceTypeID and
+      // frameID sizes, in that order. Reference types are sent as objectIDs.
+      this->field_id_size = checked(std::get<0>(sizes));
+      this->method_id_size = checked(std::get<1>(sizes));
+      this->obj_id_size = checked(std::get<2>(sizes));
+      this->frame_id_size = checked(std::get<4>(sizes));
+      this->CacheIdSizes(this->field_id_size, this->method_id_size,
+          this->obj_id_size, this->frame_id_size);
+      this->id_sizes_known = true;
     }
 
     /**
-     * Queues the given message to be send to the JVM.
+     * Serializes the given message, queues it to be send to the JVM, and wakes
+     * the reactor to write it out. Blocks while \c outgoing is full.
      *
      * @param message The message to send.
+     * @param on_reply The handler for the reply, may be \c nullptr.
+     * @param track Whether \c message may be an event request to set again
+     * after reconnecting. Those the connection sends itself aren't.
      */
-    void SendMessageImpl(unique_ptr<IJdwpCommandPacket> message) override {
-        lock_guard<mutex> l(this->outgoing_messages_lck);
-        this->outgoing_messages.push(move(message));
+    void Send(unique_ptr<IJdwpCommandPacket> message,
+        unique_ptr<ReplyHandler> on_reply, bool track) {
+      uint32_t id = message->GetId();
+      SerializeScratch scratch;
+      string& buffer = scratch.Get();
+      message->SerializeTo(buffer, *this);
+      CommandCounters* counters = this->command_stats.For(buffer);
+      int32_t cleared = this->fast_resume_requests.Clears(buffer);
+      EventRequestTracker::Sending sending;
+      if (track) {
+        sending = this->TrackEventRequest(*message, buffer, on_reply);
+      }
+      // All that's left is queueing it or failing it as closed, and either way
+      // it's been handed off.
+      this->event_requests.Apply(sending);
+      this->fast_resume_requests.Forget(cleared);
+      if (on_reply && !this->RegisterPending(id, message, on_reply, counters,
+            move(sending.set))) {
+        return;
+      }
+      CountRequest(counters, buffer);
+      this->NoteIfResume(buffer);
+
+      if (!this->TryQueueSerialized(buffer)) {
+        this->blocked_sends++;
+        while (!this->TryQueueSerialized(buffer)) {
+          if (this->closed) {
+            PendingReplyTable::Pending pending;
+            if (this->pending_replies.Take(id, pending)) FailPending(pending);
+            return;
+          }
+          if (this->reactor->InReactorThread()) {
+            // This thread is the one that drains the queue, so waiting would
+            // never end. Write out what's queued to make room instead.
+            this->FlushOutgoing(true);
+            continue;
+          }
+          this->ScheduleFlush();
+          std::unique_lock<mutex> l(this->space_lck);
+          this->space_waiters++;
+          this->space_cv.wait_for(l, kSendQueueRetry, [this]() {
+            return this->closed ||
+                this->outgoing.Size() < this->outgoing.Capacity();
+          });
+          this->space_waiters--;
+        }
+      }
+      this->ScheduleFlush();
+    }
+
+    /**
+     * Looks at \c message, just serialized into \c serialized, as an event
+     * request to set again after reconnecting, rewriting \c serialized if it
+     * needs to. \c Set commands sent without a handler are given one, as
+     * their replies carry the request's ID.
+     *
+     * @return What was found in \c message, to pass to
+     * \c EventRequestTracker::Apply once it's been handed off.
+     */
+    EventRequestTracker::Sending TrackEventRequest(
+        const IJdwpCommandPacket& message, string& serialized,
+        unique_ptr<ReplyHandler>& on_reply) {
+      auto res = this->event_requests.OnSend(message, serialized);
+      if (res.set && !on_reply) {
+        on_reply = std::make_unique<IgnoredReplyHandler>();
+      }
+      return res;
     }
-  private:
-    unique_ptr<JdwpSocket> socket;
 
-    std::atomic_bool should_cancel;
-    thread write_thread, read_thread;
-    queue<unique_ptr<IJdwpCommandPacket>> outgoing_messages;
-    mutex outgoing_messages_lck;
+    /**
+     * Registers \c on_reply to recieve the reply to \c message. The reply
+     * can't arrive before the message is written, so registering the handler
+     * before queueing the message means the reactor always finds it.
+     *
+     * @return \c false if the connection has already closed, in which case
+     * \c on_reply has been failed.
+     */
+    bool RegisterPending(uint32_t id, unique_ptr<IJdwpCommandPacket>& message,
+        unique_ptr<ReplyHandler>& on_reply, CommandCounters* counters,
+        unique_ptr<EventRequestTracker::Sent> event_request) {
+      bool streams =
+        dynamic_cast<StreamingReplyHandler*>(on_reply.get()) != nullptr;
+      this->pending_replies.Insert(id, { move(message), move(on_reply),
+          counters, counters ? std::chrono::steady_clock::now() :
+            std::chrono::steady_clock::time_point(), streams,
+          move(event_request) });
+      // If the connection closed after we checked, the reactor may have
+      // already failed everything that was pending, so fail this too.
+      PendingReplyTable::Pending pending;
+      if (this->closed && this->pending_replies.Take(id, pending)) {
+        FailPending(pending);
+        return false;
+      }
+      return true;
+    }
 
     /**
-     * Maps from message IDs to their replies.
+     * Pushes \c buffer, a serialized message, onto \c outgoing, unless it's
+     * full.
+     *
+     * @return Whether the message was queued.
      */
-    std::map<uint32_t, shared_ptr<void>> incoming_messages;
-    mutex incoming_messages_lck;
+    bool TryQueueSerialized(string& buffer) {
+      // Small messages are copied into the queue's slot, reusing its storage.
+      // A large one is worth handing over, the next message from this thread
+      // will just need a new buffer.
+      bool queued = buffer.size() >= kLargeMessage ?
+          this->outgoing.TryPush(move(buffer)) :
+          this->outgoing.TryPush(buffer);
+      if (queued && buffer.capacity() > kMaxRetainedBuffer) {
+        string().swap(buffer);
+      }
+      return queued;
+    }
 
     /**
-     * Hols all currently registered event handlers
+     * Posts a flush to the reactor, unless one is already pending. It will
+     * pick up anything queued before it runs.
      */
-    vector<unique_ptr<Handler>> event_handlers;
-    mutex event_handlers_lck;
+    void ScheduleFlush() {
+      if (!this->flush_scheduled.exchange(true)) {
+        this->reactor->Post([guard = this->flush_guard]() {
+          lock_guard<mutex> l(guard->lck);
+          if (guard->con) guard->con->FlushOutgoing();
+        });
+      }
+    }
 
     /**
-     * Dispatches outgoing messages to \c socket.
+     * Makes every flush still to run do nothing, waiting out one that's
+     * running. Called before this is torn down.
      */
-    void OutgoingMessageQueueHandler() {
-      while (!this->should_cancel) {
-        unique_ptr<IJdwpCommandPacket> next_packet;
-        if (!this->outgoing_messages.empty()) {
-          {
-            lock_guard<mutex> l(outgoing_messages_lck);
-            next_packet = move(this->outgoing_messages.front());
-            this->outgoing_messages.pop();
-          }
-          this->socket->Write(next_packet->Serialize(*this));
+    void RetireFlushes() {
+      if (this->reactor->InReactorThread()) {
+        // Any flush that's running is further up this thread's stack, so
+        // waiting for it would never end.
+        this->flush_guard->con = nullptr;
+        return;
+      }
+      lock_guard<mutex> l(this->flush_guard->lck);
+      this->flush_guard->con = nullptr;
+    }
+
+    /**
+     * Wakes any senders waiting for room in \c outgoing.
+     */
+    void WakeBlockedSenders() {
+      if (this->space_waiters > 0) {
+        lock_guard<mutex> l(this->space_lck);
+        this->space_cv.notify_all();
+      }
+    }
+
+    /**
+     * Writes queued outgoing messages to \c socket in a single batch, as much
+     * of it as the socket will take. The rest is written before anything else
+     * by the flush the reactor runs once the socket can take more, and until
+     * then nothing more is taken from \c outgoing, so a VM that's slow to read
+     * holds up senders rather than the reactor. Runs on the reactor's thread.
+     *
+     * @param block Whether to wait for the socket to take the whole batch.
+     */
+    void FlushOutgoing(bool block = false) {
+      // Exchanged rather than stored, so that this synchronizes with the
+      // sender that set it and sees what that sender queued.
+      this->flush_scheduled.exchange(false);
+
+      // Take at most a queue's worth, so a steady stream of sends can't keep
+      // the reactor from reading. Nothing's taken while an earlier batch is
+      // still being written.
+      bool backlogged = !this->write_segments.empty();
+      for (size_t taken = 0; !backlogged &&
+          taken < this->outgoing.Capacity() &&
+          this->outgoing.TryPop(this->popped); taken++) {
+        // Once closed, the queue is only drained so blocked senders can move
+        // on.
+        if (this->closed) continue;
+        if (this->popped.size() >= kLargeMessage) {
+          this->write_segments.push_back(move(this->popped));
+          this->popped.clear();
         } else {
-          std::this_thread::yield();
+          if (this->write_segments.empty() ||
+              this->write_segments.back().size() >= kLargeMessage) {
+            this->write_segments.push_back(this->TakeSpareSegment());
+          }
+          this->write_segments.back() += this->popped;
+        }
+      }
+      this->WakeBlockedSenders();
+
+      if (!this->closed && !this->write_segments.empty()) {
+        this->write_views.assign(this->write_segments.begin(),
+            this->write_segments.end());
+        this->write_views.front().remove_prefix(this->write_offset);
+        try {
+          if (this->options.cork_batches) this->socket->SetCork(true);
+          size_t written = 0;
+          if (block) {
+            this->socket->Write(this->write_views);
+            for (auto& view : this->write_views) written += view.size();
+          } else {
+            written = this->socket->TryWrite(this->write_views);
+          }
+          if (this->options.cork_batches) this->socket->SetCork(false);
+          this->ReleaseWritten(written);
+          if (!this->write_segments.empty()) {
+            this->reactor->WatchWritable(this->socket->GetFd(),
+                [this]() { this->FlushOutgoing(); });
+          }
+        } catch (const JdwpException& e) {
+          this->HandleClosed();
+        } catch (const std::system_error& e) {
+          this->HandleClosed();
         }
+        this->write_views.clear();
+      }
+      if (this->popped.capacity() > kMaxRetainedBuffer) {
+        string().swap(this->popped);
+      }
+
+      // A batch still being written is picked up again once the socket can
+      // take more.
+      if (this->write_segments.empty() && !this->outgoing.Empty() &&
+          !this->retiring) {
+        this->ScheduleFlush();
       }
     }
 
     /**
-     * Dispatches incoming messages to registered handlers.
+     * Drops the first \c written bytes still to be written from
+     * \c write_segments, which the socket has taken.
      */
-    void IncomingMessageQueueHandler() {
-      while (!this->should_cancel) {
-        if (this->socket->CanRead()) {
-          string header = this->socket->Read(impl::kHeaderLen);
-          uint32_t total_len = ntohl(
-              // Read the first four bytes of the header as a length.
-              *reinterpret_cast<uint32_t*>(header.data()));
-          string body = this->socket->Read(total_len - impl::kHeaderLen);
-          string packet = header + body;
-          if (HeaderIsEvent(header)) {
-            auto events = IJdwpEvent::FromComposite(packet, *this);
-            for (auto& event : events) {
-              for (auto& handler : event_handlers) {
-                event->Dispatch(*handler);
-              }
+    void ReleaseWritten(size_t written) {
+      written += this->write_offset;
+      size_t done = 0;
+      while (done < this->write_segments.size() &&
+          written >= this->write_segments[done].size()) {
+        written -= this->write_segments[done].size();
+        this->RecycleSegment(move(this->write_segments[done]));
+        done++;
+      }
+      this->write_segments.erase(this->write_segments.begin(),
+          this->write_segments.begin() + done);
+      this->write_offset = written;
+    }
+
+    /**
+     * Drops whatever of \c write_segments hasn't been written, once it never
+     * will be.
+     */
+    void DropUnwritten() {
+      for (string& segment : this->write_segments) {
+        this->RecycleSegment(move(segment));
+      }
+      this->write_segments.clear();
+      this->write_offset = 0;
+    }
+
+    /**
+     * Reads whatever data is available, and dispatches each complete message
+     * in it: to registered handlers if it's an event, or to the sender's
+     * \c ReplyHandler if it's a reply. Runs on the reactor's thread whenever
+     * \c socket is readable.
+     */
+    void OnReadable() {
+      try {
+        this->socket->ReadAvailable();
+        std::shared_ptr<JdwpRecorder> recorder;
+        if (this->recording) recorder = std::atomic_load(&this->recorder);
+        std::string_view packet;
+        while (!this->closed) {
+          if (this->streamed) {
+            size_t remaining;
+            if (!this->socket->NextPacketPart(packet, remaining)) break;
+            this->StreamPart(packet, remaining);
+          } else if (this->socket->NextPacket(packet)) {
+            if (recorder) recorder->Append(packet);
+            this->Dispatch(packet);
+          } else if (recorder || !this->StartStreaming()) {
+            // Recordings hold whole packets, so nothing's streamed then
+            break;
+          }
+        }
+      } catch (const JdwpException& e) {
+        this->HandleClosed();
+      } catch (const std::system_error& e) {
+        this->HandleClosed();
+      }
+    }
+
+    /**
+     * Starts streaming the next packet to its handler, if it's a large reply
+     * whose handler can take it in parts, and its header has been recieved.
+     *
+     * @return Whether the packet is now being streamed.
+     */
+    bool StartStreaming() {
+      std::string_view header;
+      if (!this->socket->PeekHeader(header)) return false;
+      if (!(static_cast<uint8_t>(header[8]) &
+            static_cast<uint8_t>(JdwpFlags::kReply))) {
+        return false;
+      }
+      uint32_t len_nbo, id_nbo;
+      header.copy(reinterpret_cast<char*>(&len_nbo), sizeof(len_nbo), 0);
+      header.copy(reinterpret_cast<char*>(&id_nbo), sizeof(id_nbo), 4);
+      if (ntohl(len_nbo) < this->options.stream_replies_over) return false;
+      if (!this->pending_replies.TakeStreaming(ntohl(id_nbo),
+            this->streamed_reply)) {
+        return false;
+      }
+      this->streamed = true;
+      this->streamed_error = ReplyHasError(header);
+      this->streamed_bytes = 0;
+      return true;
+    }
+
+    /**
+     * Hands the next \c part of the reply being streamed to its handler.
+     *
+     * @param remaining How much of the reply is still to come after \c part.
+     */
+    void StreamPart(std::string_view part, size_t remaining) {
+      PendingReplyTable::Pending& pending = this->streamed_reply;
+      this->streamed_bytes += part.size();
+      if (remaining == 0) {
+        this->streamed = false;
+        CountReply(pending, this->streamed_error, this->streamed_bytes);
+      }
+      static_cast<StreamingReplyHandler&>(*pending.handler).OnReplyPart(
+          *pending.request, part, remaining, *this);
+      // Also covers the connection closing during the call
+      if (!this->streamed) this->streamed_reply = PendingReplyTable::Pending();
+    }
+
+    /**
+     * Fails the reply being streamed, if any, as it won't be finished. Leaves
+     * \c streamed_reply in place, as its handler may be the one closing the
+     * connection.
+     */
+    void FailStreamed() {
+      if (!this->streamed) return;
+      this->streamed = false;
+      FailPending(this->streamed_reply);
+    }
+
+    /**
+     * Hands a single complete message off to whoever is waiting for it.
+     *
+     * @param packet The message, including its header. Only valid until the
+     * next read from \c socket.
+     */
+    void Dispatch(std::string_view packet) {
+      if (HeaderIsEvent(packet)) {
+        // Events can't be decoded without the ID sizes. No handler can have
+        // been registered before they're fetched anyway, so nothing misses
+        // out on these.
+        if (!this->id_sizes_known) return;
+        try {
+          IJdwpEvent::FromComposite(packet, *this, this->event_pool,
+              this->decoded_events);
+        } catch (const JdwpException& e) {
+          // A malformed event packet doesn't affect the framing of anything
+          // after it, so just drop it.
+          return;
+        }
+        if (this->event_requests.Active()) {
+          for (auto& event : this->decoded_events) {
+            this->event_requests.OnEvent(*event);
+          }
+        }
+        this->event_packets.fetch_add(1, std::memory_order_relaxed);
+        this->event_bytes.fetch_add(packet.size(), std::memory_order_relaxed);
+        for (auto& event : this->decoded_events) {
+          this->event_counts[static_cast<uint8_t>(event->GetKind())].fetch_add(
+              1, std::memory_order_relaxed);
+        }
+        this->suspensions.Suspended(this->decoded_events);
+        auto handling_start = std::chrono::steady_clock::now();
+        if (this->fast_resume) {
+          impl::HandlerList::Snapshot fast = this->fast_resume_handlers.Get();
+          for (auto& event : this->decoded_events) {
+            for (auto& handler : *fast) {
+              event->Dispatch(*handler);
             }
-          } else {
-            lock_guard<mutex> l(incoming_messages_lck);
-            // add new message to the map
           }
-        } else {
-          std::this_thread::yield();
         }
+        // Only a composite made up entirely of events for fast-resume
+        // requests is resumed, as any other event may rely on what it
+        // suspended staying suspended
+        if (this->fast_resume_requests.All(this->decoded_events)) {
+          this->ResumeAfter(this->decoded_events);
+        }
+        impl::HandlerList::Snapshot handlers = this->inline_handlers.Get();
+        for (auto& event : this->decoded_events) {
+          for (auto& handler : *handlers) {
+            event->Dispatch(*handler);
+          }
+        }
+        auto packet_handlers = this->packet_handlers.Get();
+        for (auto& handler : *packet_handlers) {
+          handler(packet, *this);
+        }
+        this->inline_handler_time.Add(
+            std::chrono::steady_clock::now() - handling_start);
+        if (JdwpEventDispatcher* dispatcher = this->dispatcher) {
+          for (auto& event : this->decoded_events) {
+            dispatcher->Dispatch(move(event));
+          }
+        }
+        // Hand the events back to the pool for the next packet
+        this->decoded_events.clear();
+      } else if (static_cast<uint8_t>(packet[8]) &
+          static_cast<uint8_t>(JdwpFlags::kReply)) {
+        uint32_t id_nbo;
+        packet.copy(reinterpret_cast<char*>(&id_nbo), sizeof(id_nbo), 4);
+        PendingReplyTable::Pending pending;
+        // Replies to messages sent without a handler are dropped.
+        if (this->pending_replies.Take(ntohl(id_nbo), pending)) {
+          CountReply(pending, ReplyHasError(packet), packet.size());
+          std::string_view reply = packet;
+          if (pending.event_request && !ReplyHasError(packet)) {
+            reply = this->TranslateSetReply(*pending.event_request, packet);
+          }
+          pending.handler->OnReply(*pending.request, reply, *this);
+        }
+      }
+    }
+
+    /**
+     * Asks the VM for the signature of each of \c types, so that the event
+     * requests naming them can find them again after reconnecting.
+     */
+    void NameTypes(const vector<uint64_t>& types) {
+      using command_packets::reference_type::SignatureCommand;
+      EventRequestTracker& requests = this->event_requests;
+      for (uint64_t type : types) {
+        auto command = std::make_unique<SignatureCommand>();
+        std::get<0>(command->GetFields()) << type;
+        this->Send(move(command),
+            std::make_unique<impl::CallbackReplyHandler<SignatureCommand>>(
+              [&requests, type](SignatureCommand::ReplyFields& reply) {
+                requests.Named(type, std::get<0>(reply).GetValue());
+              },
+              [&requests, type](std::exception_ptr error) {
+                static_cast<void>(error);
+                requests.NameFailed(type);
+              }), false);
       }
     }
+
+    /**
+     * Records the event request \c sent, which the VM set with \c reply.
+     *
+     * @return \c reply with the ID handlers know the request by, which is
+     * only valid until the next reply.
+     */
+    std::string_view TranslateSetReply(EventRequestTracker::Sent& sent,
+        std::string_view reply) {
+      if (reply.size() < impl::kHeaderLen + sizeof(int32_t)) return reply;
+      int32_t vm_id = ReadInt(&reply[impl::kHeaderLen]);
+      vector<uint64_t> unnamed;
+      int32_t request_id = this->event_requests.Set(std::move(sent), vm_id,
+          unnamed);
+      this->NameTypes(unnamed);
+      if (request_id == vm_id) return reply;
+      this->translated_reply.assign(reply);
+      uint32_t request_id_nbo = htonl(request_id);
+      memcpy(&this->translated_reply[impl::kHeaderLen], &request_id_nbo,
+          sizeof(request_id_nbo));
+      return this->translated_reply;
+    }
 };
 
-uint8_t IJdwpCon::GetObjIdSize() { return this->GetObjIdSizeImpl(); }
-uint8_t IJdwpCon::GetMethodIdSize() { return this->GetMethodIdSizeImpl(); }
-uint8_t IJdwpCon::GetFieldIdSize() { return this->GetFieldIdSizeImpl(); }
-uint8_t IJdwpCon::GetFrameIdSize() { return this->GetFrameIdSizeImpl(); }
+void IJdwpCon::CacheIdSizes(uint8_t field, uint8_t method, uint8_t obj,
+    uint8_t frame) {
+  this->field_id_size = field;
+  this->method_id_size = method;
+  this->obj_id_size = obj;
+  this->frame_id_size = frame;
+}
 void IJdwpCon::RegisterEventHandler(unique_ptr<Handler> handler) {
-  this->RegisterEventHandlerImpl(move(handler));
+  this->RegisterEventHandlerImpl(move(handler), JdwpDispatchMode::kInline);
+}
+void IJdwpCon::RegisterEventHandler(unique_ptr<Handler> handler,
+    JdwpDispatchMode mode) {
+  this->RegisterEventHandlerImpl(move(handler), mode);
 }
 void IJdwpCon::SendMessage(unique_ptr<IJdwpCommandPacket> message) {
-  this->SendMessageImpl(move(message));
+  this->SendMessageImpl(move(message), nullptr);
+}
+void IJdwpCon::SendMessage(unique_ptr<IJdwpCommandPacket> message,
+    unique_ptr<ReplyHandler> on_reply) {
+  this->SendMessageImpl(move(message), move(on_reply));
+}
+void IJdwpCon::RegisterReconnectHandler(std::function<void()> handler) {
+  this->RegisterReconnectHandlerImpl(move(handler));
+}
+void IJdwpCon::RegisterReconnectHandlerImpl(std::function<void()> handler) {
+  static_cast<void>(handler);
+}
+void IJdwpCon::RegisterPacketHandler(JdwpPacketHandler handler) {
+  this->RegisterPacketHandlerImpl(move(handler));
+}
+void IJdwpCon::RegisterPacketHandlerImpl(JdwpPacketHandler handler) {
+  static_cast<void>(handler);
+}
+void IJdwpCon::RegisterReplayHandler(JdwpReplayHandler handler) {
+  this->RegisterReplayHandlerImpl(move(handler));
+}
+void IJdwpCon::RegisterReplayHandlerImpl(JdwpReplayHandler handler) {
+  static_cast<void>(handler);
+}
+void IJdwpCon::FastResume(int32_t request_id) {
+  this->FastResumeImpl(request_id);
+}
+void IJdwpCon::FastResumeImpl(int32_t request_id) {
+  static_cast<void>(request_id);
+}
+bool IJdwpCon::TrySendMessage(unique_ptr<IJdwpCommandPacket>& message,
+    unique_ptr<ReplyHandler>& on_reply) {
+  return this->TrySendMessageImpl(message, on_reply);
+}
+bool IJdwpCon::TrySendMessageImpl(unique_ptr<IJdwpCommandPacket>& message,
+    unique_ptr<ReplyHandler>& on_reply) {
+  this->SendMessageImpl(move(message), move(on_reply));
+  return true;
+}
+
+JdwpCon::JdwpCon(uint16_t port, const JdwpConOptions& options) :
+    pImpl(new JdwpCon::Impl(port, options)) {
+  this->CacheImplIdSizes();
+}
+JdwpCon::JdwpCon(const string& address, uint16_t port,
+    const JdwpConOptions& options) :
+    pImpl(new JdwpCon::Impl(address, port, options)) {
+  this->CacheImplIdSizes();
+}
+JdwpCon::JdwpCon(const string& address, uint16_t port, JdwpConPool& pool,
+    const JdwpConOptions& options) :
+    pImpl(new JdwpCon::Impl(address, port, pool, options)) {
+  this->CacheImplIdSizes();
 }
 
-JdwpCon::JdwpCon(uint16_t port) :
-  pImpl(new JdwpCon::Impl(port)) { }
-JdwpCon::JdwpCon(const string& address, uint16_t port) :
-  pImpl(new JdwpCon::Impl(address, port)) { }
+void JdwpCon::CacheImplIdSizes() {
+  this->CacheIdSizes(this->pImpl->GetFieldIdSize(),
+      this->pImpl->GetMethodIdSize(), this->pImpl->GetObjIdSize(),
+      this->pImpl->GetFrameIdSize());
+}
 
 JdwpCon::JdwpCon(JdwpCon&& other) noexcept = default;
 JdwpCon& JdwpCon::operator=(JdwpCon&& other) noexcept = default;
 
 JdwpCon::~JdwpCon() = default;
 
+JdwpSendQueueStats JdwpCon::GetSendQueueStats() const {
+  return this->pImpl->GetSendQueueStats();
+}
+
+JdwpSuspensionHistogram JdwpCon::GetSuspensionHistogram() const {
+  return this->pImpl->GetSuspensionHistogram();
+}
+
+JdwpConStats JdwpCon::GetStats() const {
+  return this->pImpl->GetStats();
+}
+
+void JdwpCon::Record(std::shared_ptr<JdwpRecorder> recorder) {
+  this->pImpl->Record(move(recorder));
+}
+
 uint8_t JdwpCon::GetObjIdSizeImpl() { return this->pImpl->GetObjIdSize(); }
 uint8_t JdwpCon::GetMethodIdSizeImpl() {
   return this->pImpl->GetMethodIdSize();
 }
 uint8_t JdwpCon::GetFieldIdSizeImpl() { return this->pImpl->GetFieldIdSize(); }
 uint8_t JdwpCon::GetFrameIdSizeImpl() { return this->pImpl->GetFrameIdSize(); }
-void JdwpCon::RegisterEventHandlerImpl(unique_ptr<Handler> handler) {
-  this->pImpl->RegisterEventHandler(move(handler));
+void JdwpCon::RegisterEventHandlerImpl(unique_ptr<Handler> handler,
+    JdwpDispatchMode mode) {
+  this->pImpl->RegisterEventHandler(move(handler), mode);
+}
+void JdwpCon::RegisterReconnectHandlerImpl(
+    std::function<void()> handler) {
+  this->pImpl->AddReconnectHandler(move(handler));
+}
+void JdwpCon::RegisterPacketHandlerImpl(JdwpPacketHandler handler) {
+  this->pImpl->AddPacketHandler(move(handler));
+}
+void JdwpCon::RegisterReplayHandlerImpl(JdwpReplayHandler handler) {
+  this->pImpl->AddReplayHandler(move(handler));
+}
+void JdwpCon::FastResumeImpl(int32_t request_id) {
+  this->pImpl->FastResume(request_id);
+}
+void JdwpCon::SendMessageImpl(unique_ptr<IJdwpCommandPacket> p,
+    unique_ptr<ReplyHandler> on_reply) {
+  return this->pImpl->SendMessage(move(p), move(on_reply));
 }
-void JdwpCon::SendMessageImpl(unique_ptr<IJdwpCommandPacket> p) {
-  return this->pImpl->SendMessage(move(p));
+bool JdwpCon::TrySendMessageImpl(unique_ptr<IJdwpCommandPacket>& p,
+    unique_ptr<ReplyHandler>& on_reply) {
+  return this->pImpl->TrySendMessage(p, on_reply);
 }
 
 }  // namespace roastery
@@ -0,0 +1,121 @@
+/* Implements a pool of JDWP connections sharing a fixed set of I/O threads
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_con_pool.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_reactor.hpp"
+
+using std::lock_guard;
+using std::mutex;
+using std::unique_ptr;
+using std::vector;
+
+namespace roastery {
+
+/**
+ * Implementation of \c JdwpConPool.
+ */
+class JdwpConPool::Impl {
+  public:
+    explicit Impl(size_t num_threads) {
+      if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+      }
+      for (size_t i = 0; i < num_threads; i++) {
+        this->reactors.emplace_back(new JdwpReactor());
+      }
+    }
+
+    ~Impl() {
+      // Connections must go before the reactors that drive them.
+      lock_guard<mutex> l(this->connections_lck);
+      this->connections.clear();
+    }
+
+    void Add(unique_ptr<JdwpCon> con) {
+      lock_guard<mutex> l(this->connections_lck);
+      this->connections.push_back(move(con));
+    }
+
+    void Remove(JdwpCon& con) {
+      unique_ptr<JdwpCon> removed;
+      {
+        lock_guard<mutex> l(this->connections_lck);
+        auto it = std::find_if(this->connections.begin(),
+            this->connections.end(),
+            [&con](const unique_ptr<JdwpCon>& c) { return c.get() == &con; });
+        if (it == this->connections.end()) {
+          throw std::invalid_argument("Connection is not owned by this pool");
+        }
+        removed = move(*it);
+        this->connections.erase(it);
+      }
+      // removed is destroyed outside of the lock, since that waits on the
+      // connection's reactor.
+    }
+
+    size_t Size() const {
+      lock_guard<mutex> l(this->connections_lck);
+      return this->connections.size();
+    }
+
+    size_t ThreadCount() const { return this->reactors.size(); }
+
+    JdwpReactor& GetReactor(int fd) {
+      return *this->reactors[static_cast<size_t>(fd) % this->reactors.size()];
+    }
+  private:
+    vector<unique_ptr<JdwpReactor>> reactors;
+
+    vector<unique_ptr<JdwpCon>> connections;
+    mutable mutex connections_lck;
+};
+
+JdwpConPool::JdwpConPool(size_t num_threads) : pImpl(new Impl(num_threads)) { }
+
+JdwpConPool::~JdwpConPool() = default;
+
+JdwpCon& JdwpConPool::Connect(const std::string& address, uint16_t port,
+    const JdwpConOptions& options) {
+  unique_ptr<JdwpCon> con(new JdwpCon(address, port, *this, options));
+  JdwpCon& res = *con;
+  this->pImpl->Add(move(con));
+  return res;
+}
+
+void JdwpConPool::Disconnect(JdwpCon& con) { this->pImpl->Remove(con); }
+
+size_t JdwpConPool::Size() const { return this->pImpl->Size(); }
+
+size_t JdwpConPool::ThreadCount() const { return this->pImpl->ThreadCount(); }
+
+JdwpReactor& JdwpConPool::GetReactor(int fd) {
+  return this->pImpl->GetReactor(fd);
+}
+
+}  // namespace roastery
@@ -0,0 +1,181 @@
+/* Implements a worker pool for delivering JDWP events to handlers
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_dispatcher.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "jdwp_packet.hpp"
+#include "jdwp_stats.hpp"
+
+using std::lock_guard;
+using std::mutex;
+using std::unique_ptr;
+using std::vector;
+
+namespace roastery {
+
+/**
+ * Implementation of \c JdwpEventDispatcher.
+ */
+class JdwpEventDispatcher::Impl {
+  public:
+    explicit Impl(size_t num_workers) {
+      if (num_workers == 0) {
+        num_workers = std::max(1u, std::thread::hardware_concurrency());
+      }
+      for (size_t i = 0; i < num_workers; i++) {
+        this->workers.emplace_back(new Worker());
+      }
+      // Only start the threads once every worker exists
+      for (auto& worker : this->workers) {
+        Worker* w = worker.get();
+        w->thread = std::thread([this, w]() { this->Run(*w); });
+      }
+    }
+
+    ~Impl() {
+      for (auto& worker : this->workers) {
+        lock_guard<mutex> l(worker->lck);
+        worker->stop = true;
+        worker->has_work.notify_one();
+      }
+      for (auto& worker : this->workers) worker->thread.join();
+    }
+
+    void RegisterHandler(unique_ptr<Handler> handler) {
+      this->handlers.Add(move(handler));
+    }
+
+    void Dispatch(JdwpEventPool::Ptr event) {
+      uint64_t thread_id = 0;
+      event->GetThreadId(thread_id);
+      Worker& worker = *this->workers[this->WorkerFor(thread_id)];
+      lock_guard<mutex> l(worker.lck);
+      worker.queue.push_back(move(event));
+      worker.pending++;
+      worker.has_work.notify_one();
+    }
+
+    void Flush() {
+      for (auto& worker : this->workers) {
+        std::unique_lock<mutex> l(worker->lck);
+        worker->idle.wait(l, [&worker]() { return worker->pending == 0; });
+      }
+    }
+
+    size_t WorkerCount() const { return this->workers.size(); }
+
+    JdwpDurationHistogram GetHandlerTime() const {
+      return this->handler_time.Get();
+    }
+  private:
+    struct Worker {
+      mutex lck;
+      std::condition_variable has_work;
+      /**
+       * Notified whenever \c pending drops to zero.
+       */
+      std::condition_variable idle;
+      vector<JdwpEventPool::Ptr> queue;
+      /**
+       * The number of events queued to this worker that haven't been handled
+       * yet, including the ones it's currently handling.
+       */
+      size_t pending = 0;
+      bool stop = false;
+      std::thread thread;
+    };
+
+    /**
+     * Picks the worker for events on the thread with ID \c thread_id. IDs are
+     * often handed out sequentially, so they're mixed first to spread them
+     * evenly.
+     */
+    size_t WorkerFor(uint64_t thread_id) const {
+      uint64_t mixed = thread_id * 0x9E3779B97F4A7C15ull;
+      return (mixed >> 32) % this->workers.size();
+    }
+
+    /**
+     * The body of each worker thread. Handles its queue in batches until
+     * stopped, finishing off whatever was queued before it was.
+     */
+    void Run(Worker& worker) {
+      vector<JdwpEventPool::Ptr> batch;
+      while (true) {
+        {
+          std::unique_lock<mutex> l(worker.lck);
+          worker.has_work.wait(l,
+              [&worker]() { return worker.stop || !worker.queue.empty(); });
+          if (worker.queue.empty()) return;
+          batch.swap(worker.queue);
+        }
+
+        impl::HandlerList::Snapshot handlers = this->handlers.Get();
+        for (auto& event : batch) {
+          auto start = std::chrono::steady_clock::now();
+          for (auto& handler : *handlers) {
+            event->Dispatch(*handler);
+          }
+          this->handler_time.Add(std::chrono::steady_clock::now() - start);
+        }
+        size_t handled = batch.size();
+        // Hands the events back to their pool
+        batch.clear();
+
+        lock_guard<mutex> l(worker.lck);
+        worker.pending -= handled;
+        if (worker.pending == 0) worker.idle.notify_all();
+      }
+    }
+
+    impl::HandlerList handlers;
+    vector<unique_ptr<Worker>> workers;
+    impl::AtomicDurationHistogram handler_time;
+};
+
+JdwpEventDispatcher::JdwpEventDispatcher(size_t num_workers) :
+  pImpl(new Impl(num_workers)) { }
+
+JdwpEventDispatcher::~JdwpEventDispatcher() = default;
+
+void JdwpEventDispatcher::RegisterHandler(unique_ptr<Handler> handler) {
+  this->pImpl->RegisterHandler(move(handler));
+}
+void JdwpEventDispatcher::Dispatch(JdwpEventPool::Ptr event) {
+  this->pImpl->Dispatch(move(event));
+}
+void JdwpEventDispatcher::Flush() { this->pImpl->Flush(); }
+size_t JdwpEventDispatcher::WorkerCount() const {
+  return this->pImpl->WorkerCount();
+}
+JdwpDurationHistogram JdwpEventDispatcher::GetHandlerTime() const {
+  return this->pImpl->GetHandlerTime();
+}
+
+}  // namespace roastery
@@ -0,0 +1,343 @@
+/* Provides a builder for filtered JDWP event requests
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_event_filter.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_packet.hpp"
+
+namespace roastery {
+
+namespace {
+
+using SetCommand = command_packets::event_request::SetCommand;
+
+/**
+ * The index of each modifier in \c SetCommand::Modifier, one less than its
+ * JDWP \c modKind.
+ */
+enum ModIndex : size_t {
+  kCount = 0,
+  kThreadOnly = 2,
+  kClassOnly = 3,
+  kClassMatch = 4,
+  kClassExclude = 5,
+  kLocationOnly = 6,
+  kExceptionOnly = 7,
+  kFieldOnly = 8,
+  kStep = 9,
+  kInstanceOnly = 10,
+};
+
+bool StartsWith(const string& str, const string& prefix) {
+  return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+bool EndsWith(const string& str, const string& suffix) {
+  return str.size() >= suffix.size() &&
+    str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/**
+ * Class patterns, as used by \c ClassMatch and \c ClassExclude: either an
+ * exact class name, or a name that starts or ends with \c *.
+ */
+bool IsPrefix(const string& pattern) {
+  return !pattern.empty() && pattern.back() == '*';
+}
+bool IsSuffix(const string& pattern) {
+  return pattern.size() > 1 && pattern.front() == '*';
+}
+string Stem(const string& pattern) {
+  if (IsPrefix(pattern)) return pattern.substr(0, pattern.size() - 1);
+  if (IsSuffix(pattern)) return pattern.substr(1);
+  return pattern;
+}
+
+/**
+ * Returns whether every class matched by \c inner is also matched by
+ * \c outer.
+ */
+bool Covers(const string& outer, const string& inner) {
+  if (outer == "*") return true;
+  string outer_stem = Stem(outer);
+  string inner_stem = Stem(inner);
+  if (IsPrefix(outer)) {
+    return !IsSuffix(inner) && inner != "*" &&
+      StartsWith(inner_stem, outer_stem);
+  }
+  if (IsSuffix(outer)) {
+    return !IsPrefix(inner) && EndsWith(inner_stem, outer_stem);
+  }
+  return outer == inner;
+}
+
+/**
+ * Returns whether some class name could be matched by both \c a and \c b.
+ */
+bool MayOverlap(const string& a, const string& b) {
+  if (a == "*" || b == "*") return true;
+  string a_stem = Stem(a);
+  string b_stem = Stem(b);
+  if (IsPrefix(a) && IsPrefix(b)) {
+    return StartsWith(a_stem, b_stem) || StartsWith(b_stem, a_stem);
+  }
+  if (IsSuffix(a) && IsSuffix(b)) {
+    return EndsWith(a_stem, b_stem) || EndsWith(b_stem, a_stem);
+  }
+  bool a_wild = IsPrefix(a) || IsSuffix(a);
+  bool b_wild = IsPrefix(b) || IsSuffix(b);
+  // One prefix and one suffix, something like "<prefix>...<suffix>" fits
+  if (a_wild && b_wild) return true;
+  // At least one is an exact name, which either matches the other or not
+  return a_wild ? Covers(a, b) : Covers(b, a);
+}
+
+/**
+ * Removes every pattern covered by another in \c patterns, keeping the first
+ * of any duplicates.
+ */
+vector<string> Tighten(const vector<string>& patterns) {
+  vector<string> res;
+  for (size_t i = 0; i < patterns.size(); i++) {
+    bool redundant = false;
+    for (size_t j = 0; j < patterns.size() && !redundant; j++) {
+      if (i == j || !Covers(patterns[j], patterns[i])) continue;
+      // Equal patterns cover each other, so only drop the later ones
+      redundant = !Covers(patterns[i], patterns[j]) || j < i;
+    }
+    if (!redundant) res.push_back(patterns[i]);
+  }
+  return res;
+}
+
+template<typename T>
+void Dedupe(vector<T>& values) {
+  vector<T> res;
+  for (T& value : values) {
+    if (std::find(res.begin(), res.end(), value) == res.end()) {
+      res.push_back(value);
+    }
+  }
+  values.swap(res);
+}
+
+template<size_t kIndex, typename... Fields>
+SetCommand::Modifier MakeModifier(Fields... fields) {
+  return SetCommand::Modifier(std::in_place_index<kIndex>,
+      std::make_tuple(std::move(fields)...));
+}
+
+template<typename Field, typename Value>
+Field MakeField(Value value) {
+  Field res;
+  res << value;
+  return res;
+}
+
+bool SameLocation(const JdwpLocation& a, const JdwpLocation& b) {
+  return a.type == b.type &&
+    a.class_id.GetValue() == b.class_id.GetValue() &&
+    a.method_id.GetValue() == b.method_id.GetValue() && a.index == b.index;
+}
+
+}  // namespace
+
+JdwpEventFilter::JdwpEventFilter(JdwpEventKind kind) :
+  kind(kind), suspend_policy(0) { }
+
+JdwpEventFilter& JdwpEventFilter::Suspend(uint8_t suspend_policy) {
+  this->suspend_policy = suspend_policy;
+  return *this;
+}
+
+JdwpEventFilter& JdwpEventFilter::Count(int32_t count) {
+  this->count = count;
+  return *this;
+}
+
+JdwpEventFilter& JdwpEventFilter::InClasses(const string& pattern) {
+  this->classes.push_back({ pattern, 0 });
+  return *this;
+}
+
+JdwpEventFilter& JdwpEventFilter::InClass(uint64_t ref_type) {
+  this->classes.push_back({ "", ref_type });
+  return *this;
+}
+
+JdwpEventFilter& JdwpEventFilter::ExcludingClasses(const string& pattern) {
+  this->excludes.push_back(pattern);
+  return *this;
+}
+
+JdwpEventFilter& JdwpEventFilter::OnThread(uint64_t thread) {
+  this->threads.push_back(thread);
+  return *this;
+}
+
+JdwpEventFilter& JdwpEventFilter::AtLocation(const JdwpLocation& location) {
+  for (const JdwpLocation& existing : this->locations) {
+    if (SameLocation(existing, location)) return *this;
+  }
+  this->locations.push_back(location);
+  return *this;
+}
+
+JdwpEventFilter& JdwpEventFilter::OnInstance(uint64_t object) {
+  this->instances.push_back(object);
+  return *this;
+}
+
+JdwpEventFilter& JdwpEventFilter::ForException(uint64_t ref_type,
+    bool caught, bool uncaught) {
+  this->exact.push_back(MakeModifier<kExceptionOnly>(
+        MakeField<JdwpReferenceTypeId>(ref_type), MakeField<JdwpBool>(caught),
+        MakeField<JdwpBool>(uncaught)));
+  return *this;
+}
+
+JdwpEventFilter& JdwpEventFilter::ForField(uint64_t ref_type,
+    uint64_t field) {
+  this->exact.push_back(MakeModifier<kFieldOnly>(
+        MakeField<JdwpReferenceTypeId>(ref_type),
+        MakeField<JdwpFieldId>(field)));
+  return *this;
+}
+
+JdwpEventFilter& JdwpEventFilter::Step(uint64_t thread, int32_t size,
+    int32_t depth) {
+  this->exact.push_back(MakeModifier<kStep>(MakeField<JdwpThreadId>(thread),
+        MakeField<JdwpInt>(size), MakeField<JdwpInt>(depth)));
+  return *this;
+}
+
+vector<unique_ptr<JdwpEventFilter::SetCommand>> JdwpEventFilter::Compile()
+    const {
+  vector<string> excludes = Tighten(this->excludes);
+
+  // Each alternative set of classes, along with the exclusions that apply
+  // to it. With no classes given, a single alternative allows any class.
+  vector<string> patterns;
+  vector<uint64_t> ref_types;
+  for (const ClassAlternative& alternative : this->classes) {
+    if (alternative.pattern.empty()) {
+      ref_types.push_back(alternative.ref_type);
+    } else {
+      patterns.push_back(alternative.pattern);
+    }
+  }
+  patterns = Tighten(patterns);
+  Dedupe(ref_types);
+
+  vector<std::pair<vector<SetCommand::Modifier>, vector<string>>> class_alts;
+  for (const string& pattern : patterns) {
+    vector<string> relevant;
+    bool excluded = false;
+    for (const string& exclude : excludes) {
+      if (Covers(exclude, pattern)) excluded = true;
+      if (MayOverlap(exclude, pattern)) relevant.push_back(exclude);
+    }
+    if (excluded) continue;
+    class_alts.push_back({ { MakeModifier<kClassMatch>(
+          MakeField<JdwpString>(pattern)) }, relevant });
+  }
+  for (uint64_t ref_type : ref_types) {
+    // Nothing is known about the names of a type's subtypes
+    class_alts.push_back({ { MakeModifier<kClassOnly>(
+          MakeField<JdwpReferenceTypeId>(ref_type)) }, excludes });
+  }
+  if (this->classes.empty()) class_alts.push_back({ { }, excludes });
+
+  // The other alternatives; an empty modifier list stands for no restriction
+  auto alternatives = [](auto& values, auto make) {
+    vector<vector<SetCommand::Modifier>> res;
+    for (auto& value : values) res.push_back({ make(value) });
+    if (res.empty()) res.emplace_back();
+    return res;
+  };
+  vector<uint64_t> threads = this->threads;
+  Dedupe(threads);
+  vector<uint64_t> instances = this->instances;
+  Dedupe(instances);
+  auto thread_alts = alternatives(threads, [](uint64_t thread) {
+        return MakeModifier<kThreadOnly>(MakeField<JdwpThreadId>(thread));
+      });
+  auto location_alts = alternatives(this->locations,
+      [](const JdwpLocation& location) {
+        return MakeModifier<kLocationOnly>(location);
+      });
+  auto instance_alts = alternatives(instances, [](uint64_t object) {
+        return MakeModifier<kInstanceOnly>(MakeField<JdwpObjId>(object));
+      });
+
+  vector<unique_ptr<SetCommand>> res;
+  for (auto& class_alt : class_alts) {
+    for (auto& location : location_alts) {
+      for (auto& thread : thread_alts) {
+        for (auto& instance : instance_alts) {
+          auto command = std::make_unique<SetCommand>();
+          auto& fields = command->GetFields();
+          std::get<0>(fields) << static_cast<uint8_t>(this->kind);
+          std::get<1>(fields) << this->suspend_policy;
+          auto& modifiers = std::get<2>(fields);
+          // Exact matches on IDs first, since they're cheapest to check and
+          // rule out the most, then name patterns, then the count.
+          for (auto* part : { &location, &thread, &instance }) {
+            modifiers.insert(modifiers.end(), part->begin(), part->end());
+          }
+          modifiers.insert(modifiers.end(), this->exact.begin(),
+              this->exact.end());
+          modifiers.insert(modifiers.end(), class_alt.first.begin(),
+              class_alt.first.end());
+          for (const string& exclude : class_alt.second) {
+            modifiers.push_back(MakeModifier<kClassExclude>(
+                  MakeField<JdwpString>(exclude)));
+          }
+          if (this->count) {
+            modifiers.push_back(MakeModifier<kCount>(
+                  MakeField<JdwpInt>(*this->count)));
+          }
+          res.push_back(move(command));
+        }
+      }
+    }
+  }
+  return res;
+}
+
+vector<std::future<JdwpEventFilter::SetCommand::ReplyFields>>
+JdwpEventFilter::Send(IJdwpCon& con) const {
+  vector<std::future<SetCommand::ReplyFields>> res;
+  for (auto& command : this->Compile()) {
+    res.push_back(con.SendAsync(move(command)));
+  }
+  return res;
+}
+
+}  // namespace roastery
@@ -22,6 +22,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdexcept>
 #include <string>
 
+#include "jdwp_type.hpp"
+
 namespace roastery {
 
 // JdwpException
@@ -47,5 +49,38 @@ const char* JdwpException::what() const noexcept {
   return runtime_error::what();
 }
 
+// JdwpTruncatedException
+JdwpTruncatedException::JdwpTruncatedException(const char* what_arg) :
+  JdwpException(what_arg) { }
+
+JdwpTruncatedException::JdwpTruncatedException(
+    const JdwpTruncatedException& other) : JdwpException(other) { }
+
+JdwpTruncatedException& JdwpTruncatedException::operator=(
+    const JdwpTruncatedException& other) {
+  JdwpException::operator=(other);
+  return *this;
+}
+
+// JdwpReplyException
+JdwpReplyException::JdwpReplyException(JdwpError error) :
+  JdwpException(jdwp_strerror(error)), error(error) { }
+
+JdwpReplyException::JdwpReplyException(const JdwpReplyException& other) :
+  JdwpException(other), error(other.error) { }
+
+JdwpReplyException& JdwpReplyException::operator=(
+    const JdwpReplyException& other) {
+  if (this != &other) {
+    JdwpException::operator=(other);
+    this->error = other.error;
+  }
+  return *this;
+}
+
+JdwpError JdwpReplyException::GetError() const noexcept {
+  return this->error;
+}
+
 }  // namespace roastery
 
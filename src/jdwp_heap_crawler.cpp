@@ -0,0 +1,705 @@
+/* Defines a crawler that snapshots part of a VM's object graph to disk
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_heap_crawler.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_exception.hpp"
+#include "jdwp_metadata_cache.hpp"
+#include "jdwp_packet.hpp"
+
+using std::shared_future;
+
+namespace roastery {
+
+namespace {
+
+using command_packets::array_reference::LengthCommand;
+using command_packets::class_type::SuperclassCommand;
+using command_packets::object_reference::DisableCollectionCommand;
+using command_packets::object_reference::EnableCollectionCommand;
+using command_packets::object_reference::ReferenceTypeCommand;
+using command_packets::object_reference::ReferringObjectsCommand;
+using command_packets::reference_type::InstancesCommand;
+using command_packets::virtual_machine::InstanceCounts;
+using ArrayValuesCommand = command_packets::array_reference::GetValuesCommand;
+using FieldValuesCommand = command_packets::object_reference::GetValuesCommand;
+
+constexpr char kFileHeader[] = "# roastery heap graph v1";
+
+/**
+ * The modifier bit of static fields, from the JVM specification.
+ */
+constexpr int32_t kStaticModifier = 0x0008;
+
+/**
+ * Writes all of \c data to \c fd.
+ *
+ * @return 0, or the \c errno of the write that failed.
+ */
+int WriteAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t written = write(fd, data.data(), data.size());
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
+    data.remove_prefix(written);
+  }
+  return 0;
+}
+
+/**
+ * Returns a \c Command whose first field is \c id.
+ */
+template<typename Command>
+unique_ptr<Command> ForId(uint64_t id) {
+  auto res = std::make_unique<Command>();
+  std::get<0>(res->GetFields()) << id;
+  return res;
+}
+
+/**
+ * Returns whether a value tagged \c tag holds an object ID.
+ */
+bool IsObject(JdwpTag tag) {
+  switch (tag) {
+    case JdwpTag::kArray:
+    case JdwpTag::kObject:
+    case JdwpTag::kString:
+    case JdwpTag::kThread:
+    case JdwpTag::kThreadGroup:
+    case JdwpTag::kClassLoader:
+    case JdwpTag::kClassObject:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * Returns the object \c value refers to, or 0 if it's \c null or not an
+ * object.
+ */
+uint64_t ObjectIn(const JdwpValue& value) {
+  if (!IsObject(value.tag)) return 0;
+  return std::get<JdwpObjId>(value.value).GetValue();
+}
+
+/**
+ * A reference field, to be read from instances.
+ */
+struct RefField {
+  uint64_t id;
+  string name;
+};
+
+/**
+ * What a crawl needs to know to expand instances of a reference type.
+ */
+struct TypeInfo {
+  /**
+   * Whether the type is an array of objects, whose elements are followed.
+   */
+  bool object_array = false;
+  /**
+   * The reference fields of instances of the type, including inherited
+   * ones.
+   */
+  vector<RefField> fields;
+};
+
+/**
+ * An object being expanded, and the replies it's waiting on.
+ */
+struct Pending {
+  uint64_t obj;
+  uint64_t ref_type = 0;
+  std::future<FieldValuesCommand::ReplyFields> values;
+  std::future<LengthCommand::ReplyFields> length;
+  std::future<ArrayValuesCommand::ReplyFields> elements;
+  std::future<ReferringObjectsCommand::ReplyFields> referrers;
+  /**
+   * The error that kept the object from being expanded, if any.
+   */
+  JdwpError error = JdwpError::kNone;
+};
+
+/**
+ * Stores the value of \c future in \c out, unless it holds an error reply.
+ *
+ * @return The error replied, \c JdwpError::kNone if there wasn't one.
+ */
+template<typename T>
+JdwpError TryGet(std::future<T>& future, T& out) {
+  try {
+    out = future.get();
+    return JdwpError::kNone;
+  } catch (const JdwpReplyException& e) {
+    return e.GetError();
+  }
+}
+
+}  // namespace
+
+/**
+ * Implementation of \c JdwpHeapCrawler.
+ */
+class JdwpHeapCrawler::Impl {
+  public:
+    Impl(IJdwpCon& con, JdwpMetadataCache& cache, const string& path,
+        const JdwpHeapCrawlOptions& options) :
+        con(con), cache(cache), path(path), options(options), expanded(0) {
+      off_t valid_len = options.resume ? this->Load() : 0;
+      int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+      if (!options.resume) flags |= O_TRUNC;
+      this->fd = open(path.c_str(), flags, 0644);
+      if (this->fd < 0) {
+        throw std::system_error(errno, std::generic_category(),
+            "Could not create " + path);
+      }
+      // Drop the line a previous crawl was cut off in the middle of
+      if (options.resume && ftruncate(this->fd, valid_len) < 0) {
+        int err = errno;
+        close(this->fd);
+        throw std::system_error(err, std::generic_category(),
+            "Could not write to " + path);
+      }
+      if (valid_len == 0) {
+        this->buffer = kFileHeader;
+        this->buffer.push_back('\n');
+        try {
+          this->Flush();
+        } catch (const std::system_error& e) {
+          close(this->fd);
+          throw;
+        }
+      }
+    }
+
+    // No copies/default constructor
+    Impl() = delete;
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    ~Impl() {
+      WriteAll(this->fd, this->buffer);
+      close(this->fd);
+    }
+
+    size_t AddRootClasses(const vector<uint64_t>& ref_types) {
+      auto counts_command = std::make_unique<InstanceCounts>();
+      for (uint64_t ref_type : ref_types) {
+        JdwpReferenceTypeId id;
+        id << ref_type;
+        std::get<0>(counts_command->GetFields()).emplace_back(id);
+      }
+      auto counts = this->con.SendAsync(std::move(counts_command));
+      vector<std::future<InstancesCommand::ReplyFields>> instances;
+      instances.reserve(ref_types.size());
+      for (uint64_t ref_type : ref_types) {
+        auto command = ForId<InstancesCommand>(ref_type);
+        std::get<1>(command->GetFields()) << this->options.max_instances;
+        instances.push_back(this->con.SendAsync(std::move(command)));
+      }
+      std::unordered_map<uint64_t,
+        shared_future<JdwpMetadataCache::SignatureReply>> signatures;
+      for (uint64_t ref_type : ref_types) {
+        if (this->written_types.count(ref_type) == 0) {
+          signatures.emplace(ref_type, this->cache.GetSignature(ref_type));
+        }
+      }
+
+      auto count_reply = counts.get();
+      size_t added = 0;
+      for (size_t i = 0; i < ref_types.size(); i++) {
+        if (signatures.count(ref_types[i]) != 0) {
+          this->WriteType(ref_types[i],
+              std::get<0>(signatures[ref_types[i]].get()).GetValue());
+        }
+        auto& count = std::get<0>(count_reply);
+        if (i < count.size()) {
+          this->Write('C', ref_types[i]);
+          this->buffer += ' ';
+          this->buffer += std::to_string(std::get<0>(count[i]).GetValue());
+          this->buffer += '\n';
+        }
+        auto objects = instances[i].get();
+        for (auto& entry : std::get<0>(objects)) {
+          uint64_t obj = std::get<0>(entry).obj_id.GetValue();
+          if (this->Discover(obj)) {
+            this->Write('R', obj);
+            this->buffer += '\n';
+            added++;
+          }
+        }
+      }
+      this->Flush();
+      return added;
+    }
+
+    void AddRoot(uint64_t obj) {
+      if (!this->Discover(obj)) return;
+      this->Write('R', obj);
+      this->buffer += '\n';
+      this->Flush();
+    }
+
+    size_t Step() {
+      vector<Pending> batch;
+      while (!this->frontier.empty() &&
+          batch.size() < this->options.max_in_flight &&
+          (this->options.max_objects == 0 ||
+           this->expanded + batch.size() < this->options.max_objects)) {
+        batch.emplace_back();
+        batch.back().obj = this->frontier.front();
+        this->frontier.pop_front();
+      }
+      if (batch.empty()) return 0;
+
+      // Keep every object in the batch alive until it's been expanded, which
+      // the VM does before looking up its type, as it handles commands in
+      // order
+      vector<std::future<ReferenceTypeCommand::ReplyFields>> types;
+      types.reserve(batch.size());
+      // Objects still disabled if anything below throws are enabled again,
+      // or the VM would hold on to them for the rest of the session
+      size_t disabled = 0;
+      size_t enabled = 0;
+      try {
+        for (Pending& curr : batch) {
+          this->con.SendMessage(ForId<DisableCollectionCommand>(curr.obj));
+          disabled++;
+          types.push_back(this->con.SendAsync(
+                ForId<ReferenceTypeCommand>(curr.obj)));
+        }
+        vector<std::pair<uint64_t, JdwpTypeTag>> new_types;
+        std::unordered_set<uint64_t> new_type_ids;
+        for (size_t i = 0; i < batch.size(); i++) {
+          ReferenceTypeCommand::ReplyFields type;
+          batch[i].error = TryGet(types[i], type);
+          if (batch[i].error != JdwpError::kNone) continue;
+          batch[i].ref_type = std::get<1>(type).GetValue();
+          if (this->types.count(batch[i].ref_type) == 0 &&
+              new_type_ids.insert(batch[i].ref_type).second) {
+            new_types.emplace_back(batch[i].ref_type,
+                static_cast<JdwpTypeTag>(std::get<0>(type).GetValue()));
+          }
+        }
+        this->ResolveTypes(new_types);
+
+        for (Pending& curr : batch) {
+          if (curr.error != JdwpError::kNone) continue;
+          const TypeInfo& type = this->types[curr.ref_type];
+          if (type.object_array) {
+            curr.length = this->con.SendAsync(ForId<LengthCommand>(curr.obj));
+          } else if (!type.fields.empty()) {
+            auto command = ForId<FieldValuesCommand>(curr.obj);
+            for (const RefField& field : type.fields) {
+              JdwpFieldId id;
+              id << field.id;
+              std::get<1>(command->GetFields()).emplace_back(id);
+            }
+            curr.values = this->con.SendAsync(std::move(command));
+          }
+          if (this->options.follow_referrers) {
+            auto command = ForId<ReferringObjectsCommand>(curr.obj);
+            std::get<1>(command->GetFields()) << this->options.max_referrers;
+            curr.referrers = this->con.SendAsync(std::move(command));
+          }
+        }
+        for (Pending& curr : batch) {
+          if (!curr.length.valid()) continue;
+          LengthCommand::ReplyFields length;
+          curr.error = TryGet(curr.length, length);
+          if (curr.error != JdwpError::kNone) continue;
+          int32_t count = std::min(std::get<0>(length).GetValue(),
+              this->options.max_array_elements);
+          if (count <= 0) continue;
+          auto command = ForId<ArrayValuesCommand>(curr.obj);
+          std::get<1>(command->GetFields()) << 0;
+          std::get<2>(command->GetFields()) << count;
+          curr.elements = this->con.SendAsync(std::move(command));
+        }
+
+        for (; enabled < batch.size(); enabled++) {
+          this->Finish(batch[enabled]);
+          this->con.SendMessage(
+              ForId<EnableCollectionCommand>(batch[enabled].obj));
+        }
+      } catch (...) {
+        for (; enabled < disabled; enabled++) {
+          this->con.SendMessage(
+              ForId<EnableCollectionCommand>(batch[enabled].obj));
+        }
+        throw;
+      }
+      this->expanded += batch.size();
+      this->Flush();
+      return batch.size();
+    }
+
+    uint64_t Crawl() {
+      while (this->Step() != 0) { }
+      return this->expanded;
+    }
+
+    uint64_t GetExpandedCount() const { return this->expanded; }
+    size_t GetFrontierSize() const { return this->frontier.size(); }
+  private:
+    IJdwpCon& con;
+    JdwpMetadataCache& cache;
+    const string path;
+    const JdwpHeapCrawlOptions options;
+    int fd;
+    /**
+     * Records not written out yet.
+     */
+    string buffer;
+
+    uint64_t expanded;
+    /**
+     * Every object found, whether expanded yet or not.
+     */
+    std::unordered_set<uint64_t> seen;
+    /**
+     * The objects found that haven't been expanded yet, in the order they
+     * were found.
+     */
+    std::deque<uint64_t> frontier;
+    /**
+     * The types whose \c T record has been written.
+     */
+    std::unordered_set<uint64_t> written_types;
+    std::unordered_map<uint64_t, TypeInfo> types;
+    /**
+     * The superclass of each class resolved so far, 0 for \c Object.
+     */
+    std::unordered_map<uint64_t, uint64_t> superclasses;
+    /**
+     * The reference fields declared by each class resolved so far.
+     */
+    std::unordered_map<uint64_t, vector<RefField>> declared;
+
+    /**
+     * Reads back the crawl in the file at \c this->path, if there's one.
+     *
+     * @return The length of the file up to its last complete line.
+     */
+    off_t Load() {
+      std::ifstream in(this->path);
+      if (!in) {
+        if (errno == ENOENT) return 0;
+        throw std::system_error(errno, std::generic_category(),
+            "Could not open " + this->path);
+      }
+      // Keep the order objects were found in, so the crawl carries on in the
+      // same order it would have
+      vector<uint64_t> found;
+      std::unordered_set<uint64_t> done;
+      off_t valid_len = 0;
+      string line;
+      while (std::getline(in, line)) {
+        if (in.eof()) break;  // Cut off before its newline
+        if (valid_len == 0 && line != kFileHeader) {
+          throw JdwpException(this->path + " is not a heap graph");
+        }
+        valid_len += line.size() + 1;
+
+        std::istringstream record(line);
+        char kind;
+        uint64_t first, second;
+        record >> kind >> std::hex >> first;
+        if (!record) continue;
+        switch (kind) {
+          case 'R':
+            found.push_back(first);
+            break;
+          case 'E':
+            if (record >> second) found.push_back(second);
+            break;
+          case 'N':
+          case 'X':
+            done.insert(first);
+            break;
+          case 'T':
+            this->written_types.insert(first);
+            break;
+          default:
+            break;
+        }
+      }
+      if (in.bad()) {
+        throw std::system_error(errno, std::generic_category(),
+            "Could not read " + this->path);
+      }
+
+      this->expanded = done.size();
+      for (uint64_t obj : found) {
+        if (this->seen.insert(obj).second && done.count(obj) == 0) {
+          this->frontier.push_back(obj);
+        }
+      }
+      for (uint64_t obj : done) this->seen.insert(obj);
+      return valid_len;
+    }
+
+    /**
+     * Marks \c obj as found, and queues it to be expanded if it's new.
+     *
+     * @return Whether \c obj is new.
+     */
+    bool Discover(uint64_t obj) {
+      if (!this->seen.insert(obj).second) return false;
+      this->frontier.push_back(obj);
+      return true;
+    }
+
+    /**
+     * Appends a space, then \c id in hexadecimal.
+     */
+    void WriteId(uint64_t id) {
+      char hex[2 * sizeof(id) + 1];
+      int len = snprintf(hex, sizeof(hex), "%llx",
+          static_cast<unsigned long long>(id));
+      this->buffer += ' ';
+      this->buffer.append(hex, len);
+    }
+
+    /**
+     * Starts a record of kind \c kind with \c id as its first field.
+     */
+    void Write(char kind, uint64_t id) {
+      this->buffer += kind;
+      this->WriteId(id);
+    }
+
+    void WriteType(uint64_t ref_type, const string& signature) {
+      if (!this->written_types.insert(ref_type).second) return;
+      this->Write('T', ref_type);
+      this->buffer += ' ';
+      this->buffer += signature;
+      this->buffer += '\n';
+    }
+
+    void WriteEdge(uint64_t from, uint64_t to, const string& label) {
+      this->Write('E', from);
+      this->WriteId(to);
+      this->buffer += ' ';
+      this->buffer += label;
+      this->buffer += '\n';
+    }
+
+    void Flush() {
+      if (int err = WriteAll(this->fd, this->buffer)) {
+        throw std::system_error(err, std::generic_category(),
+            "Could not write to " + this->path);
+      }
+      this->buffer.clear();
+    }
+
+    /**
+     * Fills in \c this->types for each of \c new_types, a list of reference
+     * types and their tags. The superclasses of every class are resolved a
+     * level at a time, each level with one round trip.
+     */
+    void ResolveTypes(const vector<std::pair<uint64_t, JdwpTypeTag>>&
+        new_types) {
+      if (new_types.empty()) return;
+      std::unordered_map<uint64_t,
+        shared_future<JdwpMetadataCache::SignatureReply>> signatures;
+      std::unordered_map<uint64_t,
+        shared_future<JdwpMetadataCache::FieldsReply>> fields;
+      vector<uint64_t> level;
+      for (auto& type : new_types) {
+        signatures.emplace(type.first, this->cache.GetSignature(type.first));
+        if (type.second == JdwpTypeTag::kClass) level.push_back(type.first);
+      }
+      while (!level.empty()) {
+        vector<std::pair<uint64_t,
+          std::future<SuperclassCommand::ReplyFields>>> supers;
+        for (uint64_t cls : level) {
+          if (this->superclasses.count(cls) != 0 ||
+              fields.count(cls) != 0) {
+            continue;
+          }
+          supers.emplace_back(cls,
+              this->con.SendAsync(ForId<SuperclassCommand>(cls)));
+          fields.emplace(cls, this->cache.GetFields(cls));
+        }
+        level.clear();
+        for (auto& entry : supers) {
+          SuperclassCommand::ReplyFields reply;
+          uint64_t super = 0;
+          if (TryGet(entry.second, reply) == JdwpError::kNone) {
+            super = std::get<0>(reply).GetValue();
+          }
+          this->superclasses[entry.first] = super;
+          if (super != 0) level.push_back(super);
+        }
+      }
+      for (auto& entry : fields) {
+        vector<RefField>& out = this->declared[entry.first];
+        try {
+          for (auto& field : std::get<0>(entry.second.get())) {
+            const string& signature = std::get<2>(field).GetValue();
+            if ((std::get<4>(field).GetValue() & kStaticModifier) != 0 ||
+                signature.empty() ||
+                (signature[0] != 'L' && signature[0] != '[')) {
+              continue;
+            }
+            out.push_back({ std::get<0>(field).GetValue(),
+                std::get<1>(field).GetValue() });
+          }
+        } catch (const JdwpReplyException& e) { }
+      }
+
+      for (auto& type : new_types) {
+        TypeInfo& info = this->types[type.first];
+        string signature;
+        try {
+          signature = std::get<0>(signatures[type.first].get()).GetValue();
+        } catch (const JdwpReplyException& e) {
+          signature = "?";
+        }
+        if (type.second == JdwpTypeTag::kArray) {
+          info.object_array = signature.size() >= 2 &&
+            (signature[1] == 'L' || signature[1] == '[');
+        } else if (type.second == JdwpTypeTag::kClass) {
+          for (uint64_t cls = type.first; cls != 0;
+              cls = this->superclasses[cls]) {
+            auto& inherited = this->declared[cls];
+            info.fields.insert(info.fields.end(), inherited.begin(),
+                inherited.end());
+          }
+        }
+        this->WriteType(type.first, signature);
+      }
+    }
+
+    /**
+     * Writes the references from \c curr, once every reply it's waiting on
+     * is in, then marks it as expanded.
+     */
+    void Finish(Pending& curr) {
+      if (curr.values.valid()) {
+        FieldValuesCommand::ReplyFields values;
+        curr.error = TryGet(curr.values, values);
+        const TypeInfo& type = this->types[curr.ref_type];
+        auto& list = std::get<0>(values);
+        for (size_t i = 0; i < list.size() && i < type.fields.size(); i++) {
+          if (uint64_t to = ObjectIn(std::get<0>(list[i]))) {
+            this->WriteEdge(curr.obj, to, type.fields[i].name);
+            this->Discover(to);
+          }
+        }
+      }
+      if (curr.elements.valid()) {
+        ArrayValuesCommand::ReplyFields elements;
+        curr.error = TryGet(curr.elements, elements);
+        const JdwpArrayRegion& region = std::get<0>(elements);
+        if (region.values) {
+          for (size_t i = 0; i < region.values->size(); i++) {
+            if (uint64_t to = ObjectIn(*(*region.values)[i])) {
+              this->WriteEdge(curr.obj, to, "[" + std::to_string(i) + "]");
+              this->Discover(to);
+            }
+          }
+        }
+      }
+      if (curr.referrers.valid()) {
+        ReferringObjectsCommand::ReplyFields referrers;
+        // Not every VM can find referrers, which doesn't stop the rest of
+        // the object from being expanded
+        if (TryGet(curr.referrers, referrers) == JdwpError::kNone) {
+          for (auto& entry : std::get<0>(referrers)) {
+            uint64_t from = std::get<0>(entry).obj_id.GetValue();
+            this->WriteEdge(from, curr.obj, "?");
+            this->Discover(from);
+          }
+        }
+      }
+
+      if (curr.error != JdwpError::kNone) {
+        this->Write('X', curr.obj);
+        this->buffer += ' ';
+        this->buffer += std::to_string(static_cast<int>(curr.error));
+      } else {
+        this->Write('N', curr.obj);
+        this->WriteId(curr.ref_type);
+      }
+      this->buffer += '\n';
+    }
+};
+
+JdwpHeapCrawler::JdwpHeapCrawler(IJdwpCon& con, JdwpMetadataCache& cache,
+    const string& path, const JdwpHeapCrawlOptions& options) :
+  pImpl(new JdwpHeapCrawler::Impl(con, cache, path, options)) { }
+
+JdwpHeapCrawler::JdwpHeapCrawler(JdwpHeapCrawler&& other) noexcept =
+  default;
+JdwpHeapCrawler& JdwpHeapCrawler::operator=(
+    JdwpHeapCrawler&& other) noexcept = default;
+
+JdwpHeapCrawler::~JdwpHeapCrawler() = default;
+
+size_t JdwpHeapCrawler::AddRootClasses(const vector<uint64_t>& ref_types) {
+  return this->pImpl->AddRootClasses(ref_types);
+}
+
+void JdwpHeapCrawler::AddRoot(uint64_t obj) { this->pImpl->AddRoot(obj); }
+
+size_t JdwpHeapCrawler::Step() { return this->pImpl->Step(); }
+
+uint64_t JdwpHeapCrawler::Crawl() { return this->pImpl->Crawl(); }
+
+uint64_t JdwpHeapCrawler::GetExpandedCount() const {
+  return this->pImpl->GetExpandedCount();
+}
+
+size_t JdwpHeapCrawler::GetFrontierSize() const {
+  return this->pImpl->GetFrontierSize();
+}
+
+}  // namespace roastery
@@ -0,0 +1,443 @@
+/* Provides a pipeline for redefining loaded classes from class files
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_hot_swap.hpp"
+
+#include <endian.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <unordered_set>
+#include <vector>
+
+#include "jdwp_class_index.hpp"
+#include "jdwp_con.hpp"
+#include "jdwp_exception.hpp"
+#include "jdwp_mapped_file.hpp"
+#include "jdwp_metadata_cache.hpp"
+#include "jdwp_packet.hpp"
+
+namespace roastery {
+
+namespace {
+
+using command_packets::virtual_machine::CapabilitiesNewCommand;
+using command_packets::virtual_machine::RedefineClassesCommand;
+
+constexpr unsigned char kClassMagic[] = { 0xCA, 0xFE, 0xBA, 0xBE };
+constexpr std::string_view kClassSuffix = ".class";
+constexpr std::string_view kJarSuffix = ".jar";
+
+/**
+ * Where in a \c CapabilitiesNew reply the VM says whether it can redefine
+ * classes.
+ */
+constexpr size_t kCanRedefineClasses = 7;
+
+/**
+ * The zip structures read from jars, and where their fields are.
+ */
+constexpr uint32_t kEndOfDirSig = 0x06054b50;
+constexpr size_t kEndOfDirLen = 22;
+constexpr size_t kEndOfDirEntries = 10;
+constexpr size_t kEndOfDirOffset = 16;
+constexpr size_t kMaxZipComment = 0xFFFF;
+
+constexpr uint32_t kDirEntrySig = 0x02014b50;
+constexpr size_t kDirEntryLen = 46;
+constexpr size_t kDirEntryFlags = 8;
+constexpr size_t kDirEntryMethod = 10;
+constexpr size_t kDirEntryCompressedSize = 20;
+constexpr size_t kDirEntrySize = 24;
+constexpr size_t kDirEntryNameLen = 28;
+constexpr size_t kDirEntryExtraLen = 30;
+constexpr size_t kDirEntryCommentLen = 32;
+constexpr size_t kDirEntryLocalOffset = 42;
+
+constexpr uint32_t kLocalHeaderSig = 0x04034b50;
+constexpr size_t kLocalHeaderLen = 30;
+constexpr size_t kLocalHeaderNameLen = 26;
+constexpr size_t kLocalHeaderExtraLen = 28;
+
+constexpr uint16_t kStored = 0;
+constexpr uint16_t kEncrypted = 1;
+
+template<typename T>
+T ReadLittleEndian(const char* data);
+
+template<>
+uint16_t ReadLittleEndian<uint16_t>(const char* data) {
+  uint16_t val;
+  memcpy(&val, data, sizeof(val));
+  return le16toh(val);
+}
+
+template<>
+uint32_t ReadLittleEndian<uint32_t>(const char* data) {
+  uint32_t val;
+  memcpy(&val, data, sizeof(val));
+  return le32toh(val);
+}
+
+bool StartsWith(std::string_view str, std::string_view prefix) {
+  return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+bool EndsWith(std::string_view str, std::string_view suffix) {
+  return str.size() >= suffix.size() &&
+    str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool IsClassFile(std::string_view bytes) {
+  return bytes.size() >= sizeof(kClassMagic) &&
+    memcmp(bytes.data(), kClassMagic, sizeof(kClassMagic)) == 0;
+}
+
+/**
+ * Returns whether the file at \c path, relative to the root of a directory
+ * or jar, holds a class that could be redefined.
+ */
+bool IsClassPath(std::string_view path) {
+  return EndsWith(path, kClassSuffix) && !StartsWith(path, "META-INF/") &&
+    path != "module-info.class";
+}
+
+/**
+ * Returns the signature of the class whose file is at \c path, relative to
+ * the root of a directory or jar.
+ */
+string PathToSignature(std::string_view path) {
+  path.remove_suffix(kClassSuffix.size());
+  string res = "L";
+  res += path;
+  res += ';';
+  return res;
+}
+
+}  // namespace
+
+/**
+ * Implementation of \c JdwpClassFiles.
+ */
+class JdwpClassFiles::Impl {
+  public:
+    Impl() = default;
+
+    // No copies
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    void AddDirectory(const string& dir) {
+      namespace fs = std::filesystem;
+      // Sorted, so the order classes are added in doesn't depend on the
+      // file system
+      std::vector<string> paths;
+      for (const fs::directory_entry& entry :
+          fs::recursive_directory_iterator(dir)) {
+        if (!entry.is_regular_file()) continue;
+        string path = entry.path().lexically_relative(dir).generic_string();
+        if (IsClassPath(path)) paths.push_back(std::move(path));
+      }
+      std::sort(paths.begin(), paths.end());
+
+      std::vector<JdwpClassFile> found;
+      std::vector<unique_ptr<impl::MappedFile>> mapped;
+      for (const string& path : paths) {
+        string full = (fs::path(dir) / path).string();
+        mapped.push_back(std::make_unique<impl::MappedFile>(full,
+            MADV_WILLNEED));
+        if (!IsClassFile(mapped.back()->Get())) {
+          throw JdwpException(full + " is not a class file");
+        }
+        found.push_back({ PathToSignature(path), mapped.back()->Get() });
+      }
+
+      // Only add anything once every file is known to be readable
+      this->classes.insert(this->classes.end(),
+          std::make_move_iterator(found.begin()),
+          std::make_move_iterator(found.end()));
+      this->mappings.insert(this->mappings.end(),
+          std::make_move_iterator(mapped.begin()),
+          std::make_move_iterator(mapped.end()));
+    }
+
+    void AddJar(const string& path) {
+      auto mapping = std::make_unique<impl::MappedFile>(path,
+          MADV_WILLNEED);
+      std::string_view jar = mapping->Get();
+      std::vector<JdwpClassFile> found;
+
+      size_t dir_offset;
+      size_t entries;
+      this->FindDirectory(path, jar, dir_offset, entries);
+      size_t offset = dir_offset;
+      for (size_t i = 0; i < entries; i++) {
+        if (jar.size() - offset < kDirEntryLen ||
+            ReadLittleEndian<uint32_t>(jar.data() + offset) != kDirEntrySig) {
+          throw JdwpException(path + " is not a jar");
+        }
+        const char* entry = jar.data() + offset;
+        size_t name_len = ReadLittleEndian<uint16_t>(entry + kDirEntryNameLen);
+        size_t entry_len = kDirEntryLen + name_len +
+          ReadLittleEndian<uint16_t>(entry + kDirEntryExtraLen) +
+          ReadLittleEndian<uint16_t>(entry + kDirEntryCommentLen);
+        if (jar.size() - offset < entry_len) {
+          throw JdwpException(path + " is not a jar");
+        }
+        offset += entry_len;
+
+        std::string_view name(entry + kDirEntryLen, name_len);
+        if (!IsClassPath(name)) continue;
+        string where = path + "!/" + string(name);
+        if (ReadLittleEndian<uint16_t>(entry + kDirEntryMethod) != kStored ||
+            (ReadLittleEndian<uint16_t>(entry + kDirEntryFlags) &
+             kEncrypted) != 0) {
+          throw JdwpException(where + " is compressed, only jars made " +
+              "without compression can be read");
+        }
+        uint32_t size = ReadLittleEndian<uint32_t>(entry + kDirEntrySize);
+        if (ReadLittleEndian<uint32_t>(entry + kDirEntryCompressedSize) !=
+            size) {
+          throw JdwpException(path + " is not a jar");
+        }
+        std::string_view bytes = ReadLocalEntry(path, jar,
+            ReadLittleEndian<uint32_t>(entry + kDirEntryLocalOffset), size);
+        if (!IsClassFile(bytes)) {
+          throw JdwpException(where + " is not a class file");
+        }
+        found.push_back({ PathToSignature(name), bytes });
+      }
+
+      // Only add anything once the whole jar is known to be readable
+      this->classes.insert(this->classes.end(),
+          std::make_move_iterator(found.begin()),
+          std::make_move_iterator(found.end()));
+      this->mappings.push_back(std::move(mapping));
+    }
+
+    void Add(const string& path) {
+      if (EndsWith(path, kJarSuffix)) {
+        this->AddJar(path);
+      } else {
+        this->AddDirectory(path);
+      }
+    }
+
+    const std::vector<JdwpClassFile>& GetClasses() const {
+      return this->classes;
+    }
+  private:
+    std::vector<JdwpClassFile> classes;
+    /**
+     * Holds the memory \c classes points into.
+     */
+    std::vector<unique_ptr<impl::MappedFile>> mappings;
+
+    /**
+     * Finds the central directory of \c jar, from the record that ends it.
+     * That record is the last thing in the file, save for a comment of up to
+     * 64KiB.
+     */
+    static void FindDirectory(const string& path, std::string_view jar,
+        size_t& offset, size_t& entries) {
+      if (jar.size() < kEndOfDirLen) {
+        throw JdwpException(path + " is not a jar");
+      }
+      size_t lowest = jar.size() - kEndOfDirLen -
+        std::min(jar.size() - kEndOfDirLen, kMaxZipComment);
+      for (size_t at = jar.size() - kEndOfDirLen + 1; at-- > lowest;) {
+        const char* end = jar.data() + at;
+        if (ReadLittleEndian<uint32_t>(end) != kEndOfDirSig) continue;
+        entries = ReadLittleEndian<uint16_t>(end + kEndOfDirEntries);
+        offset = ReadLittleEndian<uint32_t>(end + kEndOfDirOffset);
+        if (offset > at) break;
+        return;
+      }
+      throw JdwpException(path + " is not a jar");
+    }
+
+    /**
+     * Returns the \c size bytes of the entry whose local header is at
+     * \c offset in \c jar.
+     */
+    static std::string_view ReadLocalEntry(const string& path,
+        std::string_view jar, size_t offset, size_t size) {
+      if (offset > jar.size() || jar.size() - offset < kLocalHeaderLen ||
+          ReadLittleEndian<uint32_t>(jar.data() + offset) !=
+          kLocalHeaderSig) {
+        throw JdwpException(path + " is not a jar");
+      }
+      const char* header = jar.data() + offset;
+      size_t start = offset + kLocalHeaderLen +
+        ReadLittleEndian<uint16_t>(header + kLocalHeaderNameLen) +
+        ReadLittleEndian<uint16_t>(header + kLocalHeaderExtraLen);
+      if (start > jar.size() || jar.size() - start < size) {
+        throw JdwpException(path + " is not a jar");
+      }
+      return jar.substr(start, size);
+    }
+};
+
+JdwpClassFiles::JdwpClassFiles() : pImpl(std::make_unique<Impl>()) { }
+
+JdwpClassFiles::JdwpClassFiles(JdwpClassFiles&& other) noexcept = default;
+JdwpClassFiles& JdwpClassFiles::operator=(JdwpClassFiles&& other) noexcept =
+  default;
+
+JdwpClassFiles::~JdwpClassFiles() = default;
+
+void JdwpClassFiles::AddDirectory(const string& dir) {
+  this->pImpl->AddDirectory(dir);
+}
+
+void JdwpClassFiles::AddJar(const string& path) {
+  this->pImpl->AddJar(path);
+}
+
+void JdwpClassFiles::Add(const string& path) {
+  this->pImpl->Add(path);
+}
+
+const std::vector<JdwpClassFile>& JdwpClassFiles::GetClasses() const {
+  return this->pImpl->GetClasses();
+}
+
+/**
+ * Implementation of \c JdwpHotSwapper.
+ */
+class JdwpHotSwapper::Impl {
+  public:
+    Impl(IJdwpCon& con, JdwpClassIndex& index, JdwpMetadataCache& cache) :
+      con(con), index(index), cache(cache), can_redefine(false) { }
+
+    // No copies/default constructor
+    Impl() = delete;
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    JdwpHotSwapResult Swap(const JdwpClassFiles& files) {
+      // Ask while the command is being prepared, unless the VM already said
+      // it's able
+      std::future<CapabilitiesNewCommand::ReplyFields> capabilities;
+      if (!this->can_redefine) {
+        capabilities = this->con.SendAsync(
+            std::make_unique<CapabilitiesNewCommand>());
+      }
+
+      JdwpHotSwapResult res;
+      std::vector<Slot> slots;
+      std::unordered_set<std::string_view> seen;
+      for (const JdwpClassFile& file : files.GetClasses()) {
+        // As on a class path, the first class with a signature wins
+        if (!seen.insert(file.signature).second) continue;
+        std::vector<JdwpClassInfo> loaded =
+          this->index.FindBySignature(file.signature);
+        if (loaded.empty()) {
+          res.not_loaded.push_back(file.signature);
+          continue;
+        }
+        res.redefined.push_back(file.signature);
+        for (const JdwpClassInfo& info : loaded) {
+          slots.push_back({ info.ref_type, file.bytes });
+        }
+      }
+      res.types = slots.size();
+
+      auto command = std::make_unique<RedefineClassesCommand>();
+      this->Prepare(slots, std::get<0>(command->GetFields()));
+
+      if (capabilities.valid()) {
+        auto reply = capabilities.get();
+        if (!std::get<kCanRedefineClasses>(reply).GetValue()) {
+          throw JdwpException("The VM can't redefine classes");
+        }
+        this->can_redefine = true;
+      }
+      if (!slots.empty()) this->cache.RedefineClasses(std::move(command)).get();
+      return res;
+    }
+  private:
+    using Entry = std::tuple<JdwpReferenceTypeId, JdwpBytes>;
+
+    /**
+     * A loaded type to redefine, and the class file to redefine it with.
+     */
+    struct Slot {
+      uint64_t ref_type;
+      std::string_view bytes;
+    };
+
+    IJdwpCon& con;
+    JdwpClassIndex& index;
+    JdwpMetadataCache& cache;
+    /**
+     * Whether the VM has said it can redefine classes. It never changes its
+     * mind, so it's only asked until it's said so.
+     */
+    std::atomic<bool> can_redefine;
+
+    /**
+     * Fills \c entries with a command entry for each of \c slots. The class
+     * files aren't copied: each entry refers to its mapped file, and is copied
+     * straight from it into the packet as the command is serialized.
+     */
+    static void Prepare(const std::vector<Slot>& slots,
+        std::vector<Entry>& entries) {
+      entries.resize(slots.size());
+      for (size_t i = 0; i < slots.size(); i++) {
+        std::get<0>(entries[i]) << slots[i].ref_type;
+        std::get<1>(entries[i]).Refer(slots[i].bytes);
+      }
+    }
+};
+
+JdwpHotSwapper::JdwpHotSwapper(IJdwpCon& con, JdwpClassIndex& index,
+    JdwpMetadataCache& cache) :
+    pImpl(std::make_unique<Impl>(con, index, cache)) { }
+
+JdwpHotSwapper::JdwpHotSwapper(JdwpHotSwapper&& other) noexcept = default;
+JdwpHotSwapper& JdwpHotSwapper::operator=(JdwpHotSwapper&& other) noexcept =
+  default;
+
+JdwpHotSwapper::~JdwpHotSwapper() = default;
+
+JdwpHotSwapResult JdwpHotSwapper::Swap(const JdwpClassFiles& classes) {
+  return this->pImpl->Swap(classes);
+}
+
+}  // namespace roastery
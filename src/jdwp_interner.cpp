@@ -0,0 +1,134 @@
+/* Defines a table of interned strings, for metadata that repeats heavily
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_interner.hpp"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+
+namespace roastery {
+
+namespace {
+
+/**
+ * The table itself, shared with the deleter of every string handed out so
+ * that a string can be dropped from it without depending on the table
+ * outliving the string.
+ */
+struct InternerState {
+  mutex lck;
+  /**
+   * Each key views the string it maps to, so it stays valid for as long as
+   * the string does.
+   */
+  std::unordered_map<std::string_view, std::weak_ptr<const string>> table;
+};
+
+/**
+ * Frees an interned string, after removing it from its table if the table is
+ * still around.
+ */
+class Forget {
+  public:
+    explicit Forget(std::weak_ptr<InternerState> state) :
+      state(std::move(state)) { }
+
+    void operator()(const string* str) {
+      if (auto state = this->state.lock()) {
+        lock_guard<mutex> l(state->lck);
+        auto it = state->table.find(*str);
+        // The string may have been interned again since its last reference
+        // was dropped, in which case the entry is no longer ours.
+        if (it != state->table.end() && it->first.data() == str->data()) {
+          state->table.erase(it);
+        }
+      }
+      delete str;
+    }
+  private:
+    std::weak_ptr<InternerState> state;
+};
+
+}  // namespace
+
+/**
+ * Implementation of \c JdwpStringInterner.
+ */
+class JdwpStringInterner::Impl {
+  public:
+    Impl() : state(std::make_shared<InternerState>()) { }
+
+    // No copies
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    std::shared_ptr<const string> Intern(std::string_view str) {
+      lock_guard<mutex> l(this->state->lck);
+      auto it = this->state->table.find(str);
+      if (it != this->state->table.end()) {
+        if (auto res = it->second.lock()) return res;
+        // Its last reference is being dropped, but it hasn't been forgotten
+        // yet. The key views the dying string, so it has to go too.
+        this->state->table.erase(it);
+      }
+      std::shared_ptr<const string> res(new string(str),
+          Forget(this->state));
+      this->state->table.emplace(*res, res);
+      return res;
+    }
+
+    size_t Size() const {
+      lock_guard<mutex> l(this->state->lck);
+      return this->state->table.size();
+    }
+  private:
+    std::shared_ptr<InternerState> state;
+};
+
+JdwpStringInterner::JdwpStringInterner() :
+  pImpl(new JdwpStringInterner::Impl()) { }
+
+JdwpStringInterner::JdwpStringInterner(JdwpStringInterner&& other) noexcept =
+  default;
+JdwpStringInterner& JdwpStringInterner::operator=(
+    JdwpStringInterner&& other) noexcept = default;
+
+JdwpStringInterner::~JdwpStringInterner() = default;
+
+std::shared_ptr<const string> JdwpStringInterner::Intern(
+    std::string_view str) {
+  return this->pImpl->Intern(str);
+}
+
+size_t JdwpStringInterner::Size() const {
+  return this->pImpl->Size();
+}
+
+}  // namespace roastery
@@ -0,0 +1,73 @@
+/* Provides read-only memory mappings of whole files
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_mapped_file.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <string>
+#include <system_error>
+
+namespace roastery {
+
+namespace impl {
+
+MappedFile::MappedFile(const std::string& path, int advice) :
+    data(nullptr), size(0) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(),
+        "Could not open " + path);
+  }
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    int err = errno;
+    close(fd);
+    throw std::system_error(err, std::generic_category(),
+        "Could not open " + path);
+  }
+  // Empty files can't be mapped, leave them empty
+  if (info.st_size == 0) {
+    close(fd);
+    return;
+  }
+  void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid once the file is closed
+  int err = errno;
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    throw std::system_error(err, std::generic_category(),
+        "Could not map " + path);
+  }
+  this->data = static_cast<const char*>(mapped);
+  this->size = info.st_size;
+  madvise(mapped, this->size, advice);
+}
+
+MappedFile::~MappedFile() {
+  if (this->data) munmap(const_cast<char*>(this->data), this->size);
+}
+
+}  // namespace impl
+
+}  // namespace roastery
@@ -0,0 +1,459 @@
+/* Provides a cache of reference type metadata fetched over JDWP
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_metadata_cache.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_interner.hpp"
+#include "jdwp_packet.hpp"
+
+using std::lock_guard;
+using std::mutex;
+using std::shared_future;
+
+namespace roastery {
+
+namespace {
+
+using command_packets::method::LineTableCommand;
+using command_packets::method::VariableTableWithGenericCommand;
+using command_packets::reference_type::FieldsWithGenericCommand;
+using command_packets::reference_type::MethodsWithGenericCommand;
+using command_packets::reference_type::SignatureCommand;
+using command_packets::reference_type::SourceFileCommand;
+using command_packets::virtual_machine::RedefineClassesCommand;
+
+/**
+ * A single cached reply, or the request for it that's still in flight.
+ */
+template<typename T>
+struct Cached {
+  shared_future<T> value;
+  /**
+   * Identifies the request that \c value came from, so a late reply or error
+   * for a request that's since been invalidated never touches its
+   * replacement. Zero if nothing is cached.
+   */
+  uint64_t token = 0;
+};
+
+/**
+ * Everything cached about a single reference type.
+ */
+struct TypeEntry {
+  Cached<JdwpMetadataCache::SignatureReply> signature;
+  Cached<JdwpMetadataCache::SourceFileReply> source_file;
+  Cached<JdwpMetadataCache::FieldsReply> fields;
+  Cached<JdwpMetadataCache::MethodsReply> methods;
+  std::unordered_map<uint64_t, Cached<JdwpMetadataCache::LineTableReply>>
+    line_tables;
+  std::unordered_map<uint64_t,
+    Cached<JdwpMetadataCache::VariableTableReply>> variable_tables;
+  /**
+   * Set once the type's signature is known, so the entry can be found when
+   * the VM reports the class has been unloaded.
+   */
+  bool signature_known = false;
+  string signature_text;
+};
+
+/**
+ * The cached metadata, shared with the event handler and the reply callbacks
+ * of any lookups in flight so that neither depends on the cache outliving
+ * them.
+ */
+class CacheState {
+  public:
+    explicit CacheState(std::shared_ptr<JdwpStringInterner> interner) :
+      interner(std::move(interner)) { }
+
+    mutex lck;
+    /**
+     * Holds the strings in cached replies, if set.
+     */
+    std::shared_ptr<JdwpStringInterner> interner;
+    std::unordered_map<uint64_t, TypeEntry> types;
+    /**
+     * Maps each known signature to the types that have it. Usually a single
+     * type, but classes loaded by different class loaders share signatures.
+     */
+    std::unordered_map<string, vector<uint64_t>> by_signature;
+    uint64_t next_token = 1;
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+    /**
+     * Drops the entry for \c ref_type, if there is one. \c lck must be held.
+     */
+    void EraseLocked(uint64_t ref_type) {
+      auto it = this->types.find(ref_type);
+      if (it == this->types.end()) return;
+      if (it->second.signature_known) {
+        this->ForgetSignatureLocked(ref_type, it->second.signature_text);
+      }
+      this->types.erase(it);
+    }
+
+    /**
+     * Records that \c entry, the entry for \c ref_type, has the signature
+     * \c signature. \c lck must be held.
+     */
+    void RecordSignatureLocked(uint64_t ref_type, TypeEntry& entry,
+        const string& signature) {
+      if (entry.signature_known) return;
+      entry.signature_known = true;
+      entry.signature_text = signature;
+      this->by_signature[signature].push_back(ref_type);
+    }
+
+    /**
+     * Drops everything cached for a newly prepared type, in case the VM has
+     * reused the ID of an unloaded one, then records its signature.
+     */
+    void Prepare(uint64_t ref_type, const string& signature) {
+      JdwpMetadataCache::SignatureReply reply;
+      std::get<0>(reply) << signature;
+      std::promise<JdwpMetadataCache::SignatureReply> known;
+      known.set_value(std::move(reply));
+
+      lock_guard<mutex> l(this->lck);
+      this->EraseLocked(ref_type);
+      TypeEntry& entry = this->types[ref_type];
+      entry.signature.value = known.get_future().share();
+      entry.signature.token = this->next_token++;
+      this->RecordSignatureLocked(ref_type, entry, signature);
+    }
+
+    /**
+     * Drops everything cached for the types with \c signature. \c ClassUnload
+     * only names the signature, so types whose signature was never fetched
+     * might be the one unloaded, and are dropped as well.
+     */
+    void Unload(const string& signature) {
+      lock_guard<mutex> l(this->lck);
+      auto sig_it = this->by_signature.find(signature);
+      if (sig_it != this->by_signature.end()) {
+        vector<uint64_t> unloaded = std::move(sig_it->second);
+        this->by_signature.erase(sig_it);
+        for (uint64_t ref_type : unloaded) this->types.erase(ref_type);
+      }
+      for (auto it = this->types.begin(); it != this->types.end();) {
+        if (it->second.signature_known) {
+          ++it;
+        } else {
+          it = this->types.erase(it);
+        }
+      }
+    }
+  private:
+    void ForgetSignatureLocked(uint64_t ref_type, const string& signature) {
+      auto it = this->by_signature.find(signature);
+      if (it == this->by_signature.end()) return;
+      vector<uint64_t>& ids = it->second;
+      for (size_t i = 0; i < ids.size(); i++) {
+        if (ids[i] == ref_type) {
+          ids[i] = ids.back();
+          ids.pop_back();
+          break;
+        }
+      }
+      if (ids.empty()) this->by_signature.erase(it);
+    }
+};
+
+/**
+ * Keeps a \c CacheState up to date with the classes being prepared and
+ * unloaded on the VM. Runs on the connection's I/O thread.
+ */
+class InvalidationHandler : public Handler {
+  public:
+    using Handler::Handle;
+
+    explicit InvalidationHandler(std::weak_ptr<CacheState> state) :
+      state(std::move(state)) { }
+
+    void Handle(events::ClassPrepare& event) override {
+      if (auto state = this->state.lock()) {
+        state->Prepare(std::get<3>(event.GetFields()).GetValue(),
+            std::get<4>(event.GetFields()).GetValue());
+      }
+    }
+
+    void Handle(events::ClassUnload& event) override {
+      if (auto state = this->state.lock()) {
+        state->Unload(std::get<1>(event.GetFields()).GetValue());
+      }
+    }
+  private:
+    std::weak_ptr<CacheState> state;
+};
+
+}  // namespace
+
+/**
+ * Implementation of \c JdwpMetadataCache.
+ */
+class JdwpMetadataCache::Impl {
+  public:
+    Impl(IJdwpCon& con, std::shared_ptr<JdwpStringInterner> interner) :
+        con(con), state(std::make_shared<CacheState>(std::move(interner))) {
+      this->con.RegisterEventHandler(
+          std::make_unique<InvalidationHandler>(this->state));
+      // Everything is cached by reference type ID, and those were only good
+      // for the connection that was lost
+      this->con.RegisterReconnectHandler(
+          [state = std::weak_ptr<CacheState>(this->state)]() {
+            if (auto held = state.lock()) ClearAll(*held);
+          });
+    }
+
+    // No copies/default constructor
+    Impl() = delete;
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    shared_future<SignatureReply> GetSignature(uint64_t ref_type) {
+      return this->Lookup<SignatureCommand>(ref_type,
+          [](TypeEntry& entry) -> auto& { return entry.signature; },
+          [](SignatureCommand&) { });
+    }
+
+    shared_future<SourceFileReply> GetSourceFile(uint64_t ref_type) {
+      return this->Lookup<SourceFileCommand>(ref_type,
+          [](TypeEntry& entry) -> auto& { return entry.source_file; },
+          [](SourceFileCommand&) { });
+    }
+
+    shared_future<FieldsReply> GetFields(uint64_t ref_type) {
+      return this->Lookup<FieldsWithGenericCommand>(ref_type,
+          [](TypeEntry& entry) -> auto& { return entry.fields; },
+          [](FieldsWithGenericCommand&) { });
+    }
+
+    shared_future<MethodsReply> GetMethods(uint64_t ref_type) {
+      return this->Lookup<MethodsWithGenericCommand>(ref_type,
+          [](TypeEntry& entry) -> auto& { return entry.methods; },
+          [](MethodsWithGenericCommand&) { });
+    }
+
+    shared_future<LineTableReply> GetLineTable(uint64_t ref_type,
+        uint64_t method) {
+      return this->Lookup<LineTableCommand>(ref_type,
+          [method](TypeEntry& entry) -> auto& {
+            return entry.line_tables[method];
+          },
+          [method](LineTableCommand& command) {
+            std::get<1>(command.GetFields()) << method;
+          });
+    }
+
+    shared_future<VariableTableReply> GetVariableTable(uint64_t ref_type,
+        uint64_t method) {
+      return this->Lookup<VariableTableWithGenericCommand>(ref_type,
+          [method](TypeEntry& entry) -> auto& {
+            return entry.variable_tables[method];
+          },
+          [method](VariableTableWithGenericCommand& command) {
+            std::get<1>(command.GetFields()) << method;
+          });
+    }
+
+    std::future<RedefineReply> RedefineClasses(
+        unique_ptr<RedefineClassesCommand> message) {
+      auto redefined = std::make_shared<vector<uint64_t>>();
+      for (auto& cls : std::get<0>(message->GetFields())) {
+        redefined->push_back(std::get<0>(cls).GetValue());
+      }
+      this->InvalidateAll(*this->state, *redefined);
+
+      auto promise = std::make_shared<std::promise<RedefineReply>>();
+      std::future<RedefineReply> res = promise->get_future();
+      std::shared_ptr<CacheState> state = this->state;
+      this->con.SendAsync(std::move(message),
+          [state, redefined, promise](RedefineReply& reply) {
+            InvalidateAll(*state, *redefined);
+            promise->set_value(std::move(reply));
+          },
+          [state, redefined, promise](std::exception_ptr error) {
+            // The VM may have redefined some of the classes before failing
+            InvalidateAll(*state, *redefined);
+            promise->set_exception(error);
+          });
+      return res;
+    }
+
+    void Invalidate(uint64_t ref_type) {
+      lock_guard<mutex> l(this->state->lck);
+      this->state->EraseLocked(ref_type);
+    }
+
+    void Clear() { ClearAll(*this->state); }
+
+    JdwpMetadataCacheStats GetStats() const {
+      JdwpMetadataCacheStats res;
+      res.hits = this->state->hits;
+      res.misses = this->state->misses;
+      return res;
+    }
+  private:
+    IJdwpCon& con;
+    std::shared_ptr<CacheState> state;
+
+    static void ClearAll(CacheState& state) {
+      lock_guard<mutex> l(state.lck);
+      state.types.clear();
+      state.by_signature.clear();
+    }
+
+    static void InvalidateAll(CacheState& state,
+        const vector<uint64_t>& ref_types) {
+      lock_guard<mutex> l(state.lck);
+      for (uint64_t ref_type : ref_types) state.EraseLocked(ref_type);
+    }
+
+    /**
+     * Returns the cached reply to \c Command for \c ref_type, or sends
+     * \c Command to fetch it if nothing is cached.
+     *
+     * @param select Returns the slot in a \c TypeEntry that caches the reply.
+     * @param fill Fills in any fields of the command past the
+     * \c JdwpReferenceTypeId.
+     */
+    template<typename Command, typename Select, typename Fill>
+    shared_future<typename Command::ReplyFields> Lookup(uint64_t ref_type,
+        Select select, Fill fill) {
+      using Reply = typename Command::ReplyFields;
+      auto promise = std::make_shared<std::promise<Reply>>();
+      uint64_t token;
+      shared_future<Reply> res;
+      {
+        lock_guard<mutex> l(this->state->lck);
+        Cached<Reply>& slot = select(this->state->types[ref_type]);
+        if (slot.token != 0) {
+          this->state->hits++;
+          return slot.value;
+        }
+        token = this->state->next_token++;
+        slot.token = token;
+        slot.value = promise->get_future().share();
+        res = slot.value;
+      }
+      this->state->misses++;
+
+      // Only the slot for this request may be touched once the reply comes
+      // in. It may have been invalidated, and even refilled, in the meantime.
+      std::shared_ptr<CacheState> state = this->state;
+      auto find_slot = [state, ref_type, token, select]() -> Cached<Reply>* {
+        auto it = state->types.find(ref_type);
+        if (it == state->types.end()) return nullptr;
+        Cached<Reply>& slot = select(it->second);
+        return slot.token == token ? &slot : nullptr;
+      };
+      auto on_error = [state, find_slot, promise](std::exception_ptr error) {
+        {
+          lock_guard<mutex> l(state->lck);
+          if (Cached<Reply>* slot = find_slot()) *slot = Cached<Reply>();
+        }
+        promise->set_exception(error);
+      };
+
+      try {
+        auto command = std::make_unique<Command>();
+        std::get<0>(command->GetFields()) << ref_type;
+        fill(*command);
+        this->con.SendAsync(std::move(command),
+            [state, ref_type, find_slot, promise](Reply& reply) {
+              if constexpr (std::is_same_v<Command, SignatureCommand>) {
+                lock_guard<mutex> l(state->lck);
+                if (find_slot()) {
+                  state->RecordSignatureLocked(ref_type,
+                      state->types[ref_type], std::get<0>(reply).GetValue());
+                }
+              }
+              if (state->interner) impl::InternStrings(reply, *state->interner);
+              promise->set_value(std::move(reply));
+            }, on_error);
+      } catch (...) {
+        on_error(std::current_exception());
+      }
+      return res;
+    }
+};
+
+JdwpMetadataCache::JdwpMetadataCache(IJdwpCon& con,
+    std::shared_ptr<JdwpStringInterner> interner) :
+  pImpl(new JdwpMetadataCache::Impl(con, std::move(interner))) { }
+
+JdwpMetadataCache::~JdwpMetadataCache() = default;
+
+std::shared_future<JdwpMetadataCache::SignatureReply>
+JdwpMetadataCache::GetSignature(uint64_t ref_type) {
+  return this->pImpl->GetSignature(ref_type);
+}
+std::shared_future<JdwpMetadataCache::SourceFileReply>
+JdwpMetadataCache::GetSourceFile(uint64_t ref_type) {
+  return this->pImpl->GetSourceFile(ref_type);
+}
+std::shared_future<JdwpMetadataCache::FieldsReply>
+JdwpMetadataCache::GetFields(uint64_t ref_type) {
+  return this->pImpl->GetFields(ref_type);
+}
+std::shared_future<JdwpMetadataCache::MethodsReply>
+JdwpMetadataCache::GetMethods(uint64_t ref_type) {
+  return this->pImpl->GetMethods(ref_type);
+}
+std::shared_future<JdwpMetadataCache::LineTableReply>
+JdwpMetadataCache::GetLineTable(uint64_t ref_type, uint64_t method) {
+  return this->pImpl->GetLineTable(ref_type, method);
+}
+std::shared_future<JdwpMetadataCache::VariableTableReply>
+JdwpMetadataCache::GetVariableTable(uint64_t ref_type, uint64_t method) {
+  return this->pImpl->GetVariableTable(ref_type, method);
+}
+std::future<JdwpMetadataCache::RedefineReply>
+JdwpMetadataCache::RedefineClasses(
+    unique_ptr<command_packets::virtual_machine::RedefineClassesCommand>
+    message) {
+  return this->pImpl->RedefineClasses(std::move(message));
+}
+void JdwpMetadataCache::Invalidate(uint64_t ref_type) {
+  this->pImpl->Invalidate(ref_type);
+}
+void JdwpMetadataCache::Clear() { this->pImpl->Clear(); }
+JdwpMetadataCacheStats JdwpMetadataCache::GetStats() const {
+  return this->pImpl->GetStats();
+}
+
+}  // namespace roastery
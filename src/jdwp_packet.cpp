@@ -17,7 +17,9 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
-#include <sstream>
+#include <array>
+#include <atomic>
+#include <cstring>
 #include <mutex>
 #include <variant>
 
@@ -38,6 +40,21 @@ uint32_t GetNextId() {
   return res;
 }
 
+void CheckReplyHeader(std::string_view msg) {
+  if (msg.size() < kHeaderLen) throw JdwpException("Truncated reply packet");
+  if (!(static_cast<uint8_t>(msg[8]) &
+        static_cast<uint8_t>(JdwpFlags::kReply))) {
+    throw JdwpException("Cannot parse non-reply packet as a reply");
+  }
+
+  uint16_t error_nbo;
+  msg.copy(reinterpret_cast<char*>(&error_nbo), sizeof(error_nbo), 9);
+  uint16_t error = ntohs(error_nbo);
+  if (error != static_cast<uint16_t>(JdwpError::kNone)) {
+    throw JdwpReplyException(static_cast<JdwpError>(error));
+  }
+}
+
 }  // namespace impl
 
 // Defining pure virtual dtors for house keeping
@@ -47,73 +64,97 @@ IJdwpCommandPacket::IJdwpCommandPacket() : id(impl::GetNextId()) { }
 uint32_t IJdwpCommandPacket::GetId() const { return id; }
 
 string IJdwpCommandPacket::Serialize(IJdwpCon& con) const {
-  return this->SerializeImpl(con);
+  string res;
+  this->SerializeToImpl(res, con);
+  return res;
+}
+
+void IJdwpCommandPacket::SerializeTo(string& out, IJdwpCon& con) const {
+  size_t start = out.size();
+  try {
+    this->SerializeToImpl(out, con);
+  } catch (...) {
+    out.resize(start);
+    throw;
+  }
+}
+
+size_t IJdwpCommandPacket::BeginHeader(string& out) {
+  size_t header_offset = out.size();
+  out.resize(header_offset + impl::kHeaderLen);
+  return header_offset;
 }
 
-string IJdwpCommandPacket::ProduceHeader(uint8_t command_set, uint8_t command,
-    size_t body_len, uint32_t id) {
-  if (body_len > UINT32_MAX - 11) {
+void IJdwpCommandPacket::FinishHeader(string& out, size_t header_offset,
+    uint8_t command_set, uint8_t command, uint32_t id) {
+  size_t packet_len = out.size() - header_offset;
+  if (packet_len > UINT32_MAX) {
     throw JdwpException("Body too long");
   }
 
-  uint32_t len_nbo = htonl(static_cast<uint32_t>(body_len) + impl::kHeaderLen);
+  uint32_t len_nbo = htonl(static_cast<uint32_t>(packet_len));
   uint32_t id_nbo = htonl(id);
-  const unsigned char* len_nbo_bytes =
-    reinterpret_cast<unsigned char*>(&len_nbo);
-  const unsigned char* id_nbo_bytes =
-    reinterpret_cast<unsigned char*>(&id_nbo);
-
-  std::stringstream res;
-  for (size_t i = 0; i < sizeof(len_nbo); i++) res << len_nbo_bytes[i];
-  for (size_t i = 0; i < sizeof(id_nbo); i++) res << id_nbo_bytes[i];
-  res << static_cast<unsigned char>(JdwpFlags::kNone);
-  res << command_set;
-  res << command;
-
-  return res.str();
+  char* header = &out[header_offset];
+  std::memcpy(header, &len_nbo, sizeof(len_nbo));
+  std::memcpy(header + 4, &id_nbo, sizeof(id_nbo));
+  header[8] = static_cast<char>(JdwpFlags::kNone);
+  header[9] = static_cast<char>(command_set);
+  header[10] = static_cast<char>(command);
 }
 
 
 using namespace command_packets;
 using std::get;
 
-string class_type::SetValuesCommand::SerializeImpl(IJdwpCon& con) const {
-  std::ostringstream res;
+void class_type::SetValuesCommand::SerializeToImpl(string& out,
+    IJdwpCon& con) const {
   const auto& values = this->GetFields();
+  size_t header_offset = BeginHeader(out);
 
-  res << get<JdwpClassId>(values).Serialize(con);
+  get<JdwpClassId>(values).SerializeTo(out, con);
+  JdwpInt count; count << get<1>(values).size();
+  count.SerializeTo(out, con);
   for (const tuple<JdwpFieldId, JdwpValue>& value : get<1>(values)) {
-    res << get<JdwpFieldId>(value).Serialize(con);
-    res << get<JdwpValue>(value).SerializeAsUntagged(con);
+    get<JdwpFieldId>(value).SerializeTo(out, con);
+    get<JdwpValue>(value).SerializeAsUntaggedTo(out, con);
   }
 
-  return res.str();
+  FinishHeader(out, header_offset, kClassType,
+      static_cast<uint8_t>(ClassType::kSetValues), this->id);
 }
 
-string object_reference::SetValuesCommand::SerializeImpl(IJdwpCon& con) const {
-  std::ostringstream res;
+void object_reference::SetValuesCommand::SerializeToImpl(string& out,
+    IJdwpCon& con) const {
   const auto& values = this->GetFields();
+  size_t header_offset = BeginHeader(out);
 
-  res << get<JdwpObjId>(values).Serialize(con);
+  get<JdwpObjId>(values).SerializeTo(out, con);
+  JdwpInt count; count << get<1>(values).size();
+  count.SerializeTo(out, con);
   for (const tuple<JdwpFieldId, JdwpValue>& value : get<1>(values)) {
-    res << get<JdwpFieldId>(value).Serialize(con);
-    res << get<JdwpValue>(value).SerializeAsUntagged(con);
+    get<JdwpFieldId>(value).SerializeTo(out, con);
+    get<JdwpValue>(value).SerializeAsUntaggedTo(out, con);
   }
 
-  return res.str();
+  FinishHeader(out, header_offset, kObjRef,
+      static_cast<uint8_t>(ObjectReference::kSetValues), this->id);
 }
 
-string array_reference::SetValuesCommand::SerializeImpl(IJdwpCon& con) const {
-  std::ostringstream res;
+void array_reference::SetValuesCommand::SerializeToImpl(string& out,
+    IJdwpCon& con) const {
   const auto& values = this->GetFields();
+  size_t header_offset = BeginHeader(out);
 
-  res << get<JdwpArrayId>(values).Serialize(con);
-  res << get<JdwpInt>(values).Serialize(con);
+  get<JdwpArrayId>(values).SerializeTo(out, con);
+  get<JdwpInt>(values).SerializeTo(out, con);
+  JdwpInt count; count << get<2>(values).size();
+  count.SerializeTo(out, con);
   for (const tuple<JdwpValue>& value : get<2>(values)) {
-    res << get<JdwpValue>(value).SerializeAsUntagged(con);
+    get<JdwpValue>(value).SerializeAsUntaggedTo(out, con);
   }
 
-  return res.str();
+  FinishHeader(out, header_offset, kArrRef,
+      static_cast<uint8_t>(ArrayReference::kSetValues), this->id);
 }
 
 event_request::SetCommand::SetCommand() : IJdwpCommandPacket() { }
@@ -127,38 +168,38 @@ const event_request::SetCommand::Fields& event_request::SetCommand::
   return this->fields;
 }
 
-string event_request::SetCommand::SerializeImpl(IJdwpCon& con) const {
-  std::ostringstream body_acc;
+event_request::SetCommand::ReplyFields event_request::SetCommand::Deserialize(
+    std::string_view msg, IJdwpCon& con) const {
+  return impl::DecodeReply<ReplyFields>(msg, con);
+}
+
+void event_request::SetCommand::SerializeToImpl(string& out,
+    IJdwpCon& con) const {
+  size_t header_offset = BeginHeader(out);
 
-  JdwpByte event_kind = get<0>(this->fields);
-  JdwpByte suspend_policy = get<1>(this->fields);
-  vector<Modifier> modifiers = get<2>(this->fields);
+  const vector<Modifier>& modifiers = get<2>(this->fields);
 
-  body_acc << event_kind.Serialize(con);
-  body_acc << suspend_policy.Serialize(con);
+  get<0>(this->fields).SerializeTo(out, con);
+  get<1>(this->fields).SerializeTo(out, con);
   JdwpInt mod_len; mod_len << modifiers.size();
-  body_acc << mod_len.Serialize(con);
+  mod_len.SerializeTo(out, con);
   for (const Modifier& modifier : modifiers) {
     JdwpByte mod_kind; mod_kind << modifier.index() + 1;
-    body_acc << mod_kind.Serialize(con);
-    std::visit([&body_acc, &con](const auto& s) {
-      impl::TupleForEach(s, [&body_acc, &con](const auto& s) {
-        body_acc << s.Serialize(con);
-      });
+    mod_kind.SerializeTo(out, con);
+    std::visit([&out, &con](const auto& s) {
+      impl::RecursiveSerialize(out, s, con);
     }, modifier);
   }
 
-  string body = body_acc.str();
-  return ProduceHeader(
+  FinishHeader(out, header_offset,
       static_cast<uint8_t>(commands::CommandSet::kEventRequest),
       static_cast<uint8_t>(commands::EventRequest::kSet),
-      body.length(),
-      this->id) +
-    body;
+      this->id);
 }
 
-bool HeaderIsEvent(const string& header) {
+bool HeaderIsEvent(std::string_view header) {
   return
+    header.size() >= impl::kHeaderLen &&
     // Header is not a reply
     !(header[8] & 0x80) &&
     // Header is in the event command-set
@@ -167,98 +208,115 @@ bool HeaderIsEvent(const string& header) {
 
 IJdwpEvent::~IJdwpEvent() = default;
 
-vector<unique_ptr<IJdwpEvent>> IJdwpEvent::FromComposite(const string& encoded,
-    IJdwpCon& con) {
+namespace {
+
+/**
+ * Calls \c make with the \c TypeTag of the event type for \c kind, and
+ * returns the result. Which type that is comes from a table built from
+ * \c events::AllEvents at compile time.
+ *
+ * @throws JdwpException if \c kind is not a known event kind.
+ */
+template<typename Make>
+auto MakeEvent(JdwpEventKind kind, Make&& make) {
+  using Result = decltype(make(impl::TypeTag<events::VmStart>()));
+  using Entry = Result (*)(Make& make);
+  static constexpr std::array<Entry, 256> table =
+    impl::MakeEventTable<Entry, events::AllEvents>([](auto tag) {
+      using Tag = decltype(tag);
+      return static_cast<Entry>([](Make& make) { return make(Tag()); });
+    });
+  static_assert(impl::CountEventTableEntries(table) ==
+      std::tuple_size<events::AllEvents>::value,
+      "Two event types share a kind");
+
+  Entry entry = table[static_cast<uint8_t>(kind)];
+  if (entry == nullptr) {
+    throw JdwpException("Illegal eventKind in composite event");
+  }
+  return entry(make);
+}
+
+/**
+ * Parses a JDWP composite event, appending each event to \c out.
+ *
+ * @param acquire Returns a new \c Ptr for a given \c JdwpEventKind.
+ */
+template<typename Ptr, typename Acquire>
+void DecodeComposite(std::string_view encoded, IJdwpCon& con,
+    Acquire&& acquire, vector<Ptr>& out) {
+  JdwpSuspendPolicy policy;
+  int32_t event_cnt;
+  size_t idx = impl::DecodeCompositeHeader(encoded, con, policy, event_cnt);
+
+  for (int i = 0; i < event_cnt; i++) {
+    JdwpByte event_kind;
+    event_kind.FromEncoded(encoded.substr(idx), con);
+
+    Ptr ev = acquire(static_cast<JdwpEventKind>(event_kind.GetValue()));
+    idx += ev->FromEncoded(encoded.substr(idx), con);
+    ev->SetSuspendPolicy(policy);
+    out.emplace_back(move(ev));
+  }
+}
+
+}  // namespace
+
+size_t impl::DecodeCompositeHeader(std::string_view encoded, IJdwpCon& con,
+    JdwpSuspendPolicy& policy, int32_t& event_cnt) {
   if (!HeaderIsEvent(encoded))
     throw JdwpException("Cannot parse non-event packet as a composite event");
 
   size_t idx = impl::kHeaderLen;
-  // ignore suspend policy for now
-  idx += JdwpByte::value_size;
-
-  JdwpInt event_cnt;
-  event_cnt.FromEncoded(encoded.substr(idx, JdwpInt::value_size), con);
-  idx += JdwpInt::value_size;
+  JdwpByte suspend_policy;
+  idx += suspend_policy.FromEncoded(encoded.substr(idx), con);
+  policy = static_cast<JdwpSuspendPolicy>(suspend_policy.GetValue());
+
+  JdwpInt event_cnt_field;
+  idx += event_cnt_field.FromEncoded(encoded.substr(idx), con);
+  event_cnt = event_cnt_field.GetValue();
+  return idx;
+}
 
+vector<unique_ptr<IJdwpEvent>> IJdwpEvent::FromComposite(
+    std::string_view encoded, IJdwpCon& con) {
   auto res = vector<unique_ptr<IJdwpEvent>>();
-  for (int i = 0; i < event_cnt.GetValue(); i++) {
-    using namespace roastery::events;
-
-    JdwpByte event_kind;
-    event_kind.FromEncoded(encoded.substr(idx, JdwpByte::value_size), con);
-
-    unique_ptr<IJdwpEvent> ev;
-    switch(static_cast<JdwpEventKind>(event_kind.GetValue())) {
-      case JdwpEventKind::kVmStart:
-          ev = unique_ptr<VmStart>(new VmStart());
-          break;
-      case JdwpEventKind::kSingleStep:
-          ev = unique_ptr<SingleStep>(new SingleStep());
-          break;
-      case JdwpEventKind::kBreakpoint:
-          ev = unique_ptr<Breakpoint>(new Breakpoint());
-          break;
-      case JdwpEventKind::kMethodEntry:
-          ev = unique_ptr<MethodEntry>(new MethodEntry());
-          break;
-      case JdwpEventKind::kMethodExit:
-          ev = unique_ptr<MethodExit>(new MethodExit());
-          break;
-      case JdwpEventKind::kMethodExitWithReturnValue:
-          ev = unique_ptr<MethodExitWithReturnValue>(
-              new MethodExitWithReturnValue());
-          break;
-      case JdwpEventKind::kMonitorContendedEnter:
-          ev = unique_ptr<MonitorContendedEnter>(new MonitorContendedEnter());
-          break;
-      case JdwpEventKind::kMonitorContendedEntered:
-          ev = unique_ptr<MonitorContendedEntered>(
-              new MonitorContendedEntered());
-          break;
-      case JdwpEventKind::kMonitorWait:
-          ev = unique_ptr<MonitorWait>(new MonitorWait());
-          break;
-      case JdwpEventKind::kMonitorWaited:
-          ev = unique_ptr<MonitorWaited>(new MonitorWaited());
-          break;
-      case JdwpEventKind::kException:
-          ev = unique_ptr<Exception>(new Exception());
-          break;
-      case JdwpEventKind::kThreadStart:
-          ev = unique_ptr<ThreadStart>(new ThreadStart());
-          break;
-      case JdwpEventKind::kThreadDeath:
-          ev = unique_ptr<ThreadDeath>(new ThreadDeath());
-          break;
-      case JdwpEventKind::kClassPrepare:
-          ev = unique_ptr<ClassPrepare>(new ClassPrepare());
-          break;
-      case JdwpEventKind::kClassUnload:
-          ev = unique_ptr<ClassUnload>(new ClassUnload());
-          break;
-      case JdwpEventKind::kFieldAccess:
-          ev = unique_ptr<FieldAccess>(new FieldAccess());
-          break;
-      case JdwpEventKind::kFieldModification:
-          ev = unique_ptr<FieldModification>(new FieldModification());
-          break;
-      case JdwpEventKind::kVmDeath:
-          ev = unique_ptr<VmDeath>(new VmDeath());
-          break;
-      default:
-          throw JdwpException("Illegal eventKind in composite event");
-    }
+  DecodeComposite(encoded, con, [](JdwpEventKind kind) {
+    return MakeEvent(kind, [](auto tag) {
+      return unique_ptr<IJdwpEvent>(new typename decltype(tag)::type());
+    });
+  }, res);
+  return res;
+}
 
-    idx += ev->FromEncoded(encoded.substr(idx), con);
-    res.emplace_back(move(ev));
+void IJdwpEvent::FromComposite(std::string_view encoded, IJdwpCon& con,
+    JdwpEventPool& pool, vector<JdwpEventPool::Ptr>& out) {
+  out.clear();
+  try {
+    DecodeComposite(encoded, con,
+        [&pool](JdwpEventKind kind) { return pool.Acquire(kind); }, out);
+  } catch (...) {
+    out.clear();
+    throw;
   }
-
-  return res;
 }
 
 JdwpEventKind IJdwpEvent::GetKind() const { return this->GetKindImpl(); }
+int32_t IJdwpEvent::GetRequestId() const { return this->GetRequestIdImpl(); }
+void IJdwpEvent::SetRequestId(int32_t request_id) {
+  this->SetRequestIdImpl(request_id);
+}
+bool IJdwpEvent::GetThreadId(uint64_t& thread_id) const {
+  return this->GetThreadIdImpl(thread_id);
+}
+JdwpSuspendPolicy IJdwpEvent::GetSuspendPolicy() const {
+  return this->suspend_policy;
+}
+void IJdwpEvent::SetSuspendPolicy(JdwpSuspendPolicy suspend_policy) {
+  this->suspend_policy = suspend_policy;
+}
 
-size_t IJdwpEvent::FromEncoded(const string& encoded, IJdwpCon& con) {
+size_t IJdwpEvent::FromEncoded(std::string_view encoded, IJdwpCon& con) {
   JdwpByte event_kind; event_kind.FromEncoded(encoded, con);
   if (static_cast<JdwpEventKind>(event_kind.GetValue()) != this->GetKind())
     throw JdwpException("Wrong IJdwpEvent instance for event");
@@ -270,5 +328,86 @@ void IJdwpEvent::Dispatch(Handler& handler) {
   this->DispatchImpl(handler);
 }
 
+/**
+ * Implementation of \c JdwpEventPool.
+ */
+class JdwpEventPool::Impl {
+  public:
+    explicit Impl(size_t max_per_kind) :
+      max_per_kind(max_per_kind), allocated(0) { }
+
+    ~Impl() {
+      for (auto& free_list : this->free_lists) {
+        for (IJdwpEvent* event : free_list) delete event;
+      }
+    }
+
+    /**
+     * Pops a released event of the given \c kind, or returns \c nullptr if
+     * there isn't one.
+     */
+    IJdwpEvent* TakeFree(JdwpEventKind kind) {
+      auto& free_list = this->free_lists[static_cast<uint8_t>(kind)];
+      std::lock_guard<std::mutex> l(this->lck);
+      if (free_list.empty()) return nullptr;
+      IJdwpEvent* res = free_list.back();
+      free_list.pop_back();
+      return res;
+    }
+
+    /**
+     * Keeps \c event around to be reused, or deletes it if there are already
+     * enough unused events of its kind.
+     */
+    void Release(IJdwpEvent* event) {
+      auto& free_list =
+          this->free_lists[static_cast<uint8_t>(event->GetKind())];
+      {
+        std::lock_guard<std::mutex> l(this->lck);
+        if (free_list.size() < this->max_per_kind) {
+          free_list.push_back(event);
+          return;
+        }
+      }
+      delete event;
+    }
+
+    const size_t max_per_kind;
+    std::atomic<size_t> allocated;
+  private:
+    /**
+     * Released events, indexed by their \c JdwpEventKind.
+     */
+    std::array<vector<IJdwpEvent*>, 256> free_lists;
+    std::mutex lck;
+};
+
+void JdwpEventPool::Recycler::operator()(IJdwpEvent* event) const {
+  if (this->pool) {
+    this->pool->pImpl->Release(event);
+  } else {
+    delete event;
+  }
+}
+
+JdwpEventPool::JdwpEventPool(size_t max_per_kind) :
+  pImpl(new Impl(max_per_kind)) { }
+
+JdwpEventPool::~JdwpEventPool() = default;
+
+JdwpEventPool::Ptr JdwpEventPool::Acquire(JdwpEventKind kind) {
+  IJdwpEvent* event = this->pImpl->TakeFree(kind);
+  if (event) return Ptr(event, Recycler(this));
+  Ptr res = MakeEvent(kind, [this](auto tag) {
+    return Ptr(new typename decltype(tag)::type(), Recycler(this));
+  });
+  this->pImpl->allocated++;
+  return res;
+}
+
+size_t JdwpEventPool::GetAllocatedCount() const {
+  return this->pImpl->allocated;
+}
+
 }  // namespace roastery
 
@@ -0,0 +1,371 @@
+/* Implements an event loop for driving JDWP connections
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_reactor.hpp"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using std::condition_variable;
+using std::lock_guard;
+using std::mutex;
+using std::shared_ptr;
+using std::unique_lock;
+using std::vector;
+
+namespace roastery {
+
+/**
+ * Implementation of \c JdwpReactor.
+ */
+class JdwpReactor::Impl {
+  public:
+    Impl() : epoll_fd(epoll_create1(EPOLL_CLOEXEC)), should_stop(false),
+        wait_error(0) {
+      if (this->epoll_fd < 0) {
+        throw std::system_error(errno, std::generic_category(),
+            "Could not create an epoll instance");
+      }
+      this->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (this->wake_fd < 0) {
+        int err = errno;
+        close(this->epoll_fd);
+        throw std::system_error(err, std::generic_category(),
+            "Could not create an eventfd");
+      }
+      try {
+        this->AddToEpoll(this->wake_fd);
+      } catch (...) {
+        close(this->wake_fd);
+        close(this->epoll_fd);
+        throw;
+      }
+      this->loop_thread = std::thread(&Impl::Loop, this);
+    }
+
+    // No copies/default constructor
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    ~Impl() {
+      this->should_stop = true;
+      this->Wake();
+      {
+        // Taken so the loop can't miss this between checking should_stop and
+        // waiting, if it's only running tasks.
+        lock_guard<mutex> l(this->tasks_lck);
+      }
+      this->tasks_cv.notify_all();
+      if (this->loop_thread.joinable()) {
+        this->loop_thread.join();
+      }
+      close(this->wake_fd);
+      close(this->epoll_fd);
+    }
+
+    void Watch(int fd, Callback on_readable, Callback on_failed) {
+      // Held throughout, so fd is either failed along with the rest or not
+      // added at all.
+      lock_guard<mutex> l(this->watchers_lck);
+      if (this->wait_error != 0) {
+        throw std::system_error(this->wait_error, std::generic_category(),
+            "Could not watch file descriptor");
+      }
+      this->watchers[fd] = std::make_shared<Watcher>(
+          Watcher{ move(on_readable), move(on_failed), nullptr });
+      try {
+        this->AddToEpoll(fd);
+      } catch (...) {
+        this->watchers.erase(fd);
+        throw;
+      }
+    }
+
+    void WatchWritable(int fd, Callback on_writable) {
+      lock_guard<mutex> l(this->watchers_lck);
+      auto it = this->watchers.find(fd);
+      if (it == this->watchers.end()) return;
+      bool armed = static_cast<bool>(it->second->on_writable);
+      it->second->on_writable = move(on_writable);
+      if (!armed && !this->ModifyEpoll(fd, EPOLLIN | EPOLLOUT)) {
+        int err = errno;
+        it->second->on_writable = nullptr;
+        throw std::system_error(err, std::generic_category(),
+            "Could not watch file descriptor for writing");
+      }
+    }
+
+    void Unwatch(int fd) {
+      bool was_watched;
+      {
+        lock_guard<mutex> l(this->watchers_lck);
+        was_watched = this->watchers.erase(fd) > 0;
+      }
+      if (was_watched) {
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+      }
+
+      // The loop may be in the middle of running the callback we just removed.
+      // Wait for the loop to come around to the task queue, which happens only
+      // after every callback from the current batch of events has returned.
+      if (!this->InReactorThread()) {
+        this->Sync();
+      }
+    }
+
+    void Post(Callback task) {
+      {
+        lock_guard<mutex> l(this->tasks_lck);
+        this->tasks.push_back(move(task));
+      }
+      this->Wake();
+      this->tasks_cv.notify_one();
+    }
+
+    bool InReactorThread() const {
+      return std::this_thread::get_id() == this->loop_thread.get_id();
+    }
+  private:
+    static constexpr int kMaxEvents = 64;
+
+    /**
+     * What's registered for a watched file descriptor. \c on_writable is set
+     * while it's watched for writability, and guarded by \c watchers_lck.
+     */
+    struct Watcher {
+      Callback on_readable;
+      Callback on_failed;
+      Callback on_writable;
+    };
+
+    int epoll_fd;
+    int wake_fd;
+    std::atomic_bool should_stop;
+    std::thread loop_thread;
+
+    std::unordered_map<int, shared_ptr<Watcher>> watchers;
+    // Why epoll_wait last failed, once it can't be used anymore.
+    int wait_error;
+    mutex watchers_lck;
+
+    vector<Callback> tasks;
+    mutex tasks_lck;
+    // Only waited on once epoll_wait can't be.
+    condition_variable tasks_cv;
+
+    /**
+     * Registers \c fd with \c epoll_fd for level-triggered read readiness.
+     */
+    void AddToEpoll(int fd) {
+      struct epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+      if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        throw std::system_error(errno, std::generic_category(),
+            "Could not watch file descriptor");
+      }
+    }
+
+    /**
+     * Changes the readiness \c fd is watched for to \c events.
+     *
+     * @return Whether \c epoll_fd could be updated, with the reason in
+     * \c errno if not.
+     */
+    bool ModifyEpoll(int fd, uint32_t events) {
+      struct epoll_event ev = {};
+      ev.events = events;
+      ev.data.fd = fd;
+      return epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0;
+    }
+
+    /**
+     * Takes the \c on_writable waiting for \c fd, if there is one, and goes
+     * back to watching it only for reads.
+     */
+    Callback TakeWritable(int fd) {
+      lock_guard<mutex> l(this->watchers_lck);
+      auto it = this->watchers.find(fd);
+      if (it == this->watchers.end() || !it->second->on_writable) {
+        return nullptr;
+      }
+      // If this fails, fd just stays watched for writes, and the next time
+      // it's reported nothing's waiting and this is tried again.
+      static_cast<void>(this->ModifyEpoll(fd, EPOLLIN));
+      Callback res = move(it->second->on_writable);
+      it->second->on_writable = nullptr;
+      return res;
+    }
+
+    /**
+     * Wakes the loop if it is sleeping in \c epoll_wait.
+     */
+    void Wake() {
+      uint64_t one = 1;
+      // The only possible failure is the counter overflowing, in which case the
+      // loop already has a wakeup pending.
+      static_cast<void>(write(this->wake_fd, &one, sizeof(one)));
+    }
+
+    /**
+     * Blocks until every task posted before this call has run.
+     */
+    void Sync() {
+      mutex done_lck;
+      condition_variable done_cv;
+      bool done = false;
+      this->Post([&]() {
+        lock_guard<mutex> l(done_lck);
+        done = true;
+        done_cv.notify_all();
+      });
+      unique_lock<mutex> l(done_lck);
+      done_cv.wait(l, [&done]() { return done; });
+    }
+
+    /**
+     * Runs every task that is currently queued.
+     */
+    void RunTasks() {
+      vector<Callback> to_run;
+      {
+        lock_guard<mutex> l(this->tasks_lck);
+        to_run.swap(this->tasks);
+      }
+      for (Callback& task : to_run) {
+        task();
+      }
+    }
+
+    /**
+     * Stops watching every file descriptor, for good, after \c epoll_wait
+     * failed with \c err, and tells each watcher.
+     */
+    void FailWatchers(int err) {
+      std::unordered_map<int, shared_ptr<Watcher>> failed;
+      {
+        lock_guard<mutex> l(this->watchers_lck);
+        this->wait_error = err;
+        failed.swap(this->watchers);
+      }
+      for (auto& [fd, watcher] : failed) {
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        if (watcher->on_failed) watcher->on_failed();
+      }
+    }
+
+    /**
+     * Runs tasks as they're posted until the reactor is stopped, without
+     * \c epoll_wait.
+     */
+    void RunTasksUntilStopped() {
+      while (true) {
+        {
+          unique_lock<mutex> l(this->tasks_lck);
+          this->tasks_cv.wait(l, [this]() {
+            return this->should_stop || !this->tasks.empty();
+          });
+          if (this->should_stop && this->tasks.empty()) return;
+        }
+        this->RunTasks();
+      }
+    }
+
+    /**
+     * The body of the reactor's thread.
+     */
+    void Loop() {
+      struct epoll_event events[kMaxEvents];
+      while (!this->should_stop) {
+        int ready = epoll_wait(this->epoll_fd, events, kMaxEvents, -1);
+        if (ready < 0) {
+          if (errno == EINTR) continue;
+          // Throwing here would take the whole process down, so close what's
+          // watched instead and keep running tasks.
+          this->FailWatchers(errno);
+          this->RunTasksUntilStopped();
+          return;
+        }
+
+        for (int i = 0; i < ready; i++) {
+          int fd = events[i].data.fd;
+          if (fd == this->wake_fd) {
+            uint64_t count;
+            static_cast<void>(read(this->wake_fd, &count, sizeof(count)));
+            continue;
+          }
+
+          shared_ptr<Watcher> watcher;
+          {
+            lock_guard<mutex> l(this->watchers_lck);
+            auto it = this->watchers.find(fd);
+            if (it != this->watchers.end()) watcher = it->second;
+          }
+          // The watcher may have been removed by an earlier callback in this
+          // batch.
+          if (!watcher) continue;
+          // Anything but writability is for the reader, including a hang up or
+          // an error, which the writer hears of too.
+          if (events[i].events & ~EPOLLOUT) watcher->on_readable();
+          if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+            Callback on_writable = this->TakeWritable(fd);
+            if (on_writable) on_writable();
+          }
+        }
+
+        this->RunTasks();
+      }
+      // Don't leave anything blocked in Sync().
+      this->RunTasks();
+    }
+};
+
+JdwpReactor::JdwpReactor() : pImpl(new Impl()) { }
+
+JdwpReactor::~JdwpReactor() = default;
+
+void JdwpReactor::Watch(int fd, Callback on_readable, Callback on_failed) {
+  this->pImpl->Watch(fd, move(on_readable), move(on_failed));
+}
+void JdwpReactor::WatchWritable(int fd, Callback on_writable) {
+  this->pImpl->WatchWritable(fd, move(on_writable));
+}
+void JdwpReactor::Unwatch(int fd) { this->pImpl->Unwatch(fd); }
+void JdwpReactor::Post(Callback task) { this->pImpl->Post(move(task)); }
+bool JdwpReactor::InReactorThread() const {
+  return this->pImpl->InReactorThread();
+}
+
+}  // namespace roastery
@@ -0,0 +1,437 @@
+/* Provides recording and replay of the packets recieved from a JDWP server
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_recording.hpp"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_dispatcher.hpp"
+#include "jdwp_exception.hpp"
+#include "jdwp_mapped_file.hpp"
+#include "jdwp_packet.hpp"
+
+using std::lock_guard;
+using std::mutex;
+
+namespace roastery {
+
+namespace {
+
+constexpr char kMagic[] = { 'R', 'S', 'T', 'R', 'E', 'C' };
+constexpr uint16_t kVersion = 1;
+constexpr size_t kFileHeaderLen = 16;
+constexpr size_t kTimestampLen = sizeof(uint64_t);
+
+/**
+ * Buffered records are written out once there's at least this much of them.
+ */
+constexpr size_t kFlushThreshold = 64 * 1024;
+
+/**
+ * Writes all of \c data to \c fd.
+ *
+ * @return 0, or the \c errno of the write that failed.
+ */
+int WriteAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t written = write(fd, data.data(), data.size());
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
+    data.remove_prefix(written);
+  }
+  return 0;
+}
+
+template<typename T>
+T ReadBigEndian(const char* data);
+
+template<>
+uint16_t ReadBigEndian<uint16_t>(const char* data) {
+  uint16_t res;
+  memcpy(&res, data, sizeof(res));
+  return be16toh(res);
+}
+
+template<>
+uint32_t ReadBigEndian<uint32_t>(const char* data) {
+  uint32_t res;
+  memcpy(&res, data, sizeof(res));
+  return be32toh(res);
+}
+
+template<>
+uint64_t ReadBigEndian<uint64_t>(const char* data) {
+  uint64_t res;
+  memcpy(&res, data, sizeof(res));
+  return be64toh(res);
+}
+
+}  // namespace
+
+/**
+ * Implementation of \c JdwpRecorder.
+ */
+class JdwpRecorder::Impl {
+  public:
+    Impl(const string& path, IJdwpCon& con) : error(0), records(0) {
+      this->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+          0644);
+      if (this->fd < 0) {
+        throw std::system_error(errno, std::generic_category(),
+            "Could not create " + path);
+      }
+
+      string header(kMagic, sizeof(kMagic));
+      uint16_t version_nbo = htobe16(kVersion);
+      header.append(reinterpret_cast<char*>(&version_nbo),
+          sizeof(version_nbo));
+      header.push_back(static_cast<char>(con.GetFieldIdSize()));
+      header.push_back(static_cast<char>(con.GetMethodIdSize()));
+      header.push_back(static_cast<char>(con.GetObjIdSize()));
+      header.push_back(static_cast<char>(con.GetFrameIdSize()));
+      header.resize(kFileHeaderLen, '\0');
+      if (int err = WriteAll(this->fd, header)) {
+        close(this->fd);
+        throw std::system_error(err, std::generic_category(),
+            "Could not write to " + path);
+      }
+    }
+
+    // No copies/default constructor
+    Impl() = delete;
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    ~Impl() {
+      this->WriteBuffered();
+      close(this->fd);
+    }
+
+    void Append(std::string_view packet) {
+      auto now = std::chrono::system_clock::now().time_since_epoch();
+      uint64_t timestamp_nbo = htobe64(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+
+      lock_guard<mutex> l(this->lck);
+      if (this->error) return;
+      this->buffer.append(reinterpret_cast<char*>(&timestamp_nbo),
+          sizeof(timestamp_nbo));
+      this->buffer.append(packet);
+      this->records++;
+      if (this->buffer.size() >= kFlushThreshold) this->WriteBuffered();
+    }
+
+    void Flush() {
+      lock_guard<mutex> l(this->lck);
+      this->WriteBuffered();
+      if (this->error) {
+        throw std::system_error(this->error, std::generic_category(),
+            "Could not write recording");
+      }
+    }
+
+    uint64_t GetRecordCount() const {
+      lock_guard<mutex> l(this->lck);
+      return this->records;
+    }
+  private:
+    int fd;
+    mutable mutex lck;
+    /**
+     * Records not yet written to \c fd.
+     */
+    string buffer;
+    /**
+     * The \c errno of the first write that failed, or 0.
+     */
+    int error;
+    uint64_t records;
+
+    /**
+     * Writes out \c buffer. \c lck must be held, or \c this being destroyed.
+     */
+    void WriteBuffered() {
+      if (!this->error) this->error = WriteAll(this->fd, this->buffer);
+      this->buffer.clear();
+    }
+};
+
+JdwpRecorder::JdwpRecorder(const string& path, IJdwpCon& con) :
+  pImpl(new JdwpRecorder::Impl(path, con)) { }
+
+JdwpRecorder::JdwpRecorder(JdwpRecorder&& other) noexcept = default;
+JdwpRecorder& JdwpRecorder::operator=(JdwpRecorder&& other) noexcept =
+  default;
+
+JdwpRecorder::~JdwpRecorder() = default;
+
+void JdwpRecorder::Append(std::string_view packet) {
+  this->pImpl->Append(packet);
+}
+void JdwpRecorder::Flush() { this->pImpl->Flush(); }
+uint64_t JdwpRecorder::GetRecordCount() const {
+  return this->pImpl->GetRecordCount();
+}
+
+/**
+ * Implementation of \c JdwpRecording.
+ */
+class JdwpRecording::Impl {
+  public:
+    explicit Impl(const string& path) :
+        mapping(path, MADV_SEQUENTIAL), data(mapping.Get().data()),
+        size(mapping.Get().size()), offset(kFileHeaderLen) {
+      if (this->size < kFileHeaderLen ||
+          memcmp(this->data, kMagic, sizeof(kMagic)) != 0 ||
+          ReadBigEndian<uint16_t>(this->data + sizeof(kMagic)) != kVersion) {
+        throw JdwpException(path + " is not a recording");
+      }
+    }
+
+    // No copies/default constructor
+    Impl() = delete;
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    bool Next(JdwpRecord& out) {
+      size_t remaining = this->size - this->offset;
+      if (remaining < kTimestampLen + impl::kHeaderLen) return false;
+      const char* record = this->data + this->offset;
+      uint32_t length = ReadBigEndian<uint32_t>(record + kTimestampLen);
+      if (length < impl::kHeaderLen || length > remaining - kTimestampLen) {
+        return false;
+      }
+      out.timestamp_ns = ReadBigEndian<uint64_t>(record);
+      out.packet = std::string_view(record + kTimestampLen, length);
+      this->offset += kTimestampLen + length;
+      return true;
+    }
+
+    void Rewind() { this->offset = kFileHeaderLen; }
+
+    /**
+     * Returns the ID size at \c index in the file header, in the order
+     * field, method, object, frame.
+     */
+    uint8_t GetIdSize(size_t index) const {
+      return static_cast<uint8_t>(
+          this->data[sizeof(kMagic) + sizeof(kVersion) + index]);
+    }
+  private:
+    impl::MappedFile mapping;
+    const char* data;
+    size_t size;
+    /**
+     * Where the next record starts.
+     */
+    size_t offset;
+};
+
+JdwpRecording::JdwpRecording(const string& path) :
+  pImpl(new JdwpRecording::Impl(path)) { }
+
+JdwpRecording::JdwpRecording(JdwpRecording&& other) noexcept = default;
+JdwpRecording& JdwpRecording::operator=(JdwpRecording&& other) noexcept =
+  default;
+
+JdwpRecording::~JdwpRecording() = default;
+
+bool JdwpRecording::Next(JdwpRecord& out) { return this->pImpl->Next(out); }
+void JdwpRecording::Rewind() { this->pImpl->Rewind(); }
+
+uint8_t JdwpRecording::GetFieldIdSize() const {
+  return this->pImpl->GetIdSize(0);
+}
+uint8_t JdwpRecording::GetMethodIdSize() const {
+  return this->pImpl->GetIdSize(1);
+}
+uint8_t JdwpRecording::GetObjIdSize() const {
+  return this->pImpl->GetIdSize(2);
+}
+uint8_t JdwpRecording::GetFrameIdSize() const {
+  return this->pImpl->GetIdSize(3);
+}
+
+/**
+ * Implementation of \c JdwpReplayCon.
+ */
+class JdwpReplayCon::Impl {
+  public:
+    explicit Impl(const string& path) : recording(path) { }
+
+    // No copies/default constructor
+    Impl() = delete;
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    JdwpRecording& GetRecording() { return this->recording; }
+
+    void RegisterEventHandler(unique_ptr<Handler> handler,
+        JdwpDispatchMode mode) {
+      // There's no VM to resume, so fast-resume handlers are just inline
+      if (mode != JdwpDispatchMode::kPooled) {
+        this->inline_handlers.Add(move(handler));
+        return;
+      }
+
+      lock_guard<mutex> l(this->dispatcher_lck);
+      if (!this->dispatcher) {
+        this->dispatcher.reset(new JdwpEventDispatcher());
+      }
+      this->dispatcher->RegisterHandler(move(handler));
+    }
+
+    void AddPacketHandler(JdwpPacketHandler handler) {
+      this->packet_handlers.Add(move(handler));
+    }
+
+    /**
+     * Replays the recording, decoding its events for \c con, the connection
+     * that owns \c this.
+     */
+    size_t Replay(IJdwpCon& con) {
+      JdwpEventDispatcher* dispatcher;
+      {
+        lock_guard<mutex> l(this->dispatcher_lck);
+        dispatcher = this->dispatcher.get();
+      }
+
+      size_t replayed = 0;
+      this->recording.Rewind();
+      JdwpRecord record;
+      while (this->recording.Next(record)) {
+        if (!HeaderIsEvent(record.packet)) continue;
+        try {
+          IJdwpEvent::FromComposite(record.packet, con, this->event_pool,
+              this->decoded_events);
+        } catch (const JdwpException& e) {
+          continue;
+        }
+        impl::HandlerList::Snapshot handlers = this->inline_handlers.Get();
+        for (auto& event : this->decoded_events) {
+          for (auto& handler : *handlers) {
+            event->Dispatch(*handler);
+          }
+        }
+        auto packet_handlers = this->packet_handlers.Get();
+        for (auto& handler : *packet_handlers) {
+          handler(record.packet, con);
+        }
+        replayed += this->decoded_events.size();
+        if (dispatcher) {
+          for (auto& event : this->decoded_events) {
+            dispatcher->Dispatch(move(event));
+          }
+        }
+        this->decoded_events.clear();
+      }
+      if (dispatcher) dispatcher->Flush();
+      return replayed;
+    }
+  private:
+    JdwpRecording recording;
+    impl::HandlerList inline_handlers;
+    impl::CopyOnWriteList<JdwpPacketHandler> packet_handlers;
+    JdwpEventPool event_pool;
+    vector<JdwpEventPool::Ptr> decoded_events;
+    /**
+     * Declared after \c event_pool, so that it's stopped before the pool its
+     * events return to is destroyed.
+     */
+    unique_ptr<JdwpEventDispatcher> dispatcher;
+    mutex dispatcher_lck;
+};
+
+JdwpReplayCon::JdwpReplayCon(const string& path) :
+    pImpl(new JdwpReplayCon::Impl(path)) {
+  const JdwpRecording& recording = this->pImpl->GetRecording();
+  this->CacheIdSizes(recording.GetFieldIdSize(), recording.GetMethodIdSize(),
+      recording.GetObjIdSize(), recording.GetFrameIdSize());
+}
+
+JdwpReplayCon::JdwpReplayCon(JdwpReplayCon&& other) noexcept = default;
+JdwpReplayCon& JdwpReplayCon::operator=(JdwpReplayCon&& other) noexcept =
+  default;
+
+JdwpReplayCon::~JdwpReplayCon() = default;
+
+size_t JdwpReplayCon::Replay() { return this->pImpl->Replay(*this); }
+
+uint8_t JdwpReplayCon::GetObjIdSizeImpl() {
+  return this->pImpl->GetRecording().GetObjIdSize();
+}
+uint8_t JdwpReplayCon::GetMethodIdSizeImpl() {
+  return this->pImpl->GetRecording().GetMethodIdSize();
+}
+uint8_t JdwpReplayCon::GetFieldIdSizeImpl() {
+  return this->pImpl->GetRecording().GetFieldIdSize();
+}
+uint8_t JdwpReplayCon::GetFrameIdSizeImpl() {
+  return this->pImpl->GetRecording().GetFrameIdSize();
+}
+
+void JdwpReplayCon::RegisterEventHandlerImpl(unique_ptr<Handler> handler,
+    JdwpDispatchMode mode) {
+  this->pImpl->RegisterEventHandler(move(handler), mode);
+}
+
+void JdwpReplayCon::RegisterPacketHandlerImpl(JdwpPacketHandler handler) {
+  this->pImpl->AddPacketHandler(move(handler));
+}
+
+void JdwpReplayCon::SendMessageImpl(unique_ptr<IJdwpCommandPacket> message,
+    unique_ptr<ReplyHandler> on_reply) {
+  if (on_reply) {
+    on_reply->OnError(*message, std::make_exception_ptr(
+          JdwpException("Can't send messages on a replayed connection")));
+  }
+}
+
+}  // namespace roastery
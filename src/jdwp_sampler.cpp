@@ -0,0 +1,324 @@
+/* Provides a wall-clock sampling profiler built on JDWP
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_sampler.hpp"
+
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_exception.hpp"
+#include "jdwp_metadata_cache.hpp"
+#include "jdwp_packet.hpp"
+
+using std::shared_future;
+
+namespace roastery {
+
+namespace {
+
+using command_packets::thread_reference::FramesCommand;
+using command_packets::thread_reference::NameCommand;
+using command_packets::thread_reference::ResumeCommand;
+using command_packets::thread_reference::SuspendCommand;
+using command_packets::virtual_machine::AllThreadsCommand;
+
+/**
+ * A frame's class, method and index within the method.
+ */
+using Frame = std::tuple<uint64_t, uint64_t, uint64_t>;
+/**
+ * A thread's frames, from the top of its stack down.
+ */
+using Stack = vector<Frame>;
+
+/**
+ * Returns a \c Command whose first field is \c thread.
+ */
+template<typename Command>
+unique_ptr<Command> ForThread(uint64_t thread) {
+  auto res = std::make_unique<Command>();
+  std::get<0>(res->GetFields()) << thread;
+  return res;
+}
+
+/**
+ * Stores the value of \c future in \c out, unless it holds an exception.
+ *
+ * @return Whether \c future held a value.
+ */
+template<typename T>
+bool TryGet(const shared_future<T>& future, const T*& out) {
+  try {
+    out = &future.get();
+    return true;
+  } catch (const JdwpException& e) {
+    return false;
+  }
+}
+
+/**
+ * Returns the fully qualified name of the class with the JNI signature
+ * \c signature, e.g. \c java.lang.String for \c Ljava/lang/String;
+ */
+string ClassName(const string& signature) {
+  string res = signature;
+  if (res.size() >= 2 && res.front() == 'L' && res.back() == ';') {
+    res = res.substr(1, res.size() - 2);
+  }
+  for (char& c : res) {
+    if (c == '/') c = '.';
+  }
+  return res;
+}
+
+/**
+ * Replaces the characters that separate frames in folded stacks.
+ */
+string FoldedSafe(string label) {
+  for (char& c : label) {
+    if (c == ';' || c == '\n') c = '_';
+  }
+  return label;
+}
+
+}  // namespace
+
+/**
+ * Implementation of \c JdwpSampler.
+ */
+class JdwpSampler::Impl {
+  public:
+    Impl(IJdwpCon& con, JdwpMetadataCache& cache,
+        const JdwpSamplerOptions& options) :
+      con(con), cache(cache), options(options), samples(0) { }
+
+    // No copies/default constructor
+    Impl() = delete;
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    size_t Sample() {
+      auto threads = this->con.SendAsync(
+          std::make_unique<AllThreadsCommand>()).get();
+
+      // Send everything for every thread before waiting on any of it. The VM
+      // handles commands in order, so each thread's frames are read while
+      // it's suspended.
+      struct Pending {
+        uint64_t thread;
+        bool suspended;
+        std::future<FramesCommand::ReplyFields> frames;
+        std::future<NameCommand::ReplyFields> name;
+      };
+      vector<Pending> pending;
+      pending.reserve(std::get<0>(threads).size());
+      for (auto& entry : std::get<0>(threads)) {
+        Pending curr;
+        curr.thread = std::get<0>(entry).GetValue();
+        curr.suspended = !this->options.suspend_free ||
+          this->needs_suspend.count(curr.thread) != 0;
+        if (curr.suspended) {
+          this->con.SendMessage(ForThread<SuspendCommand>(curr.thread));
+        }
+        auto frames = ForThread<FramesCommand>(curr.thread);
+        std::get<1>(frames->GetFields()) << 0;
+        std::get<2>(frames->GetFields()) << this->options.max_depth;
+        curr.frames = this->con.SendAsync(std::move(frames));
+        if (curr.suspended) {
+          this->con.SendMessage(ForThread<ResumeCommand>(curr.thread));
+        }
+        if (this->thread_names.count(curr.thread) == 0) {
+          curr.name = this->con.SendAsync(ForThread<NameCommand>(curr.thread));
+        }
+        pending.push_back(std::move(curr));
+      }
+
+      size_t sampled = 0;
+      for (Pending& curr : pending) {
+        if (curr.name.valid()) {
+          try {
+            this->thread_names[curr.thread] =
+              std::get<0>(curr.name.get()).GetValue();
+          } catch (const JdwpReplyException& e) { }
+        }
+
+        FramesCommand::ReplyFields frames;
+        try {
+          frames = curr.frames.get();
+        } catch (const JdwpReplyException& e) {
+          // Most likely, the thread died in the meantime. Otherwise, this VM
+          // can only read the frames of suspended threads.
+          if (!curr.suspended &&
+              e.GetError() == JdwpError::kThreadNotSuspended) {
+            this->needs_suspend.insert(curr.thread);
+          }
+          continue;
+        }
+        Stack stack;
+        stack.reserve(std::get<0>(frames).size());
+        for (auto& frame : std::get<0>(frames)) {
+          const JdwpLocation& location = std::get<1>(frame);
+          stack.emplace_back(location.class_id.GetValue(),
+              location.method_id.GetValue(), location.index);
+        }
+        this->stacks[{ curr.thread, std::move(stack) }]++;
+        sampled++;
+      }
+      this->samples++;
+      return sampled;
+    }
+
+    void WriteFolded(std::ostream& out) {
+      // Request every class, method and line table used before waiting on
+      // any of them, so uncached ones are fetched concurrently.
+      std::unordered_map<uint64_t,
+        shared_future<JdwpMetadataCache::SignatureReply>> signatures;
+      std::unordered_map<uint64_t,
+        shared_future<JdwpMetadataCache::MethodsReply>> methods;
+      std::map<std::pair<uint64_t, uint64_t>,
+        shared_future<JdwpMetadataCache::LineTableReply>> lines;
+      for (auto& entry : this->stacks) {
+        for (const Frame& frame : entry.first.second) {
+          uint64_t cls = std::get<0>(frame);
+          uint64_t method = std::get<1>(frame);
+          if (signatures.count(cls) == 0) {
+            signatures.emplace(cls, this->cache.GetSignature(cls));
+            methods.emplace(cls, this->cache.GetMethods(cls));
+          }
+          if (this->options.resolve_lines &&
+              lines.count({ cls, method }) == 0) {
+            lines.emplace(std::make_pair(cls, method),
+                this->cache.GetLineTable(cls, method));
+          }
+        }
+      }
+
+      auto label = [&](const Frame& frame) {
+        uint64_t cls = std::get<0>(frame);
+        uint64_t method = std::get<1>(frame);
+        string res = "unknown";
+        const JdwpMetadataCache::SignatureReply* signature;
+        if (TryGet(signatures.at(cls), signature)) {
+          res = ClassName(std::get<0>(*signature).GetValue());
+        }
+        res += ".";
+        string method_name = "unknown";
+        const JdwpMetadataCache::MethodsReply* declared;
+        if (TryGet(methods.at(cls), declared)) {
+          for (auto& info : std::get<0>(*declared)) {
+            if (std::get<0>(info).GetValue() == method) {
+              method_name = std::get<1>(info).GetValue();
+              break;
+            }
+          }
+        }
+        res += method_name;
+
+        const JdwpMetadataCache::LineTableReply* table;
+        if (this->options.resolve_lines &&
+            TryGet(lines.at({ cls, method }), table)) {
+          // The frame is on the last line that starts at or before it
+          int64_t index = static_cast<int64_t>(std::get<2>(frame));
+          int64_t best_start = -1;
+          int32_t line = -1;
+          for (auto& entry : std::get<2>(*table)) {
+            int64_t start = std::get<0>(entry).GetValue();
+            if (start <= index && start > best_start) {
+              best_start = start;
+              line = std::get<1>(entry).GetValue();
+            }
+          }
+          if (line >= 0) res += ":" + std::to_string(line);
+        }
+        return FoldedSafe(res);
+      };
+
+      // Different locations can resolve to the same line, so merge once
+      // they've been resolved.
+      std::map<string, uint64_t> folded;
+      for (auto& entry : this->stacks) {
+        uint64_t thread = entry.first.first;
+        auto name = this->thread_names.find(thread);
+        string line = name == this->thread_names.end() ?
+          "thread-" + std::to_string(thread) : FoldedSafe(name->second);
+        const Stack& stack = entry.first.second;
+        for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+          line += ";" + label(*it);
+        }
+        folded[line] += entry.second;
+      }
+      for (auto& entry : folded) {
+        out << entry.first << " " << entry.second << "\n";
+      }
+    }
+
+    uint64_t GetSampleCount() const { return this->samples; }
+  private:
+    IJdwpCon& con;
+    JdwpMetadataCache& cache;
+    JdwpSamplerOptions options;
+
+    /**
+     * The name of each thread seen so far, only fetched the first time it's
+     * sampled.
+     */
+    std::unordered_map<uint64_t, string> thread_names;
+    /**
+     * Threads whose frames couldn't be read without suspending them.
+     */
+    std::unordered_set<uint64_t> needs_suspend;
+    /**
+     * How many times each thread was sampled with each stack.
+     */
+    std::map<std::pair<uint64_t, Stack>, uint64_t> stacks;
+    uint64_t samples;
+};
+
+JdwpSampler::JdwpSampler(IJdwpCon& con, JdwpMetadataCache& cache,
+    const JdwpSamplerOptions& options) :
+  pImpl(new JdwpSampler::Impl(con, cache, options)) { }
+
+JdwpSampler::JdwpSampler(JdwpSampler&& other) noexcept = default;
+JdwpSampler& JdwpSampler::operator=(JdwpSampler&& other) noexcept = default;
+
+JdwpSampler::~JdwpSampler() = default;
+
+size_t JdwpSampler::Sample() { return this->pImpl->Sample(); }
+void JdwpSampler::WriteFolded(std::ostream& out) {
+  this->pImpl->WriteFolded(out);
+}
+uint64_t JdwpSampler::GetSampleCount() const {
+  return this->pImpl->GetSampleCount();
+}
+
+}  // namespace roastery
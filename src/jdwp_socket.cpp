@@ -20,18 +20,26 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "jdwp_socket.hpp"
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <fstream>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <cstring>
 #include <mutex>
 #include <stdexcept>
 #include <string>
 #include <system_error>
+#include <vector>
 
 #include "jdwp_exception.hpp"
 
@@ -44,6 +52,24 @@ using std::string;
  */
 typedef uint16_t port_t;
 
+/**
+ * The length of a JDWP packet header, which starts with the length of the
+ * whole packet.
+ */
+constexpr size_t kJdwpHeaderLen = 11;
+
+/**
+ * The size of the read-ahead buffer when it is created, and the size it
+ * goes back to once drained if a large packet made it grow past
+ * \c kMaxRetainedRecvBuffer.
+ */
+constexpr size_t kInitialRecvBuffer = 64 * 1024;
+constexpr size_t kMaxRetainedRecvBuffer = 1 << 20;
+/**
+ * The least free space to offer each \c recv call.
+ */
+constexpr size_t kMinRecvSpace = 4 * 1024;
+
 /**
  * Create a TCP connection to \c address on \c port.
  *
@@ -101,9 +127,37 @@ int Connect(const string& address, uint16_t portHost) {
         "Could not connect to " + address);
   }
 
+  // Connected before this, so connect() itself still blocks. Everything after
+  // only blocks where it chooses to, in WaitFor.
+  int flags = fcntl(sock_fd, F_GETFL);
+  if (flags < 0 || fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    int err = errno;
+    close(sock_fd);
+    throw system_error(err, generic_category(),
+        "Could not make the socket non-blocking");
+  }
+
   return sock_fd;
 }
 
+/**
+ * Blocks until \c fd is ready for \c events, which are \c poll events.
+ *
+ * @throws std::system_error if \c fd cannot be polled.
+ */
+void WaitFor(int fd, short events) {
+  struct pollfd query = {
+    .fd = fd,
+    .events = events,
+    .revents = 0,
+  };
+  while (poll(&query, 1, -1) < 0) {
+    if (errno != EINTR) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+}
+
 }  // namespace
 
 using std::mutex;
@@ -119,7 +173,10 @@ class JdwpSocket::Impl {
   public:
     explicit Impl(uint16_t port) : Impl("localhost", port) { }
     explicit Impl(const string& address, uint16_t port) :
-        sock_fd(Connect(address, port)) {
+        sock_fd(Connect(address, port)), connected(true),
+        recv_buffer(kInitialRecvBuffer, '\0'), recv_start(0), recv_end(0),
+        pending_packet_len(0), part_remaining(0), bytes_written(0),
+        bytes_read(0), writes(0), reads(0) {
       this->Write(kJdwpHandshake);
       string reply = this->Read(kJdwpHandshake.length());
       if (reply != kJdwpHandshake) {
@@ -160,28 +217,55 @@ class JdwpSocket::Impl {
      * other than a closed connection.
      * @throws std::logic_error if this socket is not currently connected.
      */
-    void Write(const string& data) {
-      if (this->sock_fd < 0)
-        throw std::logic_error("Cannot write while not connected");
+    void Write(std::string_view data) {
+      this->WriteSegments(&data, 1, true);
+    }
 
-      size_t bytes_written = 0;
-      ssize_t written_this_call = 0;
-      {  // critical segment, acquire lock_guard
-        lock_guard<mutex> lck(write_lock);
-        while (bytes_written < data.length()) {
-          written_this_call = send(this->sock_fd, data.c_str() + bytes_written,
-              data.length() - bytes_written, MSG_NOSIGNAL);
-          if (written_this_call < 0) {
-            if (errno == EPIPE) {
-              this->Close();
-              throw roastery::JdwpException("Connection closed");
-            }
-            if (errno != EAGAIN && errno != EINTR)
-              throw std::system_error(errno, std::generic_category());
-          }
+    /**
+     * Writes each of \c segments, in order, to the connected server, handing
+     * up to \c kMaxIov of them to each \c sendmsg call.
+     *
+     * This method is thread-safe, it can be invoked concurrently by multiple
+     * callers.
+     *
+     * @throws roastery::JdwpException if the connection is closed.
+     * @throws std::system_error if there is an error writing to the server,
+     * other than a closed connection.
+     * @throws std::logic_error if this socket is not currently connected.
+     */
+    void Write(const std::vector<std::string_view>& segments) {
+      this->WriteSegments(segments.data(), segments.size(), true);
+    }
 
-          bytes_written += written_this_call;
-        }
+    /**
+     * Writes as much of \c segments, in order, as the socket will take
+     * without blocking.
+     *
+     * This method is thread-safe, it can be invoked concurrently by multiple
+     * callers.
+     *
+     * @returns The number of bytes written.
+     *
+     * @throws roastery::JdwpException if the connection is closed.
+     * @throws std::system_error if there is an error writing to the server,
+     * other than a closed connection.
+     * @throws std::logic_error if this socket is not currently connected.
+     */
+    size_t TryWrite(const std::vector<std::string_view>& segments) {
+      return this->WriteSegments(segments.data(), segments.size(), false);
+    }
+
+    /**
+     * Sets the \c IPPROTO_TCP level socket option \c option to \c enabled.
+     *
+     * @throws std::system_error if the option cannot be set.
+     */
+    void SetTcpOption(int option, bool enabled) {
+      int value = enabled ? 1 : 0;
+      if (setsockopt(this->sock_fd, IPPROTO_TCP, option, &value,
+            sizeof(value)) < 0) {
+        throw std::system_error(errno, std::generic_category(),
+            "Could not set socket option");
       }
     }
 
@@ -193,7 +277,7 @@ class JdwpSocket::Impl {
      * @throws std::logic_error if the socket is not currently connected.
      */
     bool CanRead() {
-      if (this->sock_fd < 0)
+      if (!this->connected)
         throw std::logic_error("Cannot poll while not connected");
 
       struct pollfd query = {
@@ -228,38 +312,313 @@ class JdwpSocket::Impl {
      * @returns The data read.
      */
     string Read(size_t len) {
-      if (this->sock_fd < 0)
+      if (!this->connected)
         throw std::logic_error("Cannot read while not connected");
 
       size_t bytes_read = 0;
       ssize_t read_this_call = 0;
-      string out = "";
-      char buf[BUFSIZ + 1];
+      string out(len, '\0');
       {  // critical segment, acquire lock_guard
         lock_guard<mutex> lck(read_lock);
+
+        // Anything read ahead comes first
+        bytes_read = std::min(len, this->recv_end - this->recv_start);
+        out.replace(0, bytes_read, this->recv_buffer, this->recv_start,
+            bytes_read);
+        this->recv_start += bytes_read;
+
         while (bytes_read < len) {
-          read_this_call = read(this->sock_fd, buf,
-              std::min(static_cast<size_t>(BUFSIZ), len - bytes_read));
-          if (read_this_call < 0 && errno != EAGAIN && errno != EINTR)
-            throw std::system_error(errno, std::generic_category());
+          read_this_call = read(this->sock_fd, &out[bytes_read],
+              len - bytes_read);
+          if (read_this_call < 0) {
+            if (errno == ECONNRESET) {
+              this->Close();
+              throw roastery::JdwpException("Connection closed");
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+              WaitFor(this->sock_fd, POLLIN);
+            } else if (errno != EINTR) {
+              throw std::system_error(errno, std::generic_category());
+            }
+            continue;
+          }
           if (read_this_call == 0) {
             this->Close();
             throw roastery::JdwpException("Connection closed");
           }
-          out.append(buf, read_this_call);
           bytes_read += read_this_call;
+          this->CountRead(read_this_call);
         }
       }
 
       return out;
     }
+
+    /**
+     * Reads whatever data is available, without blocking, into
+     * \c recv_buffer.
+     *
+     * This method is thread-safe, but invalidates any view returned by
+     * \c NextPacket.
+     *
+     * @throws roastery::JdwpException if the connection is closed.
+     * @throws std::system_error if there is an error reading from the server.
+     * @throws std::logic_error if the socket is not currently connected.
+     *
+     * @returns The number of bytes read.
+     */
+    size_t ReadAvailable() {
+      if (!this->connected)
+        throw std::logic_error("Cannot read while not connected");
+
+      lock_guard<mutex> lck(read_lock);
+      this->ReserveRecvSpace();
+      while (true) {
+        ssize_t read_this_call = recv(this->sock_fd,
+            &this->recv_buffer[this->recv_end],
+            this->recv_buffer.size() - this->recv_end, MSG_DONTWAIT);
+        if (read_this_call < 0) {
+          if (errno == EINTR) continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+          if (errno == ECONNRESET) {
+            this->Close();
+            throw roastery::JdwpException("Connection closed");
+          }
+          throw std::system_error(errno, std::generic_category());
+        }
+        if (read_this_call == 0) {
+          this->Close();
+          throw roastery::JdwpException("Connection closed");
+        }
+        this->recv_end += read_this_call;
+        this->CountRead(read_this_call);
+        return read_this_call;
+      }
+    }
+
+    /**
+     * Takes the next complete packet out of \c recv_buffer, if there is one.
+     *
+     * @throws roastery::JdwpException if the buffered data doesn't start with
+     * a valid JDWP header.
+     *
+     * @returns Whether a packet was available.
+     */
+    bool NextPacket(std::string_view& packet) {
+      lock_guard<mutex> lck(read_lock);
+      size_t buffered = this->recv_end - this->recv_start;
+      if (this->part_remaining != 0 || buffered < kJdwpHeaderLen) return false;
+
+      size_t len = this->BufferedPacketLen();
+      if (buffered < len) {
+        // Make sure the next read has room for the rest of it
+        this->pending_packet_len = len;
+        return false;
+      }
+
+      packet = std::string_view(&this->recv_buffer[this->recv_start], len);
+      this->recv_start += len;
+      this->pending_packet_len = 0;
+      return true;
+    }
+
+    /**
+     * Returns the header of the next packet in \c recv_buffer, if it's all
+     * there and none of the packet has been taken yet.
+     */
+    bool PeekHeader(std::string_view& header) {
+      lock_guard<mutex> lck(read_lock);
+      size_t buffered = this->recv_end - this->recv_start;
+      if (this->part_remaining != 0 || buffered < kJdwpHeaderLen) return false;
+
+      header = std::string_view(&this->recv_buffer[this->recv_start],
+          kJdwpHeaderLen);
+      return true;
+    }
+
+    /**
+     * Takes whatever of the next packet is in \c recv_buffer.
+     *
+     * @throws roastery::JdwpException if the buffered data doesn't start with
+     * a valid JDWP header.
+     *
+     * @returns Whether part of a packet was available.
+     */
+    bool NextPacketPart(std::string_view& part, size_t& remaining) {
+      lock_guard<mutex> lck(read_lock);
+      size_t buffered = this->recv_end - this->recv_start;
+      if (this->part_remaining == 0) {
+        if (buffered < kJdwpHeaderLen) return false;
+        this->part_remaining = this->BufferedPacketLen();
+        // The packet no longer has to fit in the buffer whole
+        this->pending_packet_len = 0;
+      } else if (buffered == 0) {
+        return false;
+      }
+
+      size_t len = std::min(buffered, this->part_remaining);
+      part = std::string_view(&this->recv_buffer[this->recv_start], len);
+      this->recv_start += len;
+      this->part_remaining -= len;
+      remaining = this->part_remaining;
+      return true;
+    }
+
+    /**
+     * Returns the file descriptor of the underlying socket.
+     */
+    int GetFd() const {
+      return this->sock_fd;
+    }
+
+    JdwpSocketStats GetStats() const {
+      JdwpSocketStats res;
+      res.bytes_written = this->bytes_written.load(std::memory_order_relaxed);
+      res.bytes_read = this->bytes_read.load(std::memory_order_relaxed);
+      res.writes = this->writes.load(std::memory_order_relaxed);
+      res.reads = this->reads.load(std::memory_order_relaxed);
+      return res;
+    }
   protected:
     /**
-     * Closes the socket associated with \c this.
+     * The most segments passed to a single \c sendmsg call.
+     */
+    static constexpr size_t kMaxIov = 64;
+
+    /**
+     * Implements \c Write and \c TryWrite.
+     *
+     * @param block Whether to wait for the socket to take all of
+     * \c segments, rather than stopping once it won't take any more.
+     *
+     * @returns The number of bytes written.
+     */
+    size_t WriteSegments(const std::string_view* segments, size_t count,
+        bool block) {
+      if (!this->connected)
+        throw std::logic_error("Cannot write while not connected");
+
+      // The next byte to write is at segments[seg][offset]
+      size_t seg = 0;
+      size_t offset = 0;
+      size_t written = 0;
+      {  // critical segment, acquire lock_guard
+        lock_guard<mutex> lck(write_lock);
+        while (true) {
+          struct iovec iov[kMaxIov];
+          size_t iov_count = 0;
+          for (size_t i = seg; i < count && iov_count < kMaxIov; i++) {
+            size_t skip = i == seg ? offset : 0;
+            if (segments[i].size() == skip) continue;
+            iov[iov_count].iov_base =
+              const_cast<char*>(segments[i].data() + skip);
+            iov[iov_count].iov_len = segments[i].size() - skip;
+            iov_count++;
+          }
+          if (iov_count == 0) break;
+
+          struct msghdr msg = {};
+          msg.msg_iov = iov;
+          msg.msg_iovlen = iov_count;
+          ssize_t written_this_call = sendmsg(this->sock_fd, &msg,
+              MSG_NOSIGNAL);
+          if (written_this_call < 0) {
+            if (errno == EPIPE || errno == ECONNRESET) {
+              this->Close();
+              throw roastery::JdwpException("Connection closed");
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+              if (!block) break;
+              WaitFor(this->sock_fd, POLLOUT);
+            } else if (errno != EINTR) {
+              throw std::system_error(errno, std::generic_category());
+            }
+            continue;
+          }
+          written += written_this_call;
+          this->bytes_written.fetch_add(written_this_call,
+              std::memory_order_relaxed);
+          this->writes.fetch_add(1, std::memory_order_relaxed);
+
+          // Skip past everything that was written, which may end part of the
+          // way through a segment.
+          size_t remaining = written_this_call;
+          while (remaining > 0) {
+            size_t left_in_seg = segments[seg].size() - offset;
+            if (remaining < left_in_seg) {
+              offset += remaining;
+              remaining = 0;
+            } else {
+              remaining -= left_in_seg;
+              seg++;
+              offset = 0;
+            }
+          }
+        }
+      }
+      return written;
+    }
+
+    /**
+     * Returns the length of the packet at \c recv_start, whose header must
+     * have been recieved. Must be called with \c read_lock held.
+     *
+     * @throws roastery::JdwpException if the header is malformed.
+     */
+    size_t BufferedPacketLen() const {
+      uint32_t len_nbo;
+      std::memcpy(&len_nbo, &this->recv_buffer[this->recv_start],
+          sizeof(len_nbo));
+      size_t len = ntohl(len_nbo);
+      if (len < kJdwpHeaderLen) {
+        throw roastery::JdwpException("Malformed packet header");
+      }
+      return len;
+    }
+
+    /**
+     * Makes sure there's room after \c recv_end for at least
+     * \c kMinRecvSpace bytes, and for all of the packet currently being
+     * recieved. Must be called with \c read_lock held.
+     */
+    void ReserveRecvSpace() {
+      if (this->recv_start == this->recv_end) {
+        this->recv_start = this->recv_end = 0;
+        if (this->recv_buffer.size() > kMaxRetainedRecvBuffer) {
+          this->recv_buffer.resize(kInitialRecvBuffer);
+          this->recv_buffer.shrink_to_fit();
+        }
+      }
+
+      size_t buffered = this->recv_end - this->recv_start;
+      size_t wanted = std::max(buffered + kMinRecvSpace,
+          this->pending_packet_len);
+      if (this->recv_buffer.size() - this->recv_end < wanted - buffered) {
+        // Move what's left to the front, so all the free space is at the end
+        std::memmove(&this->recv_buffer[0],
+            &this->recv_buffer[this->recv_start], buffered);
+        this->recv_start = 0;
+        this->recv_end = buffered;
+        if (this->recv_buffer.size() < wanted) {
+          this->recv_buffer.resize(
+              std::max(wanted, 2 * this->recv_buffer.size()));
+        }
+      }
+    }
+
+    /**
+     * Shuts down the connection associated with \c this. The file descriptor
+     * itself is only closed on destruction, so that it can't be reused for
+     * another file while something may still be watching it.
      */
     void Close() {
-      close(this->sock_fd);
-      this->sock_fd = -1;
+      shutdown(this->sock_fd, SHUT_RDWR);
+      this->connected = false;
+    }
+
+    void CountRead(size_t len) {
+      this->bytes_read.fetch_add(len, std::memory_order_relaxed);
+      this->reads.fetch_add(1, std::memory_order_relaxed);
     }
 
   private:
@@ -267,6 +626,33 @@ class JdwpSocket::Impl {
     mutable mutex write_lock;
     const string kJdwpHandshake = "JDWP-Handshake";
     int sock_fd;
+    std::atomic_bool connected;
+
+    /**
+     * Holds data read ahead by \c ReadAvailable. The bytes in
+     * [\c recv_start, \c recv_end) haven't been consumed yet.
+     */
+    string recv_buffer;
+    size_t recv_start;
+    size_t recv_end;
+    /**
+     * The length of the packet at \c recv_start, if only part of it has been
+     * recieved, or zero.
+     */
+    size_t pending_packet_len;
+    /**
+     * The number of bytes of the packet being taken with \c NextPacketPart
+     * that haven't been taken yet, or zero.
+     */
+    size_t part_remaining;
+
+    /**
+     * Counts the traffic for \c GetStats.
+     */
+    std::atomic<uint64_t> bytes_written;
+    std::atomic<uint64_t> bytes_read;
+    std::atomic<uint64_t> writes;
+    std::atomic<uint64_t> reads;
 };
 
 JdwpSocket::JdwpSocket(uint16_t port) : pImpl(new Impl(port)) { }
@@ -278,9 +664,41 @@ JdwpSocket& JdwpSocket::operator=(JdwpSocket&& other) noexcept = default;
 
 JdwpSocket::~JdwpSocket() = default;
 
-void JdwpSocket::Write(const string& data) { this->pImpl->Write(data); }
+void JdwpSocket::Write(std::string_view data) {
+  this->pImpl->Write(data);
+}
+void JdwpSocket::Write(const std::vector<std::string_view>& segments) {
+  this->pImpl->Write(segments);
+}
+size_t JdwpSocket::TryWrite(const std::vector<std::string_view>& segments) {
+  return this->pImpl->TryWrite(segments);
+}
+void JdwpSocket::SetNoDelay(bool enabled) {
+  this->pImpl->SetTcpOption(TCP_NODELAY, enabled);
+}
+void JdwpSocket::SetCork(bool enabled) {
+#ifdef TCP_CORK
+  this->pImpl->SetTcpOption(TCP_CORK, enabled);
+#else
+  static_cast<void>(enabled);
+#endif
+}
 bool JdwpSocket::CanRead() { return this->pImpl->CanRead(); }
 string JdwpSocket::Read(size_t len) { return this->pImpl->Read(len); }
+size_t JdwpSocket::ReadAvailable() { return this->pImpl->ReadAvailable(); }
+bool JdwpSocket::NextPacket(std::string_view& packet) {
+  return this->pImpl->NextPacket(packet);
+}
+bool JdwpSocket::PeekHeader(std::string_view& header) {
+  return this->pImpl->PeekHeader(header);
+}
+bool JdwpSocket::NextPacketPart(std::string_view& part, size_t& remaining) {
+  return this->pImpl->NextPacketPart(part, remaining);
+}
+int JdwpSocket::GetFd() const { return this->pImpl->GetFd(); }
+JdwpSocketStats JdwpSocket::GetStats() const {
+  return this->pImpl->GetStats();
+}
 
 }
 
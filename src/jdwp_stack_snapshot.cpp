@@ -0,0 +1,343 @@
+/* Defines snapshots of every thread's stack and locals, taken in one pass
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_stack_snapshot.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "jdwp_con.hpp"
+#include "jdwp_exception.hpp"
+#include "jdwp_metadata_cache.hpp"
+#include "jdwp_packet.hpp"
+
+using std::shared_future;
+
+namespace roastery {
+
+namespace {
+
+using command_packets::thread_reference::FramesCommand;
+using command_packets::thread_reference::NameCommand;
+using command_packets::thread_reference::ResumeCommand;
+using command_packets::thread_reference::SuspendCommand;
+using command_packets::virtual_machine::AllThreadsCommand;
+using FrameValuesCommand = command_packets::stack_frame::GetValuesCommand;
+using VmResumeCommand = command_packets::virtual_machine::ResumeCommand;
+using VmSuspendCommand = command_packets::virtual_machine::SuspendCommand;
+using VariableTableReply = JdwpMetadataCache::VariableTableReply;
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * A method, by its class and its ID.
+ */
+using MethodKey = std::pair<uint64_t, uint64_t>;
+
+/**
+ * Returns a \c Command whose first field is \c thread.
+ */
+template<typename Command>
+unique_ptr<Command> ForThread(uint64_t thread) {
+  auto res = std::make_unique<Command>();
+  std::get<0>(res->GetFields()) << thread;
+  return res;
+}
+
+/**
+ * Returns whether \c future holds its value or exception already.
+ */
+template<typename T>
+bool IsReady(const shared_future<T>& future) {
+  return future.wait_for(std::chrono::seconds(0)) ==
+    std::future_status::ready;
+}
+
+/**
+ * A thread being snapshotted, and the replies it's waiting on.
+ */
+struct PendingThread {
+  JdwpThreadSnapshot snapshot;
+  Clock::time_point suspended_at;
+  std::future<FramesCommand::ReplyFields> frames;
+  std::future<NameCommand::ReplyFields> name;
+  /**
+   * For each frame, the values of its live locals, if any were requested.
+   */
+  vector<std::future<FrameValuesCommand::ReplyFields>> values;
+};
+
+}  // namespace
+
+/**
+ * Implementation of \c JdwpStackSnapshotter.
+ */
+class JdwpStackSnapshotter::Impl {
+  public:
+    Impl(IJdwpCon& con, JdwpMetadataCache& cache,
+        const JdwpStackSnapshotOptions& options) :
+      con(con), cache(cache), options(options) { }
+
+    // No copies/default constructor
+    Impl() = delete;
+    Impl(const Impl& copy) = delete;
+    Impl& operator=(const Impl& other) = delete;
+
+    // Not moveable
+    Impl(Impl&& other) = delete;
+    Impl& operator=(Impl&& other) = delete;
+
+    vector<JdwpThreadSnapshot> Take() {
+      Clock::time_point vm_suspended_at;
+      if (this->options.suspend_all) {
+        vm_suspended_at = Clock::now();
+        this->con.SendMessage(std::make_unique<VmSuspendCommand>());
+      }
+      std::future<AllThreadsCommand::ReplyFields> listed =
+        this->con.SendAsync(std::make_unique<AllThreadsCommand>());
+      AllThreadsCommand::ReplyFields threads;
+      try {
+        threads = listed.get();
+      } catch (const JdwpException& e) {
+        if (this->options.suspend_all) this->ResumeVm();
+        throw;
+      }
+
+      // Every thread's frames are asked for before any of them are waited
+      // on. Without locals, nothing else needs the thread suspended.
+      vector<PendingThread> pending(std::get<0>(threads).size());
+      for (size_t i = 0; i < pending.size(); i++) {
+        PendingThread& curr = pending[i];
+        uint64_t thread = std::get<0>(std::get<0>(threads)[i]).GetValue();
+        curr.snapshot.thread = thread;
+        curr.snapshot.error = JdwpError::kNone;
+        curr.suspended_at = this->options.suspend_all ?
+          vm_suspended_at : Clock::now();
+        if (!this->options.suspend_all) {
+          this->con.SendMessage(ForThread<SuspendCommand>(thread));
+        }
+        auto frames = ForThread<FramesCommand>(thread);
+        std::get<1>(frames->GetFields()) << 0;
+        std::get<2>(frames->GetFields()) << this->options.max_depth;
+        curr.frames = this->con.SendAsync(std::move(frames));
+        if (!this->options.include_locals) this->Resume(curr);
+        if (this->names.count(thread) == 0) {
+          curr.name = this->con.SendAsync(ForThread<NameCommand>(thread));
+        }
+      }
+
+      // A thread whose methods' variable tables are all in the cache goes on
+      // as soon as its frames are in. The rest go on once theirs arrive,
+      // which are all fetched at the same time.
+      std::map<MethodKey, shared_future<VariableTableReply>> tables;
+      vector<PendingThread*> waiting;
+      for (PendingThread& curr : pending) {
+        this->ReadFrames(curr);
+        if (!this->options.include_locals) continue;
+        bool ready = true;
+        for (const JdwpFrameSnapshot& frame : curr.snapshot.frames) {
+          MethodKey method(frame.location.class_id.GetValue(),
+              frame.location.method_id.GetValue());
+          if (this->absent.count(method) != 0) continue;
+          auto it = tables.find(method);
+          if (it == tables.end()) {
+            it = tables.emplace(method, this->cache.GetVariableTable(
+                  method.first, method.second)).first;
+          }
+          ready = ready && IsReady(it->second);
+        }
+        if (ready) {
+          this->RequestLocals(curr, tables);
+        } else {
+          waiting.push_back(&curr);
+        }
+      }
+      for (PendingThread* curr : waiting) this->RequestLocals(*curr, tables);
+      if (this->options.suspend_all) {
+        this->ResumeVm();
+        for (PendingThread& curr : pending) {
+          curr.snapshot.suspended = this->vm_resumed_at - curr.suspended_at;
+        }
+      }
+
+      vector<JdwpThreadSnapshot> res;
+      res.reserve(pending.size());
+      for (PendingThread& curr : pending) {
+        this->ReadLocals(curr);
+        res.push_back(std::move(curr.snapshot));
+      }
+      return res;
+    }
+  private:
+    IJdwpCon& con;
+    JdwpMetadataCache& cache;
+    const JdwpStackSnapshotOptions options;
+    std::unordered_map<uint64_t, string> names;
+    /**
+     * Methods without variable information, which the cache doesn't
+     * remember, as it doesn't cache failed lookups.
+     */
+    std::set<MethodKey> absent;
+    Clock::time_point vm_resumed_at;
+
+    void Resume(PendingThread& curr) {
+      if (this->options.suspend_all) return;
+      this->con.SendMessage(ForThread<ResumeCommand>(curr.snapshot.thread));
+      curr.snapshot.suspended = Clock::now() - curr.suspended_at;
+    }
+
+    void ResumeVm() {
+      this->con.SendMessage(std::make_unique<VmResumeCommand>());
+      this->vm_resumed_at = Clock::now();
+    }
+
+    /**
+     * Waits for the name and frames of \c curr, and adds them to its
+     * snapshot.
+     */
+    void ReadFrames(PendingThread& curr) {
+      uint64_t thread = curr.snapshot.thread;
+      if (curr.name.valid()) {
+        try {
+          this->names[thread] = std::get<0>(curr.name.get()).GetValue();
+        } catch (const JdwpReplyException& e) { }
+      }
+      auto name = this->names.find(thread);
+      if (name != this->names.end()) curr.snapshot.name = name->second;
+
+      FramesCommand::ReplyFields frames;
+      try {
+        frames = curr.frames.get();
+      } catch (const JdwpReplyException& e) {
+        // Most likely, the thread died in the meantime
+        curr.snapshot.error = e.GetError();
+        return;
+      }
+      curr.snapshot.frames.reserve(std::get<0>(frames).size());
+      for (auto& entry : std::get<0>(frames)) {
+        JdwpFrameSnapshot frame;
+        frame.frame_id = std::get<0>(entry).GetValue();
+        frame.location = std::get<1>(entry);
+        curr.snapshot.frames.push_back(std::move(frame));
+      }
+    }
+
+    /**
+     * Asks for the values of the live locals of every frame of \c curr, then
+     * resumes it. Waits for any variable table in \c tables that isn't in
+     * yet.
+     */
+    void RequestLocals(PendingThread& curr,
+        std::map<MethodKey, shared_future<VariableTableReply>>& tables) {
+      curr.values.resize(curr.snapshot.frames.size());
+      for (size_t i = 0; i < curr.snapshot.frames.size(); i++) {
+        JdwpFrameSnapshot& frame = curr.snapshot.frames[i];
+        MethodKey method(frame.location.class_id.GetValue(),
+            frame.location.method_id.GetValue());
+        auto table = tables.find(method);
+        if (table == tables.end()) continue;
+
+        auto command = ForThread<FrameValuesCommand>(curr.snapshot.thread);
+        std::get<1>(command->GetFields()) << frame.frame_id;
+        try {
+          for (auto& var : std::get<1>(table->second.get())) {
+            uint64_t start = std::get<0>(var).GetValue();
+            uint64_t length =
+              static_cast<uint32_t>(std::get<4>(var).GetValue());
+            const string& signature = std::get<2>(var).GetValue();
+            if (frame.location.index < start ||
+                frame.location.index >= start + length || signature.empty()) {
+              continue;
+            }
+            JdwpInt slot;
+            slot << std::get<5>(var).GetValue();
+            JdwpByte tag;
+            tag << static_cast<uint8_t>(signature[0]);
+            std::get<2>(command->GetFields()).emplace_back(slot, tag);
+            JdwpLocalSnapshot local;
+            local.name = std::get<1>(var).GetValue();
+            local.signature = signature;
+            frame.locals.push_back(std::move(local));
+          }
+        } catch (const JdwpReplyException& e) {
+          if (e.GetError() == JdwpError::kAbsentInformation ||
+              e.GetError() == JdwpError::kNativeMethod) {
+            this->absent.insert(method);
+          }
+          continue;
+        }
+        if (!frame.locals.empty()) {
+          curr.values[i] = this->con.SendAsync(std::move(command));
+        }
+      }
+      this->Resume(curr);
+    }
+
+    /**
+     * Waits for the values of \c curr's locals, and adds them to its
+     * snapshot.
+     */
+    void ReadLocals(PendingThread& curr) {
+      for (size_t i = 0; i < curr.values.size(); i++) {
+        vector<JdwpLocalSnapshot>& locals = curr.snapshot.frames[i].locals;
+        if (!curr.values[i].valid()) continue;
+        FrameValuesCommand::ReplyFields values;
+        try {
+          values = curr.values[i].get();
+        } catch (const JdwpReplyException& e) {
+          locals.clear();
+          continue;
+        }
+        auto& list = std::get<0>(values);
+        if (list.size() != locals.size()) {
+          locals.clear();
+          continue;
+        }
+        for (size_t j = 0; j < list.size(); j++) {
+          locals[j].value = std::move(std::get<0>(list[j]));
+        }
+      }
+    }
+};
+
+JdwpStackSnapshotter::JdwpStackSnapshotter(IJdwpCon& con,
+    JdwpMetadataCache& cache, const JdwpStackSnapshotOptions& options) :
+  pImpl(new JdwpStackSnapshotter::Impl(con, cache, options)) { }
+
+JdwpStackSnapshotter::JdwpStackSnapshotter(
+    JdwpStackSnapshotter&& other) noexcept = default;
+JdwpStackSnapshotter& JdwpStackSnapshotter::operator=(
+    JdwpStackSnapshotter&& other) noexcept = default;
+
+JdwpStackSnapshotter::~JdwpStackSnapshotter() = default;
+
+vector<JdwpThreadSnapshot> JdwpStackSnapshotter::Take() {
+  return this->pImpl->Take();
+}
+
+}  // namespace roastery
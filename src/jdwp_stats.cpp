@@ -0,0 +1,93 @@
+/* Defines the counters JDWP connections report about themselves
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jdwp_stats.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+namespace roastery {
+
+size_t JdwpDurationHistogram::BucketFor(std::chrono::nanoseconds duration) {
+  int64_t micros =
+    std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+  size_t bucket = 0;
+  while (bucket + 1 < kBuckets && micros >= (int64_t(1) << bucket)) {
+    bucket++;
+  }
+  return bucket;
+}
+
+void JdwpDurationHistogram::Add(std::chrono::nanoseconds duration) {
+  this->counts[BucketFor(duration)]++;
+  this->total++;
+  this->sum += duration;
+  if (duration > this->max) this->max = duration;
+}
+
+std::chrono::microseconds JdwpDurationHistogram::Percentile(
+    double fraction) const {
+  if (this->total == 0) return std::chrono::microseconds(0);
+  auto target = static_cast<uint64_t>(std::ceil(
+        std::clamp(fraction, 0.0, 1.0) * this->total));
+  target = std::max<uint64_t>(target, 1);
+  uint64_t seen = 0;
+  for (size_t i = 0; i + 1 < kBuckets; i++) {
+    seen += this->counts[i];
+    if (seen >= target) return std::chrono::microseconds(int64_t(1) << i);
+  }
+  return std::chrono::ceil<std::chrono::microseconds>(this->max);
+}
+
+namespace impl {
+
+AtomicDurationHistogram::AtomicDurationHistogram() :
+    total(0), sum_ns(0), max_ns(0) {
+  for (auto& count : this->counts) count = 0;
+}
+
+void AtomicDurationHistogram::Add(std::chrono::nanoseconds duration) {
+  this->counts[JdwpDurationHistogram::BucketFor(duration)].fetch_add(1,
+      std::memory_order_relaxed);
+  this->total.fetch_add(1, std::memory_order_relaxed);
+  this->sum_ns.fetch_add(duration.count(), std::memory_order_relaxed);
+  int64_t max = this->max_ns.load(std::memory_order_relaxed);
+  while (duration.count() > max && !this->max_ns.compare_exchange_weak(max,
+        duration.count(), std::memory_order_relaxed)) { }
+}
+
+JdwpDurationHistogram AtomicDurationHistogram::Get() const {
+  JdwpDurationHistogram res;
+  for (size_t i = 0; i < res.counts.size(); i++) {
+    res.counts[i] = this->counts[i].load(std::memory_order_relaxed);
+  }
+  res.total = this->total.load(std::memory_order_relaxed);
+  res.sum = std::chrono::nanoseconds(
+      this->sum_ns.load(std::memory_order_relaxed));
+  res.max = std::chrono::nanoseconds(
+      this->max_ns.load(std::memory_order_relaxed));
+  return res;
+}
+
+}  // namespace impl
+
+}  // namespace roastery
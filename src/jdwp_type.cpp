@@ -21,12 +21,19 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <arpa/inet.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ROASTERY_HAVE_SSSE3_SWAP 1
+#endif
+
 #include <algorithm>
 #include <cstring>
 #include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <variant>
 
 #include "jdwp_con.hpp"
 #include "jdwp_packet.hpp"
@@ -35,36 +42,6 @@ namespace {
 
 using namespace roastery;
 
-/**
- * Convert a network byte order/big endian 64-bit value to host byte order.
- */
-uint64_t ntohll(uint64_t network) {
-#if __BIG_ENDIAN__
-  return network;
-#else
-  uint32_t upper_bits = network >> 32;
-  uint32_t lower_bits = network & UINT32_MAX;
-  upper_bits = ntohl(upper_bits);
-  lower_bits = ntohl(lower_bits);
-  return (uint64_t{lower_bits} << 32) + upper_bits;
-#endif
-}
-
-/**
- * Convert a host byte order 64-bit value to network byte order/big endian.
- */
-uint64_t htonll(uint64_t host) {
-#if __BIG_ENDIAN__
-  return host;
-#else
-  uint32_t upper_bits = host >> 32;
-  uint32_t lower_bits = host & UINT32_MAX;
-  upper_bits = htonl(upper_bits);
-  lower_bits = htonl(lower_bits);
-  return (uint64_t{lower_bits} << 32) + upper_bits;
-#endif
-}
-
 /**
  * Returns the size, in bytes of a JDWP entity based on the tag.
  *
@@ -119,6 +96,147 @@ bool TagIsObjType(JdwpTag t) {
     t == JdwpTag::kClassObject;
 }
 
+/**
+ * Returns the index of the alternative of \c JdwpArrayRegion::Packed that holds
+ * values tagged \c t, or 0 if they aren't packed.
+ */
+size_t PackedIndexByTag(JdwpTag t) {
+  switch(t) {
+    case JdwpTag::kBoolean:
+    case JdwpTag::kByte:
+      return 1;
+    case JdwpTag::kChar:
+    case JdwpTag::kShort:
+      return 2;
+    case JdwpTag::kInt:
+      return 3;
+    case JdwpTag::kFloat:
+      return 4;
+    case JdwpTag::kLong:
+      return 5;
+    case JdwpTag::kDouble:
+      return 6;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Returns an empty \c JdwpArrayRegion::Packed holding the alternative at
+ * \c index.
+ */
+JdwpArrayRegion::Packed EmptyPacked(size_t index) {
+  switch(index) {
+    case 1:
+      return JdwpArrayRegion::Packed(std::in_place_index<1>);
+    case 2:
+      return JdwpArrayRegion::Packed(std::in_place_index<2>);
+    case 3:
+      return JdwpArrayRegion::Packed(std::in_place_index<3>);
+    case 4:
+      return JdwpArrayRegion::Packed(std::in_place_index<4>);
+    case 5:
+      return JdwpArrayRegion::Packed(std::in_place_index<5>);
+    case 6:
+      return JdwpArrayRegion::Packed(std::in_place_index<6>);
+    default:
+      return JdwpArrayRegion::Packed();
+  }
+}
+
+#ifdef ROASTERY_HAVE_SSSE3_SWAP
+/**
+ * Returns whether the CPU we're running on supports SSSE3. Only checked once.
+ */
+bool HasSsse3() {
+  static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+  return has_ssse3;
+}
+
+/**
+ * Does the work of \c CopySwapped 16 bytes at a time with \c pshufb. Values
+ * that don't fill a whole 16 bytes are left for the caller.
+ *
+ * @return The number of values copied.
+ */
+__attribute__((target("ssse3")))
+size_t CopySwappedSsse3(const char* in, char* out, size_t count,
+    size_t width) {
+  __m128i mask;
+  switch(width) {
+    case 2:
+      mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15,
+          14);
+      break;
+    case 4:
+      mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13,
+          12);
+      break;
+    case 8:
+      mask = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9,
+          8);
+      break;
+    default:
+      return 0;
+  }
+  const size_t kChunk = sizeof(__m128i);
+  size_t len = count * width / kChunk * kChunk;
+  for (size_t i = 0; i < len; i += kChunk) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+        _mm_shuffle_epi8(chunk, mask));
+  }
+  return len / width;
+}
+#endif
+
+/**
+ * Copies \c count values, each \c width bytes wide, from \c in to \c out,
+ * converting each between network and host byte order.
+ */
+void CopySwapped(const char* in, char* out, size_t count, size_t width) {
+#if __BIG_ENDIAN__
+  memcpy(out, in, count * width);
+#else
+  if (width == 1) {
+    memcpy(out, in, count);
+    return;
+  }
+  size_t done = 0;
+#ifdef ROASTERY_HAVE_SSSE3_SWAP
+  if (HasSsse3()) done = CopySwappedSsse3(in, out, count, width);
+#endif
+  for (size_t i = done * width; i < count * width; i += width) {
+    for (size_t j = 0; j < width; j++) {
+      out[i + j] = in[i + width - 1 - j];
+    }
+  }
+#endif
+}
+
+/**
+ * Reads the length of a JDWP string from the start of \c encoded, and checks
+ * that the string fits in \c encoded.
+ */
+uint32_t DecodeStringLength(std::string_view encoded) {
+  impl::RequireBytes(encoded, sizeof(uint32_t));
+  uint32_t strlen_nbo;
+  encoded.copy(reinterpret_cast<char*>(&strlen_nbo), sizeof(strlen_nbo));
+  uint32_t strlen = ntohl(strlen_nbo);
+  impl::RequireBytes(encoded, sizeof(uint32_t) + static_cast<size_t>(strlen));
+  return strlen;
+}
+
+/**
+ * Appends \c str to \c out as a JDWP string.
+ */
+void EncodeString(string& out, std::string_view str) {
+  uint32_t len_network_byte_order = htonl(str.length());
+  out.append(reinterpret_cast<char*>(&len_network_byte_order),
+      sizeof(len_network_byte_order));
+  out += str;
+}
+
 }  // namespace
 
 namespace roastery {
@@ -333,9 +451,14 @@ const string& jdwp_strerror(JdwpError e) {
 }
 
 string IJdwpField::Serialize(IJdwpCon& con) const {
-  return this->SerializeImpl(con);
+  string res;
+  this->SerializeToImpl(res, con);
+  return res;
+}
+void IJdwpField::SerializeTo(string& out, IJdwpCon& con) const {
+  this->SerializeToImpl(out, con);
 }
-size_t IJdwpField::FromEncoded(const string& encoded, IJdwpCon& con) {
+size_t IJdwpField::FromEncoded(std::string_view encoded, IJdwpCon& con) {
   return this->FromEncodedImpl(encoded, con);
 }
 // pure virtual dtor housekeeping
@@ -343,21 +466,29 @@ IJdwpField::~IJdwpField() { }
 
 JdwpTaggedObjectId::JdwpTaggedObjectId() = default;
 
-size_t JdwpTaggedObjectId::FromEncodedImpl(const string& data, IJdwpCon& con) {
-  const char* data_arr = data.data();
-  this->tag = static_cast<JdwpTag>(data_arr[0]);
+size_t JdwpTaggedObjectId::Decode(std::string_view data, IJdwpCon& con) {
+  impl::RequireBytes(data, 1);
+  this->tag = static_cast<JdwpTag>(data[0]);
 
-  size_t obj_id_size = this->obj_id.FromEncoded(&data_arr[1], con);
+  size_t obj_id_size = this->obj_id.Decode(data.substr(1), con);
   return 1 + obj_id_size;
 }
 
+void JdwpTaggedObjectId::Encode(string& out, IJdwpCon& con) const {
+  out.push_back(static_cast<char>(this->tag));
+  this->obj_id.Encode(out, con);
+}
+
+size_t JdwpTaggedObjectId::FromEncodedImpl(std::string_view data,
+    IJdwpCon& con) {
+  return this->Decode(data, con);
+}
+
 JdwpTaggedObjectId::JdwpTaggedObjectId(JdwpTag tag, JdwpObjId obj_id)
     : tag(tag), obj_id(obj_id) { }
 
-string JdwpTaggedObjectId::SerializeImpl(IJdwpCon& con) const {
-  string out = { static_cast<char>(this->tag) };
-  out += this->obj_id.Serialize(con);
-  return out;
+void JdwpTaggedObjectId::SerializeToImpl(string& out, IJdwpCon& con) const {
+  this->Encode(out, con);
 }
 
 JdwpLocation::JdwpLocation() = default;
@@ -366,80 +497,166 @@ JdwpLocation::JdwpLocation(JdwpTypeTag type, JdwpClassId class_id,
     JdwpMethodId method_id, uint64_t index) : type(type), class_id(class_id),
     method_id(method_id), index(index) { }
 
-size_t JdwpLocation::FromEncodedImpl(const string& encoded, IJdwpCon& con) {
+size_t JdwpLocation::Decode(std::string_view encoded, IJdwpCon& con) {
   size_t total_size = 0;
-  const char* encoded_bytes = encoded.data();
-  this->type = static_cast<JdwpTypeTag>(encoded_bytes[0]);
+  impl::RequireBytes(encoded, 1);
+  this->type = static_cast<JdwpTypeTag>(encoded[0]);
   total_size += 1;  // For JdwpTypeTag
 
-  size_t obj_id_size = con.GetObjIdSize();
-  size_t method_id_size = con.GetMethodIdSize();
-  total_size += this->class_id.FromEncoded(
-      string(&encoded_bytes[1], obj_id_size), con);
-  total_size += this->method_id.FromEncoded(
-      string(&encoded_bytes[1 + obj_id_size], method_id_size), con);
-
-  uint64_t index_network_byte_order =
-    *reinterpret_cast<const uint64_t*>(
-        &encoded_bytes[1 + obj_id_size + method_id_size]);
-  this->index = ntohll(index_network_byte_order);
+  total_size += this->class_id.Decode(encoded.substr(total_size), con);
+  total_size += this->method_id.Decode(encoded.substr(total_size), con);
+
+  impl::RequireBytes(encoded, total_size + sizeof(uint64_t));
+  this->index = impl::FixedCodec<uint64_t>::Decode(encoded.data() + total_size);
   total_size += sizeof(uint64_t);  // For location index
 
   return total_size;
 }
 
-string JdwpLocation::SerializeImpl(IJdwpCon& con) const {
-  string res = { static_cast<char>(this->type) };
-  res.append(this->class_id.Serialize(con));
-  res.append(this->method_id.Serialize(con));
+void JdwpLocation::Encode(string& out, IJdwpCon& con) const {
+  out.push_back(static_cast<char>(this->type));
+  this->class_id.Encode(out, con);
+  this->method_id.Encode(out, con);
 
-  uint64_t index_network_byte_order = htonll(this->index);
-  res.append(string(reinterpret_cast<char*>(&index_network_byte_order),
-        sizeof(index_network_byte_order)));
+  size_t start = out.size();
+  out.resize(start + sizeof(uint64_t));
+  impl::FixedCodec<uint64_t>::Encode(this->index, &out[start]);
+}
 
-  return res;
+size_t JdwpLocation::FromEncodedImpl(std::string_view encoded,
+    IJdwpCon& con) {
+  return this->Decode(encoded, con);
+}
+
+void JdwpLocation::SerializeToImpl(string& out, IJdwpCon& con) const {
+  this->Encode(out, con);
 }
 
 JdwpString::JdwpString() = default;
 
 JdwpString& JdwpString::operator<<(const string& s) {
   this->data = s;
+  this->interned.reset();
   return *this;
 }
 
 string& JdwpString::GetValue() {
+  if (this->interned) {
+    this->data = *this->interned;
+    this->interned.reset();
+  }
   return this->data;
 }
 
 const string& JdwpString::GetValue() const {
-  return this->data;
+  return this->interned ? *this->interned : this->data;
 }
 
-size_t JdwpString::FromEncodedImpl(const string& data, IJdwpCon& con) {
+void JdwpString::Intern(JdwpStringInterner& interner) {
+  if (this->interned) return;
+  this->interned = interner.Intern(this->data);
+  string().swap(this->data);
+}
+
+size_t JdwpString::FromEncodedImpl(std::string_view data, IJdwpCon& con) {
   static_cast<void>(con);  // non variable-width type
-  const char* data_bytes = data.data();
-  uint32_t strlen = ntohl(*reinterpret_cast<const uint32_t*>(data_bytes));
-  this->data = (string(data_bytes + 4, strlen));
+  uint32_t strlen = DecodeStringLength(data);
+  this->interned.reset();
+  this->data.assign(data.data() + sizeof(uint32_t), strlen);
 
   return sizeof(uint32_t) + strlen;  // uint32_t for size, strlen for the string
 }
 
-string JdwpString::SerializeImpl(IJdwpCon& con) const {
+void JdwpString::SerializeToImpl(string& out, IJdwpCon& con) const {
   static_cast<void>(con);  // non variable-width type
-  uint32_t len_network_byte_order = htonl(data.length());
-  string res = string(reinterpret_cast<char*>(&len_network_byte_order),
-      sizeof(len_network_byte_order));
-  res += data;
-  return res;
+  EncodeString(out, this->GetValue());
 }
 
 JdwpString::JdwpString(const string& data) : data(data) { }
 
+JdwpLazyString::JdwpLazyString() : lazy_data(nullptr), lazy_len(0) { }
+
+JdwpLazyString& JdwpLazyString::operator<<(const string& s) {
+  this->data = s;
+  this->lazy_data = nullptr;
+  return *this;
+}
+
+std::string_view JdwpLazyString::GetView() const {
+  if (this->lazy_data) return std::string_view(this->lazy_data, this->lazy_len);
+  return this->data;
+}
+
+const string& JdwpLazyString::GetValue() {
+  this->Materialize();
+  return this->data;
+}
+
+void JdwpLazyString::Materialize() {
+  if (!this->lazy_data) return;
+  this->data.assign(this->lazy_data, this->lazy_len);
+  this->lazy_data = nullptr;
+}
+
+bool JdwpLazyString::IsMaterialized() const {
+  return !this->lazy_data;
+}
+
+size_t JdwpLazyString::FromEncodedImpl(std::string_view encoded,
+    IJdwpCon& con) {
+  static_cast<void>(con);  // non variable-width type
+  uint32_t strlen = DecodeStringLength(encoded);
+  this->data.clear();
+  this->lazy_data = encoded.data() + sizeof(uint32_t);
+  this->lazy_len = strlen;
+  return sizeof(uint32_t) + strlen;
+}
+
+void JdwpLazyString::SerializeToImpl(string& out, IJdwpCon& con) const {
+  static_cast<void>(con);  // non variable-width type
+  EncodeString(out, this->GetView());
+}
+
+JdwpBytes::JdwpBytes() : referred(nullptr), referred_len(0) { }
+
+JdwpBytes& JdwpBytes::operator<<(const string& s) {
+  this->data = s;
+  this->referred = nullptr;
+  return *this;
+}
+
+void JdwpBytes::Refer(std::string_view bytes) {
+  string().swap(this->data);
+  this->referred = bytes.data();
+  this->referred_len = bytes.size();
+}
+
+std::string_view JdwpBytes::GetView() const {
+  if (this->referred) {
+    return std::string_view(this->referred, this->referred_len);
+  }
+  return this->data;
+}
+
+size_t JdwpBytes::FromEncodedImpl(std::string_view encoded, IJdwpCon& con) {
+  static_cast<void>(con);  // non variable-width type
+  // Encoded just like a string, as a length and then the bytes
+  uint32_t len = DecodeStringLength(encoded);
+  this->data.assign(encoded.data() + sizeof(uint32_t), len);
+  this->referred = nullptr;
+  return sizeof(uint32_t) + len;
+}
+
+void JdwpBytes::SerializeToImpl(string& out, IJdwpCon& con) const {
+  static_cast<void>(con);  // non variable-width type
+  EncodeString(out, this->GetView());
+}
+
 JdwpValue::JdwpValue() = default;
 
 JdwpValue::JdwpValue(JdwpTag tag, JdwpVal val) : tag(tag), value(val) { }
 
-size_t JdwpValue::FromEncodedAsUntagged(JdwpTag t, const string& encoded,
+size_t JdwpValue::FromEncodedAsUntagged(JdwpTag t, std::string_view encoded,
     IJdwpCon& con) {
   this->tag = t;
   if (t == JdwpTag::kVoid) {
@@ -450,7 +667,8 @@ size_t JdwpValue::FromEncodedAsUntagged(JdwpTag t, const string& encoded,
   } else {
     if (TagIsObjType(t)) {
       this->value = JdwpObjId();
-      std::visit([&](auto&& s) { s.FromEncoded(encoded, con); }, this->value);
+      std::visit([&](auto&& s) { impl::DecodeField(s, encoded, con); },
+          this->value);
       return con.GetObjIdSize();
     } else {
       switch(t) {
@@ -483,7 +701,7 @@ size_t JdwpValue::FromEncodedAsUntagged(JdwpTag t, const string& encoded,
       }
       size_t val_size;
       std::visit([&](auto&& s) {
-        s.FromEncoded(encoded, con);
+        impl::DecodeField(s, encoded, con);
         val_size = s.value_size;
       }, this->value);
       return val_size;
@@ -493,17 +711,23 @@ size_t JdwpValue::FromEncodedAsUntagged(JdwpTag t, const string& encoded,
 
 string JdwpValue::SerializeAsUntagged(IJdwpCon& con) const {
   string res;
-  std::visit([&res, &con](auto&& v) {
-    res = v.Serialize(con);
-  }, this->value);
+  this->SerializeAsUntaggedTo(res, con);
   return res;
 }
 
-string JdwpValue::SerializeImpl(IJdwpCon& con) const {
-  return static_cast<char>(tag) + this->SerializeAsUntagged(con);
+void JdwpValue::SerializeAsUntaggedTo(string& out, IJdwpCon& con) const {
+  std::visit([&out, &con](auto&& v) {
+    impl::EncodeField(out, v, con);
+  }, this->value);
+}
+
+void JdwpValue::SerializeToImpl(string& out, IJdwpCon& con) const {
+  out.push_back(static_cast<char>(tag));
+  this->SerializeAsUntaggedTo(out, con);
 }
 
-size_t JdwpValue::FromEncodedImpl(const string& encoded, IJdwpCon& con) {
+size_t JdwpValue::FromEncodedImpl(std::string_view encoded, IJdwpCon& con) {
+  impl::RequireBytes(encoded, 1);
   this->tag = static_cast<JdwpTag>(encoded[0]);
   size_t untagged_size =
     this->FromEncodedAsUntagged(this->tag, encoded.substr(1), con);
@@ -516,7 +740,8 @@ JdwpArrayRegion::JdwpArrayRegion(JdwpTag tag,
   const vector<unique_ptr<JdwpValue>>& values) :
     tag(tag),
     values(unique_ptr<vector<unique_ptr<JdwpValue>>>(
-          new vector<unique_ptr<JdwpValue>>(values.size()))) {
+          new vector<unique_ptr<JdwpValue>>())) {
+  this->values->reserve(values.size());
   for (auto it = values.begin(); it != values.end(); ++it) {
     unique_ptr<JdwpValue> copy =
       unique_ptr<JdwpValue>(new JdwpValue(it->get()->tag, it->get()->value));
@@ -524,29 +749,80 @@ JdwpArrayRegion::JdwpArrayRegion(JdwpTag tag,
   }
 }
 
-size_t JdwpArrayRegion::FromEncodedImpl(const string& encoded, IJdwpCon& con) {
-  tag = static_cast<JdwpTag>(encoded[0]);
-  if (!values) {
-    values = unique_ptr<vector<unique_ptr<JdwpValue>>>(
-        new vector<unique_ptr<JdwpValue>>());
-  } else {
-    values->clear();
+JdwpArrayRegion::JdwpArrayRegion(JdwpTag tag, Packed packed) : tag(tag),
+    packed(std::move(packed)) {
+  size_t index = PackedIndexByTag(tag);
+  if (index == 0 || this->packed.index() != index) {
+    throw JdwpException("Packed values don't match the array region's tag");
   }
+}
 
-  uint32_t value_count =
-    ntohl(*reinterpret_cast<const uint32_t*>(encoded.data() + 1));
-  size_t value_size = GetSizeByTag(this->tag, con);
+size_t JdwpArrayRegion::Size() const {
+  if (this->values) return this->values->size();
+  return std::visit([](auto&& vals) -> size_t {
+    if constexpr (std::is_same_v<std::decay_t<decltype(vals)>,
+        std::monostate>) {
+      return 0;
+    } else {
+      return vals.size();
+    }
+  }, this->packed);
+}
 
+size_t JdwpArrayRegion::FromEncodedImpl(std::string_view encoded,
+    IJdwpCon& con) {
   const size_t kHeaderOffset = 5; // 1 for the tag, 4 for the length
+  impl::RequireBytes(encoded, kHeaderOffset);
+  tag = static_cast<JdwpTag>(encoded[0]);
+
+  uint32_t value_count_nbo;
+  encoded.copy(reinterpret_cast<char*>(&value_count_nbo),
+      sizeof(value_count_nbo), 1);
+  uint32_t value_count = ntohl(value_count_nbo);
+  size_t value_size = GetSizeByTag(this->tag, con);
+
   // Object types in array regions are handled differently
   if (TagIsObjType(this->tag)) {
     // Object types are tagged values, so they have an extra byte
     value_size++;
+  }
+  impl::RequireBytes(encoded,
+      kHeaderOffset + value_size * static_cast<size_t>(value_count));
+
+  size_t packed_index = PackedIndexByTag(this->tag);
+  if (packed_index != 0) {
+    // Primitives are swapped straight into a vector, which is kept between
+    // decodes of the same type so as to not allocate again
+    this->values.reset();
+    if (this->packed.index() != packed_index) {
+      this->packed = EmptyPacked(packed_index);
+    }
+    std::visit([&](auto&& vals) {
+      using Vals = std::decay_t<decltype(vals)>;
+      if constexpr (!std::is_same_v<Vals, std::monostate>) {
+        vals.resize(value_count);
+        CopySwapped(encoded.data() + kHeaderOffset,
+            reinterpret_cast<char*>(vals.data()), value_count,
+            sizeof(typename Vals::value_type));
+      }
+    }, this->packed);
+    return kHeaderOffset + value_count * value_size;
+  }
+
+  this->packed = std::monostate();
+  if (!values) {
+    values = unique_ptr<vector<unique_ptr<JdwpValue>>>(
+        new vector<unique_ptr<JdwpValue>>());
+  } else {
+    values->clear();
+  }
+  this->values->reserve(value_count);
+  if (TagIsObjType(this->tag)) {
     for (size_t i = kHeaderOffset;
         i < kHeaderOffset + value_size * value_count;
         i += value_size) {
       unique_ptr<JdwpValue> val = unique_ptr<JdwpValue>(new JdwpValue());
-      val->FromEncoded(encoded.substr(i, i + value_size), con);
+      val->FromEncoded(encoded.substr(i, value_size), con);
       this->values->push_back(std::move(val));
     }
   } else {
@@ -562,19 +838,30 @@ size_t JdwpArrayRegion::FromEncodedImpl(const string& encoded, IJdwpCon& con) {
   return sizeof(JdwpTag) + sizeof(value_count) + (value_count * value_size);
 }
 
-string JdwpArrayRegion::SerializeImpl(IJdwpCon& con) const {
-  std::stringstream res;
-  res << static_cast<char>(this->tag);
-  uint32_t len_nbo = htonl(this->values->size());
-  res.write(reinterpret_cast<char*>(&len_nbo), sizeof(len_nbo));
+void JdwpArrayRegion::SerializeToImpl(string& out, IJdwpCon& con) const {
+  out.push_back(static_cast<char>(this->tag));
+  uint32_t len_nbo = htonl(this->Size());
+  out.append(reinterpret_cast<char*>(&len_nbo), sizeof(len_nbo));
+  if (!this->values) {
+    std::visit([&out](auto&& vals) {
+      using Vals = std::decay_t<decltype(vals)>;
+      if constexpr (!std::is_same_v<Vals, std::monostate>) {
+        const size_t width = sizeof(typename Vals::value_type);
+        size_t start = out.size();
+        out.resize(start + vals.size() * width);
+        CopySwapped(reinterpret_cast<const char*>(vals.data()), &out[start],
+            vals.size(), width);
+      }
+    }, this->packed);
+    return;
+  }
   for (auto it = this->values->begin(); it != this->values->end(); ++it) {
     if (TagIsObjType(this->tag)) {
-      res << it->get()->Serialize(con);
+      it->get()->SerializeTo(out, con);
     } else {
-      res << it->get()->SerializeAsUntagged(con);
+      it->get()->SerializeAsUntaggedTo(out, con);
     }
   }
-  return res.str();
 }
 
 }  // namespace roastery
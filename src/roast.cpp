@@ -19,14 +19,33 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "roast.hpp"
 
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <csignal>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
 #include <thread>
+#include <vector>
 
+#include "jdwp_class_index.hpp"
 #include "jdwp_con.hpp"
+#include "jdwp_exception.hpp"
+#include "jdwp_heap_crawler.hpp"
+#include "jdwp_hot_swap.hpp"
+#include "jdwp_metadata_cache.hpp"
 #include "jdwp_packet.hpp"
+#include "jdwp_sampler.hpp"
 
 using namespace roastery;
 
@@ -39,8 +58,493 @@ class PrintHandler : public Handler {
     }
 };
 
+namespace {
+
+volatile std::sig_atomic_t interrupted = 0;
+
+/**
+ * The most commands listed in each stats dump.
+ */
+constexpr size_t kStatsCommands = 10;
+
+void OnInterrupt(int signum) {
+  static_cast<void>(signum);
+  interrupted = 1;
+}
+
+/**
+ * Writes a summary of what's happened on a connection since \c last, which
+ * was taken \c elapsed seconds before \c stats, followed by its busiest
+ * commands so far.
+ */
+void WriteStats(std::ostream& out, const JdwpConStats& stats,
+    const JdwpConStats& last, double elapsed) {
+  uint64_t requests = 0;
+  for (const JdwpCommandStats& command : stats.commands) {
+    requests += command.requests;
+  }
+  uint64_t last_requests = 0;
+  for (const JdwpCommandStats& command : last.commands) {
+    last_requests += command.requests;
+  }
+  auto rate = [elapsed](uint64_t now, uint64_t before) {
+    return elapsed > 0 ? (now - before) / elapsed : 0;
+  };
+  auto micros = [](std::chrono::nanoseconds duration) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        duration).count();
+  };
+
+  out << "stats: " << std::fixed << std::setprecision(1) <<
+    rate(requests, last_requests) << " requests/s, " <<
+    rate(stats.event_packets, last.event_packets) << " event packets/s, " <<
+    rate(stats.socket.bytes_written, last.socket.bytes_written) <<
+    " B/s out, " << rate(stats.socket.bytes_read, last.socket.bytes_read) <<
+    " B/s in, send queue " << stats.send_queue.depth << "/" <<
+    stats.send_queue.capacity << " (max " <<
+    stats.send_queue.high_water_mark << "), handlers p99 " <<
+    stats.inline_handler_time.Percentile(0.99).count() << "us inline " <<
+    stats.pooled_handler_time.Percentile(0.99).count() << "us pooled, " <<
+    "suspended p99 " << stats.suspensions.Percentile(0.99).count() << "us" <<
+    std::endl;
+
+  std::vector<const JdwpCommandStats*> busiest;
+  for (const JdwpCommandStats& command : stats.commands) {
+    busiest.push_back(&command);
+  }
+  std::sort(busiest.begin(), busiest.end(),
+      [](const JdwpCommandStats* a, const JdwpCommandStats* b) {
+        return a->requests > b->requests;
+      });
+  if (busiest.size() > kStatsCommands) busiest.resize(kStatsCommands);
+  for (const JdwpCommandStats* command : busiest) {
+    out << "  command " << static_cast<int>(command->command_set) << "/" <<
+      static_cast<int>(command->command) << ": " << command->requests <<
+      " sent, " << command->errors << " failed, " << command->bytes_sent <<
+      " B out, " << command->bytes_recieved << " B in, latency p50 " <<
+      command->latency.Percentile(0.5).count() << "us p99 " <<
+      command->latency.Percentile(0.99).count() << "us max " <<
+      micros(command->latency.max) << "us" << std::endl;
+  }
+  for (const JdwpEventStats& event : stats.events) {
+    out << "  event " << static_cast<int>(event.kind) << ": " <<
+      event.count << " recieved" << std::endl;
+  }
+}
+
+/**
+ * Writes a summary of a connection's stats to \c std::cerr periodically, and
+ * once more when destroyed, if given an interval.
+ */
+class StatsDumper {
+  public:
+    StatsDumper(const JdwpCon& con, double interval) :
+        con(con), interval(interval), stopping(false),
+        last(con.GetStats()), last_at(Clock::now()) {
+      if (interval > 0) {
+        this->thread = std::thread(&StatsDumper::Run, this);
+      }
+    }
+
+    // No copies
+    StatsDumper(const StatsDumper& copy) = delete;
+    StatsDumper& operator=(const StatsDumper& other) = delete;
+
+    ~StatsDumper() {
+      if (!this->thread.joinable()) return;
+      {
+        std::lock_guard<std::mutex> l(this->lck);
+        this->stopping = true;
+      }
+      this->cv.notify_all();
+      this->thread.join();
+      this->Dump();
+    }
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    const JdwpCon& con;
+    const double interval;
+    std::mutex lck;
+    std::condition_variable cv;
+    bool stopping;
+    JdwpConStats last;
+    Clock::time_point last_at;
+    std::thread thread;
+
+    void Dump() {
+      JdwpConStats stats = this->con.GetStats();
+      Clock::time_point now = Clock::now();
+      WriteStats(std::cerr, stats, this->last,
+          std::chrono::duration<double>(now - this->last_at).count());
+      this->last = std::move(stats);
+      this->last_at = now;
+    }
+
+    void Run() {
+      auto period = std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(this->interval));
+      std::unique_lock<std::mutex> l(this->lck);
+      while (!this->cv.wait_for(l, period,
+            [this]() { return this->stopping; })) {
+        this->Dump();
+      }
+    }
+};
+
+void SampleUsage(const char* name) {
+  std::cerr << "Usage: " << name << " sample [--host HOST] [--port PORT] " <<
+    "[--rate HZ] [--duration SECONDS] [--depth FRAMES] [--suspend-free] " <<
+    "[--no-lines] [--output FILE] [--stats SECONDS]" << std::endl;
+}
+
+/**
+ * Samples the stacks of a VM's threads until interrupted or out of time, then
+ * writes them as folded stacks.
+ */
+int Sample(const char* name, int argc, char *argv[]) {
+  const option long_options[] = {
+    { "host", required_argument, nullptr, 'h' },
+    { "port", required_argument, nullptr, 'p' },
+    { "rate", required_argument, nullptr, 'r' },
+    { "duration", required_argument, nullptr, 'd' },
+    { "depth", required_argument, nullptr, 'D' },
+    { "suspend-free", no_argument, nullptr, 's' },
+    { "no-lines", no_argument, nullptr, 'l' },
+    { "output", required_argument, nullptr, 'o' },
+    { "stats", required_argument, nullptr, 'S' },
+    { nullptr, 0, nullptr, 0 },
+  };
+  std::string host = "127.0.0.1";
+  int port = 3262;
+  double stats_interval = 0;
+  double rate = 100;
+  double duration = 0;
+  std::string output;
+  JdwpSamplerOptions options;
+  int opt;
+  try {
+    while ((opt = getopt_long(argc, argv, "h:p:r:d:D:slo:S:", long_options,
+            nullptr)) != -1) {
+      switch (opt) {
+        case 'h':
+          host = optarg;
+          break;
+        case 'p':
+          port = std::stoi(optarg);
+          break;
+        case 'r':
+          rate = std::stod(optarg);
+          break;
+        case 'd':
+          duration = std::stod(optarg);
+          break;
+        case 'D':
+          options.max_depth = std::stoi(optarg);
+          break;
+        case 's':
+          options.suspend_free = true;
+          break;
+        case 'l':
+          options.resolve_lines = false;
+          break;
+        case 'o':
+          output = optarg;
+          break;
+        case 'S':
+          stats_interval = std::stod(optarg);
+          break;
+        default:
+          SampleUsage(name);
+          return EXIT_FAILURE;
+      }
+    }
+  } catch (const std::logic_error& e) {
+    SampleUsage(name);
+    return EXIT_FAILURE;
+  }
+  if (rate <= 0 || options.max_depth <= 0) {
+    SampleUsage(name);
+    return EXIT_FAILURE;
+  }
+
+  try {
+    JdwpCon con(host, port);
+    JdwpMetadataCache cache(con);
+    JdwpSampler sampler(con, cache, options);
+    StatsDumper dumper(con, stats_interval);
+
+    signal(SIGINT, OnInterrupt);
+    using Clock = std::chrono::steady_clock;
+    auto seconds = [](double count) {
+      return std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(count));
+    };
+    auto period = seconds(1 / rate);
+    auto next = Clock::now();
+    auto end = next + seconds(duration);
+    while (!interrupted && (duration <= 0 || next < end)) {
+      sampler.Sample();
+      next += period;
+      // Skip the samples that were missed by falling behind, rather than
+      // taking them back to back
+      auto now = Clock::now();
+      if (next < now) next = now;
+      std::this_thread::sleep_until(next);
+    }
+    signal(SIGINT, SIG_DFL);
+
+    std::cerr << "Took " << sampler.GetSampleCount() << " samples" <<
+      std::endl;
+    if (output.empty()) {
+      sampler.WriteFolded(std::cout);
+    } else {
+      std::ofstream out(output);
+      if (!out) {
+        std::cerr << "Can't open " << output << ": " << strerror(errno) <<
+          std::endl;
+        return EXIT_FAILURE;
+      }
+      sampler.WriteFolded(out);
+    }
+  } catch (const std::system_error& e) {
+    std::cerr << "Can't connect to " << host << ":" << port << ": " <<
+      e.what() << std::endl;
+    return EXIT_FAILURE;
+  } catch (const JdwpException& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+void HeapUsage(const char* name) {
+  std::cerr << "Usage: " << name << " heap --output FILE --class PATTERN... " <<
+    "[--host HOST] [--port PORT] [--max-objects COUNT] " <<
+    "[--max-instances COUNT] [--in-flight COUNT] [--referrers] [--resume] " <<
+    "[--stats SECONDS]" << std::endl;
+}
+
+/**
+ * Crawls a VM's heap from the instances of the classes given, until there's
+ * nothing left to crawl, the budget runs out or it's interrupted.
+ */
+int Heap(const char* name, int argc, char *argv[]) {
+  const option long_options[] = {
+    { "host", required_argument, nullptr, 'h' },
+    { "port", required_argument, nullptr, 'p' },
+    { "class", required_argument, nullptr, 'c' },
+    { "output", required_argument, nullptr, 'o' },
+    { "max-objects", required_argument, nullptr, 'm' },
+    { "max-instances", required_argument, nullptr, 'i' },
+    { "in-flight", required_argument, nullptr, 'f' },
+    { "referrers", no_argument, nullptr, 'r' },
+    { "resume", no_argument, nullptr, 'R' },
+    { "stats", required_argument, nullptr, 'S' },
+    { nullptr, 0, nullptr, 0 },
+  };
+  std::string host = "127.0.0.1";
+  int port = 3262;
+  double stats_interval = 0;
+  std::vector<std::string> patterns;
+  std::string output;
+  JdwpHeapCrawlOptions options;
+  int opt;
+  try {
+    while ((opt = getopt_long(argc, argv, "h:p:c:o:m:i:f:rRS:", long_options,
+            nullptr)) != -1) {
+      switch (opt) {
+        case 'h':
+          host = optarg;
+          break;
+        case 'p':
+          port = std::stoi(optarg);
+          break;
+        case 'c':
+          patterns.push_back(optarg);
+          break;
+        case 'o':
+          output = optarg;
+          break;
+        case 'm':
+          options.max_objects = std::stoull(optarg);
+          break;
+        case 'i':
+          options.max_instances = std::stoi(optarg);
+          break;
+        case 'f':
+          options.max_in_flight = std::stoul(optarg);
+          break;
+        case 'r':
+          options.follow_referrers = true;
+          break;
+        case 'R':
+          options.resume = true;
+          break;
+        case 'S':
+          stats_interval = std::stod(optarg);
+          break;
+        default:
+          HeapUsage(name);
+          return EXIT_FAILURE;
+      }
+    }
+  } catch (const std::logic_error& e) {
+    HeapUsage(name);
+    return EXIT_FAILURE;
+  }
+  // A resumed crawl already has its roots
+  if (output.empty() || (patterns.empty() && !options.resume) ||
+      options.max_in_flight == 0 || options.max_instances < 0) {
+    HeapUsage(name);
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<JdwpCon> con;
+  try {
+    con = std::make_unique<JdwpCon>(host, port);
+  } catch (const std::system_error& e) {
+    std::cerr << "Can't connect to " << host << ":" << port << ": " <<
+      e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  try {
+    JdwpMetadataCache cache(*con);
+    JdwpHeapCrawler crawler(*con, cache, output, options);
+    StatsDumper dumper(*con, stats_interval);
+    if (!patterns.empty()) {
+      JdwpClassIndex index(*con);
+      index.Load().get();
+      std::vector<uint64_t> roots;
+      for (const std::string& pattern : patterns) {
+        for (const JdwpClassInfo& info : index.FindByPattern(pattern)) {
+          roots.push_back(info.ref_type);
+        }
+      }
+      if (roots.empty() && !options.resume) {
+        std::cerr << "No loaded class matches the patterns given" <<
+          std::endl;
+        return EXIT_FAILURE;
+      }
+      crawler.AddRootClasses(roots);
+    }
+
+    signal(SIGINT, OnInterrupt);
+    while (!interrupted && crawler.Step() != 0) { }
+    signal(SIGINT, SIG_DFL);
+
+    std::cerr << "Expanded " << crawler.GetExpandedCount() << " objects, " <<
+      crawler.GetFrontierSize() << " left" << std::endl;
+  } catch (const std::system_error& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  } catch (const JdwpException& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+void SwapUsage(const char* name) {
+  std::cerr << "Usage: " << name << " swap [--host HOST] [--port PORT] " <<
+    "PATH..." << std::endl;
+}
+
+/**
+ * Redefines the loaded classes in the directories and jars given with a
+ * single \c RedefineClasses command.
+ */
+int Swap(const char* name, int argc, char *argv[]) {
+  const option long_options[] = {
+    { "host", required_argument, nullptr, 'h' },
+    { "port", required_argument, nullptr, 'p' },
+    { nullptr, 0, nullptr, 0 },
+  };
+  std::string host = "127.0.0.1";
+  int port = 3262;
+  int opt;
+  try {
+    while ((opt = getopt_long(argc, argv, "h:p:", long_options,
+            nullptr)) != -1) {
+      switch (opt) {
+        case 'h':
+          host = optarg;
+          break;
+        case 'p':
+          port = std::stoi(optarg);
+          break;
+        default:
+          SwapUsage(name);
+          return EXIT_FAILURE;
+      }
+    }
+  } catch (const std::logic_error& e) {
+    SwapUsage(name);
+    return EXIT_FAILURE;
+  }
+  if (optind >= argc) {
+    SwapUsage(name);
+    return EXIT_FAILURE;
+  }
+
+  JdwpClassFiles classes;
+  try {
+    for (int i = optind; i < argc; i++) classes.Add(argv[i]);
+  } catch (const std::system_error& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  } catch (const JdwpException& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<JdwpCon> con;
+  try {
+    con = std::make_unique<JdwpCon>(host, port);
+  } catch (const std::system_error& e) {
+    std::cerr << "Can't connect to " << host << ":" << port << ": " <<
+      e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  try {
+    JdwpClassIndex index(*con);
+    JdwpMetadataCache cache(*con);
+    index.Load().get();
+    JdwpHotSwapper swapper(*con, index, cache);
+
+    auto start = std::chrono::steady_clock::now();
+    JdwpHotSwapResult res = swapper.Swap(classes);
+    std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+    for (const std::string& signature : res.not_loaded) {
+      std::cerr << "Not loaded: " << signature << std::endl;
+    }
+    std::cerr << "Redefined " << res.redefined.size() << " classes (" <<
+      res.types << " types) in " << std::fixed << std::setprecision(1) <<
+      elapsed.count() << "ms" << std::endl;
+  } catch (const std::system_error& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  } catch (const JdwpException& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+
 int main(int argc, char *argv[]) {
   signal(SIGPIPE, SIG_IGN);
+  if (argc >= 2 && strcmp(argv[1], "sample") == 0) {
+    return Sample(argv[0], argc - 1, argv + 1);
+  }
+  if (argc >= 2 && strcmp(argv[1], "heap") == 0) {
+    return Heap(argv[0], argc - 1, argv + 1);
+  }
+  if (argc >= 2 && strcmp(argv[1], "swap") == 0) {
+    return Swap(argv[0], argc - 1, argv + 1);
+  }
   auto r = JdwpCon("127.0.0.1", 3262);
   r.RegisterEventHandler(std::make_unique<PrintHandler>());
   r.SendMessage(
@@ -0,0 +1,372 @@
+/* Provides a fake JDWP server listening on the loopback interface
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROASTERY_TEST_FAKE_JDWP_SERVER_H_
+#define ROASTERY_TEST_FAKE_JDWP_SERVER_H_
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace roastery {
+
+namespace test {
+
+/**
+ * Appends \c val to \c out as a JDWP \c int.
+ */
+inline void AppendInt(std::string& out, int32_t val) {
+  uint32_t val_nbo = htonl(val);
+  out.append(reinterpret_cast<char*>(&val_nbo), sizeof(val_nbo));
+}
+
+/**
+ * Appends \c val to \c out as a JDWP \c long, or an 8 byte ID.
+ */
+inline void AppendLong(std::string& out, uint64_t val) {
+  uint64_t val_nbo = htobe64(val);
+  out.append(reinterpret_cast<char*>(&val_nbo), sizeof(val_nbo));
+}
+
+/**
+ * Appends \c str to \c out as a JDWP \c string.
+ */
+inline void AppendString(std::string& out, const std::string& str) {
+  AppendInt(out, str.size());
+  out += str;
+}
+
+/**
+ * Reads the 8 byte ID at \c offset in the body of \c packet.
+ */
+inline uint64_t ReadId(const std::string& packet, size_t offset) {
+  uint64_t val_nbo;
+  std::memcpy(&val_nbo, packet.data() + 11 + offset, sizeof(val_nbo));
+  return be64toh(val_nbo);
+}
+
+/**
+ * Reads the \c int at \c offset in the body of \c packet.
+ */
+inline int32_t ReadInt(const std::string& packet, size_t offset) {
+  uint32_t val_nbo;
+  std::memcpy(&val_nbo, packet.data() + 11 + offset, sizeof(val_nbo));
+  return ntohl(val_nbo);
+}
+
+/**
+ * A fake JDWP server that accepts connections on \c 127.0.0.1, one at a
+ * time, performs the JDWP handshake on each, and then hands each packet it
+ * recieves to a user-provided responder. Packets the responder doesn't
+ * consume are kept so tests can wait for them with \c NextPacket. \c IDSizes
+ * commands, which every \c JdwpCon sends when connecting, are answered by
+ * the server itself.
+ */
+class FakeJdwpServer {
+  public:
+    /**
+     * Called on the server's thread for each packet recieved, including the
+     * header. Returns \c true if the packet was fully handled, \c false if it
+     * should be made available through \c NextPacket.
+     */
+    using Responder = std::function<bool(FakeJdwpServer&, const std::string&)>;
+    /**
+     * Called on the server's thread for each packet recieved, including the
+     * header, to build the body of its reply in \c body, and its error code
+     * in \c error, which start out empty and zero. Returns \c false to leave
+     * the packet for \c NextPacket instead.
+     */
+    using Script = std::function<bool(const std::string& packet,
+        std::string& body, uint16_t& error)>;
+
+    /**
+     * Returns a responder that replies to each packet \c script builds a
+     * reply for.
+     */
+    static Responder Scripted(Script script) {
+      return [script = std::move(script)](FakeJdwpServer& s,
+          const std::string& packet) {
+        std::string body;
+        uint16_t error = 0;
+        if (!script(packet, body, error)) return false;
+        s.Send(MakeReply(PacketId(packet), body, error));
+        return true;
+      };
+    }
+
+    explicit FakeJdwpServer(Responder responder = nullptr) :
+        responder(std::move(responder)), client_fd(-1), stopping(false),
+        connections(0), id_sizes_requests(0), id_sizes{8, 8, 8, 8, 8} {
+      this->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (this->listen_fd < 0) throw std::runtime_error("socket");
+      int one = 1;
+      setsockopt(this->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+      struct sockaddr_in addr = {};
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      addr.sin_port = 0;
+      if (bind(this->listen_fd, reinterpret_cast<sockaddr*>(&addr),
+            sizeof(addr)) < 0 || listen(this->listen_fd, 1) < 0) {
+        close(this->listen_fd);
+        throw std::runtime_error("bind/listen");
+      }
+      socklen_t len = sizeof(addr);
+      getsockname(this->listen_fd, reinterpret_cast<sockaddr*>(&addr), &len);
+      this->port = ntohs(addr.sin_port);
+
+      this->server_thread = std::thread(&FakeJdwpServer::Serve, this);
+    }
+
+    FakeJdwpServer(const FakeJdwpServer& copy) = delete;
+    FakeJdwpServer& operator=(const FakeJdwpServer& other) = delete;
+
+    ~FakeJdwpServer() {
+      this->stopping = true;
+      shutdown(this->listen_fd, SHUT_RDWR);
+      {
+        std::lock_guard<std::mutex> l(this->lck);
+        if (this->client_fd >= 0) shutdown(this->client_fd, SHUT_RDWR);
+      }
+      this->server_thread.join();
+      if (this->client_fd >= 0) close(this->client_fd);
+      close(this->listen_fd);
+    }
+
+    /**
+     * Returns the port the server is listening on, in host byte order.
+     */
+    uint16_t GetPort() const { return this->port; }
+
+    /**
+     * Writes \c data to the connected client.
+     */
+    void Send(const std::string& data) {
+      std::lock_guard<std::mutex> l(this->write_lck);
+      size_t written = 0;
+      while (written < data.size()) {
+        ssize_t res = send(this->client_fd, data.data() + written,
+            data.size() - written, MSG_NOSIGNAL);
+        if (res <= 0) return;
+        written += res;
+      }
+    }
+
+    /**
+     * Sets the sizes reported in reply to \c IDSizes, in reply order: the
+     * fieldID, methodID, objectID, referenceTypeID and frameID sizes. Must
+     * be called before the client connects.
+     */
+    void SetIdSizes(const std::array<int32_t, 5>& sizes) {
+      std::lock_guard<std::mutex> l(this->lck);
+      this->id_sizes = sizes;
+    }
+
+    /**
+     * Returns the number of connections accepted so far.
+     */
+    size_t GetConnections() {
+      std::lock_guard<std::mutex> l(this->lck);
+      return this->connections;
+    }
+
+    /**
+     * Returns the number of \c IDSizes commands answered so far.
+     */
+    size_t GetIdSizesRequests() {
+      std::lock_guard<std::mutex> l(this->lck);
+      return this->id_sizes_requests;
+    }
+
+    /**
+     * Closes the connection with the client. The server then waits for the
+     * next one.
+     */
+    void Disconnect() {
+      std::lock_guard<std::mutex> l(this->lck);
+      if (this->client_fd >= 0) shutdown(this->client_fd, SHUT_RDWR);
+    }
+
+    /**
+     * Waits up to \c timeout for a packet not consumed by the responder, and
+     * stores it in \c out.
+     *
+     * @return \c true if a packet was recieved before the timeout.
+     */
+    bool NextPacket(std::string& out, std::chrono::milliseconds timeout =
+        std::chrono::milliseconds(2000)) {
+      std::unique_lock<std::mutex> l(this->lck);
+      if (!this->packets_cv.wait_for(l, timeout,
+            [this]() { return !this->packets.empty(); })) {
+        return false;
+      }
+      out = this->packets.front();
+      this->packets.pop_front();
+      return true;
+    }
+
+    /**
+     * Builds a JDWP packet header.
+     */
+    static std::string MakeHeader(uint32_t len, uint32_t id, uint8_t flags,
+        uint8_t command_set, uint8_t command) {
+      uint32_t len_nbo = htonl(len);
+      uint32_t id_nbo = htonl(id);
+      std::string res(reinterpret_cast<char*>(&len_nbo), sizeof(len_nbo));
+      res.append(reinterpret_cast<char*>(&id_nbo), sizeof(id_nbo));
+      res.push_back(static_cast<char>(flags));
+      res.push_back(static_cast<char>(command_set));
+      res.push_back(static_cast<char>(command));
+      return res;
+    }
+
+    /**
+     * Builds a reply packet for the command with the given \c id.
+     */
+    static std::string MakeReply(uint32_t id, const std::string& body,
+        uint16_t error = 0) {
+      uint16_t error_nbo = htons(error);
+      std::string header = MakeHeader(11 + body.size(), id, 0x80, 0, 0);
+      // The last two header bytes of a reply are the error code
+      header.replace(9, 2, reinterpret_cast<char*>(&error_nbo), 2);
+      return header + body;
+    }
+
+    /**
+     * Returns the ID in the header of \c packet, in host byte order.
+     */
+    static uint32_t PacketId(const std::string& packet) {
+      uint32_t id_nbo;
+      packet.copy(reinterpret_cast<char*>(&id_nbo), sizeof(id_nbo), 4);
+      return ntohl(id_nbo);
+    }
+
+  private:
+    Responder responder;
+    int listen_fd;
+    int client_fd;
+    uint16_t port;
+    bool stopping;
+    size_t connections;
+    size_t id_sizes_requests;
+    std::thread server_thread;
+
+    std::mutex lck;
+    std::mutex write_lck;
+    std::condition_variable packets_cv;
+    std::deque<std::string> packets;
+    std::array<int32_t, 5> id_sizes;
+
+    /**
+     * Replies to \c packet if it's an \c IDSizes command.
+     *
+     * @return Whether \c packet was answered.
+     */
+    bool AnswerIdSizes(const std::string& packet) {
+      // Command set 1 (VirtualMachine), command 7 (IDSizes)
+      if (packet[8] != 0 || packet[9] != 1 || packet[10] != 7) return false;
+      std::string body;
+      {
+        std::lock_guard<std::mutex> l(this->lck);
+        this->id_sizes_requests++;
+        for (int32_t size : this->id_sizes) {
+          uint32_t size_nbo = htonl(size);
+          body.append(reinterpret_cast<char*>(&size_nbo), sizeof(size_nbo));
+        }
+      }
+      this->Send(MakeReply(PacketId(packet), body));
+      return true;
+    }
+
+    bool ReadExactly(std::string& out, size_t len) {
+      out.resize(len);
+      size_t got = 0;
+      while (got < len) {
+        ssize_t res = recv(this->client_fd, &out[got], len - got, 0);
+        if (res <= 0) return false;
+        got += res;
+      }
+      return true;
+    }
+
+    void Serve() {
+      while (true) {
+        int fd = accept(this->listen_fd, nullptr, nullptr);
+        if (fd < 0) return;
+        {
+          std::lock_guard<std::mutex> l(this->lck);
+          this->client_fd = fd;
+          this->connections++;
+          if (this->stopping) shutdown(fd, SHUT_RDWR);
+        }
+        this->ServeClient();
+        // Nothing's sent to the descriptor once it's closed
+        std::lock_guard<std::mutex> w(this->write_lck);
+        std::lock_guard<std::mutex> l(this->lck);
+        close(this->client_fd);
+        this->client_fd = -1;
+        if (this->stopping) return;
+      }
+    }
+
+    /**
+     * Talks to the client on \c client_fd until it hangs up.
+     */
+    void ServeClient() {
+      const std::string kHandshake = "JDWP-Handshake";
+      std::string handshake;
+      if (!this->ReadExactly(handshake, kHandshake.size())) return;
+      this->Send(kHandshake);
+
+      std::string header, body;
+      while (this->ReadExactly(header, 11)) {
+        uint32_t len_nbo;
+        header.copy(reinterpret_cast<char*>(&len_nbo), sizeof(len_nbo));
+        size_t len = ntohl(len_nbo);
+        if (len < 11 || !this->ReadExactly(body, len - 11)) return;
+        std::string packet = header + body;
+        if (this->AnswerIdSizes(packet)) continue;
+        if (this->responder && this->responder(*this, packet)) continue;
+
+        std::lock_guard<std::mutex> l(this->lck);
+        this->packets.push_back(packet);
+        this->packets_cv.notify_all();
+      }
+    }
+};
+
+}  // namespace test
+
+}  // namespace roastery
+
+#endif  // ROASTERY_TEST_FAKE_JDWP_SERVER_H_
@@ -0,0 +1,278 @@
+/* Provides tests for `jdwp_breakpoints.hpp` and `jdwp_breakpoints.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "fake_jdwp_server.hpp"
+#include "jdwp_breakpoints.hpp"
+#include "jdwp_con.hpp"
+#include "jdwp_exception.hpp"
+#include "jdwp_packet.hpp"
+
+using namespace roastery;
+using namespace roastery::test;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+/**
+ * Breakpoints at this index are rejected by \c BreakpointServer.
+ */
+constexpr uint64_t kBadIndex = 999;
+
+/**
+ * Answers \c SetCommand with increasing request IDs, and records the command
+ * set and command of everything it recieves. Every class is \c LFoo;, which
+ * is found by signature as \c 0x10 on the first connection and \c 0x40 on
+ * later ones.
+ */
+class BreakpointServer {
+  public:
+    BreakpointServer() :
+        server(FakeJdwpServer::Scripted(
+              [this](const string& packet, string& body, uint16_t& error) {
+                return this->Respond(packet, body, error);
+              })) { }
+
+    /**
+     * Waits for the server to have recieved \c count packets, and returns
+     * them.
+     */
+    vector<std::pair<uint8_t, uint8_t>> WaitForPackets(size_t count) {
+      auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::seconds(2);
+      while (std::chrono::steady_clock::now() < deadline) {
+        {
+          std::lock_guard<std::mutex> l(this->lck);
+          if (this->seen.size() >= count) return this->seen;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      std::lock_guard<std::mutex> l(this->lck);
+      return this->seen;
+    }
+
+    FakeJdwpServer server;
+  private:
+    std::mutex lck;
+    vector<std::pair<uint8_t, uint8_t>> seen;
+    int32_t next_request = 1;
+
+    bool Respond(const string& packet, string& body, uint16_t& error) {
+      uint8_t command_set = packet[9];
+      uint8_t command = packet[10];
+      int32_t request_id;
+      {
+        std::lock_guard<std::mutex> l(this->lck);
+        this->seen.emplace_back(command_set, command);
+        request_id = this->next_request++;
+      }
+      if (command_set ==
+          static_cast<uint8_t>(commands::CommandSet::kReferenceType) &&
+          command ==
+            static_cast<uint8_t>(commands::ReferenceType::kSignature)) {
+        AppendString(body, "LFoo;");
+        return true;
+      }
+      if (command_set ==
+          static_cast<uint8_t>(commands::CommandSet::kVirtualMachine) &&
+          command == static_cast<uint8_t>(
+            commands::VirtualMachine::kClassesBySignature)) {
+        AppendInt(body, 1);
+        body.push_back(static_cast<char>(JdwpTypeTag::kClass));
+        AppendLong(body, this->server.GetConnections() == 1 ? 0x10 : 0x40);
+        AppendInt(body, 7);  // status
+        return true;
+      }
+      if (command_set !=
+          static_cast<uint8_t>(commands::CommandSet::kEventRequest) ||
+          command != static_cast<uint8_t>(commands::EventRequest::kSet)) {
+        return true;
+      }
+
+      // The index is the last field of the LocationOnly modifier
+      if (ReadId(packet, packet.size() - impl::kHeaderLen - 8) == kBadIndex) {
+        error = 24;
+        return true;
+      }
+      AppendInt(body, request_id);
+      return true;
+    }
+};
+
+JdwpBreakpointLocation At(uint64_t index, uint64_t class_id = 0x10) {
+  return { JdwpTypeTag::kClass, class_id, 0x20, index };
+}
+
+const std::pair<uint8_t, uint8_t> kHold = {
+  static_cast<uint8_t>(commands::CommandSet::kVirtualMachine),
+  static_cast<uint8_t>(commands::VirtualMachine::kHoldEvents) };
+const std::pair<uint8_t, uint8_t> kRelease = {
+  static_cast<uint8_t>(commands::CommandSet::kVirtualMachine),
+  static_cast<uint8_t>(commands::VirtualMachine::kReleaseEvents) };
+const std::pair<uint8_t, uint8_t> kSet = {
+  static_cast<uint8_t>(commands::CommandSet::kEventRequest),
+  static_cast<uint8_t>(commands::EventRequest::kSet) };
+const std::pair<uint8_t, uint8_t> kClear = {
+  static_cast<uint8_t>(commands::CommandSet::kEventRequest),
+  static_cast<uint8_t>(commands::EventRequest::kClear) };
+
+}  // namespace
+
+TEST(BreakpointManagerTest, InstallsBatchOnce) {
+  BreakpointServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpBreakpointManager breakpoints(con);
+
+  vector<JdwpBreakpointLocation> locations;
+  for (uint64_t i = 0; i < 500; i++) locations.push_back(At(i % 250));
+
+  std::mutex lck;
+  std::set<int32_t> request_ids;
+  size_t reported = 0;
+  auto installed = breakpoints.Install(locations,
+      [&](const JdwpBreakpointLocation&, int32_t request_id,
+        std::exception_ptr error) {
+        EXPECT_FALSE(error);
+        std::lock_guard<std::mutex> l(lck);
+        request_ids.insert(request_id);
+        reported++;
+      });
+  EXPECT_EQ(installed.get(), 250U);
+  EXPECT_EQ(reported, 250U);
+  EXPECT_EQ(request_ids.size(), 250U);
+  EXPECT_EQ(breakpoints.Size(), 250U);
+
+  // Every Set is sent while events are held
+  auto seen = server.WaitForPackets(252);
+  ASSERT_EQ(seen.size(), 252U);
+  EXPECT_EQ(seen.front(), kHold);
+  EXPECT_EQ(seen.back(), kRelease);
+  for (size_t i = 1; i + 1 < seen.size(); i++) EXPECT_EQ(seen[i], kSet);
+
+  int32_t request_id = 0;
+  EXPECT_TRUE(breakpoints.GetRequestId(At(3), request_id));
+  EXPECT_EQ(request_ids.count(request_id), 1U);
+  EXPECT_FALSE(breakpoints.GetRequestId(At(250), request_id));
+}
+
+TEST(BreakpointManagerTest, ReinstallingIsLocal) {
+  BreakpointServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpBreakpointManager breakpoints(con);
+
+  int32_t first = 0;
+  breakpoints.Install({ At(1) }, [&](const JdwpBreakpointLocation&,
+        int32_t request_id, std::exception_ptr) {
+      first = request_id;
+    }).get();
+  int32_t second = 0;
+  EXPECT_EQ(breakpoints.Install({ At(1) }, [&](const JdwpBreakpointLocation&,
+        int32_t request_id, std::exception_ptr) {
+      second = request_id;
+    }).get(), 1U);
+  EXPECT_NE(first, 0);
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(server.WaitForPackets(3).size(), 3U);
+
+  EXPECT_TRUE(breakpoints.Remove(At(1)));
+  EXPECT_FALSE(breakpoints.Remove(At(1)));
+  auto seen = server.WaitForPackets(4);
+  ASSERT_EQ(seen.size(), 4U);
+  EXPECT_EQ(seen.back(), kClear);
+  EXPECT_EQ(breakpoints.Size(), 0U);
+}
+
+TEST(BreakpointManagerTest, ReportsFailures) {
+  BreakpointServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpBreakpointManager breakpoints(con);
+
+  std::exception_ptr failure;
+  auto installed = breakpoints.Install({ At(1), At(kBadIndex) },
+      [&](const JdwpBreakpointLocation& location, int32_t request_id,
+        std::exception_ptr error) {
+        if (location == At(kBadIndex)) {
+          EXPECT_EQ(request_id, 0);
+          failure = error;
+        } else {
+          EXPECT_FALSE(error);
+        }
+      });
+  EXPECT_EQ(installed.get(), 1U);
+  ASSERT_TRUE(failure);
+  EXPECT_THROW(std::rethrow_exception(failure), JdwpReplyException);
+
+  // Failed locations can be tried again
+  int32_t request_id;
+  EXPECT_FALSE(breakpoints.GetRequestId(At(kBadIndex), request_id));
+  EXPECT_EQ(breakpoints.Install({ At(kBadIndex) }).get(), 0U);
+}
+
+
+TEST(BreakpointManagerTest, MovesBreakpointsAfterReconnect) {
+  BreakpointServer server;
+  JdwpConOptions options;
+  options.reconnect = true;
+  options.reconnect_delay = std::chrono::milliseconds(5);
+  JdwpCon con("127.0.0.1", server.server.GetPort(), options);
+  JdwpBreakpointManager breakpoints(con);
+  int32_t first = 0;
+  breakpoints.Install({ At(1) }, [&](const JdwpBreakpointLocation&,
+        int32_t request_id, std::exception_ptr) {
+      first = request_id;
+    }).get();
+  // Along with the hold and release, the connection asks for the signature
+  // of the breakpoint's class, to find it again after reconnecting
+  ASSERT_EQ(server.WaitForPackets(4).size(), 4U);
+
+  server.server.Disconnect();
+  // Set again in the class's new ID once it's been found by signature
+  int32_t request_id = 0;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (!breakpoints.GetRequestId(At(1, 0x40), request_id) &&
+      std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(request_id, first);
+  EXPECT_FALSE(breakpoints.GetRequestId(At(1), request_id));
+  EXPECT_EQ(breakpoints.Size(), 1U);
+  auto seen = server.WaitForPackets(6);
+  ASSERT_EQ(seen.size(), 6U);
+  EXPECT_EQ(seen.back(), kSet);
+
+  // Installing it again is local, and removing it clears it
+  EXPECT_EQ(breakpoints.Install({ At(1, 0x40) }).get(), 1U);
+  EXPECT_TRUE(breakpoints.Remove(At(1, 0x40)));
+  seen = server.WaitForPackets(7);
+  ASSERT_EQ(seen.size(), 7U);
+  EXPECT_EQ(seen.back(), kClear);
+  EXPECT_EQ(breakpoints.Size(), 0U);
+}
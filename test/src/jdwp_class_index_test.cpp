@@ -0,0 +1,291 @@
+/* Provides tests for `jdwp_class_index.hpp` and `jdwp_class_index.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "fake_jdwp_server.hpp"
+#include "jdwp_class_index.hpp"
+#include "jdwp_con.hpp"
+#include "jdwp_packet.hpp"
+
+using namespace roastery;
+using namespace roastery::test;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+/**
+ * Builds a composite event packet holding a single event of \c kind, with the
+ * given body after its kind.
+ */
+string MakeComposite(JdwpEventKind kind, const string& event) {
+  string body;
+  body.push_back(0);  // suspend policy
+  AppendInt(body, 1);
+  body.push_back(static_cast<char>(kind));
+  body += event;
+  return FakeJdwpServer::MakeHeader(impl::kHeaderLen + body.size(), 0, 0,
+      static_cast<uint8_t>(commands::CommandSet::kEvent),
+      static_cast<uint8_t>(commands::Event::kComposite)) + body;
+}
+
+const vector<string> kLoaded = {
+  "Ljava/lang/String;",
+  "Lcom/example/Main;",
+  "Lcom/example/util/Main;",
+  "Lcom/example/Main$Inner;",
+  "[Lcom/example/Main;",
+};
+
+/**
+ * Answers event requests and \c AllClassesWithGeneric with the first
+ * \c loaded classes of \c kLoaded, which get IDs 1 through 5.
+ */
+class ClassServer {
+  public:
+    ClassServer() :
+        event_requests(0), snapshots(0), loaded(kLoaded.size()), first_id(1),
+        server(FakeJdwpServer::Scripted(
+              [this](const string& packet, string& body, uint16_t& error) {
+                return this->Respond(packet, body, error);
+              })) { }
+
+    std::atomic<int> event_requests;
+    std::atomic<int> snapshots;
+    std::atomic<size_t> loaded;
+    /**
+     * The ID snapshots give the first class loaded, counting up from there.
+     */
+    std::atomic<uint64_t> first_id;
+    FakeJdwpServer server;
+  private:
+    bool Respond(const string& packet, string& body, uint16_t& error) {
+      static_cast<void>(error);
+      uint8_t command_set = packet[9];
+      if (command_set ==
+          static_cast<uint8_t>(commands::CommandSet::kEventRequest)) {
+        this->event_requests++;
+        AppendInt(body, this->event_requests);
+      } else {
+        this->snapshots++;
+        size_t loaded = this->loaded;
+        AppendInt(body, loaded);
+        for (size_t i = 0; i < loaded; i++) {
+          body.push_back(kLoaded[i][0] == '[' ? 3 : 1);
+          AppendLong(body, this->first_id + i);
+          AppendString(body, kLoaded[i]);
+          AppendString(body, "");
+          AppendInt(body, 7);
+        }
+      }
+      return true;
+    }
+};
+
+/**
+ * Signals once the I/O thread has handled a class being prepared or unloaded.
+ * Registered after the index, so the index has seen the event by then. Only
+ * signals for the first such event.
+ */
+class ClassEventWaiter : public Handler {
+  public:
+    using Handler::Handle;
+
+    void Handle(events::ClassPrepare& event) override {
+      static_cast<void>(event);
+      this->Signal();
+    }
+    void Handle(events::ClassUnload& event) override {
+      static_cast<void>(event);
+      this->Signal();
+    }
+
+    std::promise<void> seen;
+  private:
+    bool signalled = false;
+
+    void Signal() {
+      if (this->signalled) return;
+      this->signalled = true;
+      this->seen.set_value();
+    }
+};
+
+void SendClassEvent(ClassServer& server, JdwpCon& con, const string& packet) {
+  auto waiter = std::make_unique<ClassEventWaiter>();
+  auto seen = waiter->seen.get_future();
+  con.RegisterEventHandler(move(waiter));
+  server.server.Send(packet);
+  ASSERT_EQ(seen.wait_for(std::chrono::seconds(2)), std::future_status::ready);
+}
+
+/**
+ * Returns the sorted IDs of \c classes.
+ */
+vector<uint64_t> Ids(const vector<JdwpClassInfo>& classes) {
+  vector<uint64_t> res;
+  for (auto& cls : classes) res.push_back(cls.ref_type);
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+}  // namespace
+
+TEST(ClassIndexTest, NameToSignature) {
+  EXPECT_EQ(JdwpClassIndex::NameToSignature("java.lang.String"),
+      "Ljava/lang/String;");
+  EXPECT_EQ(JdwpClassIndex::NameToSignature("Main"), "LMain;");
+}
+
+TEST(ClassIndexTest, LoadsSnapshot) {
+  ClassServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpClassIndex index(con);
+
+  EXPECT_EQ(index.Load().get(), kLoaded.size());
+  EXPECT_EQ(server.event_requests, 2);
+  EXPECT_EQ(server.snapshots, 1);
+
+  auto found = index.FindByName("java.lang.String");
+  ASSERT_EQ(found.size(), 1U);
+  EXPECT_EQ(found[0].ref_type, 1U);
+  EXPECT_EQ(found[0].tag, JdwpTypeTag::kClass);
+  EXPECT_EQ(found[0].status, 7);
+  EXPECT_EQ(Ids(index.FindBySignature("[Lcom/example/Main;")),
+      vector<uint64_t>({ 5 }));
+  EXPECT_TRUE(index.FindByName("com.example.Missing").empty());
+
+  // Reloading resynchronizes without duplicating anything
+  EXPECT_EQ(index.Load().get(), kLoaded.size());
+  EXPECT_EQ(server.event_requests, 2);
+}
+
+TEST(ClassIndexTest, MatchesPatterns) {
+  ClassServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpClassIndex index(con);
+  index.Load().get();
+
+  EXPECT_EQ(Ids(index.FindByPattern("com.example.*")),
+      vector<uint64_t>({ 2, 3, 4 }));
+  EXPECT_EQ(Ids(index.FindByPattern("com.example.Main*")),
+      vector<uint64_t>({ 2, 4 }));
+  EXPECT_EQ(Ids(index.FindByPattern("*.Main")), vector<uint64_t>({ 2, 3 }));
+  EXPECT_EQ(Ids(index.FindByPattern("com.example.Main")),
+      vector<uint64_t>({ 2 }));
+  EXPECT_EQ(Ids(index.FindByPattern("*")), vector<uint64_t>({ 1, 2, 3, 4 }));
+  EXPECT_TRUE(index.FindByPattern("org.*").empty());
+}
+
+TEST(ClassIndexTest, SharesInterner) {
+  ClassServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  auto interner = std::make_shared<JdwpStringInterner>();
+  {
+    JdwpClassIndex index(con, interner);
+    index.Load().get();
+    // Only the signatures, as none of the classes have generic signatures
+    EXPECT_EQ(interner->Size(), kLoaded.size());
+    auto found = index.FindBySignature("Lcom/example/Main;");
+    ASSERT_EQ(found.size(), 1U);
+    EXPECT_EQ(found[0].signature, "Lcom/example/Main;");
+    EXPECT_EQ(found[0].generic_signature, "");
+    EXPECT_EQ(interner->Intern("Lcom/example/Main;").use_count(), 2);
+  }
+  // The signatures are freed along with the index
+  EXPECT_EQ(interner->Size(), 0U);
+}
+
+TEST(ClassIndexTest, TracksPreparedAndUnloadedClasses) {
+  ClassServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpClassIndex index(con);
+  index.Load().get();
+
+  string prepare;
+  AppendInt(prepare, 1);
+  AppendLong(prepare, 1);  // thread
+  prepare.push_back(1);  // type tag
+  AppendLong(prepare, 42);
+  AppendString(prepare, "Lcom/example/Late;");
+  AppendInt(prepare, 7);
+  SendClassEvent(server, con, MakeComposite(JdwpEventKind::kClassPrepare,
+        prepare));
+  EXPECT_EQ(Ids(index.FindByName("com.example.Late")),
+      vector<uint64_t>({ 42 }));
+  EXPECT_EQ(index.Size(), kLoaded.size() + 1);
+
+  string unload;
+  AppendInt(unload, 2);
+  AppendString(unload, "Lcom/example/Main;");
+  SendClassEvent(server, con, MakeComposite(JdwpEventKind::kClassUnload,
+        unload));
+  EXPECT_TRUE(index.FindByName("com.example.Main").empty());
+  EXPECT_EQ(Ids(index.FindByPattern("com.example.Main*")),
+      vector<uint64_t>({ 4 }));
+  EXPECT_EQ(index.Size(), kLoaded.size());
+}
+
+TEST(ClassIndexTest, RebuildsAfterReconnect) {
+  ClassServer server;
+  JdwpConOptions options;
+  options.reconnect = true;
+  options.reconnect_delay = std::chrono::milliseconds(5);
+  JdwpCon con("127.0.0.1", server.server.GetPort(), options);
+  JdwpClassIndex index(con);
+  index.Load().get();
+
+  // Unloaded while the connection was down
+  string prepare;
+  AppendInt(prepare, 1);
+  AppendLong(prepare, 1);  // thread
+  prepare.push_back(1);  // type tag
+  AppendLong(prepare, 42);
+  AppendString(prepare, "Lcom/example/Late;");
+  AppendInt(prepare, 7);
+  SendClassEvent(server, con, MakeComposite(JdwpEventKind::kClassPrepare,
+        prepare));
+  server.loaded = 3;
+  // The new connection gives every class a new ID
+  server.first_id = 101;
+  server.server.Disconnect();
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (index.Size() != 3 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  EXPECT_EQ(server.snapshots, 2);
+  // Set again by the connection, not the index
+  EXPECT_EQ(server.event_requests, 4);
+  EXPECT_EQ(Ids(index.FindByPattern("*")),
+      vector<uint64_t>({ 101, 102, 103 }));
+  EXPECT_TRUE(index.FindByName("com.example.Late").empty());
+  EXPECT_TRUE(index.FindBySignature("[Lcom/example/Main;").empty());
+}
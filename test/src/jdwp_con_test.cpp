@@ -0,0 +1,1468 @@
+/* Provides tests for `jdwp_con.hpp` and `jdwp_con.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "fake_jdwp_server.hpp"
+#include "jdwp_con.hpp"
+#include "jdwp_con_pool.hpp"
+#include "jdwp_exception.hpp"
+#include "jdwp_packet.hpp"
+
+using namespace roastery;
+using namespace roastery::test;
+
+using std::string;
+
+namespace {
+
+/**
+ * Builds a composite event packet holding a single \c VmDeath event.
+ */
+string MakeVmDeathComposite(int32_t request_id) {
+  string body;
+  body.push_back(0);  // suspend policy
+  uint32_t count_nbo = htonl(1);
+  body.append(reinterpret_cast<char*>(&count_nbo), sizeof(count_nbo));
+  body.push_back(static_cast<char>(JdwpEventKind::kVmDeath));
+  uint32_t req_nbo = htonl(request_id);
+  body.append(reinterpret_cast<char*>(&req_nbo), sizeof(req_nbo));
+  return FakeJdwpServer::MakeHeader(impl::kHeaderLen + body.size(), 0, 0,
+      static_cast<uint8_t>(commands::CommandSet::kEvent),
+      static_cast<uint8_t>(commands::Event::kComposite)) + body;
+}
+
+/**
+ * Records the request IDs of the \c VmDeath events it recieves.
+ */
+class VmDeathRecorder : public Handler {
+  public:
+    using Handler::Handle;
+
+    void Handle(events::VmDeath& event) override {
+      std::lock_guard<std::mutex> l(this->lck);
+      this->ids.push_back(std::get<0>(event.GetFields()).GetValue());
+      this->cv.notify_all();
+    }
+
+    bool WaitFor(size_t count) {
+      std::unique_lock<std::mutex> l(this->lck);
+      return this->cv.wait_for(l, std::chrono::seconds(2),
+          [&]() { return this->ids.size() >= count; });
+    }
+
+    std::mutex lck;
+    std::condition_variable cv;
+    std::vector<int32_t> ids;
+};
+
+/**
+ * Builds a composite event packet holding a \c ThreadStart event on
+ * \c thread for each of \c request_ids, sent with the given suspend
+ * \c policy.
+ */
+string MakeThreadStartComposite(JdwpSuspendPolicy policy, uint64_t thread,
+    const std::vector<int32_t>& request_ids = { 1 }) {
+  string body;
+  body.push_back(static_cast<char>(policy));
+  uint32_t count_nbo = htonl(request_ids.size());
+  body.append(reinterpret_cast<char*>(&count_nbo), sizeof(count_nbo));
+  for (int32_t request_id : request_ids) {
+    body.push_back(static_cast<char>(JdwpEventKind::kThreadStart));
+    uint32_t req_nbo = htonl(request_id);
+    body.append(reinterpret_cast<char*>(&req_nbo), sizeof(req_nbo));
+    uint64_t thread_nbo = htobe64(thread);
+    body.append(reinterpret_cast<char*>(&thread_nbo), sizeof(thread_nbo));
+  }
+  return FakeJdwpServer::MakeHeader(impl::kHeaderLen + body.size(), 0, 0,
+      static_cast<uint8_t>(commands::CommandSet::kEvent),
+      static_cast<uint8_t>(commands::Event::kComposite)) + body;
+}
+
+/**
+ * Records the threads and suspend policies of the \c ThreadStart events it
+ * recieves.
+ */
+class ThreadStartRecorder : public Handler {
+  public:
+    using Handler::Handle;
+
+    void Handle(events::ThreadStart& event) override {
+      std::lock_guard<std::mutex> l(this->lck);
+      this->threads.push_back(std::get<1>(event.GetFields()).GetValue());
+      this->policies.push_back(event.GetSuspendPolicy());
+      this->cv.notify_all();
+    }
+
+    bool WaitFor(size_t count) {
+      std::unique_lock<std::mutex> l(this->lck);
+      return this->cv.wait_for(l, std::chrono::seconds(2),
+          [&]() { return this->threads.size() >= count; });
+    }
+
+    std::mutex lck;
+    std::condition_variable cv;
+    std::vector<uint64_t> threads;
+    std::vector<JdwpSuspendPolicy> policies;
+};
+
+/**
+ * Returns whether \c packet is a \c ThreadReference \c Resume for
+ * \c thread.
+ */
+bool IsThreadResume(const string& packet, uint64_t thread) {
+  if (packet.size() != impl::kHeaderLen + sizeof(thread)) return false;
+  uint64_t thread_nbo;
+  packet.copy(reinterpret_cast<char*>(&thread_nbo), sizeof(thread_nbo),
+      impl::kHeaderLen);
+  return packet[9] == static_cast<char>(commands::CommandSet::kThreadReference)
+    && packet[10] == static_cast<char>(commands::ThreadReference::kResume) &&
+    be64toh(thread_nbo) == thread;
+}
+
+/**
+ * Builds the body of a reply to \c VersionCommand with the given major version.
+ */
+string MakeVersionReplyBody(int32_t major) {
+  string body;
+  auto append_string = [&body](const string& str) {
+    uint32_t len_nbo = htonl(str.size());
+    body.append(reinterpret_cast<char*>(&len_nbo), sizeof(len_nbo));
+    body += str;
+  };
+  auto append_int = [&body](int32_t val) {
+    uint32_t val_nbo = htonl(val);
+    body.append(reinterpret_cast<char*>(&val_nbo), sizeof(val_nbo));
+  };
+  append_string("A fake VM");
+  append_int(major);
+  append_int(0);
+  append_string("1.0");
+  append_string("Fake");
+  return body;
+}
+
+using command_packets::virtual_machine::VersionCommand;
+
+}  // namespace
+
+/**
+ * Blocks the connection's I/O thread in the first \c VmDeath event it
+ * recieves, until released.
+ */
+class StallingHandler : public Handler {
+  public:
+    using Handler::Handle;
+
+    StallingHandler() : released(release.get_future()) { }
+
+    void Handle(events::VmDeath& event) override {
+      static_cast<void>(event);
+      this->stalled.set_value();
+      this->released.wait();
+    }
+
+    std::promise<void> stalled;
+    std::promise<void> release;
+  private:
+    std::future<void> released;
+};
+
+TEST(ConTest, SendsMessages) {
+  FakeJdwpServer server;
+  JdwpCon con("127.0.0.1", server.GetPort());
+
+  auto packet =
+    std::make_unique<command_packets::virtual_machine::VersionCommand>();
+  uint32_t id = packet->GetId();
+  con.SendMessage(move(packet));
+
+  string recieved;
+  ASSERT_TRUE(server.NextPacket(recieved));
+  ASSERT_EQ(recieved.size(), impl::kHeaderLen);
+  EXPECT_EQ(FakeJdwpServer::PacketId(recieved), id);
+}
+
+TEST(ConTest, SendsMessagesInOrder) {
+  FakeJdwpServer server;
+  JdwpCon con("127.0.0.1", server.GetPort());
+
+  const size_t kMessages = 200;
+  std::vector<uint32_t> ids;
+  for (size_t i = 0; i < kMessages; i++) {
+    auto packet =
+      std::make_unique<command_packets::virtual_machine::VersionCommand>();
+    ids.push_back(packet->GetId());
+    con.SendMessage(move(packet));
+  }
+
+  for (size_t i = 0; i < kMessages; i++) {
+    string recieved;
+    ASSERT_TRUE(server.NextPacket(recieved));
+    EXPECT_EQ(FakeJdwpServer::PacketId(recieved), ids[i]);
+  }
+}
+
+TEST(ConTest, DispatchesEvents) {
+  FakeJdwpServer server;
+  JdwpCon con("127.0.0.1", server.GetPort());
+
+  auto handler = std::make_unique<VmDeathRecorder>();
+  VmDeathRecorder* recorder = handler.get();
+  con.RegisterEventHandler(move(handler));
+
+  // Make sure the connection has been accepted before sending anything.
+  con.SendMessage(
+      std::make_unique<command_packets::virtual_machine::VersionCommand>());
+  string ignored;
+  ASSERT_TRUE(server.NextPacket(ignored));
+
+  server.Send(MakeVmDeathComposite(7) + MakeVmDeathComposite(8));
+  ASSERT_TRUE(recorder->WaitFor(2));
+  std::lock_guard<std::mutex> l(recorder->lck);
+  EXPECT_EQ(recorder->ids[0], 7);
+  EXPECT_EQ(recorder->ids[1], 8);
+}
+
+namespace {
+
+/**
+ * What a \c StaticVisitor has seen, shared with the test as the connection
+ * owns the visitor itself.
+ */
+struct StaticVisits {
+  bool WaitFor(size_t count) {
+    std::unique_lock<std::mutex> l(this->lck);
+    return this->cv.wait_for(l, std::chrono::seconds(2),
+        [&]() { return this->threads.size() >= count; });
+  }
+
+  std::mutex lck;
+  std::condition_variable cv;
+  std::vector<uint64_t> threads;
+  std::vector<int32_t> deaths;
+};
+
+/**
+ * Records the events of a static handler into \c visits.
+ */
+struct StaticVisitor {
+  void operator()(events::ThreadStart& event) {
+    std::lock_guard<std::mutex> l(this->visits->lck);
+    this->visits->threads.push_back(std::get<1>(event.GetFields()).GetValue());
+    this->visits->cv.notify_all();
+  }
+  void operator()(events::VmDeath& event) {
+    std::lock_guard<std::mutex> l(this->visits->lck);
+    this->visits->deaths.push_back(std::get<0>(event.GetFields()).GetValue());
+  }
+
+  std::shared_ptr<StaticVisits> visits;
+};
+
+}  // namespace
+
+TEST(ConTest, FeedsStaticHandlers) {
+  FakeJdwpServer server;
+  JdwpCon con("127.0.0.1", server.GetPort());
+
+  auto all = std::make_shared<StaticVisits>();
+  con.RegisterStaticHandler(StaticVisitor{ all });
+  // Can't decode VmDeath, so skips those packets, but not the rest
+  auto starts = std::make_shared<StaticVisits>();
+  con.RegisterStaticHandler<StaticVisitor, std::tuple<events::ThreadStart>>(
+      StaticVisitor{ starts });
+
+  con.SendMessage(
+      std::make_unique<command_packets::virtual_machine::VersionCommand>());
+  string ignored;
+  ASSERT_TRUE(server.NextPacket(ignored));
+
+  server.Send(
+      MakeThreadStartComposite(JdwpSuspendPolicy::kNone, 0x42, { 1, 2 }) +
+      MakeVmDeathComposite(7) +
+      MakeThreadStartComposite(JdwpSuspendPolicy::kNone, 0x43));
+  ASSERT_TRUE(all->WaitFor(3));
+  ASSERT_TRUE(starts->WaitFor(3));
+  {
+    std::lock_guard<std::mutex> l(all->lck);
+    EXPECT_EQ(all->threads, std::vector<uint64_t>({ 0x42, 0x42, 0x43 }));
+    EXPECT_EQ(all->deaths, std::vector<int32_t>({ 7 }));
+  }
+  std::lock_guard<std::mutex> l(starts->lck);
+  EXPECT_EQ(starts->threads, std::vector<uint64_t>({ 0x42, 0x42, 0x43 }));
+  EXPECT_TRUE(starts->deaths.empty());
+}
+
+TEST(ConTest, BatchesLargeAndSmallMessages) {
+  JdwpConOptions options;
+  options.cork_batches = true;
+  FakeJdwpServer server;
+  JdwpCon con("127.0.0.1", server.GetPort(), options);
+
+  // Interleave messages large enough to get their own segment with small
+  // ones that get packed together, they must still arrive in order.
+  const size_t kMessages = 40;
+  std::vector<uint32_t> ids;
+  std::vector<size_t> lengths;
+  for (size_t i = 0; i < kMessages; i++) {
+    std::unique_ptr<IJdwpCommandPacket> packet;
+    if (i % 4 == 0) {
+      auto large = std::make_unique<
+        command_packets::virtual_machine::ClassesBySignatureCommand>();
+      JdwpString signature; signature << string(40 * 1024 + i, 'L');
+      std::get<0>(large->GetFields()) = signature;
+      packet = move(large);
+    } else {
+      packet = std::make_unique<VersionCommand>();
+    }
+    ids.push_back(packet->GetId());
+    lengths.push_back(packet->Serialize(con).size());
+    con.SendMessage(move(packet));
+  }
+
+  for (size_t i = 0; i < kMessages; i++) {
+    string recieved;
+    ASSERT_TRUE(server.NextPacket(recieved));
+    EXPECT_EQ(FakeJdwpServer::PacketId(recieved), ids[i]);
+    EXPECT_EQ(recieved.size(), lengths[i]);
+  }
+}
+
+TEST(ConTest, IdleConnectionSleeps) {
+  FakeJdwpServer server;
+  JdwpCon con("127.0.0.1", server.GetPort());
+
+  std::clock_t cpu_before = std::clock();
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  std::clock_t cpu_used = std::clock() - cpu_before;
+
+  // A spinning reader/writer would use roughly the whole 300ms per thread.
+  EXPECT_LT(cpu_used, CLOCKS_PER_SEC / 20);
+}
+
+TEST(ConTest, SurvivesServerDisconnect) {
+  FakeJdwpServer server;
+  JdwpCon con("127.0.0.1", server.GetPort());
+
+  server.Disconnect();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  // Sends on a closed connection are dropped rather than crashing.
+  con.SendMessage(
+      std::make_unique<command_packets::virtual_machine::VersionCommand>());
+}
+
+TEST(ConPoolTest, ManyConnectionsFewThreads) {
+  const size_t kConnections = 6;
+  JdwpConPool pool(2);
+  EXPECT_EQ(pool.ThreadCount(), static_cast<size_t>(2));
+
+  std::vector<std::unique_ptr<FakeJdwpServer>> servers;
+  std::vector<JdwpCon*> cons;
+  for (size_t i = 0; i < kConnections; i++) {
+    servers.emplace_back(new FakeJdwpServer());
+    cons.push_back(&pool.Connect("127.0.0.1", servers.back()->GetPort()));
+  }
+  EXPECT_EQ(pool.Size(), kConnections);
+
+  for (size_t i = 0; i < kConnections; i++) {
+    auto packet =
+      std::make_unique<command_packets::virtual_machine::VersionCommand>();
+    uint32_t id = packet->GetId();
+    cons[i]->SendMessage(move(packet));
+
+    string recieved;
+    ASSERT_TRUE(servers[i]->NextPacket(recieved));
+    EXPECT_EQ(FakeJdwpServer::PacketId(recieved), id);
+  }
+
+  pool.Disconnect(*cons[0]);
+  EXPECT_EQ(pool.Size(), kConnections - 1);
+}
+
+TEST(ConPoolTest, DispatchesEventsPerConnection) {
+  JdwpConPool pool(1);
+  FakeJdwpServer server1, server2;
+  JdwpCon& con1 = pool.Connect("127.0.0.1", server1.GetPort());
+  JdwpCon& con2 = pool.Connect("127.0.0.1", server2.GetPort());
+
+  auto handler1 = std::make_unique<VmDeathRecorder>();
+  auto handler2 = std::make_unique<VmDeathRecorder>();
+  VmDeathRecorder* recorder1 = handler1.get();
+  VmDeathRecorder* recorder2 = handler2.get();
+  con1.RegisterEventHandler(move(handler1));
+  con2.RegisterEventHandler(move(handler2));
+
+  for (JdwpCon* con : { &con1, &con2 }) {
+    con->SendMessage(
+        std::make_unique<command_packets::virtual_machine::VersionCommand>());
+  }
+  string ignored;
+  ASSERT_TRUE(server1.NextPacket(ignored));
+  ASSERT_TRUE(server2.NextPacket(ignored));
+
+  server1.Send(MakeVmDeathComposite(1));
+  server2.Send(MakeVmDeathComposite(2));
+  ASSERT_TRUE(recorder1->WaitFor(1));
+  ASSERT_TRUE(recorder2->WaitFor(1));
+  EXPECT_EQ(recorder1->ids[0], 1);
+  EXPECT_EQ(recorder2->ids[0], 2);
+}
+
+TEST(ConTest, AsyncReply) {
+  FakeJdwpServer server([](FakeJdwpServer& s, const string& packet) {
+    s.Send(FakeJdwpServer::MakeReply(FakeJdwpServer::PacketId(packet),
+        MakeVersionReplyBody(11)));
+    return true;
+  });
+  JdwpCon con("127.0.0.1", server.GetPort());
+
+  auto reply = con.SendAsync(std::make_unique<VersionCommand>());
+  ASSERT_EQ(reply.wait_for(std::chrono::seconds(2)),
+      std::future_status::ready);
+  auto fields = reply.get();
+  EXPECT_EQ(std::get<0>(fields).GetValue(), "A fake VM");
+  EXPECT_EQ(std::get<1>(fields).GetValue(), 11);
+  EXPECT_EQ(std::get<4>(fields).GetValue(), "Fake");
+}
+
+TEST(ConTest, AsyncReplyCallback) {
+  FakeJdwpServer server([](FakeJdwpServer& s, const string& packet) {
+    s.Send(FakeJdwpServer::MakeReply(FakeJdwpServer::PacketId(packet),
+        MakeVersionReplyBody(17)));
+    return true;
+  });
+  JdwpCon con("127.0.0.1", server.GetPort());
+
+  std::promise<int32_t> major;
+  con.SendAsync(std::make_unique<VersionCommand>(),
+      [&major](VersionCommand::ReplyFields& fields) {
+        major.set_value(std::get<1>(fields).GetValue());
+      });
+  auto major_future = major.get_future();
+  ASSERT_EQ(major_future.wait_for(std::chrono::seconds(2)),
+      std::future_status::ready);
+  EXPECT_EQ(major_future.get(), 17);
+}
+
+TEST(ConTest, AsyncErrorReply) {
+  FakeJdwpServer server([](FakeJdwpServer& s, const string& packet) {
+    s.Send(FakeJdwpServer::MakeReply(FakeJdwpServer::PacketId(packet), "",
+          static_cast<uint16_t>(JdwpError::kNotFound)));
+    return true;
+  });
+  JdwpCon con("127.0.0.1", server.GetPort());
+
+  auto reply = con.SendAsync(std::make_unique<VersionCommand>());
+  ASSERT_EQ(reply.wait_for(std::chrono::seconds(2)),
+      std::future_status::ready);
+  try {
+    reply.get();
+    FAIL() << "Expected a JdwpReplyException";
+  } catch (const JdwpReplyException& e) {
+    EXPECT_EQ(e.GetError(), JdwpError::kNotFound);
+  }
+}
+
+TEST(ConTest, ManyRepliesInFlight) {
+  FakeJdwpServer server;
+  JdwpCon con("127.0.0.1", server.GetPort());
+
+  const size_t kMessages = 300;
+  std::vector<std::future<VersionCommand::ReplyFields>> replies;
+  for (size_t i = 0; i < kMessages; i++) {
+    replies.push_back(con.SendAsync(std::make_unique<VersionCommand>()));
+  }
+  std::vector<uint32_t> ids;
+  for (size_t i = 0; i < kMessages; i++) {
+    string recieved;
+    ASSERT_TRUE(server.NextPacket(recieved));
+    ids.push_back(FakeJdwpServer::PacketId(recieved));
+  }
+
+  // Reply in the opposite order, each reply must still match its request.
+  for (size_t i = kMessages; i-- > 0;) {
+    server.Send(FakeJdwpServer::MakeReply(ids[i], MakeVersionReplyBody(i)));
+  }
+  for (size_t i = 0; i < kMessages; i++) {
+    ASSERT_EQ(replies[i].wait_for(std::chrono::seconds(2)),
+        std::future_status::ready);
+    EXPECT_EQ(std::get<1>(replies[i].get()).GetValue(),
+        static_cast<int32_t>(i));
+  }
+}
+
+TEST(ConTest, PendingReplyFailsOnDisconnect) {
+  FakeJdwpServer server;
+  JdwpCon con("127.0.0.1", server.GetPort());
+
+  auto reply = con.SendAsync(std::make_unique<VersionCommand>());
+  string ignored;
+  ASSERT_TRUE(server.NextPacket(ignored));
+  server.Disconnect();
+
+  ASSERT_EQ(reply.wait_for(std::chrono::seconds(2)),
+      std::future_status::ready);
+  EXPECT_THROW(reply.get(), JdwpException);
+
+  // Anything sent after the connection closed fails too.
+  auto late_reply = con.SendAsync(std::make_unique<VersionCommand>());
+  ASSERT_EQ(late_reply.wait_for(std::chrono::seconds(2)),
+      std::future_status::ready);
+  EXPECT_THROW(late_reply.get(), JdwpException);
+}
+
+TEST(ConTest, SendQueueBackpressure) {
+  JdwpConOptions options;
+  options.send_queue_capacity = 2;
+  FakeJdwpServer server;
+  JdwpCon con("127.0.0.1", server.GetPort(), options);
+  auto handler = std::make_unique<StallingHandler>();
+  StallingHandler* staller = handler.get();
+  auto stalled = staller->stalled.get_future();
+  con.RegisterEventHandler(move(handler));
+
+  con.SendMessage(std::make_unique<VersionCommand>());
+  string recieved;
+  ASSERT_TRUE(server.NextPacket(recieved));
+
+  // With the I/O thread stuck in the handler, nothing drains the queue
+  server.Send(MakeVmDeathComposite(1));
+  ASSERT_EQ(stalled.wait_for(std::chrono::seconds(2)),
+      std::future_status::ready);
+
+  unique_ptr<IJdwpCommandPacket> message;
+  unique_ptr<ReplyHandler> no_reply;
+  for (int i = 0; i < 2; i++) {
+    message = std::make_unique<VersionCommand>();
+    EXPECT_TRUE(con.TrySendMessage(message, no_reply));
+  }
+  message = std::make_unique<VersionCommand>();
+  uint32_t blocked_id = message->GetId();
+  EXPECT_FALSE(con.TrySendMessage(message, no_reply));
+  ASSERT_NE(message, nullptr);
+  // A rejected reply handler is handed back too
+  unique_ptr<ReplyHandler> on_reply =
+      std::make_unique<impl::PromiseReplyHandler<VersionCommand>>();
+  EXPECT_FALSE(con.TrySendMessage(message, on_reply));
+  ASSERT_NE(message, nullptr);
+  EXPECT_NE(on_reply, nullptr);
+
+  JdwpSendQueueStats stats = con.GetSendQueueStats();
+  EXPECT_EQ(stats.depth, static_cast<size_t>(2));
+  EXPECT_EQ(stats.capacity, static_cast<size_t>(2));
+  EXPECT_EQ(stats.high_water_mark, static_cast<size_t>(2));
+  EXPECT_EQ(stats.rejected_sends, static_cast<uint64_t>(2));
+
+  // A blocking send waits for room instead
+  std::thread sender([&]() { con.SendMessage(move(message)); });
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (con.GetSendQueueStats().blocked_sends == 0 &&
+      std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(con.GetSendQueueStats().blocked_sends, static_cast<uint64_t>(1));
+
+  staller->release.set_value();
+  sender.join();
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(server.NextPacket(recieved));
+  }
+  EXPECT_EQ(FakeJdwpServer::PacketId(recieved), blocked_id);
+}
+
+TEST(ConTest, KeepsReadingWhileWritesBackUp) {
+  const size_t kLarge = 256 * 1024;
+  // Well past what the socket buffers hold
+  const size_t kMessages = 128;
+  std::promise<void> stalled;
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::atomic<size_t> large_recieved{0};
+  // Stops reading in the first large message, until released
+  FakeJdwpServer server([&](FakeJdwpServer&, const string& packet) {
+    if (packet.size() < kLarge) return false;
+    if (large_recieved++ == 0) {
+      stalled.set_value();
+      released.wait();
+    }
+    return true;
+  });
+  JdwpConOptions options;
+  options.send_queue_capacity = 4;
+  JdwpCon con("127.0.0.1", server.GetPort(), options);
+  auto handler = std::make_unique<VmDeathRecorder>();
+  VmDeathRecorder* recorder = handler.get();
+  con.RegisterEventHandler(move(handler));
+
+  std::thread sender([&]() {
+    for (size_t i = 0; i < kMessages; i++) {
+      auto large = std::make_unique<
+        command_packets::virtual_machine::ClassesBySignatureCommand>();
+      JdwpString signature; signature << string(kLarge, 'L');
+      std::get<0>(large->GetFields()) = signature;
+      con.SendMessage(move(large));
+    }
+  });
+  EXPECT_EQ(stalled.get_future().wait_for(std::chrono::seconds(2)),
+      std::future_status::ready);
+  // The queue only fills up once the socket won't take any more
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (con.GetSendQueueStats().depth < options.send_queue_capacity &&
+      std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(con.GetSendQueueStats().depth, options.send_queue_capacity);
+
+  // The reactor isn't stuck writing, so events still get through
+  server.Send(MakeVmDeathComposite(3));
+  EXPECT_TRUE(recorder->WaitFor(1));
+
+  release.set_value();
+  sender.join();
+  // Messages arrive in order, so once this has, all of them have
+  auto last = std::make_unique<VersionCommand>();
+  uint32_t last_id = last->GetId();
+  con.SendMessage(move(last));
+  string recieved;
+  ASSERT_TRUE(server.NextPacket(recieved));
+  EXPECT_EQ(FakeJdwpServer::PacketId(recieved), last_id);
+  EXPECT_EQ(large_recieved, kMessages);
+}
+
+TEST(ConTest, PooledHandlerCanWaitOnReplies) {
+  FakeJdwpServer server([](FakeJdwpServer& s, const string& packet) {
+    s.Send(FakeJdwpServer::MakeReply(FakeJdwpServer::PacketId(packet),
+        MakeVersionReplyBody(11)));
+    return true;
+  });
+  JdwpConOptions options;
+  options.dispatch_threads = 2;
+  JdwpCon con("127.0.0.1", server.GetPort(), options);
+
+  /**
+   * Asks the VM for its version whenever it sees a \c VmDeath, which would
+   * deadlock if it were run on the connection's I/O thread.
+   */
+  class VersionOnDeath : public Handler {
+    public:
+      using Handler::Handle;
+
+      explicit VersionOnDeath(IJdwpCon& con) : con(con) { }
+
+      void Handle(events::VmDeath& event) override {
+        auto reply = this->con.SendAsync(std::make_unique<VersionCommand>());
+        this->major.set_value(std::get<1>(reply.get()).GetValue() +
+            std::get<0>(event.GetFields()).GetValue());
+      }
+
+      std::promise<int32_t> major;
+    private:
+      IJdwpCon& con;
+  };
+  auto handler = std::make_unique<VersionOnDeath>(con);
+  auto major = handler->major.get_future();
+  auto recorder_handler = std::make_unique<VmDeathRecorder>();
+  VmDeathRecorder* recorder = recorder_handler.get();
+  con.RegisterEventHandler(move(handler), JdwpDispatchMode::kPooled);
+  con.RegisterEventHandler(move(recorder_handler));
+
+  // Make sure the connection has been accepted before sending anything.
+  auto version = con.SendAsync(std::make_unique<VersionCommand>());
+  ASSERT_EQ(version.wait_for(std::chrono::seconds(2)),
+      std::future_status::ready);
+
+  server.Send(MakeVmDeathComposite(100));
+  ASSERT_EQ(major.wait_for(std::chrono::seconds(2)),
+      std::future_status::ready);
+  EXPECT_EQ(major.get(), 111);
+  // Inline handlers see the same events
+  ASSERT_TRUE(recorder->WaitFor(1));
+}
+
+TEST(ConTest, FetchesIdSizes) {
+  FakeJdwpServer server;
+  server.SetIdSizes({ 4, 2, 4, 4, 6 });
+  JdwpCon con("127.0.0.1", server.GetPort());
+  EXPECT_EQ(con.GetFieldIdSize(), 4);
+  EXPECT_EQ(con.GetMethodIdSize(), 2);
+  EXPECT_EQ(con.GetObjIdSize(), 4);
+  EXPECT_EQ(con.GetFrameIdSize(), 6);
+
+  /**
+   * Records the thread of each \c ThreadStart event.
+   */
+  class ThreadStartRecorder : public Handler {
+    public:
+      using Handler::Handle;
+
+      void Handle(events::ThreadStart& event) override {
+        uint64_t thread_id = 0;
+        event.GetThreadId(thread_id);
+        this->thread.set_value(thread_id);
+      }
+
+      std::promise<uint64_t> thread;
+  };
+  auto handler = std::make_unique<ThreadStartRecorder>();
+  auto thread = handler->thread.get_future();
+  con.RegisterEventHandler(move(handler));
+
+  // Events are decoded with the VM's sizes, here a 4 byte threadID
+  string body;
+  body.push_back(0);  // suspend policy
+  uint32_t count_nbo = htonl(1);
+  body.append(reinterpret_cast<char*>(&count_nbo), sizeof(count_nbo));
+  body.push_back(static_cast<char>(JdwpEventKind::kThreadStart));
+  uint32_t req_nbo = htonl(3);
+  body.append(reinterpret_cast<char*>(&req_nbo), sizeof(req_nbo));
+  uint32_t thread_nbo = htonl(0xCAFE);
+  body.append(reinterpret_cast<char*>(&thread_nbo), sizeof(thread_nbo));
+  server.Send(FakeJdwpServer::MakeHeader(impl::kHeaderLen + body.size(), 0, 0,
+        static_cast<uint8_t>(commands::CommandSet::kEvent),
+        static_cast<uint8_t>(commands::Event::kComposite)) + body);
+
+  ASSERT_EQ(thread.wait_for(std::chrono::seconds(2)),
+      std::future_status::ready);
+  EXPECT_EQ(thread.get(), static_cast<uint64_t>(0xCAFE));
+}
+
+TEST(ConTest, RejectsUnsupportedIdSizes) {
+  FakeJdwpServer server;
+  server.SetIdSizes({ 8, 8, 16, 8, 8 });
+  EXPECT_THROW(JdwpCon("127.0.0.1", server.GetPort()), JdwpException);
+}
+
+TEST(ConTest, TimesSuspensionsUntilResumed) {
+  FakeJdwpServer server;
+  JdwpCon con("127.0.0.1", server.GetPort());
+
+  auto handler = std::make_unique<ThreadStartRecorder>();
+  ThreadStartRecorder* recorder = handler.get();
+  con.RegisterEventHandler(move(handler));
+
+  con.SendMessage(std::make_unique<VersionCommand>());
+  string recieved;
+  ASSERT_TRUE(server.NextPacket(recieved));
+
+  server.Send(MakeThreadStartComposite(JdwpSuspendPolicy::kEventThread, 0x42)
+      + MakeThreadStartComposite(JdwpSuspendPolicy::kEventThread, 0x43));
+  ASSERT_TRUE(recorder->WaitFor(2));
+  // Inline handlers don't resume anything themselves
+  EXPECT_FALSE(server.NextPacket(recieved, std::chrono::milliseconds(50)));
+  EXPECT_EQ(con.GetSuspensionHistogram().outstanding, 2U);
+
+  auto resume =
+    std::make_unique<command_packets::thread_reference::ResumeCommand>();
+  std::get<0>(resume->GetFields()) << 0x42;
+  con.SendMessage(move(resume));
+  ASSERT_TRUE(server.NextPacket(recieved));
+  EXPECT_TRUE(IsThreadResume(recieved, 0x42));
+  JdwpSuspensionHistogram histogram = con.GetSuspensionHistogram();
+  EXPECT_EQ(histogram.total, 1U);
+  EXPECT_EQ(histogram.outstanding, 1U);
+
+  // Resuming the VM resumes every thread
+  con.SendMessage(
+      std::make_unique<command_packets::virtual_machine::ResumeCommand>());
+  histogram = con.GetSuspensionHistogram();
+  EXPECT_EQ(histogram.total, 2U);
+  EXPECT_EQ(histogram.outstanding, 0U);
+}
+
+TEST(ConTest, CountsTraffic) {
+  // Answers the VirtualMachine command set, and fails everything else
+  FakeJdwpServer server([](FakeJdwpServer& s, const string& packet) {
+    uint16_t error = packet[9] ==
+      static_cast<char>(commands::CommandSet::kVirtualMachine) ? 0 : 10;
+    s.Send(FakeJdwpServer::MakeReply(FakeJdwpServer::PacketId(packet),
+        error ? "" : MakeVersionReplyBody(11), error));
+    return true;
+  });
+  JdwpCon con("127.0.0.1", server.GetPort());
+  con.RegisterEventHandler(std::make_unique<VmDeathRecorder>(),
+      JdwpDispatchMode::kPooled);
+
+  for (int i = 0; i < 3; i++) {
+    con.SendAsync(std::make_unique<VersionCommand>()).get();
+  }
+  auto name =
+    std::make_unique<command_packets::thread_reference::NameCommand>();
+  std::get<0>(name->GetFields()) << 1;
+  auto failed = con.SendAsync(move(name));
+  EXPECT_THROW(failed.get(), JdwpReplyException);
+
+  server.Send(MakeVmDeathComposite(1) + MakeVmDeathComposite(2));
+  // Waits for the events to be read
+  con.SendAsync(std::make_unique<VersionCommand>()).get();
+
+  JdwpConStats stats = con.GetStats();
+  const JdwpCommandStats* version = nullptr;
+  const JdwpCommandStats* thread_name = nullptr;
+  for (const JdwpCommandStats& command : stats.commands) {
+    if (command.command_set == 1 && command.command == 1) version = &command;
+    if (command.command_set == 11 && command.command == 1) {
+      thread_name = &command;
+    }
+  }
+  ASSERT_NE(version, nullptr);
+  EXPECT_EQ(version->requests, 4U);
+  EXPECT_EQ(version->replies, 4U);
+  EXPECT_EQ(version->errors, 0U);
+  EXPECT_EQ(version->bytes_sent, 4 * impl::kHeaderLen);
+  EXPECT_EQ(version->bytes_recieved,
+      4 * (impl::kHeaderLen + MakeVersionReplyBody(11).size()));
+  EXPECT_EQ(version->latency.total, 4U);
+  ASSERT_NE(thread_name, nullptr);
+  EXPECT_EQ(thread_name->requests, 1U);
+  EXPECT_EQ(thread_name->errors, 1U);
+
+  ASSERT_EQ(stats.events.size(), 1U);
+  EXPECT_EQ(stats.events[0].kind,
+      static_cast<uint8_t>(JdwpEventKind::kVmDeath));
+  EXPECT_EQ(stats.events[0].count, 2U);
+  EXPECT_EQ(stats.event_packets, 2U);
+  EXPECT_EQ(stats.event_bytes, 2 * MakeVmDeathComposite(1).size());
+  EXPECT_EQ(stats.inline_handler_time.total, 2U);
+  // Includes the handshake and the ID sizes
+  EXPECT_GT(stats.socket.bytes_written, 5 * impl::kHeaderLen);
+  EXPECT_GT(stats.socket.bytes_read, stats.event_bytes);
+  EXPECT_EQ(stats.send_queue.depth, 0U);
+}
+
+namespace {
+
+using command_packets::method::BytecodesCommand;
+using Bytecode =
+  impl::StreamingReplyDecoder<BytecodesCommand::ReplyFields>::Element;
+
+}  // namespace
+
+TEST(ConTest, StreamsLargeReplies) {
+  FakeJdwpServer server;
+  JdwpConOptions options;
+  options.stream_replies_over = 1024;
+  JdwpCon con("127.0.0.1", server.GetPort(), options);
+
+  // Only touched on the I/O thread until the future is ready
+  std::vector<uint8_t> bytes;
+  std::atomic<size_t> seen{0};
+  auto count = con.SendStreaming(std::make_unique<BytecodesCommand>(),
+      [&](Bytecode& elt) {
+        bytes.push_back(std::get<0>(elt).GetValue());
+        seen++;
+      });
+  string request;
+  ASSERT_TRUE(server.NextPacket(request));
+
+  const size_t kBytes = 64 * 1024;
+  JdwpInt len; len << kBytes;
+  string body = len.Serialize(con);
+  for (size_t i = 0; i < kBytes; i++) body.push_back(i % 251);
+  string reply =
+    FakeJdwpServer::MakeReply(FakeJdwpServer::PacketId(request), body);
+
+  // The first half is decoded before the rest has been sent
+  server.Send(reply.substr(0, reply.size() / 2));
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (seen == 0 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_GT(seen, 0U);
+  EXPECT_LT(seen, kBytes);
+  server.Send(reply.substr(reply.size() / 2));
+
+  ASSERT_EQ(count.get(), kBytes);
+  ASSERT_EQ(bytes.size(), kBytes);
+  for (size_t i = 0; i < kBytes; i++) {
+    ASSERT_EQ(bytes[i], i % 251) << "Byte " << i;
+  }
+
+  // Small replies and errors go through the same callbacks, all at once
+  auto small = con.SendStreaming(std::make_unique<BytecodesCommand>(),
+      [&](Bytecode& elt) {
+        bytes.push_back(std::get<0>(elt).GetValue());
+      });
+  ASSERT_TRUE(server.NextPacket(request));
+  len << 1;
+  server.Send(FakeJdwpServer::MakeReply(FakeJdwpServer::PacketId(request),
+        len.Serialize(con) + "x"));
+  EXPECT_EQ(small.get(), 1U);
+  EXPECT_EQ(bytes.back(), 'x');
+
+  auto failed = con.SendStreaming(std::make_unique<BytecodesCommand>(),
+      [](Bytecode& elt) {
+        static_cast<void>(elt);
+      });
+  ASSERT_TRUE(server.NextPacket(request));
+  server.Send(FakeJdwpServer::MakeReply(FakeJdwpServer::PacketId(request),
+        string(2048, '\0'), 23));
+  EXPECT_THROW(failed.get(), JdwpReplyException);
+
+  JdwpConStats stats = con.GetStats();
+  for (const JdwpCommandStats& command : stats.commands) {
+    if (command.command_set != 6 || command.command != 3) continue;
+    EXPECT_EQ(command.replies, 3U);
+    EXPECT_EQ(command.errors, 1U);
+    EXPECT_GT(command.bytes_recieved, kBytes);
+  }
+}
+
+TEST(ConTest, FailsStreamedReplyOnDisconnect) {
+  FakeJdwpServer server;
+  JdwpConOptions options;
+  options.stream_replies_over = 1024;
+  JdwpCon con("127.0.0.1", server.GetPort(), options);
+
+  auto count = con.SendStreaming(std::make_unique<BytecodesCommand>(),
+      [](Bytecode& elt) {
+        static_cast<void>(elt);
+      });
+  string request;
+  ASSERT_TRUE(server.NextPacket(request));
+  JdwpInt len; len << 4096;
+  server.Send(FakeJdwpServer::MakeReply(FakeJdwpServer::PacketId(request),
+        len.Serialize(con) + string(4096, 'a')).substr(0, 2048));
+  server.Disconnect();
+  EXPECT_THROW(count.get(), JdwpException);
+}
+
+namespace {
+
+using command_packets::event_request::ClearCommand;
+using command_packets::event_request::SetCommand;
+
+/**
+ * Answers \c EventRequest \c Set commands the way a VM would, numbering
+ * requests from 1 on each new connection. Everything else is left for
+ * \c NextPacket.
+ */
+class EventRequestServer {
+  public:
+    EventRequestServer() :
+        server([this](FakeJdwpServer& s, const string& packet) {
+          return this->Respond(s, packet);
+        }) { }
+
+    std::mutex lck;
+    size_t connection = 0;
+    int32_t next_id = 0;
+    std::vector<int32_t> sets;
+    FakeJdwpServer server;
+  private:
+    bool Respond(FakeJdwpServer& s, const string& packet) {
+      if (packet[9] !=
+            static_cast<char>(commands::CommandSet::kEventRequest) ||
+          packet[10] != static_cast<char>(commands::EventRequest::kSet)) {
+        return false;
+      }
+      int32_t id;
+      {
+        std::lock_guard<std::mutex> l(this->lck);
+        if (s.GetConnections() != this->connection) {
+          this->connection = s.GetConnections();
+          this->next_id = 0;
+        }
+        id = ++this->next_id;
+        this->sets.push_back(id);
+      }
+      uint32_t id_nbo = htonl(id);
+      s.Send(FakeJdwpServer::MakeReply(FakeJdwpServer::PacketId(packet),
+          string(reinterpret_cast<char*>(&id_nbo), sizeof(id_nbo))));
+      return true;
+    }
+};
+
+/**
+ * Sets a \c VmDeath request on \c con, with a \c Count modifier if \c count
+ * isn't zero, and returns the ID it was given.
+ */
+int32_t SetVmDeathRequest(JdwpCon& con, int32_t count = 0) {
+  auto command = std::make_unique<SetCommand>();
+  std::get<0>(command->GetFields()) <<
+    static_cast<uint8_t>(JdwpEventKind::kVmDeath);
+  std::get<1>(command->GetFields()) << 0;
+  if (count != 0) {
+    SetCommand::Modifier modifier(std::in_place_index<0>);
+    std::get<0>(std::get<0>(modifier)) << count;
+    std::get<2>(command->GetFields()).push_back(modifier);
+  }
+  return std::get<0>(con.SendAsync(move(command)).get()).GetValue();
+}
+
+/**
+ * Clears the \c VmDeath request \c request_id on \c con, and returns the ID
+ * the server was asked to clear.
+ */
+int32_t ClearVmDeathRequest(JdwpCon& con, EventRequestServer& server,
+    int32_t request_id) {
+  auto command = std::make_unique<ClearCommand>();
+  std::get<0>(command->GetFields()) <<
+    static_cast<uint8_t>(JdwpEventKind::kVmDeath);
+  std::get<1>(command->GetFields()) << request_id;
+  con.SendMessage(move(command));
+  string packet;
+  if (!server.server.NextPacket(packet)) return -1;
+  uint32_t id_nbo;
+  packet.copy(reinterpret_cast<char*>(&id_nbo), sizeof(id_nbo),
+      impl::kHeaderLen + 1);
+  return ntohl(id_nbo);
+}
+
+/**
+ * Connects to \c server with \c JdwpConOptions::reconnect set.
+ */
+JdwpConOptions ReconnectOptions() {
+  JdwpConOptions options;
+  options.reconnect = true;
+  options.reconnect_delay = std::chrono::milliseconds(5);
+  return options;
+}
+
+/**
+ * Drops the server's end of \c con, and waits for \c con to connect again.
+ */
+void Reconnect(JdwpCon& con, FakeJdwpServer& server) {
+  auto reconnected = std::make_shared<std::promise<void>>();
+  auto once = std::make_shared<std::once_flag>();
+  con.RegisterReconnectHandler([reconnected, once]() {
+    std::call_once(*once, [&]() { reconnected->set_value(); });
+  });
+  server.Disconnect();
+  ASSERT_EQ(reconnected->get_future().wait_for(std::chrono::seconds(2)),
+      std::future_status::ready);
+}
+
+}  // namespace
+
+TEST(ConTest, ReconnectsAndRestoresEventRequests) {
+  EventRequestServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort(), ReconnectOptions());
+  auto recorder_owned = std::make_unique<VmDeathRecorder>();
+  VmDeathRecorder* recorder = recorder_owned.get();
+  con.RegisterEventHandler(move(recorder_owned));
+
+  EXPECT_EQ(SetVmDeathRequest(con), 1);
+  EXPECT_EQ(SetVmDeathRequest(con), 2);
+  EXPECT_EQ(SetVmDeathRequest(con), 3);
+  EXPECT_EQ(ClearVmDeathRequest(con, server, 1), 1);
+
+  Reconnect(con, server.server);
+  // Set after the other two are set again, as 1 and 2, so 3 is taken
+  EXPECT_EQ(SetVmDeathRequest(con), 4);
+  {
+    std::lock_guard<std::mutex> l(server.lck);
+    EXPECT_EQ(server.sets, std::vector<int32_t>({ 1, 2, 3, 1, 2, 3 }));
+  }
+
+  server.server.Send(MakeVmDeathComposite(1) + MakeVmDeathComposite(2) +
+      MakeVmDeathComposite(3));
+  ASSERT_TRUE(recorder->WaitFor(3));
+  {
+    std::lock_guard<std::mutex> l(recorder->lck);
+    EXPECT_EQ(recorder->ids, std::vector<int32_t>({ 2, 3, 4 }));
+  }
+  EXPECT_EQ(ClearVmDeathRequest(con, server, 3), 2);
+  EXPECT_EQ(ClearVmDeathRequest(con, server, 2), 1);
+
+  // The VM wasn't asked for its ID sizes again
+  EXPECT_EQ(server.server.GetIdSizesRequests(), 1U);
+  JdwpConStats stats = con.GetStats();
+  EXPECT_EQ(stats.reconnects, 1U);
+  EXPECT_EQ(stats.event_requests, 1U);
+}
+
+TEST(ConTest, ForgetsReportedCountedRequests) {
+  EventRequestServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort(), ReconnectOptions());
+  auto recorder_owned = std::make_unique<VmDeathRecorder>();
+  VmDeathRecorder* recorder = recorder_owned.get();
+  con.RegisterEventHandler(move(recorder_owned));
+
+  EXPECT_EQ(SetVmDeathRequest(con, 1), 1);
+  EXPECT_EQ(SetVmDeathRequest(con), 2);
+  server.server.Send(MakeVmDeathComposite(1));
+  ASSERT_TRUE(recorder->WaitFor(1));
+  EXPECT_EQ(con.GetStats().event_requests, 1U);
+
+  // Only the request that hasn't expired is set again
+  Reconnect(con, server.server);
+  EXPECT_EQ(SetVmDeathRequest(con), 3);
+  {
+    std::lock_guard<std::mutex> l(server.lck);
+    EXPECT_EQ(server.sets, std::vector<int32_t>({ 1, 2, 1, 2 }));
+  }
+  server.server.Send(MakeVmDeathComposite(1));
+  ASSERT_TRUE(recorder->WaitFor(2));
+  {
+    std::lock_guard<std::mutex> l(recorder->lck);
+    EXPECT_EQ(recorder->ids, std::vector<int32_t>({ 1, 2 }));
+  }
+}
+
+TEST(ConTest, StaysClosedWithoutReconnect) {
+  EventRequestServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  server.server.Disconnect();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(server.server.GetConnections(), 1U);
+  EXPECT_EQ(con.GetStats().reconnects, 0U);
+}
+
+TEST(ConTest, RejectedSendsLeaveEventRequestsAlone) {
+  EventRequestServer server;
+  JdwpConOptions options = ReconnectOptions();
+  options.send_queue_capacity = 2;
+  JdwpCon con("127.0.0.1", server.server.GetPort(), options);
+  auto handler = std::make_unique<StallingHandler>();
+  StallingHandler* staller = handler.get();
+  auto stalled = staller->stalled.get_future();
+  con.RegisterEventHandler(move(handler));
+  EXPECT_EQ(SetVmDeathRequest(con), 1);
+
+  // With the I/O thread stuck in the handler, nothing drains the queue
+  server.server.Send(MakeVmDeathComposite(1));
+  ASSERT_EQ(stalled.wait_for(std::chrono::seconds(2)),
+      std::future_status::ready);
+  unique_ptr<IJdwpCommandPacket> message;
+  unique_ptr<ReplyHandler> no_reply;
+  for (int i = 0; i < 2; i++) {
+    message = std::make_unique<VersionCommand>();
+    EXPECT_TRUE(con.TrySendMessage(message, no_reply));
+  }
+
+  auto clear = std::make_unique<ClearCommand>();
+  std::get<0>(clear->GetFields()) <<
+    static_cast<uint8_t>(JdwpEventKind::kVmDeath);
+  std::get<1>(clear->GetFields()) << 1;
+  message = move(clear);
+  EXPECT_FALSE(con.TrySendMessage(message, no_reply));
+  EXPECT_NE(message, nullptr);
+  // Nothing's handed back that wasn't passed in
+  auto set = std::make_unique<SetCommand>();
+  std::get<0>(set->GetFields()) <<
+    static_cast<uint8_t>(JdwpEventKind::kVmDeath);
+  std::get<1>(set->GetFields()) << 0;
+  message = move(set);
+  EXPECT_FALSE(con.TrySendMessage(message, no_reply));
+  EXPECT_NE(message, nullptr);
+  EXPECT_EQ(no_reply, nullptr);
+
+  staller->release.set_value();
+  string recieved;
+  for (int i = 0; i < 2; i++) {
+    ASSERT_TRUE(server.server.NextPacket(recieved));
+  }
+  // The request the rejected Clear was for is still set again
+  EXPECT_EQ(con.GetStats().event_requests, 1U);
+  Reconnect(con, server.server);
+  EXPECT_EQ(SetVmDeathRequest(con), 2);
+  std::lock_guard<std::mutex> l(server.lck);
+  EXPECT_EQ(server.sets, std::vector<int32_t>({ 1, 1, 2 }));
+}
+
+TEST(ConTest, FastResumeHandlersResumeRightAway) {
+  EventRequestServer requests;
+  FakeJdwpServer& server = requests.server;
+  JdwpCon con("127.0.0.1", server.GetPort());
+
+  auto fast_handler = std::make_unique<ThreadStartRecorder>();
+  ThreadStartRecorder* fast = fast_handler.get();
+  con.RegisterEventHandler(move(fast_handler), JdwpDispatchMode::kFastResume);
+  auto inline_handler = std::make_unique<ThreadStartRecorder>();
+  ThreadStartRecorder* recorder = inline_handler.get();
+  con.RegisterEventHandler(move(inline_handler));
+
+  // The events below are all for this request
+  ASSERT_EQ(SetVmDeathRequest(con), 1);
+  con.FastResume(1);
+  string recieved;
+
+  server.Send(MakeThreadStartComposite(JdwpSuspendPolicy::kEventThread, 0x42));
+  ASSERT_TRUE(server.NextPacket(recieved));
+  EXPECT_TRUE(IsThreadResume(recieved, 0x42));
+
+  server.Send(MakeThreadStartComposite(JdwpSuspendPolicy::kAll, 0x43));
+  ASSERT_TRUE(server.NextPacket(recieved));
+  ASSERT_EQ(recieved.size(), impl::kHeaderLen);
+  EXPECT_EQ(recieved[9],
+      static_cast<char>(commands::CommandSet::kVirtualMachine));
+  EXPECT_EQ(recieved[10],
+      static_cast<char>(commands::VirtualMachine::kResume));
+
+  // Nothing to resume
+  server.Send(MakeThreadStartComposite(JdwpSuspendPolicy::kNone, 0x44));
+  ASSERT_TRUE(recorder->WaitFor(3));
+  EXPECT_FALSE(server.NextPacket(recieved, std::chrono::milliseconds(50)));
+
+  {
+    std::lock_guard<std::mutex> l(fast->lck);
+    EXPECT_EQ(fast->threads, std::vector<uint64_t>({ 0x42, 0x43, 0x44 }));
+    EXPECT_EQ(fast->policies, std::vector<JdwpSuspendPolicy>({
+          JdwpSuspendPolicy::kEventThread, JdwpSuspendPolicy::kAll,
+          JdwpSuspendPolicy::kNone }));
+  }
+  JdwpSuspensionHistogram histogram = con.GetSuspensionHistogram();
+  EXPECT_EQ(histogram.total, 2U);
+  EXPECT_EQ(histogram.outstanding, 0U);
+  uint64_t counted = 0;
+  for (uint64_t count : histogram.counts) counted += count;
+  EXPECT_EQ(counted, 2U);
+  EXPECT_GE(histogram.sum, histogram.max);
+}
+
+TEST(ConTest, FastResumesOnlyFastResumeRequests) {
+  EventRequestServer requests;
+  FakeJdwpServer& server = requests.server;
+  JdwpCon con("127.0.0.1", server.GetPort());
+  auto fast_handler = std::make_unique<ThreadStartRecorder>();
+  ThreadStartRecorder* fast = fast_handler.get();
+  con.RegisterEventHandler(move(fast_handler), JdwpDispatchMode::kFastResume);
+
+  // One request a handler needs to stop its thread for, and one that's only
+  // logged, like a breakpoint and a logpoint at the same location
+  int32_t stops = SetVmDeathRequest(con);
+  int32_t logs = SetVmDeathRequest(con);
+  con.FastResume(logs);
+
+  server.Send(MakeThreadStartComposite(JdwpSuspendPolicy::kEventThread, 0x42,
+        { stops, logs }));
+  ASSERT_TRUE(fast->WaitFor(2));
+  string recieved;
+  EXPECT_FALSE(server.NextPacket(recieved, std::chrono::milliseconds(50)));
+  EXPECT_EQ(con.GetSuspensionHistogram().outstanding, 1U);
+
+  server.Send(MakeThreadStartComposite(JdwpSuspendPolicy::kEventThread, 0x43,
+        { logs, logs }));
+  ASSERT_TRUE(server.NextPacket(recieved));
+  EXPECT_TRUE(IsThreadResume(recieved, 0x43));
+
+  // Clearing the request drops the mark
+  ASSERT_EQ(ClearVmDeathRequest(con, requests, logs), logs);
+  server.Send(MakeThreadStartComposite(JdwpSuspendPolicy::kEventThread, 0x44,
+        { logs }));
+  ASSERT_TRUE(fast->WaitFor(5));
+  EXPECT_FALSE(server.NextPacket(recieved, std::chrono::milliseconds(50)));
+}
+
+namespace {
+
+/**
+ * Answers \c EventRequest \c Set commands like \c EventRequestServer, and
+ * looks up \c Lcom/example/Main; and \c Lcom/example/Gone; the way a VM
+ * would, with \c Main given a different ID on each connection and \c Gone
+ * only loaded on the first. Keeps the body of every \c Set command.
+ */
+class RetypingServer {
+  public:
+    RetypingServer() :
+        server(FakeJdwpServer::Scripted(
+              [this](const string& packet, string& body, uint16_t& error) {
+                return this->Respond(packet, body, error);
+              })) { }
+
+    /**
+     * Waits for the signatures of \c count types to have been asked for.
+     */
+    bool WaitForSignatures(size_t count) {
+      std::unique_lock<std::mutex> l(this->lck);
+      return this->cv.wait_for(l, std::chrono::seconds(2),
+          [&]() { return this->signatures >= count; });
+    }
+
+    /**
+     * Waits for \c count \c Set commands to have been recieved.
+     */
+    bool WaitForSets(size_t count) {
+      std::unique_lock<std::mutex> l(this->lck);
+      return this->cv.wait_for(l, std::chrono::seconds(2),
+          [&]() { return this->sets.size() >= count; });
+    }
+
+    std::mutex lck;
+    std::condition_variable cv;
+    std::vector<string> sets;
+    size_t signatures = 0;
+    FakeJdwpServer server;
+  private:
+    size_t connection = 0;
+    int32_t next_id = 0;
+
+    bool Respond(const string& packet, string& body, uint16_t& error) {
+      auto command_set = static_cast<commands::CommandSet>(packet[9]);
+      uint8_t command = packet[10];
+      std::lock_guard<std::mutex> l(this->lck);
+      size_t connection = this->server.GetConnections();
+      if (connection != this->connection) {
+        this->connection = connection;
+        this->next_id = 0;
+      }
+      uint64_t main_id = connection == 1 ? 0x10 : 0x20;
+      if (command_set == commands::CommandSet::kEventRequest &&
+          command == static_cast<uint8_t>(commands::EventRequest::kSet)) {
+        this->sets.push_back(packet.substr(impl::kHeaderLen));
+        AppendInt(body, ++this->next_id);
+      } else if (command_set == commands::CommandSet::kReferenceType &&
+          command ==
+            static_cast<uint8_t>(commands::ReferenceType::kSignature)) {
+        uint64_t type = ReadId(packet, 0);
+        if (type == main_id) {
+          AppendString(body, "Lcom/example/Main;");
+        } else if (connection == 1 && type == 0x11) {
+          AppendString(body, "Lcom/example/Gone;");
+        } else {
+          error = 21;  // INVALID_CLASS
+        }
+        this->signatures++;
+      } else if (command_set == commands::CommandSet::kVirtualMachine &&
+          command == static_cast<uint8_t>(
+            commands::VirtualMachine::kClassesBySignature)) {
+        uint32_t len = ReadInt(packet, 0);
+        string signature = packet.substr(impl::kHeaderLen + 4, len);
+        bool loaded = signature == "Lcom/example/Main;" ||
+          (connection == 1 && signature == "Lcom/example/Gone;");
+        AppendInt(body, loaded ? 1 : 0);
+        if (loaded) {
+          body.push_back(static_cast<char>(JdwpTypeTag::kClass));
+          AppendLong(body, signature == "Lcom/example/Main;" ? main_id : 0x11);
+          AppendInt(body, 7);
+        }
+      } else {
+        return false;
+      }
+      this->cv.notify_all();
+      return true;
+    }
+};
+
+/**
+ * Sets a request on \c con for events of \c kind with \c modifier, and
+ * returns the ID it was given.
+ */
+int32_t SetRequest(JdwpCon& con, JdwpEventKind kind,
+    SetCommand::Modifier modifier) {
+  auto command = std::make_unique<SetCommand>();
+  std::get<0>(command->GetFields()) << static_cast<uint8_t>(kind);
+  std::get<1>(command->GetFields()) << 0;
+  std::get<2>(command->GetFields()).push_back(std::move(modifier));
+  return std::get<0>(con.SendAsync(move(command)).get()).GetValue();
+}
+
+/**
+ * Returns a \c LocationOnly modifier for \c index in \c method of the class
+ * \c class_id.
+ */
+SetCommand::Modifier AtLocation(uint64_t class_id, uint64_t method,
+    uint64_t index) {
+  JdwpLocation location;
+  location.type = JdwpTypeTag::kClass;
+  location.class_id << class_id;
+  location.method_id << method;
+  location.index = index;
+  return SetCommand::Modifier(std::in_place_index<6>,
+      std::make_tuple(location));
+}
+
+/**
+ * Returns the body of a \c Set command for a breakpoint at \c AtLocation.
+ */
+string BreakpointBody(uint64_t class_id, uint64_t method, uint64_t index) {
+  string body;
+  body.push_back(static_cast<char>(JdwpEventKind::kBreakpoint));
+  body.push_back(0);  // suspend policy
+  AppendInt(body, 1);
+  body.push_back(7);  // LocationOnly
+  body.push_back(static_cast<char>(JdwpTypeTag::kClass));
+  AppendLong(body, class_id);
+  AppendLong(body, method);
+  AppendLong(body, index);
+  return body;
+}
+
+}  // namespace
+
+TEST(ConTest, FindsTypesAgainAfterReconnecting) {
+  RetypingServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort(), ReconnectOptions());
+
+  int32_t stays = SetRequest(con, JdwpEventKind::kBreakpoint,
+      AtLocation(0x10, 0x99, 5));
+  int32_t gone = SetRequest(con, JdwpEventKind::kBreakpoint,
+      AtLocation(0x11, 0x98, 1));
+  SetCommand::Modifier on_thread(std::in_place_index<2>);
+  std::get<0>(std::get<2>(on_thread)) << 0x30;
+  int32_t thread = SetRequest(con, JdwpEventKind::kThreadDeath, on_thread);
+  EXPECT_EQ(SetVmDeathRequest(con), 4);
+  EXPECT_EQ(std::vector<int32_t>({ stays, gone, thread }),
+      std::vector<int32_t>({ 1, 2, 3 }));
+  // Each type a request names is asked for once, when it's set
+  ASSERT_TRUE(server.WaitForSignatures(2));
+
+  Reconnect(con, server.server);
+  ASSERT_TRUE(server.WaitForSets(6));
+  {
+    std::lock_guard<std::mutex> l(server.lck);
+    // The request naming nothing goes first, then the breakpoint in the
+    // class that's still loaded, under its new ID. The other two can't be
+    // told apart on the new connection.
+    ASSERT_EQ(server.sets.size(), 6U);
+    EXPECT_EQ(server.sets[0], BreakpointBody(0x10, 0x99, 5));
+    EXPECT_EQ(static_cast<JdwpEventKind>(server.sets[4][0]),
+        JdwpEventKind::kVmDeath);
+    EXPECT_EQ(server.sets[5], BreakpointBody(0x20, 0x99, 5));
+  }
+  // One lookup each for the two signatures, and nothing else
+  string packet;
+  EXPECT_FALSE(server.server.NextPacket(packet,
+        std::chrono::milliseconds(50)));
+  EXPECT_EQ(con.GetStats().event_requests, 2U);
+
+  // The breakpoint is known by its first ID, and is found again by its new
+  // type's ID after another reconnect
+  Reconnect(con, server.server);
+  ASSERT_TRUE(server.WaitForSets(8));
+  {
+    std::lock_guard<std::mutex> l(server.lck);
+    EXPECT_EQ(server.sets[7], BreakpointBody(0x20, 0x99, 5));
+  }
+  // Replies are handled in order, so once this one is the breakpoint's is
+  EXPECT_EQ(SetVmDeathRequest(con), 3);
+  auto clear = std::make_unique<ClearCommand>();
+  std::get<0>(clear->GetFields()) <<
+    static_cast<uint8_t>(JdwpEventKind::kBreakpoint);
+  std::get<1>(clear->GetFields()) << stays;
+  con.SendMessage(move(clear));
+  ASSERT_TRUE(server.server.NextPacket(packet));
+  EXPECT_EQ(ReadInt(packet, 1), 2);
+}
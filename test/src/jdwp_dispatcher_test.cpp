@@ -0,0 +1,170 @@
+/* Provides tests for `jdwp_dispatcher.hpp` and `jdwp_dispatcher.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "jdwp_dispatcher.hpp"
+#include "jdwp_packet.hpp"
+
+using namespace roastery;
+
+using std::vector;
+
+namespace {
+
+/**
+ * Returns a \c ThreadStart event for \c request_id on \c thread_id.
+ */
+JdwpEventPool::Ptr MakeThreadStart(JdwpEventPool& pool, int32_t request_id,
+    uint64_t thread_id) {
+  JdwpEventPool::Ptr res = pool.Acquire(JdwpEventKind::kThreadStart);
+  auto& fields = static_cast<events::ThreadStart&>(*res).GetFields();
+  std::get<0>(fields) << request_id;
+  std::get<1>(fields) << thread_id;
+  return res;
+}
+
+/**
+ * Records the request IDs of the \c ThreadStart events on each thread.
+ */
+class ThreadStartRecorder : public Handler {
+  public:
+    using Handler::Handle;
+
+    void Handle(events::ThreadStart& event) override {
+      std::lock_guard<std::mutex> l(this->lck);
+      uint64_t thread_id;
+      ASSERT_TRUE(event.GetThreadId(thread_id));
+      this->by_thread[thread_id].push_back(event.GetRequestId());
+      this->count++;
+    }
+
+    std::mutex lck;
+    std::map<uint64_t, vector<int32_t>> by_thread;
+    size_t count = 0;
+};
+
+/**
+ * Blocks on the first event from \c blocked_thread until released.
+ */
+class BlockingHandler : public Handler {
+  public:
+    using Handler::Handle;
+
+    explicit BlockingHandler(uint64_t blocked_thread) :
+      blocked_thread(blocked_thread), released(release.get_future()) { }
+
+    void Handle(events::ThreadStart& event) override {
+      uint64_t thread_id;
+      event.GetThreadId(thread_id);
+      if (thread_id == this->blocked_thread) this->released.wait();
+    }
+
+    std::promise<void> release;
+  private:
+    uint64_t blocked_thread;
+    std::shared_future<void> released;
+};
+
+}  // namespace
+
+TEST(DispatcherTest, KeepsPerThreadOrder) {
+  JdwpEventPool pool;
+  JdwpEventDispatcher dispatcher(4);
+  ASSERT_EQ(dispatcher.WorkerCount(), static_cast<size_t>(4));
+  auto handler = std::make_unique<ThreadStartRecorder>();
+  ThreadStartRecorder* recorder = handler.get();
+  dispatcher.RegisterHandler(move(handler));
+
+  const int kEvents = 2000;
+  const uint64_t kThreads = 16;
+  for (int i = 0; i < kEvents; i++) {
+    dispatcher.Dispatch(MakeThreadStart(pool, i, i % kThreads));
+  }
+  dispatcher.Flush();
+
+  std::lock_guard<std::mutex> l(recorder->lck);
+  EXPECT_EQ(recorder->count, static_cast<size_t>(kEvents));
+  ASSERT_EQ(recorder->by_thread.size(), static_cast<size_t>(kThreads));
+  for (auto& entry : recorder->by_thread) {
+    const vector<int32_t>& ids = entry.second;
+    for (size_t i = 0; i < ids.size(); i++) {
+      EXPECT_EQ(ids[i], static_cast<int32_t>(i * kThreads + entry.first));
+    }
+  }
+}
+
+TEST(DispatcherTest, SlowThreadDoesNotBlockOthers) {
+  JdwpEventPool pool;
+  JdwpEventDispatcher dispatcher(4);
+  auto blocker = std::make_unique<BlockingHandler>(0);
+  BlockingHandler* blocking = blocker.get();
+  dispatcher.RegisterHandler(move(blocker));
+  auto handler = std::make_unique<ThreadStartRecorder>();
+  ThreadStartRecorder* recorder = handler.get();
+  dispatcher.RegisterHandler(move(handler));
+
+  // Thread 0's worker is stuck, but the other threads spread over the
+  // remaining workers should still be handled.
+  for (uint64_t thread = 0; thread < 64; thread++) {
+    dispatcher.Dispatch(MakeThreadStart(pool, 1, thread));
+  }
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  bool progressed = false;
+  while (!progressed && std::chrono::steady_clock::now() < deadline) {
+    {
+      std::lock_guard<std::mutex> l(recorder->lck);
+      progressed = recorder->count > 0;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_TRUE(progressed);
+  {
+    std::lock_guard<std::mutex> l(recorder->lck);
+    EXPECT_EQ(recorder->by_thread.count(0), static_cast<size_t>(0));
+  }
+
+  blocking->release.set_value();
+  dispatcher.Flush();
+  std::lock_guard<std::mutex> l(recorder->lck);
+  EXPECT_EQ(recorder->count, static_cast<size_t>(64));
+}
+
+TEST(DispatcherTest, EventsWithoutThreads) {
+  JdwpEventPool pool;
+  JdwpEventPool::Ptr death = pool.Acquire(JdwpEventKind::kVmDeath);
+  std::get<0>(static_cast<events::VmDeath&>(*death).GetFields()) << 5;
+  uint64_t thread_id = 17;
+  EXPECT_FALSE(death->GetThreadId(thread_id));
+  EXPECT_EQ(thread_id, static_cast<uint64_t>(17));
+  EXPECT_EQ(death->GetRequestId(), 5);
+
+  // Still gets delivered
+  JdwpEventDispatcher dispatcher(2);
+  dispatcher.Dispatch(move(death));
+  dispatcher.Flush();
+}
@@ -0,0 +1,152 @@
+/* Provides tests for `jdwp_event_filter.hpp` and `jdwp_event_filter.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "jdwp_event_filter.hpp"
+#include "jdwp_packet.hpp"
+
+using namespace roastery;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+using SetCommand = JdwpEventFilter::SetCommand;
+
+/**
+ * Describes a compiled request's modifiers, e.g. "thread:7 match:com.* count".
+ */
+string Describe(const SetCommand& command) {
+  string res;
+  for (auto& modifier : std::get<2>(command.GetFields())) {
+    if (!res.empty()) res += " ";
+    switch (modifier.index()) {
+      case 0:
+        res += "count";
+        break;
+      case 2:
+        res += "thread:" + std::to_string(
+            std::get<0>(std::get<2>(modifier)).GetValue());
+        break;
+      case 3:
+        res += "class:" + std::to_string(
+            std::get<0>(std::get<3>(modifier)).GetValue());
+        break;
+      case 4:
+        res += "match:" + std::get<0>(std::get<4>(modifier)).GetValue();
+        break;
+      case 5:
+        res += "exclude:" + std::get<0>(std::get<5>(modifier)).GetValue();
+        break;
+      case 6:
+        res += "location";
+        break;
+      default:
+        res += "mod" + std::to_string(modifier.index() + 1);
+    }
+  }
+  return res;
+}
+
+vector<string> DescribeAll(const JdwpEventFilter& filter) {
+  vector<string> res;
+  for (auto& command : filter.Compile()) res.push_back(Describe(*command));
+  return res;
+}
+
+}  // namespace
+
+TEST(EventFilterTest, AcceptsEverythingByDefault) {
+  auto commands = JdwpEventFilter(JdwpEventKind::kMethodEntry).Compile();
+  ASSERT_EQ(commands.size(), 1U);
+  auto& fields = commands[0]->GetFields();
+  EXPECT_EQ(std::get<0>(fields).GetValue(),
+      static_cast<uint8_t>(JdwpEventKind::kMethodEntry));
+  EXPECT_EQ(std::get<1>(fields).GetValue(), 0);
+  EXPECT_TRUE(std::get<2>(fields).empty());
+}
+
+TEST(EventFilterTest, OneRequestPerAlternative) {
+  JdwpEventFilter filter(JdwpEventKind::kMethodEntry);
+  filter.InClasses("com.acme.*")
+    .ExcludingClasses("*Test")
+    .OnThread(7)
+    .OnThread(8)
+    .OnThread(7)
+    .Count(10)
+    .Suspend(1);
+  EXPECT_EQ(DescribeAll(filter), vector<string>({
+        "thread:7 match:com.acme.* exclude:*Test count",
+        "thread:8 match:com.acme.* exclude:*Test count" }));
+  EXPECT_EQ(std::get<1>(filter.Compile()[0]->GetFields()).GetValue(), 1);
+}
+
+TEST(EventFilterTest, DropsRedundantPatterns) {
+  JdwpEventFilter filter(JdwpEventKind::kClassPrepare);
+  filter.InClasses("com.acme.util.*")
+    .InClasses("com.acme.*")
+    .InClasses("com.acme.*")
+    .InClasses("org.example.Main")
+    .ExcludingClasses("com.acme.internal.*")
+    .ExcludingClasses("com.acme.internal.impl.*")
+    .ExcludingClasses("net.*");
+  EXPECT_EQ(DescribeAll(filter), vector<string>({
+        "match:com.acme.* exclude:com.acme.internal.*",
+        "match:org.example.Main" }));
+}
+
+TEST(EventFilterTest, DropsExcludedAlternatives) {
+  JdwpEventFilter filter(JdwpEventKind::kMethodEntry);
+  filter.InClasses("com.acme.test.*")
+    .InClasses("com.acme.FooTest")
+    .InClasses("com.acme.Foo")
+    .InClass(42)
+    .ExcludingClasses("com.acme.test.*")
+    .ExcludingClasses("*Test");
+  EXPECT_EQ(DescribeAll(filter), vector<string>({
+        "match:com.acme.Foo",
+        "class:42 exclude:com.acme.test.* exclude:*Test" }));
+
+  JdwpEventFilter nothing(JdwpEventKind::kMethodEntry);
+  nothing.InClasses("com.acme.*").ExcludingClasses("*");
+  EXPECT_TRUE(nothing.Compile().empty());
+}
+
+TEST(EventFilterTest, CombinesIdFilters) {
+  JdwpLocation location;
+  location.type = JdwpTypeTag::kClass;
+  location.class_id << 1;
+  location.method_id << 2;
+  location.index = 3;
+
+  JdwpEventFilter filter(JdwpEventKind::kBreakpoint);
+  filter.AtLocation(location)
+    .AtLocation(location)
+    .OnInstance(5)
+    .OnThread(6)
+    .ForField(1, 2);
+  EXPECT_EQ(DescribeAll(filter), vector<string>({
+        "location thread:6 mod11 mod9" }));
+}
@@ -0,0 +1,369 @@
+/* Provides tests for `jdwp_heap_crawler.hpp` and `jdwp_heap_crawler.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "gtest/gtest.h"
+
+#include "fake_jdwp_server.hpp"
+#include "jdwp_con.hpp"
+#include "jdwp_heap_crawler.hpp"
+#include "jdwp_metadata_cache.hpp"
+
+using namespace roastery;
+using namespace roastery::test;
+
+using std::string;
+
+namespace {
+
+void AppendObject(string& out, uint64_t obj) {
+  out.push_back(static_cast<char>(JdwpTag::kObject));
+  AppendLong(out, obj);
+}
+
+string ReadFile(const string& path) {
+  std::ifstream in(path);
+  std::ostringstream res;
+  res << in.rdbuf();
+  return res.str();
+}
+
+using commands::CommandSet;
+using commands::ObjectReference;
+
+constexpr uint64_t kNode = 0x100;
+constexpr uint64_t kBase = 0x101;
+constexpr uint64_t kNodeArray = 0x200;
+
+/**
+ * Emulates a heap of \c com.acme.Node objects (class 0x100, extending
+ * \c com.acme.Base, 0x101), which have a \c next field and inherit an
+ * \c owner field:
+ *
+ * - 0x10, whose \c next is 0x11 and \c owner is the array 0x20.
+ * - 0x11, whose \c owner is 0x10.
+ * - 0x20, a \c Node[] (0x200) holding 0x10 and 0x12.
+ * - 0x12, which has been collected.
+ * - 0x30, whose \c next is 0x10, but isn't an instance the VM lists.
+ */
+class HeapServer {
+  public:
+    HeapServer() :
+      server(FakeJdwpServer::Scripted(
+            [this](const string& packet, string& body, uint16_t& error) {
+              return this->Respond(packet, body, error);
+            })) { }
+
+    /**
+     * Returns how many commands have been recieved from the
+     * \c ObjectReference command set.
+     */
+    int Count(ObjectReference command) {
+      std::lock_guard<std::mutex> l(this->lck);
+      return this->counts[static_cast<uint8_t>(command)];
+    }
+
+    /**
+     * Waits for \c count commands to have been recieved from the
+     * \c ObjectReference command set.
+     */
+    bool WaitFor(ObjectReference command, int count) {
+      auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::seconds(2);
+      while (this->Count(command) < count) {
+        if (std::chrono::steady_clock::now() >= deadline) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      return true;
+    }
+
+    /**
+     * Answers \c Signature commands with an empty reply, which can't be
+     * decoded.
+     */
+    std::atomic_bool truncate_signatures{false};
+    FakeJdwpServer server;
+  private:
+    std::mutex lck;
+    std::map<uint8_t, int> counts;
+
+    /**
+     * Returns the \c next and \c owner of the node \c obj.
+     */
+    static std::pair<uint64_t, uint64_t> Fields(uint64_t obj) {
+      switch (obj) {
+        case 0x10: return { 0x11, 0x20 };
+        case 0x11: return { 0, 0x10 };
+        default: return { 0x10, 0 };
+      }
+    }
+
+    bool Respond(const string& packet, string& body, uint16_t& error) {
+      uint8_t command_set = packet[9];
+      uint8_t command = packet[10];
+      std::lock_guard<std::mutex> l(this->lck);
+      if (command_set == static_cast<uint8_t>(CommandSet::kVirtualMachine)) {
+        // InstanceCounts
+        AppendInt(body, 1);
+        AppendLong(body, 3);
+      } else if (command_set ==
+          static_cast<uint8_t>(CommandSet::kReferenceType)) {
+        uint64_t type = ReadId(packet, 0);
+        switch (static_cast<commands::ReferenceType>(command)) {
+          case commands::ReferenceType::kSignature:
+            if (this->truncate_signatures) break;
+            AppendString(body, type == kNode ? "Lcom/acme/Node;" :
+                type == kBase ? "Lcom/acme/Base;" : "[Lcom/acme/Node;");
+            break;
+          case commands::ReferenceType::kInstances:
+            AppendInt(body, 2);
+            AppendObject(body, 0x10);
+            AppendObject(body, 0x11);
+            break;
+          default: {
+            // FieldsWithGeneric
+            auto append_field = [&body](uint64_t field, const string& name,
+                const string& signature, int32_t modifiers) {
+              AppendLong(body, field);
+              AppendString(body, name);
+              AppendString(body, signature);
+              AppendString(body, "");
+              AppendInt(body, modifiers);
+            };
+            if (type == kNode) {
+              AppendInt(body, 3);
+              append_field(1, "next", "Lcom/acme/Node;", 0x2);
+              append_field(2, "count", "I", 0x2);
+              append_field(3, "INSTANCES", "Ljava/util/List;", 0x8);
+            } else {
+              AppendInt(body, 1);
+              append_field(4, "owner", "Ljava/lang/Object;", 0);
+            }
+            break;
+          }
+        }
+      } else if (command_set == static_cast<uint8_t>(CommandSet::kClassType)) {
+        // Superclass
+        AppendLong(body, ReadId(packet, 0) == kNode ? kBase : 0);
+      } else if (command_set ==
+          static_cast<uint8_t>(CommandSet::kObjectReference)) {
+        this->counts[command]++;
+        uint64_t obj = ReadId(packet, 0);
+        switch (static_cast<ObjectReference>(command)) {
+          case ObjectReference::kReferenceType:
+            if (obj == 0x12) {
+              error = static_cast<uint16_t>(JdwpError::kInvalidObject);
+            } else if (obj == 0x20) {
+              body.push_back(static_cast<char>(JdwpTypeTag::kArray));
+              AppendLong(body, kNodeArray);
+            } else {
+              body.push_back(static_cast<char>(JdwpTypeTag::kClass));
+              AppendLong(body, kNode);
+            }
+            break;
+          case ObjectReference::kGetValues: {
+            int32_t count = ReadInt(packet, 8);
+            AppendInt(body, count);
+            for (int32_t i = 0; i < count; i++) {
+              uint64_t field = ReadId(packet, 12 + 8 * i);
+              AppendObject(body, field == 1 ?
+                  Fields(obj).first : Fields(obj).second);
+            }
+            break;
+          }
+          case ObjectReference::kReferringObjects:
+            if (obj == 0x10) {
+              AppendInt(body, 1);
+              AppendObject(body, 0x30);
+            } else {
+              AppendInt(body, 0);
+            }
+            break;
+          default:
+            break;
+        }
+      } else if (command_set ==
+          static_cast<uint8_t>(CommandSet::kArrayReference)) {
+        if (command ==
+            static_cast<uint8_t>(commands::ArrayReference::kLength)) {
+          AppendInt(body, 2);
+        } else {
+          EXPECT_EQ(ReadInt(packet, 8), 0);
+          EXPECT_EQ(ReadInt(packet, 12), 2);
+          body.push_back(static_cast<char>(JdwpTag::kObject));
+          AppendInt(body, 2);
+          AppendObject(body, 0x10);
+          AppendObject(body, 0x12);
+        }
+      }
+      return true;
+    }
+};
+
+/**
+ * Owns a file in the test's temporary directory, and deletes it at the end of
+ * the test.
+ */
+class TempFile {
+  public:
+    explicit TempFile(const string& name) :
+      path(testing::TempDir() + "/" + name) { }
+    ~TempFile() { unlink(this->path.c_str()); }
+
+    const string path;
+};
+
+const string kRoots =
+  "# roastery heap graph v1\n"
+  "T 100 Lcom/acme/Node;\n"
+  "C 100 3\n"
+  "R 10\n"
+  "R 11\n";
+const string kFirstBatch =
+  "E 10 11 next\n"
+  "E 10 20 owner\n"
+  "N 10 100\n"
+  "E 11 10 owner\n"
+  "N 11 100\n";
+const string kRest =
+  "T 200 [Lcom/acme/Node;\n"
+  "E 20 10 [0]\n"
+  "E 20 12 [1]\n"
+  "N 20 200\n"
+  "X 12 20\n";
+
+}  // namespace
+
+TEST(HeapCrawlerTest, CrawlsFromRootClass) {
+  HeapServer server;
+  TempFile file("crawl.graph");
+  {
+    JdwpCon con("127.0.0.1", server.server.GetPort());
+    JdwpMetadataCache cache(con);
+    JdwpHeapCrawler crawler(con, cache, file.path);
+    EXPECT_EQ(crawler.AddRootClasses({ kNode }), 2U);
+    EXPECT_EQ(crawler.GetFrontierSize(), 2U);
+
+    EXPECT_EQ(crawler.Step(), 2U);
+    EXPECT_EQ(crawler.GetFrontierSize(), 1U);
+    EXPECT_EQ(crawler.Crawl(), 4U);
+    EXPECT_EQ(crawler.GetFrontierSize(), 0U);
+    EXPECT_EQ(crawler.Step(), 0U);
+  }
+  EXPECT_EQ(ReadFile(file.path), kRoots + kFirstBatch + kRest);
+
+  // Every object is only pinned while it's being expanded
+  EXPECT_EQ(server.Count(ObjectReference::kDisableCollection), 4);
+  EXPECT_EQ(server.Count(ObjectReference::kEnableCollection), 4);
+  EXPECT_EQ(server.Count(ObjectReference::kReferringObjects), 0);
+}
+
+TEST(HeapCrawlerTest, Resumes) {
+  HeapServer server;
+  TempFile file("resume.graph");
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+  {
+    JdwpHeapCrawlOptions options;
+    options.max_objects = 2;
+    JdwpHeapCrawler crawler(con, cache, file.path, options);
+    crawler.AddRootClasses({ kNode });
+    EXPECT_EQ(crawler.Crawl(), 2U);
+    EXPECT_EQ(crawler.GetFrontierSize(), 1U);
+  }
+  EXPECT_EQ(ReadFile(file.path), kRoots + kFirstBatch);
+  // As if the crawl was killed in the middle of a write
+  {
+    std::ofstream out(file.path, std::ios::app);
+    out << "E 11 1";
+  }
+
+  JdwpHeapCrawlOptions options;
+  options.resume = true;
+  JdwpHeapCrawler crawler(con, cache, file.path, options);
+  EXPECT_EQ(crawler.GetExpandedCount(), 2U);
+  EXPECT_EQ(crawler.GetFrontierSize(), 1U);
+  // Roots already crawled aren't added again
+  crawler.AddRoot(0x10);
+  EXPECT_EQ(crawler.GetFrontierSize(), 1U);
+  EXPECT_EQ(crawler.Crawl(), 4U);
+  EXPECT_EQ(ReadFile(file.path), kRoots + kFirstBatch + kRest);
+}
+
+TEST(HeapCrawlerTest, RejectsOtherFiles) {
+  HeapServer server;
+  TempFile file("other.graph");
+  {
+    std::ofstream out(file.path);
+    out << "not a graph\n";
+  }
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+  JdwpHeapCrawlOptions options;
+  options.resume = true;
+  EXPECT_THROW(JdwpHeapCrawler(con, cache, file.path, options),
+      JdwpException);
+}
+
+TEST(HeapCrawlerTest, FollowsReferrers) {
+  HeapServer server;
+  TempFile file("referrers.graph");
+  {
+    JdwpCon con("127.0.0.1", server.server.GetPort());
+    JdwpMetadataCache cache(con);
+    JdwpHeapCrawlOptions options;
+    options.follow_referrers = true;
+    options.max_in_flight = 1;
+    JdwpHeapCrawler crawler(con, cache, file.path, options);
+    crawler.AddRoot(0x10);
+    EXPECT_EQ(crawler.Step(), 1U);
+    EXPECT_EQ(crawler.Crawl(), 5U);
+  }
+  string graph = ReadFile(file.path);
+  EXPECT_NE(graph.find("R 10\n"), string::npos);
+  EXPECT_NE(graph.find("E 30 10 ?\nN 10 100\n"), string::npos);
+  EXPECT_NE(graph.find("E 30 10 next\n"), string::npos);
+  EXPECT_NE(graph.find("N 30 100\n"), string::npos);
+  EXPECT_EQ(server.Count(ObjectReference::kReferringObjects), 4);
+}
+
+TEST(HeapCrawlerTest, UnpinsBatchWhenStepThrows) {
+  HeapServer server;
+  server.truncate_signatures = true;
+  TempFile file("throws.graph");
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+  JdwpHeapCrawler crawler(con, cache, file.path);
+  crawler.AddRoot(0x10);
+  crawler.AddRoot(0x11);
+  EXPECT_THROW(crawler.Step(), JdwpException);
+  EXPECT_EQ(server.Count(ObjectReference::kDisableCollection), 2);
+  EXPECT_TRUE(server.WaitFor(ObjectReference::kEnableCollection, 2));
+}
@@ -0,0 +1,418 @@
+/* Provides tests for `jdwp_hot_swap.hpp` and `jdwp_hot_swap.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "fake_jdwp_server.hpp"
+#include "jdwp_class_index.hpp"
+#include "jdwp_con.hpp"
+#include "jdwp_exception.hpp"
+#include "jdwp_hot_swap.hpp"
+#include "jdwp_metadata_cache.hpp"
+
+using namespace roastery;
+using namespace roastery::test;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+namespace fs = std::filesystem;
+
+void AppendLittleEndian(string& out, uint32_t val, size_t len) {
+  for (size_t i = 0; i < len; i++) out.push_back((val >> (8 * i)) & 0xFF);
+}
+
+/**
+ * Returns the contents of a class file for \c name. Only the magic number is
+ * real.
+ */
+string ClassBytes(const string& name) {
+  return "\xCA\xFE\xBA\xBE" + name;
+}
+
+/**
+ * Owns a directory in the test's temporary directory, and deletes it and
+ * everything in it at the end of the test.
+ */
+class TempDir {
+  public:
+    explicit TempDir(const string& name) :
+        path(testing::TempDir() + "/" + name) {
+      fs::remove_all(this->path);
+      fs::create_directories(this->path);
+    }
+    ~TempDir() { fs::remove_all(this->path); }
+
+    /**
+     * Writes \c contents to \c file, relative to \c path.
+     */
+    void Write(const string& file, const string& contents) {
+      fs::path full = fs::path(this->path) / file;
+      fs::create_directories(full.parent_path());
+      std::ofstream(full, std::ios::binary) << contents;
+    }
+
+    const string path;
+};
+
+/**
+ * Returns a zip file holding \c entries, stored with the compression
+ * \c method given. The contents are always stored as is, and CRCs are left
+ * zeroed, as neither is read.
+ */
+string MakeJar(const vector<std::pair<string, string>>& entries,
+    uint16_t method = 0) {
+  string res;
+  string dir;
+  for (auto& [name, contents] : entries) {
+    uint32_t offset = res.size();
+    AppendLittleEndian(res, 0x04034b50, 4);
+    AppendLittleEndian(res, 20, 2);  // version needed
+    AppendLittleEndian(res, 0, 2);  // flags
+    AppendLittleEndian(res, method, 2);
+    AppendLittleEndian(res, 0, 4);  // time and date
+    AppendLittleEndian(res, 0, 4);  // CRC
+    AppendLittleEndian(res, contents.size(), 4);
+    AppendLittleEndian(res, contents.size(), 4);
+    AppendLittleEndian(res, name.size(), 2);
+    AppendLittleEndian(res, 0, 2);  // extra
+    res += name + contents;
+
+    AppendLittleEndian(dir, 0x02014b50, 4);
+    AppendLittleEndian(dir, 20, 2);  // version made by
+    AppendLittleEndian(dir, 20, 2);  // version needed
+    AppendLittleEndian(dir, 0, 2);  // flags
+    AppendLittleEndian(dir, method, 2);
+    AppendLittleEndian(dir, 0, 4);  // time and date
+    AppendLittleEndian(dir, 0, 4);  // CRC
+    AppendLittleEndian(dir, contents.size(), 4);
+    AppendLittleEndian(dir, contents.size(), 4);
+    AppendLittleEndian(dir, name.size(), 2);
+    AppendLittleEndian(dir, 0, 2);  // extra
+    AppendLittleEndian(dir, 0, 2);  // comment
+    AppendLittleEndian(dir, 0, 2);  // disk
+    AppendLittleEndian(dir, 0, 2);  // internal attributes
+    AppendLittleEndian(dir, 0, 4);  // external attributes
+    AppendLittleEndian(dir, offset, 4);
+    dir += name;
+  }
+  uint32_t dir_offset = res.size();
+  res += dir;
+  AppendLittleEndian(res, 0x06054b50, 4);
+  AppendLittleEndian(res, 0, 2);  // disk
+  AppendLittleEndian(res, 0, 2);  // directory's disk
+  AppendLittleEndian(res, entries.size(), 2);
+  AppendLittleEndian(res, entries.size(), 2);
+  AppendLittleEndian(res, dir.size(), 4);
+  AppendLittleEndian(res, dir_offset, 4);
+  string comment = "made by hand";
+  AppendLittleEndian(res, comment.size(), 2);
+  return res + comment;
+}
+
+vector<string> Signatures(const JdwpClassFiles& classes) {
+  vector<string> res;
+  for (auto& cls : classes.GetClasses()) res.push_back(cls.signature);
+  return res;
+}
+
+/**
+ * \c Lcom/example/Main; has been loaded by two class loaders, as types 1 and
+ * 2, and \c Lcom/example/Util; by one, as type 3.
+ */
+const vector<std::pair<uint64_t, string>> kLoaded = {
+  { 1, "Lcom/example/Main;" },
+  { 2, "Lcom/example/Main;" },
+  { 3, "Lcom/example/Util;" },
+};
+
+/**
+ * Answers what the class index and hot swapper send, and keeps the body of
+ * every \c RedefineClasses command.
+ */
+class SwapServer {
+  public:
+    explicit SwapServer(bool can_redefine = true) :
+        can_redefine(can_redefine),
+        server(FakeJdwpServer::Scripted(
+              [this](const string& packet, string& body, uint16_t& error) {
+                return this->Respond(packet, body, error);
+              })) { }
+
+    /**
+     * Makes every \c RedefineClasses command fail with \c error.
+     */
+    void FailRedefines(uint16_t error) {
+      std::lock_guard<std::mutex> l(this->lck);
+      this->redefine_error = error;
+    }
+
+    int CapabilityRequests() {
+      std::lock_guard<std::mutex> l(this->lck);
+      return this->capability_requests;
+    }
+
+    vector<string> Redefines() {
+      std::lock_guard<std::mutex> l(this->lck);
+      return this->redefines;
+    }
+
+  private:
+    std::mutex lck;
+    bool can_redefine;
+    uint16_t redefine_error = 0;
+    int capability_requests = 0;
+    int event_requests = 0;
+    vector<string> redefines;
+
+  public:
+    // Declared last, as its responder uses everything above from the start
+    FakeJdwpServer server;
+
+  private:
+    bool Respond(const string& packet, string& body, uint16_t& error) {
+      using commands::CommandSet;
+      using commands::VirtualMachine;
+      uint8_t command_set = packet[9];
+      uint8_t command = packet[10];
+      std::lock_guard<std::mutex> l(this->lck);
+      if (command_set == static_cast<uint8_t>(CommandSet::kEventRequest)) {
+        AppendInt(body, ++this->event_requests);
+      } else if (command ==
+          static_cast<uint8_t>(VirtualMachine::kAllClassesWithGeneric)) {
+        AppendInt(body, kLoaded.size());
+        for (auto& [ref_type, signature] : kLoaded) {
+          body.push_back(1);
+          AppendLong(body, ref_type);
+          AppendString(body, signature);
+          AppendString(body, "");
+          AppendInt(body, 7);
+        }
+      } else if (command ==
+          static_cast<uint8_t>(VirtualMachine::kCapabilitiesNew)) {
+        this->capability_requests++;
+        for (int i = 0; i < 32; i++) {
+          body.push_back(i == 7 ? this->can_redefine : 1);
+        }
+      } else if (command ==
+          static_cast<uint8_t>(VirtualMachine::kRedefineClassese)) {
+        this->redefines.push_back(packet.substr(impl::kHeaderLen));
+        error = this->redefine_error;
+      } else {
+        return false;
+      }
+      return true;
+    }
+};
+
+/**
+ * Decodes the body of a \c RedefineClasses command into the bytes given for
+ * each type.
+ */
+std::map<uint64_t, string> DecodeRedefine(const string& body) {
+  std::map<uint64_t, string> res;
+  const char* at = body.data();
+  uint32_t count;
+  memcpy(&count, at, sizeof(count));
+  at += sizeof(count);
+  for (uint32_t i = 0; i < ntohl(count); i++) {
+    uint64_t ref_type;
+    memcpy(&ref_type, at, sizeof(ref_type));
+    at += sizeof(ref_type);
+    uint32_t len;
+    memcpy(&len, at, sizeof(len));
+    at += sizeof(len);
+    res[be64toh(ref_type)] = string(at, ntohl(len));
+    at += ntohl(len);
+  }
+  return res;
+}
+
+}  // namespace
+
+TEST(ClassFilesTest, ReadsDirectories) {
+  TempDir dir("hot_swap_dir");
+  dir.Write("com/example/Main.class", ClassBytes("Main"));
+  dir.Write("com/example/Main$Inner.class", ClassBytes("Inner"));
+  dir.Write("Top.class", ClassBytes("Top"));
+  dir.Write("com/example/notes.txt", "not a class");
+  dir.Write("module-info.class", ClassBytes("module"));
+  dir.Write("META-INF/versions/11/com/example/Main.class", ClassBytes("11"));
+
+  JdwpClassFiles classes;
+  classes.Add(dir.path);
+  EXPECT_EQ(Signatures(classes), vector<string>({ "LTop;",
+        "Lcom/example/Main$Inner;", "Lcom/example/Main;" }));
+  EXPECT_EQ(classes.GetClasses()[2].bytes, ClassBytes("Main"));
+}
+
+TEST(ClassFilesTest, RejectsWhatIsntAClass) {
+  TempDir dir("hot_swap_bad_dir");
+  dir.Write("Good.class", ClassBytes("Good"));
+  dir.Write("Empty.class", "");
+
+  JdwpClassFiles classes;
+  EXPECT_THROW(classes.AddDirectory(dir.path), JdwpException);
+  // Nothing from a directory that couldn't be read is kept
+  EXPECT_TRUE(classes.GetClasses().empty());
+  EXPECT_THROW(classes.AddDirectory(dir.path + "/missing"),
+      std::system_error);
+}
+
+TEST(ClassFilesTest, ReadsStoredJars) {
+  TempDir dir("hot_swap_jar");
+  dir.Write("app.jar", MakeJar({
+        { "META-INF/MANIFEST.MF", "Manifest-Version: 1.0\n" },
+        { "com/example/", "" },
+        { "com/example/Main.class", ClassBytes("Main") },
+        { "com/example/Util.class", ClassBytes("Util") },
+        { "app.properties", "key=value\n" },
+      }));
+
+  JdwpClassFiles classes;
+  classes.Add(dir.path + "/app.jar");
+  EXPECT_EQ(Signatures(classes),
+      vector<string>({ "Lcom/example/Main;", "Lcom/example/Util;" }));
+  EXPECT_EQ(classes.GetClasses()[1].bytes, ClassBytes("Util"));
+}
+
+TEST(ClassFilesTest, RejectsUnreadableJars) {
+  TempDir dir("hot_swap_bad_jar");
+  dir.Write("deflated.jar",
+      MakeJar({ { "com/example/Main.class", ClassBytes("Main") } }, 8));
+  dir.Write("truncated.jar",
+      MakeJar({ { "com/example/Main.class", ClassBytes("Main") } })
+      .substr(0, 40));
+  dir.Write("text.jar", MakeJar({ { "Main.class", "not a class" } }));
+
+  JdwpClassFiles classes;
+  EXPECT_THROW(classes.AddJar(dir.path + "/deflated.jar"), JdwpException);
+  EXPECT_THROW(classes.AddJar(dir.path + "/truncated.jar"), JdwpException);
+  EXPECT_THROW(classes.AddJar(dir.path + "/text.jar"), JdwpException);
+  EXPECT_THROW(classes.AddJar(dir.path + "/missing.jar"), std::system_error);
+  EXPECT_TRUE(classes.GetClasses().empty());
+}
+
+TEST(HotSwapTest, RedefinesEverythingAtOnce) {
+  TempDir dir("hot_swap_swap");
+  dir.Write("com/example/Main.class", ClassBytes("Main"));
+  dir.Write("com/example/Missing.class", ClassBytes("Missing"));
+  dir.Write("com/example/Util.class", ClassBytes("Util"));
+  TempDir other("hot_swap_swap_other");
+  other.Write("com/example/Util.class", ClassBytes("Shadowed"));
+  JdwpClassFiles classes;
+  classes.Add(dir.path);
+  classes.Add(other.path);
+
+  SwapServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpClassIndex index(con);
+  JdwpMetadataCache cache(con);
+  index.Load().get();
+  JdwpHotSwapper swapper(con, index, cache);
+
+  JdwpHotSwapResult res = swapper.Swap(classes);
+  EXPECT_EQ(res.redefined,
+      vector<string>({ "Lcom/example/Main;", "Lcom/example/Util;" }));
+  EXPECT_EQ(res.not_loaded, vector<string>({ "Lcom/example/Missing;" }));
+  EXPECT_EQ(res.types, 3U);
+
+  vector<string> redefines = server.Redefines();
+  ASSERT_EQ(redefines.size(), 1U);
+  EXPECT_EQ(DecodeRedefine(redefines[0]), (std::map<uint64_t, string>({
+          { 1, ClassBytes("Main") },
+          { 2, ClassBytes("Main") },
+          { 3, ClassBytes("Util") } })));
+
+  // The VM can't lose the ability to redefine classes, so it's asked once
+  swapper.Swap(classes);
+  EXPECT_EQ(server.Redefines().size(), 2U);
+  EXPECT_EQ(server.CapabilityRequests(), 1);
+}
+
+TEST(HotSwapTest, SendsNothingWithoutLoadedClasses) {
+  TempDir dir("hot_swap_unloaded");
+  dir.Write("com/example/Missing.class", ClassBytes("Missing"));
+  JdwpClassFiles classes;
+  classes.Add(dir.path);
+
+  SwapServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpClassIndex index(con);
+  JdwpMetadataCache cache(con);
+  index.Load().get();
+  JdwpHotSwapper swapper(con, index, cache);
+
+  JdwpHotSwapResult res = swapper.Swap(classes);
+  EXPECT_TRUE(res.redefined.empty());
+  EXPECT_EQ(res.types, 0U);
+  EXPECT_TRUE(server.Redefines().empty());
+}
+
+TEST(HotSwapTest, RequiresCapability) {
+  TempDir dir("hot_swap_incapable");
+  dir.Write("com/example/Main.class", ClassBytes("Main"));
+  JdwpClassFiles classes;
+  classes.Add(dir.path);
+
+  SwapServer server(false);
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpClassIndex index(con);
+  JdwpMetadataCache cache(con);
+  index.Load().get();
+  JdwpHotSwapper swapper(con, index, cache);
+
+  EXPECT_THROW(swapper.Swap(classes), JdwpException);
+  EXPECT_TRUE(server.Redefines().empty());
+}
+
+TEST(HotSwapTest, ReportsRejectedClasses) {
+  TempDir dir("hot_swap_rejected");
+  dir.Write("com/example/Main.class", ClassBytes("Main"));
+  JdwpClassFiles classes;
+  classes.Add(dir.path);
+
+  SwapServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpClassIndex index(con);
+  JdwpMetadataCache cache(con);
+  index.Load().get();
+  JdwpHotSwapper swapper(con, index, cache);
+
+  // ADD_METHOD_NOT_IMPLEMENTED
+  server.FailRedefines(63);
+  EXPECT_THROW(swapper.Swap(classes), JdwpReplyException);
+  EXPECT_EQ(server.Redefines().size(), 1U);
+}
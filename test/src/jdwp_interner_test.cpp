@@ -0,0 +1,92 @@
+/* Provides tests for `jdwp_interner.hpp` and `jdwp_interner.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "jdwp_interner.hpp"
+
+using namespace roastery;
+
+using std::shared_ptr;
+using std::string;
+
+TEST(InternerTest, SharesCopies) {
+  JdwpStringInterner interner;
+  shared_ptr<const string> first = interner.Intern("Ljava/lang/Object;");
+  string copy = "Ljava/lang/Object;";
+  shared_ptr<const string> second = interner.Intern(copy);
+  shared_ptr<const string> other = interner.Intern("Ljava/lang/String;");
+
+  EXPECT_EQ(first, second);
+  EXPECT_NE(first, other);
+  EXPECT_EQ(*first, "Ljava/lang/Object;");
+  EXPECT_EQ(*other, "Ljava/lang/String;");
+  EXPECT_EQ(interner.Size(), (size_t)2);
+}
+
+TEST(InternerTest, ForgetsUnused) {
+  JdwpStringInterner interner;
+  shared_ptr<const string> kept = interner.Intern("kept");
+  interner.Intern("dropped");
+  EXPECT_EQ(interner.Size(), (size_t)1);
+
+  // Interning it again makes a new copy
+  shared_ptr<const string> again = interner.Intern("dropped");
+  EXPECT_EQ(*again, "dropped");
+  EXPECT_EQ(interner.Size(), (size_t)2);
+  again.reset();
+  kept.reset();
+  EXPECT_EQ(interner.Size(), (size_t)0);
+}
+
+TEST(InternerTest, StringsOutliveTable) {
+  shared_ptr<const string> str;
+  {
+    JdwpStringInterner interner;
+    str = interner.Intern("()V");
+  }
+  EXPECT_EQ(*str, "()V");
+}
+
+TEST(InternerTest, Concurrent) {
+  JdwpStringInterner interner;
+  const size_t kThreads = 4;
+  const size_t kIters = 2000;
+  std::vector<std::thread> threads;
+  std::vector<shared_ptr<const string>> kept(kThreads);
+  for (size_t i = 0; i < kThreads; i++) {
+    threads.emplace_back([&interner, &kept, i, kIters]() {
+      // Keep dropping and interning the same few strings, so entries are
+      // forgotten while other threads intern them again
+      for (size_t j = 0; j < kIters; j++) {
+        auto str = interner.Intern("sig" + std::to_string(j % 8));
+        EXPECT_EQ(*str, "sig" + std::to_string(j % 8));
+      }
+      kept[i] = interner.Intern("shared");
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  for (size_t i = 1; i < kThreads; i++) EXPECT_EQ(kept[0], kept[i]);
+  EXPECT_EQ(interner.Size(), (size_t)1);
+}
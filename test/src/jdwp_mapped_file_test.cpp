@@ -0,0 +1,73 @@
+/* Provides tests for `jdwp_mapped_file.hpp` and `jdwp_mapped_file.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+#include <system_error>
+
+#include "gtest/gtest.h"
+
+#include "jdwp_mapped_file.hpp"
+
+using namespace roastery;
+
+using std::string;
+
+namespace {
+
+/**
+ * Writes \c contents to a file in the test's temporary directory, and
+ * deletes it at the end of the test.
+ */
+class TempFile {
+  public:
+    TempFile(const string& name, const string& contents) :
+        path(testing::TempDir() + "/" + name) {
+      std::ofstream out(this->path, std::ios::binary);
+      out << contents;
+    }
+    ~TempFile() { unlink(this->path.c_str()); }
+
+    const string path;
+};
+
+}  // namespace
+
+TEST(MappedFileTest, MapsWholeFile) {
+  string contents("mapped\0bytes", 12);
+  TempFile file("mapped.bin", contents);
+  impl::MappedFile mapping(file.path, MADV_SEQUENTIAL);
+  // Still readable once the file is gone
+  unlink(file.path.c_str());
+  EXPECT_EQ(mapping.Get(), contents);
+}
+
+TEST(MappedFileTest, EmptyFilesAreEmpty) {
+  TempFile file("empty.bin", "");
+  impl::MappedFile mapping(file.path, MADV_WILLNEED);
+  EXPECT_TRUE(mapping.Get().empty());
+}
+
+TEST(MappedFileTest, MissingFilesThrow) {
+  EXPECT_THROW(impl::MappedFile(testing::TempDir() + "/missing.bin",
+        MADV_WILLNEED), std::system_error);
+}
@@ -0,0 +1,312 @@
+/* Provides tests for `jdwp_metadata_cache.hpp` and `jdwp_metadata_cache.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "gtest/gtest.h"
+
+#include "fake_jdwp_server.hpp"
+#include "jdwp_con.hpp"
+#include "jdwp_exception.hpp"
+#include "jdwp_metadata_cache.hpp"
+#include "jdwp_packet.hpp"
+
+using namespace roastery;
+using namespace roastery::test;
+
+using std::string;
+
+namespace {
+
+/**
+ * Builds a composite event packet holding a single event of \c kind, with the
+ * given body after its kind.
+ */
+string MakeComposite(JdwpEventKind kind, const string& event) {
+  string body;
+  body.push_back(0);  // suspend policy
+  AppendInt(body, 1);
+  body.push_back(static_cast<char>(kind));
+  body += event;
+  return FakeJdwpServer::MakeHeader(impl::kHeaderLen + body.size(), 0, 0,
+      static_cast<uint8_t>(commands::CommandSet::kEvent),
+      static_cast<uint8_t>(commands::Event::kComposite)) + body;
+}
+
+/**
+ * Answers the commands the metadata cache sends, and counts how many of each
+ * it has answered.
+ */
+class MetadataServer {
+  public:
+    MetadataServer() :
+        server(FakeJdwpServer::Scripted(
+              [this](const string& packet, string& body, uint16_t& error) {
+                return this->Respond(packet, body, error);
+              })) { }
+
+    /**
+     * Returns how many commands with the given command set and command have
+     * been recieved.
+     */
+    int Count(commands::CommandSet command_set, uint8_t command) {
+      std::lock_guard<std::mutex> l(this->lck);
+      return this->counts[{ static_cast<uint8_t>(command_set), command }];
+    }
+
+    /**
+     * Makes the next reply carry an error code.
+     */
+    void FailNext() {
+      std::lock_guard<std::mutex> l(this->lck);
+      this->fail_next = true;
+    }
+
+    FakeJdwpServer server;
+  private:
+    std::mutex lck;
+    std::map<std::pair<uint8_t, uint8_t>, int> counts;
+    bool fail_next = false;
+
+    bool Respond(const string& packet, string& body, uint16_t& error) {
+      uint8_t command_set = packet[9];
+      uint8_t command = packet[10];
+      bool fail;
+      {
+        std::lock_guard<std::mutex> l(this->lck);
+        this->counts[{ command_set, command }]++;
+        fail = this->fail_next;
+        this->fail_next = false;
+      }
+      if (fail) {
+        error = 41;
+        return true;
+      }
+
+      using commands::CommandSet;
+      using commands::ReferenceType;
+      if (command_set == static_cast<uint8_t>(CommandSet::kReferenceType) &&
+          command == static_cast<uint8_t>(ReferenceType::kSignature)) {
+        AppendString(body, "LFoo;");
+      } else if (command_set ==
+          static_cast<uint8_t>(CommandSet::kReferenceType) &&
+          command == static_cast<uint8_t>(ReferenceType::kSourceFile)) {
+        AppendString(body, "Foo.java");
+      } else if (command_set == static_cast<uint8_t>(CommandSet::kMethod)) {
+        AppendLong(body, 0);
+        AppendLong(body, 10);
+        AppendInt(body, 1);
+        AppendLong(body, 0);
+        AppendInt(body, 42);
+      } else if (command_set ==
+          static_cast<uint8_t>(CommandSet::kReferenceType)) {
+        // Fields and methods, each with a single entry
+        AppendInt(body, 1);
+        AppendLong(body, 7);
+        AppendString(body, "value");
+        AppendString(body, "I");
+        AppendString(body, "");
+        AppendInt(body, 1);
+      }
+      return true;
+    }
+};
+
+/**
+ * Signals once the I/O thread has handled a class being prepared or unloaded.
+ * Registered after the cache, so the cache has seen the event by then.
+ */
+class ClassEventWaiter : public Handler {
+  public:
+    using Handler::Handle;
+
+    void Handle(events::ClassPrepare& event) override {
+      static_cast<void>(event);
+      this->seen.set_value();
+    }
+    void Handle(events::ClassUnload& event) override {
+      static_cast<void>(event);
+      this->seen.set_value();
+    }
+
+    std::promise<void> seen;
+};
+
+/**
+ * Sends \c packet from \c server, and waits for \c con to have handled it.
+ */
+void SendClassEvent(MetadataServer& server, JdwpCon& con,
+    const string& packet) {
+  auto waiter = std::make_unique<ClassEventWaiter>();
+  auto seen = waiter->seen.get_future();
+  con.RegisterEventHandler(move(waiter));
+  server.server.Send(packet);
+  ASSERT_EQ(seen.wait_for(std::chrono::seconds(2)), std::future_status::ready);
+}
+
+using commands::CommandSet;
+using commands::ReferenceType;
+
+constexpr auto kSignature = static_cast<uint8_t>(ReferenceType::kSignature);
+constexpr auto kMethods =
+  static_cast<uint8_t>(ReferenceType::kMethodsWithGeneric);
+constexpr auto kFields =
+  static_cast<uint8_t>(ReferenceType::kFieldsWithGeneric);
+constexpr auto kLineTable = static_cast<uint8_t>(commands::Method::kLineTable);
+
+}  // namespace
+
+TEST(MetadataCacheTest, AnswersRepeatLookupsLocally) {
+  MetadataServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(std::get<0>(cache.GetSignature(5).get()).GetValue(), "LFoo;");
+    EXPECT_EQ(std::get<0>(cache.GetSourceFile(5).get()).GetValue(),
+        "Foo.java");
+    EXPECT_EQ(std::get<0>(cache.GetMethods(5).get()).size(), 1U);
+    EXPECT_EQ(std::get<0>(cache.GetFields(5).get()).size(), 1U);
+    auto lines = cache.GetLineTable(5, 7).get();
+    ASSERT_EQ(std::get<2>(lines).size(), 1U);
+    EXPECT_EQ(std::get<1>(std::get<2>(lines)[0]).GetValue(), 42);
+  }
+
+  EXPECT_EQ(server.Count(CommandSet::kReferenceType, kSignature), 1);
+  EXPECT_EQ(server.Count(CommandSet::kReferenceType, kMethods), 1);
+  EXPECT_EQ(server.Count(CommandSet::kReferenceType, kFields), 1);
+  EXPECT_EQ(server.Count(CommandSet::kMethod, kLineTable), 1);
+  JdwpMetadataCacheStats stats = cache.GetStats();
+  EXPECT_EQ(stats.misses, 5U);
+  EXPECT_EQ(stats.hits, 10U);
+
+  // Other types and methods are cached separately
+  cache.GetMethods(6).get();
+  cache.GetLineTable(5, 8).get();
+  EXPECT_EQ(server.Count(CommandSet::kReferenceType, kMethods), 2);
+  EXPECT_EQ(server.Count(CommandSet::kMethod, kLineTable), 2);
+}
+
+TEST(MetadataCacheTest, ClassUnloadInvalidates) {
+  MetadataServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+
+  cache.GetSignature(5).get();
+  cache.GetMethods(5).get();
+  // Nothing is known about this type's signature, so it could be the class
+  // being unloaded
+  cache.GetMethods(6).get();
+
+  string event;
+  AppendInt(event, 0);
+  AppendString(event, "LFoo;");
+  SendClassEvent(server, con, MakeComposite(JdwpEventKind::kClassUnload,
+        event));
+
+  cache.GetMethods(5).get();
+  cache.GetMethods(6).get();
+  EXPECT_EQ(server.Count(CommandSet::kReferenceType, kMethods), 4);
+}
+
+TEST(MetadataCacheTest, ClassPrepareRecordsSignature) {
+  MetadataServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+
+  string event;
+  AppendInt(event, 0);
+  AppendLong(event, 1);  // thread
+  event.push_back(1);  // type tag
+  AppendLong(event, 9);
+  AppendString(event, "LBar;");
+  AppendInt(event, 7);  // status
+  SendClassEvent(server, con, MakeComposite(JdwpEventKind::kClassPrepare,
+        event));
+
+  EXPECT_EQ(std::get<0>(cache.GetSignature(9).get()).GetValue(), "LBar;");
+  EXPECT_EQ(server.Count(CommandSet::kReferenceType, kSignature), 0);
+}
+
+TEST(MetadataCacheTest, RedefineInvalidates) {
+  MetadataServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+
+  cache.GetFields(3).get();
+  cache.GetFields(4).get();
+
+  using command_packets::virtual_machine::RedefineClassesCommand;
+  auto redefine = std::make_unique<RedefineClassesCommand>();
+  std::get<0>(redefine->GetFields()).emplace_back();
+  std::get<0>(std::get<0>(redefine->GetFields()).back()) << 3;
+  cache.RedefineClasses(move(redefine)).get();
+
+  cache.GetFields(3).get();
+  cache.GetFields(4).get();
+  EXPECT_EQ(server.Count(CommandSet::kReferenceType, kFields), 3);
+}
+
+TEST(MetadataCacheTest, FailedLookupsAreRetried) {
+  MetadataServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+
+  server.FailNext();
+  EXPECT_THROW(cache.GetSignature(5).get(), JdwpReplyException);
+  EXPECT_EQ(std::get<0>(cache.GetSignature(5).get()).GetValue(), "LFoo;");
+  EXPECT_EQ(server.Count(CommandSet::kReferenceType, kSignature), 2);
+}
+
+TEST(MetadataCacheTest, ReconnectInvalidatesEverything) {
+  MetadataServer server;
+  JdwpConOptions options;
+  options.reconnect = true;
+  options.reconnect_delay = std::chrono::milliseconds(5);
+  JdwpCon con("127.0.0.1", server.server.GetPort(), options);
+  JdwpMetadataCache cache(con);
+
+  cache.GetSignature(5).get();
+  cache.GetMethods(5).get();
+  cache.GetLineTable(5, 7).get();
+
+  // Registered after the cache's, so called once it's done
+  auto reconnected = std::make_shared<std::promise<void>>();
+  auto once = std::make_shared<std::once_flag>();
+  con.RegisterReconnectHandler([reconnected, once]() {
+    std::call_once(*once, [&]() { reconnected->set_value(); });
+  });
+  server.server.Disconnect();
+  ASSERT_EQ(reconnected->get_future().wait_for(std::chrono::seconds(2)),
+      std::future_status::ready);
+
+  // The new connection could give the same IDs to anything
+  cache.GetSignature(5).get();
+  cache.GetMethods(5).get();
+  cache.GetLineTable(5, 7).get();
+  EXPECT_EQ(server.Count(CommandSet::kReferenceType, kSignature), 2);
+  EXPECT_EQ(server.Count(CommandSet::kReferenceType, kMethods), 2);
+  EXPECT_EQ(server.Count(CommandSet::kMethod, kLineTable), 2);
+}
@@ -19,9 +19,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <arpa/inet.h>
 
+#include <algorithm>
 #include <array>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "gtest/gtest.h"
 
@@ -40,6 +42,7 @@ namespace {
 using std::array;
 using std::ostringstream;
 using std::string;
+using std::vector;
 
 array<unsigned char, kHeaderLen> MakeCommandPacketHeader(uint32_t len,
     uint32_t id, uint8_t flags, uint8_t command_set, uint8_t command) {
@@ -168,6 +171,203 @@ TEST(PacketTest, Vector) {
 #warning Ensure each entry in the field survied, will need to happen once we have type deserialization in place
 }
 
+TEST(PacketTest, NestedBytes) {
+  // RedefineClasses has a block of bytes nested in a vector of tuples, encoded
+  // as a vector of bytes would be
+  RedefineClassesCommand packet;
+
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+
+  JdwpReferenceTypeId ref_type; ref_type << 0x1234;
+  const string class_file("\xC0\xC1\xC2");
+  JdwpBytes class_bytes;
+  class_bytes.Refer(class_file);
+  get<0>(packet.GetFields()).push_back({ ref_type, class_bytes });
+
+  string encoded = packet.Serialize(con);
+  const array<unsigned char, 4 + 8 + 4 + 3> kBody = {
+    0x00, 0x00, 0x00, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x12, 0x34,
+    0x00, 0x00, 0x00, 0x03,
+    0xC0, 0xC1, 0xC2 };
+  ASSERT_EQ(encoded.length(), kHeaderLen + kBody.size());
+  ExpectBytesEq(encoded.data() + kHeaderLen, kBody);
+}
+
+TEST(PacketTest, SetValuesHasHeaderAndCount) {
+  class_type::SetValuesCommand packet;
+
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+  EXPECT_CALL(con, GetFieldIdSizeImpl).WillRepeatedly(Return(8));
+
+  JdwpClassId class_id; class_id << 1;
+  JdwpFieldId field_id; field_id << 2;
+  JdwpInt value; value << 3;
+  get<0>(packet.GetFields()) = class_id;
+  get<1>(packet.GetFields()).push_back(
+      { field_id, JdwpValue(JdwpTag::kInt, value) });
+
+  string encoded = packet.Serialize(con);
+  ExpectBytesEq(encoded.data(), MakeCommandPacketHeader(encoded.length(),
+        packet.GetId(), static_cast<uint8_t>(JdwpFlags::kNone),
+        static_cast<uint8_t>(commands::CommandSet::kClassType),
+        static_cast<uint8_t>(commands::ClassType::kSetValues)));
+  // class ID, value count, field ID, then the untagged int
+  EXPECT_EQ(encoded.length(), kHeaderLen + 8 + 4 + 8 + 4);
+  JdwpInt count;
+  count.FromEncoded(encoded.substr(kHeaderLen + 8), con);
+  EXPECT_EQ(count.GetValue(), 1);
+}
+
+TEST(PacketTest, SerializeToAppends) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+
+  VersionCommand first;
+  AllThreadsCommand second;
+  string buffer = "prefix";
+  first.SerializeTo(buffer, con);
+  second.SerializeTo(buffer, con);
+  EXPECT_EQ(buffer, "prefix" + first.Serialize(con) + second.Serialize(con));
+
+  // A packet that fails to serialize leaves the buffer untouched.
+  MockJdwpCon bad_con;
+  EXPECT_CALL(bad_con, GetObjIdSizeImpl).WillRepeatedly(Return(16));
+  DisposeObjectsCommand bad;
+  JdwpObjId obj_id; JdwpInt ref_cnt;
+  get<0>(bad.GetFields()).push_back({ obj_id, ref_cnt });
+  string before = buffer;
+  EXPECT_THROW(bad.SerializeTo(buffer, bad_con), JdwpException);
+  EXPECT_EQ(buffer, before);
+}
+
+TEST(PacketTest, MaxEncodedSize) {
+  static_assert(impl::MaxEncodedSize<tuple<>>::bounded);
+  static_assert(impl::MaxEncodedSize<tuple<>>::value == 0);
+  static_assert(impl::MaxEncodedSize<tuple<JdwpByte, JdwpInt>>::value == 5);
+  static_assert(impl::MaxEncodedSize<tuple<JdwpObjId, JdwpLocation>>::value ==
+      8 + 1 + 8 + 8 + 8);
+  static_assert(!impl::MaxEncodedSize<tuple<JdwpInt, JdwpString>>::bounded);
+  static_assert(!impl::MaxEncodedSize<tuple<vector<JdwpInt>>>::bounded);
+}
+
+namespace {
+
+/**
+ * Builds a reply packet for \c id holding \c body, with the error code
+ * \c error.
+ */
+string MakeReplyPacket(uint32_t id, const string& body, uint16_t error = 0) {
+  auto header = MakeCommandPacketHeader(kHeaderLen + body.length(), id,
+      static_cast<uint8_t>(JdwpFlags::kReply), error >> 8, error & 0xFF);
+  return string(header.begin(), header.end()) + body;
+}
+
+}  // namespace
+
+TEST(PacketTest, DeserializeReply) {
+  VersionCommand packet;
+  MockJdwpCon con;
+
+  JdwpString description, vm_version, vm_name;
+  JdwpInt major, minor;
+  description << "A fake VM";
+  major << 1;
+  minor << 8;
+  vm_version << "1.8.0";
+  vm_name << "Fake";
+  string body = description.Serialize(con) + major.Serialize(con) +
+    minor.Serialize(con) + vm_version.Serialize(con) + vm_name.Serialize(con);
+
+  VersionCommand::ReplyFields reply =
+    packet.Deserialize(MakeReplyPacket(packet.GetId(), body), con);
+  EXPECT_EQ(get<0>(reply).GetValue(), "A fake VM");
+  EXPECT_EQ(get<1>(reply).GetValue(), 1);
+  EXPECT_EQ(get<2>(reply).GetValue(), 8);
+  EXPECT_EQ(get<3>(reply).GetValue(), "1.8.0");
+  EXPECT_EQ(get<4>(reply).GetValue(), "Fake");
+
+  string truncated = MakeReplyPacket(packet.GetId(), body);
+  truncated.pop_back();
+  EXPECT_THROW(packet.Deserialize(truncated, con), JdwpException);
+}
+
+TEST(PacketTest, DeserializeVectorReply) {
+  AllThreadsCommand packet;
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+
+  JdwpInt count; count << 3;
+  string body = count.Serialize(con);
+  for (uint64_t i = 0; i < 3; i++) {
+    JdwpThreadId thread; thread << 0xCAFE0000ull + i;
+    body += thread.Serialize(con);
+  }
+
+  auto reply = packet.Deserialize(MakeReplyPacket(packet.GetId(), body), con);
+  auto& threads = get<0>(reply);
+  ASSERT_EQ(threads.size(), static_cast<size_t>(3));
+  for (uint64_t i = 0; i < 3; i++) {
+    EXPECT_EQ(get<0>(threads[i]).GetValue(), 0xCAFE0000ull + i);
+  }
+
+  // A length claiming more elements than there are bytes is rejected.
+  count << 1000;
+  string bad = count.Serialize(con) + body.substr(JdwpInt::value_size);
+  EXPECT_THROW(packet.Deserialize(MakeReplyPacket(packet.GetId(), bad), con),
+      JdwpException);
+}
+
+TEST(PacketTest, DeserializeLazyStrings) {
+  AllClassesCommand packet;
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+
+  JdwpInt count; count << 1;
+  JdwpByte tag; tag << static_cast<uint8_t>(JdwpTypeTag::kClass);
+  JdwpReferenceTypeId ref_type; ref_type << 0x2000;
+  JdwpString signature; signature << "Ljava/lang/Object;";
+  JdwpInt status; status << 7;
+  string reply = MakeReplyPacket(packet.GetId(), count.Serialize(con) +
+      tag.Serialize(con) + ref_type.Serialize(con) +
+      signature.Serialize(con) + status.Serialize(con));
+
+  // Decoded in place, the signature still points into the reply
+  auto in_place = packet.DeserializeInPlace(reply, con);
+  auto& lazy = get<2>(get<0>(in_place)[0]);
+  EXPECT_FALSE(lazy.IsMaterialized());
+  EXPECT_EQ(lazy.GetView(), "Ljava/lang/Object;");
+  EXPECT_GE(lazy.GetView().data(), reply.data());
+  EXPECT_LT(lazy.GetView().data(), reply.data() + reply.size());
+
+  // Otherwise, the reply owns it, so it outlives the buffer
+  auto owned = packet.Deserialize(reply, con);
+  reply.assign(reply.size(), '\0');
+  auto& materialized = get<2>(get<0>(owned)[0]);
+  EXPECT_TRUE(materialized.IsMaterialized());
+  EXPECT_EQ(materialized.GetValue(), "Ljava/lang/Object;");
+  EXPECT_EQ(get<3>(get<0>(owned)[0]).GetValue(), 7);
+}
+
+TEST(PacketTest, DeserializeErrorReply) {
+  VersionCommand packet;
+  MockJdwpCon con;
+
+  string reply = MakeReplyPacket(packet.GetId(), "",
+      static_cast<uint16_t>(JdwpError::kVmDead));
+  try {
+    packet.Deserialize(reply, con);
+    FAIL() << "Expected a JdwpReplyException";
+  } catch (const JdwpReplyException& e) {
+    EXPECT_EQ(e.GetError(), JdwpError::kVmDead);
+  }
+
+  // Commands aren't replies
+  EXPECT_THROW(packet.Deserialize(packet.Serialize(con), con), JdwpException);
+}
+
 using namespace event_request;
 
 TEST(PacketTest, EventRequestSet) {
@@ -253,6 +453,153 @@ TEST(PacketTest, EventRequestSet) {
   curr_byte += new_uncaught.value_size;
 }
 
+namespace {
+
+/**
+ * Feeds \c reply to \c decoder in parts of \c part_len bytes.
+ */
+template<typename Decoder>
+void FeedInParts(Decoder& decoder, const string& reply, size_t part_len,
+    IJdwpCon& con) {
+  for (size_t at = 0; at < reply.size(); at += part_len) {
+    decoder.Feed(std::string_view(reply).substr(at, part_len),
+        at + part_len >= reply.size(), con);
+  }
+}
+
+}  // namespace
+
+TEST(PacketTest, StreamingDecodeMatchesWholeReply) {
+  AllClassesWithGenericCommand packet;
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+
+  const size_t kClasses = 5;
+  JdwpInt count; count << kClasses;
+  string body = count.Serialize(con);
+  for (size_t i = 0; i < kClasses; i++) {
+    JdwpByte tag; tag << static_cast<uint8_t>(JdwpTypeTag::kClass);
+    JdwpReferenceTypeId ref_type; ref_type << 0x2000 + i;
+    JdwpString signature; signature << "LClass" + std::to_string(i) + ";";
+    JdwpString generic; generic << (i % 2 ? "" : "<T:Ljava/lang/Object;>");
+    JdwpInt status; status << i;
+    body += tag.Serialize(con) + ref_type.Serialize(con) +
+      signature.Serialize(con) + generic.Serialize(con) +
+      status.Serialize(con);
+  }
+  string reply = MakeReplyPacket(packet.GetId(), body);
+  auto whole = get<0>(packet.Deserialize(reply, con));
+
+  // However the reply is split, each class comes out as it would whole
+  using Decoder = impl::StreamingReplyDecoder<
+    AllClassesWithGenericCommand::ReplyFields>;
+  for (size_t part_len = 1; part_len <= reply.size(); part_len++) {
+    vector<string> signatures;
+    vector<int32_t> statuses;
+    Decoder decoder(nullptr, [&](Decoder::Element& elt) {
+      signatures.emplace_back(get<2>(elt).GetView());
+      statuses.push_back(get<4>(elt).GetValue());
+    });
+    FeedInParts(decoder, reply, part_len, con);
+
+    ASSERT_EQ(decoder.GetCount(), kClasses) << "Parts of " << part_len;
+    for (size_t i = 0; i < kClasses; i++) {
+      EXPECT_EQ(signatures[i], get<2>(whole[i]).GetValue());
+      EXPECT_EQ(statuses[i], get<4>(whole[i]).GetValue());
+    }
+  }
+}
+
+TEST(PacketTest, StreamingDecodeHead) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+
+  JdwpInt constants; constants << 42;
+  JdwpInt count; count << 10;
+  string body = constants.Serialize(con) + count.Serialize(con);
+  for (uint8_t i = 0; i < 10; i++) {
+    JdwpByte b; b << i;
+    body += b.Serialize(con);
+  }
+  string reply = MakeReplyPacket(1, body);
+
+  using Decoder = impl::StreamingReplyDecoder<
+    reference_type::ConstantPoolCommand::ReplyFields>;
+  int32_t head = -1;
+  vector<uint8_t> bytes;
+  Decoder decoder([&](Decoder::Head& fields) {
+    EXPECT_TRUE(bytes.empty());
+    head = get<0>(fields).GetValue();
+  }, [&](Decoder::Element& elt) {
+    bytes.push_back(get<0>(elt).GetValue());
+  });
+  FeedInParts(decoder, reply, 1, con);
+
+  EXPECT_EQ(head, 42);
+  EXPECT_EQ(bytes, vector<uint8_t>({ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 }));
+}
+
+TEST(PacketTest, StreamingDecodeErrors) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+  using Decoder = impl::StreamingReplyDecoder<
+    reference_type::InstancesCommand::ReplyFields>;
+  auto ignore = [](Decoder::Element& elt) { static_cast<void>(elt); };
+
+  Decoder failed(nullptr, ignore);
+  string error = MakeReplyPacket(1, "",
+      static_cast<uint16_t>(JdwpError::kInvalidClass));
+  EXPECT_THROW(failed.Feed(error, true, con), JdwpReplyException);
+
+  JdwpInt count; count << 2;
+  JdwpTaggedObjectId object;
+  object.tag = JdwpTag::kObject;
+  object.obj_id << 0x10;
+  string reply = MakeReplyPacket(1, count.Serialize(con) +
+      object.Serialize(con) + object.Serialize(con));
+  Decoder truncated(nullptr, ignore);
+  truncated.Feed(std::string_view(reply).substr(0, reply.size() - 3), false,
+      con);
+  EXPECT_EQ(truncated.GetCount(), static_cast<size_t>(1));
+  EXPECT_THROW(truncated.Feed("", true, con), JdwpException);
+
+  // A length claiming more elements than the packet has room for
+  count << 1000;
+  string bad = MakeReplyPacket(1, count.Serialize(con) +
+      object.Serialize(con));
+  Decoder lying(nullptr, ignore);
+  EXPECT_THROW(lying.Feed(bad, false, con), JdwpException);
+}
+
+TEST(PacketTest, StreamingDecodeFailsMalformedElementsEarly) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+  using Decoder = impl::StreamingReplyDecoder<
+    reference_type::GetValuesCommand::ReplyFields>;
+  auto ignore = [](Decoder::Element& elt) { static_cast<void>(elt); };
+
+  // A value with no such tag is malformed however much more is to come, so
+  // it isn't held on to waiting for the rest
+  JdwpInt count; count << 2;
+  string reply = MakeReplyPacket(1, count.Serialize(con) + "Q" +
+      string(64, '\0'));
+  Decoder decoder(nullptr, ignore);
+  EXPECT_THROW(decoder.Feed(std::string_view(reply).substr(0,
+          impl::kHeaderLen + 6), false, con), JdwpException);
+
+  // One that's only cut off is
+  JdwpInt seven; seven << 7;
+  JdwpValue value(JdwpTag::kInt, seven);
+  string values = MakeReplyPacket(1, count.Serialize(con) +
+      value.Serialize(con) + value.Serialize(con));
+  Decoder cut(nullptr, ignore);
+  cut.Feed(std::string_view(values).substr(0, impl::kHeaderLen + 6), false,
+      con);
+  EXPECT_EQ(cut.GetCount(), static_cast<size_t>(0));
+  cut.Feed(std::string_view(values).substr(impl::kHeaderLen + 6), true, con);
+  EXPECT_EQ(cut.GetCount(), static_cast<size_t>(2));
+}
+
 TEST(PacketTest, CompositeEventTest) {
   MockJdwpCon con;
   EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
@@ -333,3 +680,200 @@ TEST(PacketTest, CompositeEventTest) {
   decoded_events[1]->Dispatch(h);
 }
 
+namespace {
+
+/**
+ * Returns a composite event packet holding a \c ThreadStart for each of
+ * \c threads, followed by a \c ThreadDeath for the last one, sent with the
+ * given suspend \c policy.
+ */
+string MakeThreadComposite(IJdwpCon& con, const vector<uint64_t>& threads,
+    JdwpSuspendPolicy policy = JdwpSuspendPolicy::kNone) {
+  JdwpByte suspend_policy; suspend_policy << static_cast<uint8_t>(policy);
+  JdwpInt event_count; event_count << threads.size() + 1;
+  string body = suspend_policy.Serialize(con) + event_count.Serialize(con);
+  for (size_t i = 0; i <= threads.size(); i++) {
+    JdwpByte event_kind;
+    event_kind << static_cast<uint8_t>(i < threads.size() ?
+        JdwpEventKind::kThreadStart : JdwpEventKind::kThreadDeath);
+    JdwpInt request_id; request_id << i;
+    JdwpThreadId thread_id;
+    thread_id << threads[std::min(i, threads.size() - 1)];
+    body += event_kind.Serialize(con) + request_id.Serialize(con) +
+      thread_id.Serialize(con);
+  }
+  array<uint8_t, kHeaderLen> header =
+    MakeCommandPacketHeader(body.size() + kHeaderLen, 0,
+        static_cast<uint8_t>(JdwpFlags::kNone),
+        static_cast<uint8_t>(commands::CommandSet::kEvent),
+        static_cast<uint8_t>(commands::Event::kComposite));
+  return string(header.begin(), header.end()) + body;
+}
+
+}  // namespace
+
+TEST(PacketTest, PooledCompositeEventTest) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+
+  JdwpEventPool pool;
+  vector<JdwpEventPool::Ptr> decoded;
+  for (uint64_t round = 0; round < 100; round++) {
+    auto policy = static_cast<JdwpSuspendPolicy>(round % 3);
+    string packet = MakeThreadComposite(con, { round, round + 1 }, policy);
+    IJdwpEvent::FromComposite(packet, con, pool, decoded);
+
+    ASSERT_EQ(decoded.size(), static_cast<size_t>(3));
+    ASSERT_EQ(decoded[0]->GetKind(), JdwpEventKind::kThreadStart);
+    ASSERT_EQ(decoded[1]->GetKind(), JdwpEventKind::kThreadStart);
+    ASSERT_EQ(decoded[2]->GetKind(), JdwpEventKind::kThreadDeath);
+    auto& first = static_cast<events::ThreadStart&>(*decoded[0]);
+    auto& second = static_cast<events::ThreadStart&>(*decoded[1]);
+    auto& death = static_cast<events::ThreadDeath&>(*decoded[2]);
+    EXPECT_EQ(std::get<1>(first.GetFields()).GetValue(), round);
+    EXPECT_EQ(std::get<1>(second.GetFields()).GetValue(), round + 1);
+    EXPECT_EQ(std::get<0>(death.GetFields()).GetValue(), 2);
+    EXPECT_EQ(std::get<1>(death.GetFields()).GetValue(), round + 1);
+    // Reused events pick up the policy of the packet they're decoded from
+    for (auto& event : decoded) EXPECT_EQ(event->GetSuspendPolicy(), policy);
+  }
+  decoded.clear();
+
+  // Only the first round should have needed new events
+  EXPECT_EQ(pool.GetAllocatedCount(), static_cast<size_t>(3));
+}
+
+TEST(PacketTest, PoolRetainsLimitedEvents) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+
+  JdwpEventPool pool(1);
+  vector<JdwpEventPool::Ptr> decoded;
+  string packet = MakeThreadComposite(con, { 1, 2, 3 });
+  IJdwpEvent::FromComposite(packet, con, pool, decoded);
+  IJdwpEvent::FromComposite(packet, con, pool, decoded);
+  // One ThreadStart was kept, the other two had to be allocated again
+  EXPECT_EQ(pool.GetAllocatedCount(), static_cast<size_t>(6));
+
+  // Events can also outlive the vector they were decoded into
+  JdwpEventPool::Ptr kept = move(decoded[0]);
+  decoded.clear();
+  EXPECT_EQ(kept->GetKind(), JdwpEventKind::kThreadStart);
+
+  EXPECT_THROW(pool.Acquire(static_cast<JdwpEventKind>(0)), JdwpException);
+}
+
+namespace {
+
+/**
+ * Records the threads of the \c ThreadStart and \c ThreadDeath events it's
+ * given.
+ */
+struct ThreadVisitor {
+  void operator()(events::ThreadStart& event) {
+    this->starts.push_back(std::get<1>(event.GetFields()).GetValue());
+    this->policies.push_back(event.GetSuspendPolicy());
+  }
+  void operator()(events::ThreadDeath& event) {
+    this->deaths.push_back(std::get<1>(event.GetFields()).GetValue());
+    this->policies.push_back(event.GetSuspendPolicy());
+  }
+
+  vector<uint64_t> starts;
+  vector<uint64_t> deaths;
+  vector<JdwpSuspendPolicy> policies;
+};
+
+/**
+ * Records the threads of \c ThreadDeath events only.
+ */
+struct DeathVisitor {
+  void operator()(events::ThreadDeath& event) {
+    this->seen.push_back(std::get<1>(event.GetFields()).GetValue());
+  }
+
+  vector<uint64_t> seen;
+};
+
+}  // namespace
+
+TEST(PacketTest, StaticDecoderVisitsEachEvent) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+
+  StaticEventDecoder<ThreadVisitor> decoder{ThreadVisitor()};
+  for (uint64_t round = 1; round <= 10; round++) {
+    auto policy = static_cast<JdwpSuspendPolicy>(round % 3);
+    ThreadVisitor& visited = decoder.GetVisitor();
+    visited = ThreadVisitor();
+    decoder.Decode(MakeThreadComposite(con, { round, round + 1 }, policy),
+        con);
+
+    EXPECT_EQ(visited.starts, vector<uint64_t>({ round, round + 1 }));
+    EXPECT_EQ(visited.deaths, vector<uint64_t>({ round + 1 }));
+    EXPECT_EQ(decoder.GetVisitor().policies,
+        vector<JdwpSuspendPolicy>(3, policy));
+  }
+}
+
+TEST(PacketTest, StaticDecoderSkipsUnvisitedEvents) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+
+  StaticEventDecoder<DeathVisitor> decoder{DeathVisitor()};
+  decoder.Decode(MakeThreadComposite(con, { 1, 2, 3 }), con);
+  EXPECT_EQ(decoder.GetVisitor().seen, vector<uint64_t>({ 3 }));
+}
+
+TEST(PacketTest, StaticDecoderRejectsUnknownKinds) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+
+  // Without ThreadDeath in the set, the last event can't be decoded.
+  StaticEventDecoder<ThreadVisitor, std::tuple<events::ThreadStart>>
+    decoder{ThreadVisitor()};
+  EXPECT_THROW(decoder.Decode(MakeThreadComposite(con, { 1, 2 }), con),
+      JdwpException);
+  EXPECT_EQ(decoder.GetVisitor().starts, vector<uint64_t>({ 1, 2 }));
+}
+
+TEST(PacketTest, TruncatedCompositeEventTest) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(8));
+
+  JdwpByte suspend_policy; suspend_policy << 0;
+  JdwpInt event_count; event_count << 1;
+  JdwpByte event_kind;
+  event_kind << static_cast<uint8_t>(JdwpEventKind::kThreadStart);
+  JdwpInt request_id; request_id << 1;
+  JdwpThreadId thread_id; thread_id << 1;
+  string packet_body = suspend_policy.Serialize(con) +
+    event_count.Serialize(con) + event_kind.Serialize(con) +
+    request_id.Serialize(con) + thread_id.Serialize(con);
+
+  // Every prefix that cuts off part of the event must be rejected, rather
+  // than read past the end of the packet.
+  for (size_t len = 0; len < packet_body.length(); len++) {
+    array<uint8_t, kHeaderLen> header =
+      MakeCommandPacketHeader(len + kHeaderLen, 0,
+          static_cast<uint8_t>(JdwpFlags::kNone),
+          static_cast<uint8_t>(commands::CommandSet::kEvent),
+          static_cast<uint8_t>(commands::Event::kComposite));
+    string packet =
+      string(header.begin(), header.end()) + packet_body.substr(0, len);
+    EXPECT_THROW(IJdwpEvent::FromComposite(packet, con), JdwpException)
+      << "Accepted a body of length " << len;
+
+    JdwpEventPool pool;
+    vector<JdwpEventPool::Ptr> events;
+    EXPECT_THROW(IJdwpEvent::FromComposite(packet, con, pool, events),
+        JdwpException) << "Accepted a body of length " << len;
+    EXPECT_TRUE(events.empty());
+
+    StaticEventDecoder<ThreadVisitor> decoder{ThreadVisitor()};
+    EXPECT_THROW(decoder.Decode(packet, con), JdwpException)
+      << "Accepted a body of length " << len;
+    EXPECT_TRUE(decoder.GetVisitor().starts.empty());
+  }
+}
+
@@ -0,0 +1,103 @@
+/* Provides tests for `jdwp_queue.hpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "jdwp_queue.hpp"
+
+using namespace roastery;
+
+using std::string;
+using std::vector;
+
+TEST(QueueTest, RoundsCapacityUp) {
+  EXPECT_EQ(impl::BoundedMpscQueue<int>(1).Capacity(),
+      static_cast<size_t>(2));
+  EXPECT_EQ(impl::BoundedMpscQueue<int>(5).Capacity(),
+      static_cast<size_t>(8));
+  EXPECT_EQ(impl::BoundedMpscQueue<int>(64).Capacity(),
+      static_cast<size_t>(64));
+  EXPECT_THROW(impl::BoundedMpscQueue<int>(0), std::invalid_argument);
+}
+
+TEST(QueueTest, FillsAndDrainsInOrder) {
+  impl::BoundedMpscQueue<string> queue(4);
+  string value;
+  EXPECT_TRUE(queue.Empty());
+  EXPECT_FALSE(queue.TryPop(value));
+
+  // Go around a few laps to exercise the sequence numbers
+  for (int lap = 0; lap < 3; lap++) {
+    for (int i = 0; i < 4; i++) {
+      EXPECT_TRUE(queue.TryPush(std::to_string(lap * 4 + i)));
+    }
+    string rejected = "rejected";
+    EXPECT_FALSE(queue.TryPush(std::move(rejected)));
+    EXPECT_EQ(rejected, "rejected");
+    EXPECT_EQ(queue.Size(), static_cast<size_t>(4));
+
+    for (int i = 0; i < 4; i++) {
+      ASSERT_TRUE(queue.TryPop(value));
+      EXPECT_EQ(value, std::to_string(lap * 4 + i));
+    }
+    EXPECT_FALSE(queue.TryPop(value));
+    EXPECT_TRUE(queue.Empty());
+  }
+  EXPECT_EQ(queue.HighWaterMark(), static_cast<size_t>(4));
+}
+
+TEST(QueueTest, ManyProducers) {
+  const int kProducers = 8;
+  const int kPerProducer = 20000;
+  impl::BoundedMpscQueue<int> queue(64);
+
+  vector<std::thread> producers;
+  for (int p = 0; p < kProducers; p++) {
+    producers.emplace_back([&queue, p]() {
+      for (int i = 0; i < kPerProducer; i++) {
+        while (!queue.TryPush(p * kPerProducer + i)) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+
+  // Each producer's values must come out in the order it pushed them
+  vector<int> next(kProducers, 0);
+  for (int popped = 0; popped < kProducers * kPerProducer;) {
+    int value = 0;
+    if (!queue.TryPop(value)) {
+      std::this_thread::yield();
+      continue;
+    }
+    int producer = value / kPerProducer;
+    ASSERT_EQ(value % kPerProducer, next[producer]);
+    next[producer]++;
+    popped++;
+  }
+  for (auto& producer : producers) producer.join();
+
+  EXPECT_TRUE(queue.Empty());
+  EXPECT_LE(queue.HighWaterMark(), queue.Capacity());
+}
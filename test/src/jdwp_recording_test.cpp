@@ -0,0 +1,213 @@
+/* Provides tests for `jdwp_recording.hpp` and `jdwp_recording.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "fake_jdwp_server.hpp"
+#include "jdwp_con.hpp"
+#include "jdwp_exception.hpp"
+#include "jdwp_packet.hpp"
+#include "jdwp_recording.hpp"
+
+using namespace roastery;
+using namespace roastery::test;
+
+using std::string;
+
+namespace {
+
+/**
+ * Builds a composite event packet holding a \c ClassPrepare event for
+ * \c signature, with 4 byte IDs.
+ */
+string MakeClassPrepare(int32_t ref_type, const string& signature) {
+  string body;
+  body.push_back(0);  // suspend policy
+  AppendInt(body, 1);
+  body.push_back(static_cast<char>(JdwpEventKind::kClassPrepare));
+  AppendInt(body, 0);  // request ID
+  AppendInt(body, 1);  // thread
+  body.push_back(static_cast<char>(JdwpTypeTag::kClass));
+  AppendInt(body, ref_type);
+  AppendString(body, signature);
+  AppendInt(body, 7);  // status
+  return FakeJdwpServer::MakeHeader(impl::kHeaderLen + body.size(), 0, 0,
+      static_cast<uint8_t>(commands::CommandSet::kEvent),
+      static_cast<uint8_t>(commands::Event::kComposite)) + body;
+}
+
+/**
+ * Records the signature of every class prepared.
+ */
+class PrepareRecorder : public Handler {
+  public:
+    using Handler::Handle;
+
+    void Handle(events::ClassPrepare& event) override {
+      std::lock_guard<std::mutex> l(this->lck);
+      uint64_t ref_type = std::get<3>(event.GetFields()).GetValue();
+      this->seen.push_back(std::to_string(ref_type) + " " +
+          std::get<4>(event.GetFields()).GetValue());
+      this->cv.notify_all();
+    }
+
+    /**
+     * Waits until \c count classes have been prepared.
+     */
+    bool WaitFor(size_t count) {
+      std::unique_lock<std::mutex> l(this->lck);
+      return this->cv.wait_for(l, std::chrono::seconds(2),
+          [&]() { return this->seen.size() >= count; });
+    }
+
+    std::vector<string> Seen() {
+      std::lock_guard<std::mutex> l(this->lck);
+      return this->seen;
+    }
+  private:
+    std::mutex lck;
+    std::condition_variable cv;
+    std::vector<string> seen;
+};
+
+/**
+ * Owns a file in the test's temporary directory, and deletes it at the end of
+ * the test.
+ */
+class TempFile {
+  public:
+    explicit TempFile(const string& name) :
+      path(testing::TempDir() + "/" + name) { }
+    ~TempFile() { unlink(this->path.c_str()); }
+
+    const string path;
+};
+
+/**
+ * Records three classes being prepared on a VM with 4 byte IDs to \c path.
+ */
+void MakeRecording(const string& path) {
+  FakeJdwpServer server;
+  server.SetIdSizes({ 4, 4, 4, 4, 4 });
+  JdwpCon con("127.0.0.1", server.GetPort());
+  auto recorder = std::make_shared<JdwpRecorder>(path, con);
+  auto waiter = std::make_unique<PrepareRecorder>();
+  PrepareRecorder& seen = *waiter;
+  con.RegisterEventHandler(std::move(waiter));
+
+  con.Record(recorder);
+  server.Send(MakeClassPrepare(1, "LFoo;"));
+  server.Send(MakeClassPrepare(2, "LBar;"));
+  server.Send(MakeClassPrepare(3, "LBaz;"));
+  ASSERT_TRUE(seen.WaitFor(3));
+  con.Record(nullptr);
+  recorder->Flush();
+  EXPECT_EQ(recorder->GetRecordCount(), 3U);
+}
+
+}  // namespace
+
+TEST(RecordingTest, RecordsPackets) {
+  TempFile file("records_packets.rec");
+  MakeRecording(file.path);
+
+  JdwpRecording recording(file.path);
+  EXPECT_EQ(recording.GetObjIdSize(), 4);
+  EXPECT_EQ(recording.GetFrameIdSize(), 4);
+  JdwpRecord record;
+  size_t count = 0;
+  uint64_t last = 0;
+  while (recording.Next(record)) {
+    EXPECT_EQ(record.packet, MakeClassPrepare(count + 1,
+          count == 0 ? "LFoo;" : count == 1 ? "LBar;" : "LBaz;"));
+    EXPECT_GE(record.timestamp_ns, last);
+    last = record.timestamp_ns;
+    count++;
+  }
+  EXPECT_EQ(count, 3U);
+
+  recording.Rewind();
+  EXPECT_TRUE(recording.Next(record));
+}
+
+TEST(RecordingTest, ReplaysEvents) {
+  TempFile file("replays_events.rec");
+  MakeRecording(file.path);
+
+  JdwpReplayCon con(file.path);
+  auto inline_handler = std::make_unique<PrepareRecorder>();
+  PrepareRecorder& inline_seen = *inline_handler;
+  con.RegisterEventHandler(std::move(inline_handler));
+  auto pooled_handler = std::make_unique<PrepareRecorder>();
+  PrepareRecorder& pooled_seen = *pooled_handler;
+  con.RegisterEventHandler(std::move(pooled_handler),
+      JdwpDispatchMode::kPooled);
+
+  EXPECT_EQ(con.Replay(), 3U);
+  std::vector<string> expected({ "1 LFoo;", "2 LBar;", "3 LBaz;" });
+  EXPECT_EQ(inline_seen.Seen(), expected);
+  EXPECT_EQ(pooled_seen.Seen(), expected);
+
+  // Replaying again starts from the beginning
+  EXPECT_EQ(con.Replay(), 3U);
+  EXPECT_EQ(inline_seen.Seen().size(), 6U);
+
+  auto reply = con.SendAsync(
+      std::make_unique<command_packets::virtual_machine::VersionCommand>());
+  EXPECT_THROW(reply.get(), JdwpException);
+}
+
+TEST(RecordingTest, StopsAtTruncatedRecord) {
+  TempFile file("truncated.rec");
+  MakeRecording(file.path);
+  {
+    std::ifstream in(file.path, std::ios::binary);
+    string contents((std::istreambuf_iterator<char>(in)),
+        std::istreambuf_iterator<char>());
+    contents.resize(contents.size() - 3);
+    std::ofstream out(file.path, std::ios::binary | std::ios::trunc);
+    out << contents;
+  }
+
+  JdwpReplayCon con(file.path);
+  EXPECT_EQ(con.Replay(), 2U);
+}
+
+TEST(RecordingTest, RejectsOtherFiles) {
+  TempFile file("not_a_recording.rec");
+  {
+    std::ofstream out(file.path);
+    out << "This is not a recording";
+  }
+  EXPECT_THROW(JdwpRecording recording(file.path), JdwpException);
+  EXPECT_THROW(JdwpRecording recording(file.path + ".missing"),
+      std::system_error);
+}
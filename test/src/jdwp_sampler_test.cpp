@@ -0,0 +1,221 @@
+/* Provides tests for `jdwp_sampler.hpp` and `jdwp_sampler.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+
+#include "gtest/gtest.h"
+
+#include "fake_jdwp_server.hpp"
+#include "jdwp_con.hpp"
+#include "jdwp_metadata_cache.hpp"
+#include "jdwp_sampler.hpp"
+
+using namespace roastery;
+using namespace roastery::test;
+
+using std::string;
+
+namespace {
+
+void AppendFrame(string& out, uint64_t cls, uint64_t method, uint64_t index) {
+  AppendLong(out, 0);  // frame ID
+  out.push_back(static_cast<char>(JdwpTypeTag::kClass));
+  AppendLong(out, cls);
+  AppendLong(out, method);
+  AppendLong(out, index);
+}
+
+using commands::CommandSet;
+using commands::ThreadReference;
+
+/**
+ * Emulates a VM with two threads: \c main (1), in \c com.acme.Foo.work called
+ * from \c com.acme.Foo.run, and \c worker (2), in \c com.acme.Bar.loop. Every
+ * method's lines start at indices 0 and 4, and are numbered ten times its
+ * ID, plus one for the second.
+ */
+class SamplerServer {
+  public:
+    /**
+     * Creates a VM that only gives the frames of suspended threads if
+     * \c require_suspend.
+     */
+    explicit SamplerServer(bool require_suspend) :
+      server(FakeJdwpServer::Scripted(
+            [this](const string& packet, string& body, uint16_t& error) {
+              return this->Respond(packet, body, error);
+            })), require_suspend(require_suspend) { }
+
+    /**
+     * Returns how many commands have been recieved from the
+     * \c ThreadReference command set.
+     */
+    int Count(ThreadReference command) {
+      std::lock_guard<std::mutex> l(this->lck);
+      return this->counts[static_cast<uint8_t>(command)];
+    }
+
+    FakeJdwpServer server;
+  private:
+    std::mutex lck;
+    std::map<uint8_t, int> counts;
+    std::set<uint64_t> suspended;
+    bool require_suspend;
+
+    bool Respond(const string& packet, string& body, uint16_t& error) {
+      uint8_t command_set = packet[9];
+      uint8_t command = packet[10];
+      std::lock_guard<std::mutex> l(this->lck);
+      if (command_set == static_cast<uint8_t>(CommandSet::kVirtualMachine)) {
+        // AllThreads
+        AppendInt(body, 2);
+        AppendLong(body, 1);
+        AppendLong(body, 2);
+      } else if (command_set ==
+          static_cast<uint8_t>(CommandSet::kThreadReference)) {
+        this->counts[command]++;
+        uint64_t thread = ReadId(packet, 0);
+        switch (static_cast<ThreadReference>(command)) {
+          case ThreadReference::kName:
+            AppendString(body, thread == 1 ? "main" : "worker");
+            break;
+          case ThreadReference::kSuspend:
+            this->suspended.insert(thread);
+            break;
+          case ThreadReference::kResume:
+            this->suspended.erase(thread);
+            break;
+          case ThreadReference::kFrames:
+            if (this->require_suspend && this->suspended.count(thread) == 0) {
+              error = static_cast<uint16_t>(JdwpError::kThreadNotSuspended);
+              return true;
+            }
+            if (thread == 1) {
+              AppendInt(body, 2);
+              AppendFrame(body, 100, 11, 5);
+              AppendFrame(body, 100, 10, 0);
+            } else {
+              AppendInt(body, 1);
+              AppendFrame(body, 200, 20, 3);
+            }
+            break;
+          default:
+            break;
+        }
+      } else if (command_set ==
+          static_cast<uint8_t>(CommandSet::kReferenceType)) {
+        uint64_t cls = ReadId(packet, 0);
+        if (command == static_cast<uint8_t>(
+              commands::ReferenceType::kSignature)) {
+          AppendString(body, cls == 100 ? "Lcom/acme/Foo;" : "Lcom/acme/Bar;");
+        } else {
+          // MethodsWithGeneric
+          auto append_method = [&body](uint64_t method, const string& name) {
+            AppendLong(body, method);
+            AppendString(body, name);
+            AppendString(body, "()V");
+            AppendString(body, "");
+            AppendInt(body, 1);
+          };
+          if (cls == 100) {
+            AppendInt(body, 2);
+            append_method(10, "run");
+            append_method(11, "work");
+          } else {
+            AppendInt(body, 1);
+            append_method(20, "loop");
+          }
+        }
+      } else if (command_set == static_cast<uint8_t>(CommandSet::kMethod)) {
+        // LineTable
+        int32_t method = ReadId(packet, 8);
+        AppendLong(body, 0);
+        AppendLong(body, 10);
+        AppendInt(body, 2);
+        AppendLong(body, 0);
+        AppendInt(body, method * 10);
+        AppendLong(body, 4);
+        AppendInt(body, method * 10 + 1);
+      }
+      return true;
+    }
+};
+
+}  // namespace
+
+TEST(SamplerTest, WritesFoldedStacks) {
+  SamplerServer server(true);
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+  JdwpSampler sampler(con, cache);
+
+  EXPECT_EQ(sampler.Sample(), 2U);
+  EXPECT_EQ(sampler.Sample(), 2U);
+  EXPECT_EQ(sampler.GetSampleCount(), 2U);
+
+  std::ostringstream out;
+  sampler.WriteFolded(out);
+  EXPECT_EQ(out.str(),
+      "main;com.acme.Foo.run:100;com.acme.Foo.work:111 2\n"
+      "worker;com.acme.Bar.loop:200 2\n");
+
+  // Names are only fetched once, and every thread is resumed
+  EXPECT_EQ(server.Count(ThreadReference::kName), 2);
+  EXPECT_EQ(server.Count(ThreadReference::kSuspend), 4);
+  EXPECT_EQ(server.Count(ThreadReference::kResume), 4);
+}
+
+TEST(SamplerTest, WithoutLines) {
+  SamplerServer server(false);
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+  JdwpSamplerOptions options;
+  options.resolve_lines = false;
+  options.suspend_free = true;
+  JdwpSampler sampler(con, cache, options);
+
+  EXPECT_EQ(sampler.Sample(), 2U);
+  std::ostringstream out;
+  sampler.WriteFolded(out);
+  EXPECT_EQ(out.str(),
+      "main;com.acme.Foo.run;com.acme.Foo.work 1\n"
+      "worker;com.acme.Bar.loop 1\n");
+  EXPECT_EQ(server.Count(ThreadReference::kSuspend), 0);
+}
+
+TEST(SamplerTest, FallsBackToSuspending) {
+  SamplerServer server(true);
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+  JdwpSamplerOptions options;
+  options.suspend_free = true;
+  JdwpSampler sampler(con, cache, options);
+
+  // The first sample finds out the threads need to be suspended
+  EXPECT_EQ(sampler.Sample(), 0U);
+  EXPECT_EQ(server.Count(ThreadReference::kSuspend), 0);
+  EXPECT_EQ(sampler.Sample(), 2U);
+  EXPECT_EQ(server.Count(ThreadReference::kSuspend), 2);
+  EXPECT_EQ(server.Count(ThreadReference::kResume), 2);
+}
@@ -0,0 +1,268 @@
+/* Provides tests for `jdwp_socket.hpp` and `jdwp_socket.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <future>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "fake_jdwp_server.hpp"
+#include "jdwp_exception.hpp"
+#include "jdwp_packet.hpp"
+#include "jdwp_socket.hpp"
+
+using namespace roastery;
+using namespace roastery::test;
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+namespace {
+
+/**
+ * Reads from \c socket until a whole packet has been buffered, or a couple of
+ * seconds have passed.
+ */
+bool WaitForPacket(JdwpSocket& socket, string_view& packet) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (std::chrono::steady_clock::now() < deadline) {
+    if (socket.NextPacket(packet)) return true;
+    if (socket.ReadAvailable() == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  return false;
+}
+
+/**
+ * Reads from \c socket until some bytes arrive, or a couple of seconds have
+ * passed.
+ */
+size_t WaitForBytes(JdwpSocket& socket) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (std::chrono::steady_clock::now() < deadline) {
+    size_t res = socket.ReadAvailable();
+    if (res > 0) return res;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return 0;
+}
+
+}  // namespace
+
+TEST(SocketTest, WritesSegmentsInOrder) {
+  FakeJdwpServer server;
+  JdwpSocket socket("127.0.0.1", server.GetPort());
+
+  // More segments than fit in one sendmsg, with packets split across segment
+  // boundaries and some empty segments thrown in.
+  const size_t kPackets = 150;
+  vector<string> packets;
+  for (size_t i = 0; i < kPackets; i++) {
+    string body(i % 7, static_cast<char>('a' + i % 26));
+    packets.push_back(FakeJdwpServer::MakeHeader(impl::kHeaderLen + body.size(),
+          i, 0, 1, 1) + body);
+  }
+  vector<string_view> segments;
+  for (const string& packet : packets) {
+    string_view view(packet);
+    segments.push_back(view.substr(0, 3));
+    segments.push_back(string_view());
+    segments.push_back(view.substr(3));
+  }
+  socket.Write(segments);
+
+  for (size_t i = 0; i < kPackets; i++) {
+    string recieved;
+    ASSERT_TRUE(server.NextPacket(recieved));
+    EXPECT_EQ(recieved, packets[i]);
+  }
+}
+
+TEST(SocketTest, TryWriteStopsWhenFull) {
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  // Stops reading after the first packet, until released
+  FakeJdwpServer server([&](FakeJdwpServer&, const string& packet) {
+    if (FakeJdwpServer::PacketId(packet) != 1) return false;
+    released.wait();
+    return true;
+  });
+  JdwpSocket socket("127.0.0.1", server.GetPort());
+  socket.Write(FakeJdwpServer::MakeHeader(impl::kHeaderLen, 1, 0, 1, 1));
+
+  // Well past what the socket buffers hold
+  string body(32 * 1024 * 1024, 'b');
+  string packet = FakeJdwpServer::MakeHeader(impl::kHeaderLen + body.size(),
+      2, 0, 1, 1) + body;
+  size_t written = 0;
+  while (true) {
+    size_t res = socket.TryWrite({ string_view(packet).substr(written) });
+    if (res == 0) break;
+    written += res;
+  }
+  EXPECT_GT(written, 0U);
+  EXPECT_LT(written, packet.size());
+
+  release.set_value();
+  socket.Write(string_view(packet).substr(written));
+  string recieved;
+  ASSERT_TRUE(server.NextPacket(recieved));
+  EXPECT_EQ(recieved, packet);
+}
+
+TEST(SocketTest, SetsTcpOptions) {
+  FakeJdwpServer server;
+  JdwpSocket socket("127.0.0.1", server.GetPort());
+
+  socket.SetNoDelay(true);
+  socket.SetNoDelay(false);
+  socket.SetCork(true);
+  socket.Write(FakeJdwpServer::MakeHeader(impl::kHeaderLen, 1, 0, 1, 1));
+  socket.SetCork(false);
+
+  string recieved;
+  ASSERT_TRUE(server.NextPacket(recieved));
+  EXPECT_EQ(FakeJdwpServer::PacketId(recieved), static_cast<uint32_t>(1));
+}
+
+TEST(SocketTest, FramesManyPacketsFromOneRead) {
+  FakeJdwpServer server;
+  JdwpSocket socket("127.0.0.1", server.GetPort());
+
+  const size_t kPackets = 100;
+  string sent;
+  for (size_t i = 0; i < kPackets; i++) {
+    sent += FakeJdwpServer::MakeReply(i, string(i % 5, 'x'));
+  }
+  server.Send(sent);
+
+  for (size_t i = 0; i < kPackets; i++) {
+    string_view packet;
+    ASSERT_TRUE(WaitForPacket(socket, packet));
+    EXPECT_EQ(FakeJdwpServer::PacketId(string(packet)),
+        static_cast<uint32_t>(i));
+    EXPECT_EQ(packet.size(), impl::kHeaderLen + i % 5);
+  }
+  string_view packet;
+  EXPECT_FALSE(socket.NextPacket(packet));
+}
+
+TEST(SocketTest, FramesPacketSplitAcrossReads) {
+  FakeJdwpServer server;
+  JdwpSocket socket("127.0.0.1", server.GetPort());
+
+  string reply = FakeJdwpServer::MakeReply(7, "some body");
+  server.Send(reply.substr(0, 5));
+  ASSERT_EQ(WaitForBytes(socket), static_cast<size_t>(5));
+  string_view packet;
+  EXPECT_FALSE(socket.NextPacket(packet));
+
+  server.Send(reply.substr(5));
+  ASSERT_TRUE(WaitForPacket(socket, packet));
+  EXPECT_EQ(packet, reply);
+}
+
+TEST(SocketTest, FramesPacketLargerThanBuffer) {
+  FakeJdwpServer server;
+  JdwpSocket socket("127.0.0.1", server.GetPort());
+
+  string large = FakeJdwpServer::MakeReply(1, string(1 << 20, 'y'));
+  string small = FakeJdwpServer::MakeReply(2, "z");
+  server.Send(large + small);
+
+  string_view packet;
+  ASSERT_TRUE(WaitForPacket(socket, packet));
+  EXPECT_EQ(packet, large);
+  ASSERT_TRUE(WaitForPacket(socket, packet));
+  EXPECT_EQ(packet, small);
+}
+
+TEST(SocketTest, TakesPacketInParts) {
+  FakeJdwpServer server;
+  JdwpSocket socket("127.0.0.1", server.GetPort());
+
+  string large = FakeJdwpServer::MakeReply(1, string(1 << 20, 'y'));
+  string small = FakeJdwpServer::MakeReply(2, "z");
+  server.Send(large.substr(0, impl::kHeaderLen - 1));
+  ASSERT_GT(WaitForBytes(socket), static_cast<size_t>(0));
+  string_view part;
+  size_t remaining;
+  // Nothing can be taken until the whole header is there
+  EXPECT_FALSE(socket.PeekHeader(part));
+  EXPECT_FALSE(socket.NextPacketPart(part, remaining));
+
+  server.Send(large.substr(impl::kHeaderLen - 1) + small);
+  string_view header;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (!socket.PeekHeader(header) &&
+      std::chrono::steady_clock::now() < deadline) {
+    socket.ReadAvailable();
+  }
+  ASSERT_EQ(header, large.substr(0, impl::kHeaderLen));
+
+  string taken;
+  size_t parts = 0;
+  remaining = large.size();
+  while (remaining > 0 && std::chrono::steady_clock::now() < deadline) {
+    if (socket.NextPacketPart(part, remaining)) {
+      taken += part;
+      parts++;
+      // The rest of a packet that's been partly taken can't be taken whole
+      string_view packet;
+      if (remaining > 0) {
+        EXPECT_FALSE(socket.NextPacket(packet));
+      }
+    } else {
+      socket.ReadAvailable();
+    }
+  }
+  EXPECT_EQ(remaining, static_cast<size_t>(0));
+  EXPECT_EQ(taken, large);
+  // The packet is bigger than the read-ahead buffer starts out
+  EXPECT_GT(parts, static_cast<size_t>(1));
+
+  string_view packet;
+  ASSERT_TRUE(WaitForPacket(socket, packet));
+  EXPECT_EQ(packet, small);
+}
+
+TEST(SocketTest, ReadTakesBufferedBytesFirst) {
+  FakeJdwpServer server;
+  JdwpSocket socket("127.0.0.1", server.GetPort());
+
+  server.Send("abcdef");
+  ASSERT_EQ(WaitForBytes(socket), static_cast<size_t>(6));
+  server.Send("ghi");
+  EXPECT_EQ(socket.Read(9), "abcdefghi");
+}
+
+TEST(SocketTest, RejectsMalformedLength) {
+  FakeJdwpServer server;
+  JdwpSocket socket("127.0.0.1", server.GetPort());
+
+  server.Send(FakeJdwpServer::MakeHeader(3, 1, 0x80, 0, 0));
+  string_view packet;
+  EXPECT_THROW(WaitForPacket(socket, packet), JdwpException);
+}
@@ -0,0 +1,299 @@
+/* Provides tests for `jdwp_stack_snapshot.hpp` and `jdwp_stack_snapshot.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "fake_jdwp_server.hpp"
+#include "jdwp_con.hpp"
+#include "jdwp_metadata_cache.hpp"
+#include "jdwp_stack_snapshot.hpp"
+
+using namespace roastery;
+using namespace roastery::test;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+void AppendFrame(string& out, uint64_t frame, uint64_t cls, uint64_t method,
+    uint64_t index) {
+  AppendLong(out, frame);
+  out.push_back(static_cast<char>(JdwpTypeTag::kClass));
+  AppendLong(out, cls);
+  AppendLong(out, method);
+  AppendLong(out, index);
+}
+
+using commands::CommandSet;
+using commands::ThreadReference;
+
+/**
+ * Emulates a VM with three threads:
+ *
+ * - \c main (1), in method 10 of class 100 at index 5 (frame 0x71), called
+ *   from method 11 at index 0 (frame 0x72). Method 10 has \c this and
+ *   \c count live there, and \c late only from index 8. Method 11 has
+ *   \c args.
+ * - \c worker (2), in method 20 of class 200 (frame 0x73), which has no
+ *   variable information.
+ * - 3, which dies before its frames are read.
+ *
+ * Every command about a thread is logged, in order.
+ */
+class StackServer {
+  public:
+    StackServer() :
+      server(FakeJdwpServer::Scripted(
+            [this](const string& packet, string& body, uint16_t& error) {
+              return this->Respond(packet, body, error);
+            })) { }
+
+    /**
+     * Returns the commands recieved about \c thread, e.g. \c Suspend,
+     * \c Frames, \c GetValues and \c Resume.
+     */
+    vector<string> Log(uint64_t thread) {
+      std::lock_guard<std::mutex> l(this->lck);
+      return this->log[thread];
+    }
+
+    /**
+     * Returns how many variable tables have been asked for.
+     */
+    int VariableTables() {
+      std::lock_guard<std::mutex> l(this->lck);
+      return this->variable_tables;
+    }
+
+    /**
+     * Returns the commands recieved from the \c VirtualMachine command set
+     * other than \c AllThreads.
+     */
+    vector<string> VmLog() {
+      std::lock_guard<std::mutex> l(this->lck);
+      return this->vm_log;
+    }
+
+    FakeJdwpServer server;
+  private:
+    std::mutex lck;
+    std::map<uint64_t, vector<string>> log;
+    vector<string> vm_log;
+    int variable_tables = 0;
+
+    bool Respond(const string& packet, string& body, uint16_t& error) {
+      uint8_t command_set = packet[9];
+      uint8_t command = packet[10];
+      std::lock_guard<std::mutex> l(this->lck);
+      if (command_set == static_cast<uint8_t>(CommandSet::kVirtualMachine)) {
+        if (command == static_cast<uint8_t>(
+              commands::VirtualMachine::kAllThreads)) {
+          AppendInt(body, 3);
+          AppendLong(body, 1);
+          AppendLong(body, 2);
+          AppendLong(body, 3);
+        } else {
+          this->vm_log.push_back(command == static_cast<uint8_t>(
+                commands::VirtualMachine::kSuspend) ? "Suspend" : "Resume");
+        }
+      } else if (command_set ==
+          static_cast<uint8_t>(CommandSet::kThreadReference)) {
+        uint64_t thread = ReadId(packet, 0);
+        switch (static_cast<ThreadReference>(command)) {
+          case ThreadReference::kName:
+            AppendString(body, thread == 1 ? "main" : "worker");
+            break;
+          case ThreadReference::kSuspend:
+            this->log[thread].push_back("Suspend");
+            break;
+          case ThreadReference::kResume:
+            this->log[thread].push_back("Resume");
+            break;
+          case ThreadReference::kFrames:
+            this->log[thread].push_back("Frames");
+            if (thread == 1) {
+              AppendInt(body, 2);
+              AppendFrame(body, 0x71, 100, 10, 5);
+              AppendFrame(body, 0x72, 100, 11, 0);
+            } else if (thread == 2) {
+              AppendInt(body, 1);
+              AppendFrame(body, 0x73, 200, 20, 3);
+            } else {
+              error = static_cast<uint16_t>(JdwpError::kInvalidThread);
+            }
+            break;
+          default:
+            break;
+        }
+      } else if (command_set == static_cast<uint8_t>(CommandSet::kMethod)) {
+        // VariableTableWithGeneric
+        this->variable_tables++;
+        auto append_var = [&body](uint64_t start, const string& name,
+            const string& signature, int32_t length, int32_t slot) {
+          AppendLong(body, start);
+          AppendString(body, name);
+          AppendString(body, signature);
+          AppendString(body, "");
+          AppendInt(body, length);
+          AppendInt(body, slot);
+        };
+        uint64_t method = ReadId(packet, 8);
+        if (method == 10) {
+          AppendInt(body, 1);
+          AppendInt(body, 3);
+          append_var(0, "this", "Lcom/acme/Foo;", 20, 0);
+          append_var(4, "count", "I", 10, 1);
+          append_var(8, "late", "J", 4, 2);
+        } else if (method == 11) {
+          AppendInt(body, 1);
+          AppendInt(body, 1);
+          append_var(0, "args", "[Ljava/lang/String;", 10, 0);
+        } else {
+          error = static_cast<uint16_t>(JdwpError::kAbsentInformation);
+        }
+      } else if (command_set ==
+          static_cast<uint8_t>(CommandSet::kStackFrame)) {
+        // GetValues, answering objects with an ID of 0x500 plus their slot,
+        // and ints with 42
+        uint64_t thread = ReadId(packet, 0);
+        this->log[thread].push_back("GetValues");
+        int32_t count = ReadInt(packet, 16);
+        AppendInt(body, count);
+        for (int32_t i = 0; i < count; i++) {
+          int32_t slot = ReadInt(packet, 20 + 5 * i);
+          char tag = packet[impl::kHeaderLen + 24 + 5 * i];
+          body.push_back(tag);
+          if (tag == 'I') {
+            AppendInt(body, 42);
+          } else {
+            AppendLong(body, 0x500 + slot);
+          }
+        }
+      }
+      return true;
+    }
+};
+
+/**
+ * Waits until the VM has handled everything sent to it before, including
+ * the resumes sent without waiting for a reply.
+ */
+void Sync(IJdwpCon& con) {
+  con.SendAsync(std::make_unique<
+      command_packets::virtual_machine::AllThreadsCommand>()).get();
+}
+
+uint64_t ObjectIn(const JdwpValue& value) {
+  return std::get<JdwpObjId>(value.value).GetValue();
+}
+
+}  // namespace
+
+TEST(StackSnapshotTest, ReadsFramesAndLocals) {
+  StackServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+  JdwpStackSnapshotter snapshotter(con, cache);
+
+  for (int i = 0; i < 2; i++) {
+    vector<JdwpThreadSnapshot> threads = snapshotter.Take();
+    ASSERT_EQ(threads.size(), 3U);
+
+    EXPECT_EQ(threads[0].thread, 1U);
+    EXPECT_EQ(threads[0].name, "main");
+    EXPECT_EQ(threads[0].error, JdwpError::kNone);
+    ASSERT_EQ(threads[0].frames.size(), 2U);
+    EXPECT_EQ(threads[0].frames[0].frame_id, 0x71U);
+    EXPECT_EQ(threads[0].frames[0].location.method_id.GetValue(), 10U);
+    auto& locals = threads[0].frames[0].locals;
+    ASSERT_EQ(locals.size(), 2U);
+    EXPECT_EQ(locals[0].name, "this");
+    EXPECT_EQ(locals[0].signature, "Lcom/acme/Foo;");
+    EXPECT_EQ(ObjectIn(locals[0].value), 0x500U);
+    EXPECT_EQ(locals[1].name, "count");
+    EXPECT_EQ(std::get<JdwpInt>(locals[1].value.value).GetValue(), 42);
+    ASSERT_EQ(threads[0].frames[1].locals.size(), 1U);
+    EXPECT_EQ(threads[0].frames[1].locals[0].value.tag, JdwpTag::kArray);
+
+    EXPECT_EQ(threads[1].name, "worker");
+    ASSERT_EQ(threads[1].frames.size(), 1U);
+    EXPECT_TRUE(threads[1].frames[0].locals.empty());
+
+    EXPECT_EQ(threads[2].error, JdwpError::kInvalidThread);
+    EXPECT_TRUE(threads[2].frames.empty());
+  }
+
+  // Each thread is resumed right after its locals are asked for, and never
+  // waits on a reply in between
+  Sync(con);
+  EXPECT_EQ(server.Log(1), vector<string>({
+        "Suspend", "Frames", "GetValues", "GetValues", "Resume",
+        "Suspend", "Frames", "GetValues", "GetValues", "Resume" }));
+  EXPECT_EQ(server.Log(2), vector<string>({
+        "Suspend", "Frames", "Resume", "Suspend", "Frames", "Resume" }));
+  EXPECT_EQ(server.Log(3), vector<string>({
+        "Suspend", "Frames", "Resume", "Suspend", "Frames", "Resume" }));
+  // Cached variable tables aren't fetched again, and neither are missing
+  // ones
+  EXPECT_EQ(server.VariableTables(), 3);
+  EXPECT_TRUE(server.VmLog().empty());
+}
+
+TEST(StackSnapshotTest, WithoutLocals) {
+  StackServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+  JdwpStackSnapshotOptions options;
+  options.include_locals = false;
+  JdwpStackSnapshotter snapshotter(con, cache, options);
+
+  vector<JdwpThreadSnapshot> threads = snapshotter.Take();
+  ASSERT_EQ(threads.size(), 3U);
+  ASSERT_EQ(threads[0].frames.size(), 2U);
+  EXPECT_TRUE(threads[0].frames[0].locals.empty());
+  Sync(con);
+  EXPECT_EQ(server.Log(1), vector<string>({ "Suspend", "Frames", "Resume" }));
+  EXPECT_EQ(server.VariableTables(), 0);
+}
+
+TEST(StackSnapshotTest, SuspendsWholeVm) {
+  StackServer server;
+  JdwpCon con("127.0.0.1", server.server.GetPort());
+  JdwpMetadataCache cache(con);
+  JdwpStackSnapshotOptions options;
+  options.suspend_all = true;
+  JdwpStackSnapshotter snapshotter(con, cache, options);
+
+  vector<JdwpThreadSnapshot> threads = snapshotter.Take();
+  ASSERT_EQ(threads.size(), 3U);
+  EXPECT_EQ(threads[0].frames[0].locals.size(), 2U);
+  EXPECT_EQ(threads[0].suspended, threads[1].suspended);
+  Sync(con);
+  EXPECT_EQ(server.VmLog(), vector<string>({ "Suspend", "Resume" }));
+  EXPECT_EQ(server.Log(1), vector<string>({
+        "Frames", "GetValues", "GetValues" }));
+}
@@ -0,0 +1,84 @@
+/* Provides tests for `jdwp_stats.hpp` and `jdwp_stats.cpp`
+   Copyright 2021 Mitchell Levy
+
+This file is a part of Roastery
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "jdwp_stats.hpp"
+
+using namespace roastery;
+
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+
+TEST(StatsTest, BucketsByPowersOfTwo) {
+  EXPECT_EQ(JdwpDurationHistogram::BucketFor(nanoseconds(0)), 0U);
+  EXPECT_EQ(JdwpDurationHistogram::BucketFor(nanoseconds(999)), 0U);
+  EXPECT_EQ(JdwpDurationHistogram::BucketFor(microseconds(1)), 1U);
+  EXPECT_EQ(JdwpDurationHistogram::BucketFor(microseconds(3)), 2U);
+  EXPECT_EQ(JdwpDurationHistogram::BucketFor(microseconds(4)), 3U);
+  EXPECT_EQ(JdwpDurationHistogram::BucketFor(microseconds(1000)), 10U);
+  EXPECT_EQ(JdwpDurationHistogram::BucketFor(std::chrono::hours(1)),
+      JdwpDurationHistogram::kBuckets - 1);
+}
+
+TEST(StatsTest, Percentiles) {
+  JdwpDurationHistogram histogram;
+  EXPECT_EQ(histogram.Percentile(0.5), microseconds(0));
+
+  for (int i = 0; i < 98; i++) histogram.Add(microseconds(3));
+  histogram.Add(microseconds(100));
+  histogram.Add(std::chrono::hours(1));
+  EXPECT_EQ(histogram.total, 100U);
+  EXPECT_EQ(histogram.counts[2], 98U);
+  EXPECT_EQ(histogram.max, std::chrono::hours(1));
+  EXPECT_EQ(histogram.sum,
+      microseconds(3 * 98 + 100) + std::chrono::hours(1));
+
+  EXPECT_EQ(histogram.Percentile(0), microseconds(4));
+  EXPECT_EQ(histogram.Percentile(0.5), microseconds(4));
+  EXPECT_EQ(histogram.Percentile(0.99), microseconds(128));
+  // The last bucket is only bounded by the largest duration
+  EXPECT_EQ(histogram.Percentile(1), std::chrono::hours(1));
+}
+
+TEST(StatsTest, AtomicHistogramFromManyThreads) {
+  impl::AtomicDurationHistogram histogram;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&histogram, i]() {
+      for (int j = 0; j < 1000; j++) histogram.Add(microseconds(i + j % 2));
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  JdwpDurationHistogram res = histogram.Get();
+  EXPECT_EQ(res.total, 4000U);
+  EXPECT_EQ(res.max, microseconds(4));
+  EXPECT_EQ(res.sum, microseconds(1000 * (0 + 1 + 2 + 3) + 4 * 500));
+  uint64_t counted = 0;
+  for (uint64_t count : res.counts) counted += count;
+  EXPECT_EQ(counted, 4000U);
+  // 0us, then 1us, 2us and 3us, then 4us
+  EXPECT_EQ(res.counts[0], 500U);
+  EXPECT_EQ(res.counts[3], 500U);
+}
@@ -24,6 +24,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "gtest/gtest.h"
 
 #include "jdwp_con.hpp"
+#include "jdwp_interner.hpp"
 #include "jdwp_type.hpp"
 #include "mock_jdwp_con.hpp"
 
@@ -33,6 +34,7 @@ using namespace roastery::test;
 using ::testing::Return;
 using std::array;
 using std::stringstream;
+using std::vector;
 
 namespace {
 
@@ -110,6 +112,94 @@ TEST(TypeTest, JdwpTaggedObjectIdTest) {
   EXPECT_EQ(tagged_obj_id, jtoi.Serialize(con));
 }
 
+TEST(TypeTest, JdwpTaggedObjectIdWithZeroBytesTest) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(kObjectIdSize));
+
+  const array<unsigned char, kObjectIdSize + 1> kEncoded = {
+    static_cast<unsigned char>(JdwpTag::kObject),
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00 };
+
+  JdwpTaggedObjectId jtoi;
+  size_t bytes_read = jtoi.FromEncoded(Stringify(kEncoded), con);
+  EXPECT_EQ(bytes_read, kEncoded.size());
+  EXPECT_EQ(jtoi.obj_id.GetValue(), 0x100ull);
+}
+
+TEST(TypeTest, JdwpIdEverySizeTest) {
+  const uint64_t kFullValue = 0x0102030405060708ull;
+  for (uint8_t size = 1; size <= sizeof(uint64_t); size++) {
+    MockJdwpCon con;
+    EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(size));
+    EXPECT_CALL(con, GetFrameIdSizeImpl).WillRepeatedly(Return(size));
+
+    // Only the low bytes fit, and go out most significant first
+    uint64_t value = size == sizeof(uint64_t) ?
+      kFullValue : kFullValue & ((1ull << (8 * size)) - 1);
+    string expected;
+    for (uint8_t i = 0; i < size; i++) {
+      expected.push_back(static_cast<char>(8 - size + 1 + i));
+    }
+
+    JdwpObjId obj_id; obj_id << value;
+    EXPECT_EQ(obj_id.Serialize(con), expected) << "size " << int(size);
+    JdwpObjId decoded;
+    EXPECT_EQ(decoded.FromEncoded(expected + "trailing", con),
+        static_cast<size_t>(size));
+    EXPECT_EQ(decoded.GetValue(), value) << "size " << int(size);
+
+    // Frame IDs have a size of their own
+    JdwpFrameId frame_id; frame_id << value;
+    EXPECT_EQ(frame_id.Serialize(con), expected) << "size " << int(size);
+  }
+}
+
+TEST(TypeTest, CachedIdSizesTest) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).Times(0);
+  EXPECT_CALL(con, GetMethodIdSizeImpl).Times(0);
+  EXPECT_CALL(con, GetFieldIdSizeImpl).Times(0);
+  EXPECT_CALL(con, GetFrameIdSizeImpl).Times(0);
+  con.CacheIdSizes(2, 4, 8, 3);
+
+  JdwpFieldId field_id; field_id << 0x0102;
+  EXPECT_EQ(field_id.Serialize(con), string("\x01\x02", 2));
+  JdwpMethodId method_id; method_id << 0x01020304;
+  EXPECT_EQ(method_id.Serialize(con), string("\x01\x02\x03\x04", 4));
+  JdwpFrameId frame_id; frame_id << 0x010203;
+  EXPECT_EQ(frame_id.Serialize(con), string("\x01\x02\x03", 3));
+
+  const string kEncoded("\x01\x02\x03\x04\x05\x06\x07\x08", 8);
+  JdwpObjId obj_id;
+  EXPECT_EQ(obj_id.FromEncoded(kEncoded, con), kEncoded.size());
+  EXPECT_EQ(obj_id.GetValue(), 0x0102030405060708ull);
+  EXPECT_EQ(obj_id.Serialize(con), kEncoded);
+}
+
+TEST(TypeTest, TruncatedFieldsTest) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(kObjectIdSize));
+
+  JdwpInt i;
+  EXPECT_THROW(i.FromEncoded(string(3, '\0'), con), JdwpException);
+
+  JdwpObjId obj_id;
+  EXPECT_THROW(obj_id.FromEncoded(string(kObjectIdSize - 1, '\0'), con),
+      JdwpException);
+
+  // Claims to be 8 bytes long, but only 3 are present.
+  array<unsigned char, 4> str_len_NBO = { 0x00, 0x00, 0x00, 0x08 };
+  JdwpString str;
+  EXPECT_THROW(str.FromEncoded(Stringify(str_len_NBO) + "abc", con),
+      JdwpException);
+
+  // Only the bytes of the field itself are read from a longer buffer.
+  string encoded = Stringify(str_len_NBO) + "roasteryTRAILING";
+  EXPECT_EQ(str.FromEncoded(std::string_view(encoded), con),
+      static_cast<size_t>(12));
+  EXPECT_EQ(str.GetValue(), "roastery");
+}
+
 TEST(TypeTest, JdwpLocationTest) {
   // Setup the location index NBO/HBO
   array<unsigned char, 8> loc_index_HBO = { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC,
@@ -210,6 +300,127 @@ TEST(TypeTest, JdwpValueTestInt) {
   EXPECT_EQ(iint.Serialize(con), jdwp_int.str());
 }
 
+static_assert(impl::HasStaticCodec<JdwpInt>::value);
+static_assert(impl::HasStaticCodec<JdwpThreadId>::value);
+static_assert(impl::HasStaticCodec<JdwpLocation>::value);
+static_assert(!impl::HasStaticCodec<JdwpString>::value);
+static_assert(!impl::HasStaticCodec<JdwpValue>::value);
+
+TEST(TypeTest, StaticCodecTest) {
+  MockJdwpCon con;
+  EXPECT_CALL(con, GetObjIdSizeImpl).WillRepeatedly(Return(4));
+  EXPECT_CALL(con, GetMethodIdSizeImpl).WillRepeatedly(Return(kMethodIdSize));
+
+  JdwpChar jdwp_char;
+  jdwp_char << -2;
+  JdwpDouble jdwp_double;
+  jdwp_double << 0x0123456789ABCDEF;
+  JdwpThreadId thread;
+  thread << 0xCAFEF00D;
+  JdwpClassId class_id;
+  class_id << 0x1234;
+  JdwpMethodId method_id;
+  method_id << 0x0102030405060708;
+  JdwpLocation location(JdwpTypeTag::kInterface, class_id, method_id, 99);
+
+  // The static codecs encode just like the virtual ones
+  string encoded;
+  jdwp_char.Encode(encoded, con);
+  jdwp_double.Encode(encoded, con);
+  thread.Encode(encoded, con);
+  location.Encode(encoded, con);
+  EXPECT_EQ(encoded, jdwp_char.Serialize(con) + jdwp_double.Serialize(con) +
+      thread.Serialize(con) + location.Serialize(con));
+  EXPECT_EQ(encoded.substr(0, 2), Stringify(array<unsigned char, 2> {
+        0xFF, 0xFE }));
+
+  JdwpChar char_out;
+  JdwpDouble double_out;
+  JdwpThreadId thread_out;
+  JdwpLocation location_out;
+  size_t idx = 0;
+  idx += char_out.Decode(encoded, con);
+  idx += double_out.Decode(std::string_view(encoded).substr(idx), con);
+  idx += thread_out.Decode(std::string_view(encoded).substr(idx), con);
+  idx += location_out.Decode(std::string_view(encoded).substr(idx), con);
+  EXPECT_EQ(idx, encoded.size());
+  EXPECT_EQ(char_out.GetValue(), -2);
+  EXPECT_EQ(double_out.GetValue(), 0x0123456789ABCDEFull);
+  EXPECT_EQ(thread_out.GetValue(), 0xCAFEF00Dull);
+  EXPECT_EQ(location_out.type, JdwpTypeTag::kInterface);
+  EXPECT_EQ(location_out.class_id.GetValue(), 0x1234ull);
+  EXPECT_EQ(location_out.method_id.GetValue(), 0x0102030405060708ull);
+  EXPECT_EQ(location_out.index, 99ull);
+
+  // Truncated fields are rejected the same way
+  EXPECT_THROW(double_out.Decode(encoded.substr(0, 7), con), JdwpException);
+  EXPECT_THROW(location_out.Decode(location.Serialize(con).substr(0, 20),
+        con), JdwpException);
+}
+
+TEST(TypeTest, JdwpStringInternTest) {
+  MockJdwpCon con;
+  JdwpStringInterner interner;
+  JdwpString first;
+  first << "(Ljava/lang/String;)V";
+  JdwpString second;
+  second.FromEncoded(first.Serialize(con), con);
+
+  first.Intern(interner);
+  second.Intern(interner);
+  const JdwpString& first_ref = first;
+  const JdwpString& second_ref = second;
+  EXPECT_EQ(&first_ref.GetValue(), &second_ref.GetValue());
+  EXPECT_EQ(interner.Size(), (size_t)1);
+  EXPECT_EQ(second.Serialize(con), first.Serialize(con));
+
+  // Modifying one doesn't modify the other
+  second.GetValue() += "!";
+  EXPECT_EQ(first_ref.GetValue(), "(Ljava/lang/String;)V");
+  EXPECT_EQ(second_ref.GetValue(), "(Ljava/lang/String;)V!");
+}
+
+TEST(TypeTest, JdwpLazyStringTest) {
+  MockJdwpCon con;
+  JdwpString str;
+  str << "Lcom/example/Foo;";
+  string encoded = str.Serialize(con) + "trailing";
+
+  JdwpLazyString lazy;
+  EXPECT_EQ(lazy.FromEncoded(encoded, con), str.Serialize(con).size());
+  EXPECT_FALSE(lazy.IsMaterialized());
+  EXPECT_EQ(lazy.GetView(), "Lcom/example/Foo;");
+  EXPECT_EQ(lazy.GetView().data(), encoded.data() + sizeof(uint32_t));
+  EXPECT_EQ(lazy.Serialize(con), str.Serialize(con));
+
+  lazy.Materialize();
+  EXPECT_TRUE(lazy.IsMaterialized());
+  encoded.assign(encoded.size(), '\0');
+  EXPECT_EQ(lazy.GetValue(), "Lcom/example/Foo;");
+  EXPECT_EQ(lazy.Serialize(con), str.Serialize(con));
+
+  EXPECT_THROW(lazy.FromEncoded(string("\0\0\0\x05" "abc", 7), con),
+      JdwpException);
+}
+
+TEST(TypeTest, JdwpBytesTest) {
+  MockJdwpCon con;
+  string file("\xCA\xFE\xBA\xBE\0\x01", 6);
+  JdwpBytes bytes;
+  bytes.Refer(file);
+  EXPECT_EQ(bytes.GetView().data(), file.data());
+  // Encoded as a length and then the bytes, as a vector of JdwpByte would be
+  string encoded = bytes.Serialize(con);
+  EXPECT_EQ(encoded, string("\0\0\0\x06", 4) + file);
+
+  JdwpBytes decoded;
+  EXPECT_EQ(decoded.FromEncoded(encoded + "trailing", con), encoded.size());
+  EXPECT_EQ(decoded.GetView(), file);
+  EXPECT_NE(decoded.GetView().data(), file.data());
+  EXPECT_THROW(decoded.FromEncoded(string("\0\0\0\x05" "abc", 7), con),
+      JdwpException);
+}
+
 TEST(TypeTest, JdwpArrayRegionObjectTest) {
   array<unsigned char, 4> len_NBO = { 0x00, 0x00, 0x00, 0x04 };
 
@@ -255,12 +466,89 @@ TEST(TypeTest, JdwpArrayRegionPrimativeTest) {
   EXPECT_EQ(bytes_read, jdwp_arr_region.str().length());
 
   EXPECT_EQ(arr_region.tag, JdwpTag::kInt);
-  ASSERT_EQ(arr_region.values->size(), (size_t)4);
-  for (const unique_ptr<JdwpValue>& v : *arr_region.values) {
-    EXPECT_EQ(v->tag, JdwpTag::kInt);
-    int32_t int_val = std::get<JdwpInt>(v->value).GetValue();
+  EXPECT_EQ(arr_region.values, nullptr);
+  ASSERT_EQ(arr_region.Size(), (size_t)4);
+  for (int32_t int_val : std::get<vector<int32_t>>(arr_region.packed)) {
     ExpectBytesEq(&int_val, int_HBO);
   }
   EXPECT_EQ(arr_region.Serialize(con), jdwp_arr_region.str());
 }
 
+TEST(TypeTest, JdwpArrayRegionPackedWidthsTest) {
+  MockJdwpCon con;
+  // Long enough to need both whole 16 byte chunks and leftover values
+  const size_t kCount = 19;
+
+  string shorts;
+  shorts.push_back(static_cast<char>(JdwpTag::kShort));
+  shorts += Stringify(array<unsigned char, 4> { 0x00, 0x00, 0x00, kCount });
+  string longs;
+  longs.push_back(static_cast<char>(JdwpTag::kLong));
+  longs += Stringify(array<unsigned char, 4> { 0x00, 0x00, 0x00, kCount });
+  string bytes;
+  bytes.push_back(static_cast<char>(JdwpTag::kByte));
+  bytes += Stringify(array<unsigned char, 4> { 0x00, 0x00, 0x00, kCount });
+  for (size_t i = 0; i < kCount; i++) {
+    shorts += Stringify(array<unsigned char, 2> { 0x12,
+        static_cast<unsigned char>(i) });
+    longs += Stringify(array<unsigned char, 8> { 0x01, 0x23, 0x45, 0x67, 0x89,
+        0xAB, 0xCD, static_cast<unsigned char>(i) });
+    bytes.push_back(static_cast<char>(i));
+  }
+
+  JdwpArrayRegion arr_region;
+  EXPECT_EQ(arr_region.FromEncoded(shorts, con), shorts.size());
+  const auto& short_vals = std::get<vector<int16_t>>(arr_region.packed);
+  ASSERT_EQ(short_vals.size(), kCount);
+  for (size_t i = 0; i < kCount; i++) {
+    EXPECT_EQ(short_vals[i], static_cast<int16_t>(0x1200 | i));
+  }
+  EXPECT_EQ(arr_region.Serialize(con), shorts);
+
+  EXPECT_EQ(arr_region.FromEncoded(longs, con), longs.size());
+  const auto& long_vals = std::get<vector<int64_t>>(arr_region.packed);
+  ASSERT_EQ(long_vals.size(), kCount);
+  for (size_t i = 0; i < kCount; i++) {
+    EXPECT_EQ(long_vals[i], static_cast<int64_t>(0x0123456789ABCD00 | i));
+  }
+  EXPECT_EQ(arr_region.Serialize(con), longs);
+
+  EXPECT_EQ(arr_region.FromEncoded(bytes, con), bytes.size());
+  const auto& byte_vals = std::get<vector<uint8_t>>(arr_region.packed);
+  ASSERT_EQ(byte_vals.size(), kCount);
+  for (size_t i = 0; i < kCount; i++) EXPECT_EQ(byte_vals[i], i);
+  EXPECT_EQ(arr_region.Serialize(con), bytes);
+}
+
+TEST(TypeTest, JdwpArrayRegionFromPackedTest) {
+  MockJdwpCon con;
+  JdwpArrayRegion arr_region(JdwpTag::kInt,
+      JdwpArrayRegion::Packed(vector<int32_t> { 0x12345678, -1 }));
+  EXPECT_EQ(arr_region.Size(), (size_t)2);
+  EXPECT_EQ(arr_region.Serialize(con), Stringify(array<unsigned char, 13> {
+        static_cast<unsigned char>(JdwpTag::kInt), 0x00, 0x00, 0x00, 0x02,
+        0x12, 0x34, 0x56, 0x78, 0xFF, 0xFF, 0xFF, 0xFF }));
+
+  EXPECT_THROW(JdwpArrayRegion(JdwpTag::kLong,
+        JdwpArrayRegion::Packed(vector<int32_t> { 1 })), JdwpException);
+  EXPECT_THROW(JdwpArrayRegion(JdwpTag::kObject,
+        JdwpArrayRegion::Packed(vector<uint64_t> { 1 })), JdwpException);
+}
+
+
+TEST(TypeTest, JdwpArrayRegionFromValuesTest) {
+  MockJdwpCon con;
+  JdwpInt val;
+  val << 0x12345678;
+  vector<unique_ptr<JdwpValue>> values;
+  values.push_back(std::make_unique<JdwpValue>(JdwpTag::kInt,
+        JdwpValue::JdwpVal(val)));
+  values.push_back(std::make_unique<JdwpValue>(JdwpTag::kInt,
+        JdwpValue::JdwpVal(val)));
+
+  JdwpArrayRegion arr_region(JdwpTag::kInt, values);
+  ASSERT_EQ(arr_region.values->size(), values.size());
+  EXPECT_EQ(arr_region.Serialize(con), Stringify(array<unsigned char, 13> {
+        static_cast<unsigned char>(JdwpTag::kInt), 0x00, 0x00, 0x00, 0x02,
+        0x12, 0x34, 0x56, 0x78, 0x12, 0x34, 0x56, 0x78 }));
+}
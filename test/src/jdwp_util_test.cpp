@@ -18,6 +18,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include <tuple>
+#include <type_traits>
 #include <vector>
 
 #include "gtest/gtest.h"
@@ -69,3 +70,12 @@ TEST(UtilTest, IsVectorTest) {
   EXPECT_FALSE(IsVector<JdwpString>::value);
 }
 
+
+TEST(UtilTest, RepeatedTupleTest) {
+  EXPECT_TRUE((std::is_same_v<RepeatedTuple<int, 1>::Type, tuple<int>>));
+  EXPECT_TRUE((std::is_same_v<RepeatedTuple<int, 3>::Type,
+        tuple<int, int, int>>));
+  // CapabilitiesNew replies with exactly 32 booleans
+  EXPECT_EQ(std::tuple_size_v<command_packets::virtual_machine::
+      CapabilitiesNewCommand::ReplyFields>, 32U);
+}